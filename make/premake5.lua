@@ -6,12 +6,39 @@ filter { "platforms:Win64" }
 	system "Windows"
 	architecture "x64"
 
+filter { "platforms:Linux64" }
+	system "linux"
+	architecture "x64"
+	cppdialect "C++14"
+	disablewarnings { "multichar" }
+
+-- The machine itself: CPU, ULA, beeper, tape and file formats.  It has no UI, sound device or third-party libraries,
+-- so it builds on any platform and can run headless.
+coreFiles = {
+	"../src/beeper.*",
+	"../src/callstack.*",
+	"../src/condition.*",
+	"../src/config.h",
+	"../src/eventqueue.h",
+	"../src/flatbus.h",
+	"../src/hash.*",
+	"../src/jit.*",
+	"../src/nxfile.*",
+	"../src/roms.cc",
+	"../src/snapshot.*",
+	"../src/spectrum.*",
+	"../src/tape.*",
+	"../src/trace.*",
+	"../src/types.h",
+	"../src/z80.*",
+}
+
 
 -- Solution
 solution "nx"
 	language "C++"
 	configurations { "Debug", "Release" }
-	platforms { "Win64" }
+	platforms { "Win64", "Linux64" }
 	location "../_build"
     --debugdir "../data"
     characterset "MBCS"
@@ -36,7 +63,76 @@ solution "nx"
 		optimize "full"
 
 	-- Projects
+	project "nx-core"
+		targetdir "../_bin/%{cfg.platform}/%{cfg.buildcfg}/%{prj.name}"
+		objdir "../_obj/%{cfg.platform}/%{cfg.buildcfg}/%{prj.name}"
+		kind "StaticLib"
+		files(coreFiles)
+		includedirs { "../include/stb_image" }
+
+	project "nx-bench"
+		targetdir "../_bin/%{cfg.platform}/%{cfg.buildcfg}/%{prj.name}"
+		objdir "../_obj/%{cfg.platform}/%{cfg.buildcfg}/%{prj.name}"
+		kind "ConsoleApp"
+		files {
+			"../tools/bench.cc",
+			"../tools/headless.*",
+		}
+		includedirs { "../src" }
+		links { "nx-core" }
+		filter { "platforms:Linux64" }
+			links { "pthread" }
+		filter {}
+
+	project "nx-runner"
+		targetdir "../_bin/%{cfg.platform}/%{cfg.buildcfg}/%{prj.name}"
+		objdir "../_obj/%{cfg.platform}/%{cfg.buildcfg}/%{prj.name}"
+		kind "ConsoleApp"
+		files {
+			"../tools/runner.cc",
+			"../tools/headless.*",
+		}
+		includedirs { "../src" }
+		links { "nx-core" }
+		filter { "platforms:Linux64" }
+			links { "pthread" }
+		filter {}
+
+	project "nx-microbench"
+		targetdir "../_bin/%{cfg.platform}/%{cfg.buildcfg}/%{prj.name}"
+		objdir "../_obj/%{cfg.platform}/%{cfg.buildcfg}/%{prj.name}"
+		kind "ConsoleApp"
+		files {
+			"../tools/microbench.cc",
+			"../src/disasm.*",
+			"../src/vram.*",
+		}
+		includedirs { "../src" }
+		links { "nx-core" }
+
+	project "nx-zex"
+		targetdir "../_bin/%{cfg.platform}/%{cfg.buildcfg}/%{prj.name}"
+		objdir "../_obj/%{cfg.platform}/%{cfg.buildcfg}/%{prj.name}"
+		kind "ConsoleApp"
+		files { "../tools/zex.cc" }
+		includedirs { "../src" }
+		links { "nx-core" }
+		filter { "platforms:Linux64" }
+			links { "pthread" }
+		filter {}
+
+	project "nx-tracedump"
+		targetdir "../_bin/%{cfg.platform}/%{cfg.buildcfg}/%{prj.name}"
+		objdir "../_obj/%{cfg.platform}/%{cfg.buildcfg}/%{prj.name}"
+		kind "ConsoleApp"
+		files {
+			"../tools/tracedump.cc",
+			"../src/disasm.*",
+		}
+		includedirs { "../src" }
+
 	project "nx"
+		removeplatforms { "Linux64" }
 		targetdir "../_bin/%{cfg.platform}/%{cfg.buildcfg}/%{prj.name}"
 		objdir "../_obj/%{cfg.platform}/%{cfg.buildcfg}/%{prj.name}"
         kind "WindowedApp"
@@ -46,10 +142,12 @@ solution "nx"
             "../README.md",
             "../etc/keys.txt"
 		}
+		removefiles(coreFiles)
         includedirs {
             "../include",
         }
         links {
+            "nx-core",
             "flac.lib",
             "freetype.lib",
             "ogg.lib",
@@ -4,29 +4,23 @@
 
 #include "audio.h"
 
+#include <algorithm>
 #include <cassert>
-
-#define NX_VOLUME       10000
+#include <cstring>
 
 //----------------------------------------------------------------------------------------------------------------------
 // Audio
 //----------------------------------------------------------------------------------------------------------------------
 
-Audio::Audio(int numTStatesPerFrame, function<void()> frameFunc)
-    : m_numTStatesPerSample(0)
-    , m_numSamplesPerFrame(0)
-    , m_numTStatesPerFrame(numTStatesPerFrame)
+Audio::Audio()
+    : m_numSamplesPerFrame(0)
+    , m_sampleRate(NX_AUDIO_SAMPLERATE)
     , m_soundBuffer(nullptr)
     , m_playBuffer(nullptr)
     , m_fillBuffer(nullptr)
-    , m_tStatesUpdated(0)
-    , m_tStateCounter(0)
-    , m_audioValue(0)
-    , m_writePosition(0)
     , m_audioHost(0)
     , m_audioDevice(0)
     , m_stream(nullptr)
-    , m_frameFunc(frameFunc)
     , m_mute(false)
 {
     Pa_Initialize();
@@ -38,11 +32,7 @@ Audio::Audio(int numTStatesPerFrame, function<void()> frameFunc)
     const PaDeviceInfo* deviceInfo = Pa_GetDeviceInfo(m_audioDevice);
     m_sampleRate = (int)deviceInfo->defaultSampleRate;
 
-    //m_numTStatesPerSample = numTStatesPerFrame / (m_sampleRate / 50);
-    //m_numSamplesPerFrame = numTStatesPerFrame / m_numTStatesPerSample;
-
     m_numSamplesPerFrame = m_sampleRate / 50;
-    m_numTStatesPerSample = numTStatesPerFrame / m_numSamplesPerFrame;
 
     printf("Audio host: %s\n", hostInfo->name);
     printf("Audio device: %s\n", deviceInfo->name);
@@ -118,34 +108,12 @@ int Audio::callback(const void *input,
     return paContinue;
 }
 
-void Audio::updateBeeper(i64 tState, u8 speaker)
+void Audio::submitFrame(const i16* samples, int numSamples)
 {
-    if (m_mute) speaker = 0;
-
-    if (m_writePosition < m_numSamplesPerFrame)
-    {
-        i64 dt = tState - m_tStatesUpdated;
-        if (m_tStateCounter + dt > m_numTStatesPerSample)
-        {
-            m_audioValue += int(speaker ? (m_numTStatesPerSample - m_tStateCounter) : 0);
-            m_fillBuffer[m_writePosition++] = ((m_audioValue * (2 * NX_VOLUME)) / m_numTStatesPerSample) - NX_VOLUME;
-
-            dt = (m_tStateCounter + dt) - m_numTStatesPerSample;
-            m_audioValue = 0;
-            m_tStateCounter = 0;
-        }
-
-        m_audioValue += int(speaker ? dt : 0);
-        m_tStateCounter += dt;
-    }
-    m_tStatesUpdated = tState;
-
-    if (tState >= m_numTStatesPerFrame)
-    {
-        m_writePosition = 0;
-        std::swap(m_fillBuffer, m_playBuffer);
-        m_tStatesUpdated -= m_numTStatesPerFrame;
-    }
+    // The beeper works at the rate we gave it, so a frame always fits.
+    numSamples = min(numSamples, m_numSamplesPerFrame);
+    memcpy(m_fillBuffer, samples, numSamples * sizeof(i16));
+    std::swap(m_fillBuffer, m_playBuffer);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -6,12 +6,11 @@
 
 #include "config.h"
 #include "types.h"
+#include "beeper.h"
 
 #include <portaudio/portaudio.h>
 #include <mutex>
-#include <functional>
 
-#define NX_AUDIO_SAMPLERATE 44100
 #define NX_DISABLE_AUDIO    0
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -51,21 +50,26 @@ private:
 
 //----------------------------------------------------------------------------------------------------------------------
 // Audio system
+// Plays the machine's sound through PortAudio's default output device.  Each buffer the device asks for triggers the
+// render signal, which is what paces the emulator.
 //----------------------------------------------------------------------------------------------------------------------
 
-class Audio
+class Audio : public IAudioSink
 {
 public:
-    Audio(int numTStatesPerFrame, function<void()> frameFunc);
+    Audio();
     ~Audio();
 
-    void updateBeeper(i64 tState, u8 speaker);
     void mute(bool enabled) { m_mute = enabled; }
 
     bool isMute() const { return m_mute; }
 
     Signal& getSignal() { return m_renderSignal; }
 
+    // IAudioSink interface
+    int getSampleRate() const override { return m_sampleRate; }
+    void submitFrame(const i16* samples, int numSamples) override;
+
 private:
     void initialiseBuffers();
 
@@ -77,24 +81,17 @@ private:
         void* userData);
 
 private:
-    int                 m_numTStatesPerSample;
     int                 m_numSamplesPerFrame;
-    int                 m_numTStatesPerFrame;
     int                 m_sampleRate;
     i16*                m_soundBuffer;
     i16*                m_playBuffer;
     i16*                m_fillBuffer;
-    i64                 m_tStatesUpdated;
-    i64                 m_tStateCounter;
-    int                 m_audioValue;
-    int                 m_writePosition;
 
     PaHostApiIndex      m_audioHost;
     PaDeviceIndex       m_audioDevice;
     PaStream*           m_stream;
 
     Signal              m_renderSignal;
-    function<void()>    m_frameFunc;
 
     bool                m_mute;
 };
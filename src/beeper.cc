@@ -0,0 +1,61 @@
+//----------------------------------------------------------------------------------------------------------------------
+// Beeper implementation
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "beeper.h"
+
+#define NX_VOLUME       10000
+
+//----------------------------------------------------------------------------------------------------------------------
+// Beeper
+//----------------------------------------------------------------------------------------------------------------------
+
+Beeper::Beeper(int numTStatesPerFrame, IAudioSink* sink)
+    : m_sink(sink)
+    , m_numTStatesPerSample(0)
+    , m_numSamplesPerFrame(0)
+    , m_numTStatesPerFrame(numTStatesPerFrame)
+    , m_samples()
+    , m_tStatesUpdated(0)
+    , m_tStateCounter(0)
+    , m_audioValue(0)
+    , m_writePosition(0)
+{
+    int sampleRate = sink ? sink->getSampleRate() : NX_AUDIO_SAMPLERATE;
+    m_numSamplesPerFrame = sampleRate / 50;
+    m_numTStatesPerSample = numTStatesPerFrame / m_numSamplesPerFrame;
+    m_samples.resize(m_numSamplesPerFrame, 0);
+}
+
+void Beeper::update(i64 tState, u8 speaker)
+{
+    i64 dt = tState - m_tStatesUpdated;
+
+    // The time since the last update can span many samples, so keep writing them until we run out.
+    while (m_writePosition < m_numSamplesPerFrame && m_tStateCounter + dt > m_numTStatesPerSample)
+    {
+        m_audioValue += int(speaker ? (m_numTStatesPerSample - m_tStateCounter) : 0);
+        m_samples[m_writePosition++] = ((m_audioValue * (2 * NX_VOLUME)) / m_numTStatesPerSample) - NX_VOLUME;
+
+        dt = (m_tStateCounter + dt) - m_numTStatesPerSample;
+        m_audioValue = 0;
+        m_tStateCounter = 0;
+    }
+
+    if (m_writePosition < m_numSamplesPerFrame)
+    {
+        m_audioValue += int(speaker ? dt : 0);
+        m_tStateCounter += dt;
+    }
+    m_tStatesUpdated = tState;
+
+    if (tState >= m_numTStatesPerFrame)
+    {
+        if (m_sink) m_sink->submitFrame(m_samples.data(), m_numSamplesPerFrame);
+        m_writePosition = 0;
+        m_tStatesUpdated -= m_numTStatesPerFrame;
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,62 @@
+//----------------------------------------------------------------------------------------------------------------------
+// Beeper
+// Turns the ULA's speaker bit into 16-bit samples.  A frame's worth is handed to an audio sink when each frame ends,
+// so the machine itself never talks to a sound device.
+//----------------------------------------------------------------------------------------------------------------------
+
+#pragma once
+
+#include "config.h"
+#include "types.h"
+
+#include <vector>
+
+// Sample rate used when there is no sink to ask.
+#define NX_AUDIO_SAMPLERATE 44100
+
+//----------------------------------------------------------------------------------------------------------------------
+// Audio sink
+// Implemented by whatever plays, records or discards the sound.
+//----------------------------------------------------------------------------------------------------------------------
+
+class IAudioSink
+{
+public:
+    virtual ~IAudioSink() {}
+
+    // Asked once, when the beeper is created.
+    virtual int getSampleRate() const = 0;
+
+    // Called at the end of every frame with that frame's samples.  The data is only valid during the call.
+    virtual void submitFrame(const i16* samples, int numSamples) = 0;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+// Beeper
+//----------------------------------------------------------------------------------------------------------------------
+
+class Beeper
+{
+public:
+    // The sink can be null, in which case samples are generated at NX_AUDIO_SAMPLERATE and thrown away.
+    Beeper(int numTStatesPerFrame, IAudioSink* sink);
+
+    void update(i64 tState, u8 speaker);
+
+    int getTStatesPerSample() const { return m_numTStatesPerSample; }
+    int getSamplesPerFrame() const { return m_numSamplesPerFrame; }
+
+private:
+    IAudioSink*         m_sink;
+    int                 m_numTStatesPerSample;
+    int                 m_numSamplesPerFrame;
+    int                 m_numTStatesPerFrame;
+    vector<i16>         m_samples;
+    i64                 m_tStatesUpdated;
+    i64                 m_tStateCounter;
+    int                 m_audioValue;
+    int                 m_writePosition;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,149 @@
+//----------------------------------------------------------------------------------------------------------------------
+// Shadow call stack
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "callstack.h"
+
+#if NX_CALL_STACK
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+
+//----------------------------------------------------------------------------------------------------------------------
+// Tracking
+//----------------------------------------------------------------------------------------------------------------------
+
+CallStack::CallStack()
+{
+    clear();
+}
+
+void CallStack::clear()
+{
+    m_frames.clear();
+    clearProfile();
+}
+
+void CallStack::clearProfile()
+{
+    m_nodes.assign(1, Node{ 0, -1, 0, 0 });
+    m_children.clear();
+
+    // Put the current frames back into the new tree.
+    int node = 0;
+    for (Frame& frame : m_frames)
+    {
+        node = child(node, frame.routine);
+        frame.node = node;
+    }
+}
+
+void CallStack::enter(u16 routine, u16 returnAddress, u16 sp, Kind kind)
+{
+    unwind(sp);
+    if (m_frames.size() == kMaxDepth) m_frames.erase(m_frames.begin());
+
+    const int node = child(m_frames.empty() ? 0 : m_frames.back().node, routine);
+    ++m_nodes[node].calls;
+    m_frames.push_back(Frame{ routine, returnAddress, sp, kind, node });
+}
+
+void CallStack::leave(u16 sp)
+{
+    unwind(sp);
+}
+
+// Drop the frames whose return addresses were pushed at or below sp.
+void CallStack::unwind(int sp)
+{
+    while (!m_frames.empty() && m_frames.back().sp <= sp) m_frames.pop_back();
+}
+
+// The node for routine called from parent.  Once the tree is full, new paths are charged to their caller.
+int CallStack::child(int parent, u16 routine)
+{
+    const u64 key = (u64(parent) << 16) | routine;
+    auto it = m_children.find(key);
+    if (it != m_children.end()) return it->second;
+    if (m_nodes.size() == kMaxNodes) return parent;
+
+    const int node = (int)m_nodes.size();
+    m_nodes.push_back(Node{ routine, parent, 0, 0 });
+    m_children[key] = node;
+    return node;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Reports
+//----------------------------------------------------------------------------------------------------------------------
+
+vector<CallStack::Routine> CallStack::getRoutines() const
+{
+    // Children are always added after their parents, so going backwards totals each subtree before its parent needs it.
+    vector<u64> subtree(m_nodes.size());
+    for (size_t i = m_nodes.size(); i-- > 0;)
+    {
+        subtree[i] += m_nodes[i].tStates;
+        if (m_nodes[i].parent >= 0) subtree[m_nodes[i].parent] += subtree[i];
+    }
+
+    map<u16, Routine> routines;
+    for (size_t i = 1; i < m_nodes.size(); ++i)
+    {
+        const Node& node = m_nodes[i];
+        Routine& routine = routines[node.routine];
+        routine.address = node.routine;
+        routine.calls += node.calls;
+        routine.exclusive += node.tStates;
+
+        // Only the outermost call of a recursive routine counts towards its inclusive time.
+        bool recursive = false;
+        for (int p = node.parent; p > 0 && !recursive; p = m_nodes[p].parent)
+        {
+            recursive = m_nodes[p].routine == node.routine;
+        }
+        if (!recursive) routine.inclusive += subtree[i];
+    }
+
+    vector<Routine> result;
+    for (const auto& r : routines) result.push_back(r.second);
+    stable_sort(result.begin(), result.end(), [](const Routine& a, const Routine& b) {
+        return a.inclusive > b.inclusive;
+    });
+    return result;
+}
+
+u64 CallStack::getTotalTStates() const
+{
+    u64 total = 0;
+    for (const Node& node : m_nodes) total += node.tStates;
+    return total;
+}
+
+bool CallStack::saveFoldedStacks(const string& fileName) const
+{
+    FILE* f = fopen(fileName.c_str(), "w");
+    if (!f) return false;
+
+    for (size_t i = 0; i < m_nodes.size(); ++i)
+    {
+        if (!m_nodes[i].tStates) continue;
+
+        string path;
+        for (int n = (int)i; n > 0; n = m_nodes[n].parent)
+        {
+            char name[8];
+            snprintf(name, sizeof(name), "%04X", m_nodes[n].routine);
+            path = path.empty() ? string(name) : string(name) + ";" + path;
+        }
+        fprintf(f, "%s %llu\n", path.empty() ? "(top)" : path.c_str(), (unsigned long long)m_nodes[i].tStates);
+    }
+
+    return fclose(f) == 0;
+}
+
+#endif // NX_CALL_STACK
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
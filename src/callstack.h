@@ -0,0 +1,112 @@
+//----------------------------------------------------------------------------------------------------------------------
+// Shadow call stack
+// Follows the Z80's calls, restarts and interrupts, and the returns from them, and keeps a tree of the routines that
+// were called from each routine with the t-states spent in them.
+//----------------------------------------------------------------------------------------------------------------------
+
+#pragma once
+
+#include "config.h"
+#include "types.h"
+
+#if NX_CALL_STACK
+
+#include <unordered_map>
+
+//----------------------------------------------------------------------------------------------------------------------
+// Call stack
+// Frames are matched to returns by where their return address is on the stack, not by the address returned to.  A
+// return unwinds every frame whose return address is at or below the one it pops, so code that drops its return address
+// and returns to its caller's caller, or that adjusts its return address to skip inline data, stays in step.  A RET
+// with nothing of ours under it (such as PUSH HL : RET used as a jump) unwinds nothing, and a call unwinds any frames
+// at or below where it pushes, which cleans up after code that abandons its stack.
+//----------------------------------------------------------------------------------------------------------------------
+
+class CallStack
+{
+public:
+    enum class Kind : u8
+    {
+        Call,
+        Rst,
+        Interrupt,
+    };
+
+    struct Frame
+    {
+        u16     routine;        // Address that was called
+        u16     returnAddress;  // Address pushed on the stack
+        u16     sp;             // Where the return address was pushed
+        Kind    kind;
+        int     node;           // The routine's node in the call tree
+    };
+
+    // One node per routine per path of calls that reached it.  Node 0 is the code that isn't in any known call.
+    struct Node
+    {
+        u16     routine;
+        int     parent;
+        u64     calls;
+        u64     tStates;        // Time spent in the routine itself, not in the routines it called
+    };
+
+    // A routine's totals over every path that called it.  Inclusive time counts a recursive routine only once.
+    struct Routine
+    {
+        u16     address;
+        u64     calls;
+        u64     inclusive;
+        u64     exclusive;
+    };
+
+    CallStack();
+
+    // Forget the frames and the call tree.
+    void clear();
+
+    // Reset the call tree's counts.  The current frames are kept.
+    void clearProfile();
+
+    const vector<Frame>& getFrames() const { return m_frames; }
+    const vector<Node>& getNodes() const { return m_nodes; }
+
+    // True if the frame whose return address was pushed at sp has returned or been unwound.
+    bool hasReturned(u16 sp) const { return m_frames.empty() || m_frames.back().sp > sp; }
+
+    //
+    // Called by the Z80 after each instruction
+    //
+
+    void charge(TState t) { m_nodes[m_frames.empty() ? 0 : m_frames.back().node].tStates += t; }
+    void enter(u16 routine, u16 returnAddress, u16 sp, Kind kind);
+    void leave(u16 sp);
+
+    //
+    // Reports
+    //
+
+    // Every routine that has been called, with the most inclusive t-states first.
+    vector<Routine> getRoutines() const;
+    u64 getTotalTStates() const;
+
+    // Write the call tree as folded stacks (one line per path: addresses separated by semicolons, then the t-states),
+    // which flame graph tools take as input.
+    bool saveFoldedStacks(const string& fileName) const;
+
+private:
+    void unwind(int sp);
+    int child(int parent, u16 routine);
+
+private:
+    static const size_t kMaxDepth = 256;
+    static const size_t kMaxNodes = 65536;
+
+    vector<Frame>                   m_frames;
+    vector<Node>                    m_nodes;
+    unordered_map<u64, int>         m_children;     // (parent << 16) | routine -> node
+};
+
+#endif // NX_CALL_STACK
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,103 @@
+//----------------------------------------------------------------------------------------------------------------------
+// Call Stack Window
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "debugger.h"
+#include "nx.h"
+
+#if NX_CALL_STACK
+
+#include <algorithm>
+
+//----------------------------------------------------------------------------------------------------------------------
+// Call stack window
+//----------------------------------------------------------------------------------------------------------------------
+
+CallStackWindow::CallStackWindow(Nx& nx)
+    : SelectableWindow(nx, 45, 39, 34, 14, "Call Stack", Colour::Black, Colour::White)
+    , m_z80(nx.getSpeccy().getZ80())
+    , m_enabled(false)
+    , m_topRow(0)
+{
+
+}
+
+static const char* kindName(CallStack::Kind kind)
+{
+    switch (kind)
+    {
+    case CallStack::Kind::Call:         return "CALL";
+    case CallStack::Kind::Rst:          return "RST";
+    case CallStack::Kind::Interrupt:    return "INT";
+    }
+    return "";
+}
+
+// The innermost call is at the top.  Frames are only known from when tracking was switched on.
+void CallStackWindow::onDraw(Draw& draw)
+{
+    u8 onColour = draw.attr(Colour::Black, Colour::Green, true);
+    u8 offColour = draw.attr(Colour::Black, Colour::Red, true);
+    u8 titleColour = draw.attr(Colour::Blue, Colour::White, false);
+    const vector<CallStack::Frame>& frames = m_callStack.getFrames();
+
+    draw.printString(m_x + 1, m_y + 1, m_enabled ? " On " : " Off ", m_enabled ? onColour : offColour);
+    draw.printString(m_x + 7, m_y + 1, Draw::format("Depth %d", (int)frames.size()), m_bkgColour);
+    draw.printString(m_x + 1, m_y + 2, "Routine Return SP   Via", titleColour);
+
+    const int numRows = m_height - 4;
+    m_topRow = max(0, min(m_topRow, (int)frames.size() - numRows));
+
+    u8 bkg2 = m_bkgColour & ~0x40;
+    for (int i = 0; i < numRows && m_topRow + i < (int)frames.size(); ++i)
+    {
+        const CallStack::Frame& frame = frames[frames.size() - 1 - (m_topRow + i)];
+        u8 colour = (i & 1) ? bkg2 : m_bkgColour;
+
+        draw.attrRect(m_x, m_y + 3 + i, m_width, 1, colour);
+        draw.printString(m_x + 1, m_y + 3 + i, Draw::format("%04X    %04X   %04X %s", frame.routine,
+            frame.returnAddress, frame.sp, kindName(frame.kind)), colour);
+    }
+}
+
+void CallStackWindow::onKey(sf::Keyboard::Key key, bool shift, bool ctrl, bool alt)
+{
+    using K = sf::Keyboard::Key;
+    if (shift || ctrl || alt) return;
+
+    const int page = m_height - 4;
+    switch (key)
+    {
+    case K::T:
+        // Calls made before now are unknown, so start from an empty stack.
+        m_enabled = !m_enabled;
+        if (m_enabled) m_callStack.clear();
+        m_z80.setCallStack(m_enabled ? &m_callStack : nullptr);
+        m_topRow = 0;
+        break;
+
+    case K::C:
+        m_callStack.clear();
+        m_topRow = 0;
+        break;
+
+    case K::Up:         --m_topRow;         break;
+    case K::Down:       ++m_topRow;         break;
+    case K::PageUp:     m_topRow -= page;   break;
+    case K::PageDown:   m_topRow += page;   break;
+
+    default:
+        break;
+    }
+
+    m_topRow = max(0, m_topRow);
+}
+
+void CallStackWindow::onText(char ch)
+{
+}
+
+#endif // NX_CALL_STACK
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,532 @@
+//----------------------------------------------------------------------------------------------------------------------
+// Breakpoint conditions
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "condition.h"
+#include "spectrum.h"
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+using Op = Condition::Op;
+
+//----------------------------------------------------------------------------------------------------------------------
+// Registers
+//----------------------------------------------------------------------------------------------------------------------
+
+static const char* kRegisterNames[] =
+{
+    "A", "F", "B", "C", "D", "E", "H", "L", "I", "R", "IXH", "IXL", "IYH", "IYL",
+    "AF", "BC", "DE", "HL", "IX", "IY", "SP", "PC", "AF'", "BC'", "DE'", "HL'",
+};
+
+static const int kNumRegisters = int(sizeof(kRegisterNames) / sizeof(kRegisterNames[0]));
+
+// Indexed as kRegisterNames.
+static i32 readRegister(Spectrum::CPU& z80, i32 reg)
+{
+    switch (reg)
+    {
+    case 0:     return z80.A();
+    case 1:     return z80.F();
+    case 2:     return z80.B();
+    case 3:     return z80.C();
+    case 4:     return z80.D();
+    case 5:     return z80.E();
+    case 6:     return z80.H();
+    case 7:     return z80.L();
+    case 8:     return z80.I();
+    case 9:     return z80.R();
+    case 10:    return z80.IXH();
+    case 11:    return z80.IXL();
+    case 12:    return z80.IYH();
+    case 13:    return z80.IYL();
+    case 14:    return z80.AF();
+    case 15:    return z80.BC();
+    case 16:    return z80.DE();
+    case 17:    return z80.HL();
+    case 18:    return z80.IX();
+    case 19:    return z80.IY();
+    case 20:    return z80.SP();
+    case 21:    return z80.PC();
+    case 22:    return z80.AF_();
+    case 23:    return z80.BC_();
+    case 24:    return z80.DE_();
+    case 25:    return z80.HL_();
+    }
+    return 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Lexer
+//----------------------------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+struct Token
+{
+    enum class Kind
+    {
+        Number,
+        Name,
+        Operator,
+        End,
+    };
+
+    Kind    kind;
+    string  text;
+    i32     value;
+};
+
+// Longer operators come first so that && isn't taken for two &s.
+const char* kOperators[] =
+{
+    "==", "!=", "<=", ">=", "&&", "||", "<", ">", "!", "-", "~", "&", "+", "|", "^", "(", ")",
+};
+
+bool isHexNumber(const string& digits)
+{
+    if (digits.empty()) return false;
+    for (char c : digits) if (!isxdigit((unsigned char)c)) return false;
+    return true;
+}
+
+bool tokenise(const string& text, vector<Token>& tokens, string& error)
+{
+    size_t i = 0;
+    while (i < text.size())
+    {
+        const char c = text[i];
+        if (isspace((unsigned char)c))
+        {
+            ++i;
+            continue;
+        }
+
+        if (isalnum((unsigned char)c) || c == '_' || c == '$' || c == '#')
+        {
+            size_t start = i++;
+            while (i < text.size() && (isalnum((unsigned char)text[i]) || text[i] == '_')) ++i;
+            if (i < text.size() && text[i] == '\'') ++i;
+
+            string word = text.substr(start, i - start);
+            string upper = word;
+            for (char& u : upper) u = (char)toupper((unsigned char)u);
+
+            // $2A, #2A, 0x2A and 2Ah are hexadecimal; anything else starting with a digit is decimal.
+            string digits;
+            int base = 10;
+            if (upper[0] == '$' || upper[0] == '#')
+            {
+                digits = upper.substr(1);
+                base = 16;
+            }
+            else if (upper.size() > 2 && upper[0] == '0' && upper[1] == 'X')
+            {
+                digits = upper.substr(2);
+                base = 16;
+            }
+            else if (isdigit((unsigned char)upper[0]) && upper.back() == 'H')
+            {
+                digits = upper.substr(0, upper.size() - 1);
+                base = 16;
+            }
+            else if (isdigit((unsigned char)upper[0]))
+            {
+                digits = upper;
+            }
+            else
+            {
+                tokens.push_back({ Token::Kind::Name, upper, 0 });
+                continue;
+            }
+
+            bool valid = base == 16 ? isHexNumber(digits) : !digits.empty();
+            for (char d : digits) if (base == 10 && !isdigit((unsigned char)d)) valid = false;
+            if (!valid || digits.size() > 7)
+            {
+                error = "Bad number '" + word + "'";
+                return false;
+            }
+            tokens.push_back({ Token::Kind::Number, word, (i32)strtol(digits.c_str(), nullptr, base) });
+            continue;
+        }
+
+        const char* op = nullptr;
+        for (const char* o : kOperators)
+        {
+            if (text.compare(i, strlen(o), o) == 0)
+            {
+                op = o;
+                break;
+            }
+        }
+        if (!op)
+        {
+            error = string("Unexpected '") + c + "'";
+            return false;
+        }
+        tokens.push_back({ Token::Kind::Operator, op, 0 });
+        i += strlen(op);
+    }
+
+    tokens.push_back({ Token::Kind::End, "", 0 });
+    return true;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Parser
+// Recursive descent, one function per level of precedence, emitting code as it goes.
+//----------------------------------------------------------------------------------------------------------------------
+
+class Parser
+{
+public:
+    Parser(const vector<Token>& tokens, vector<Condition::Instruction>& code)
+        : m_tokens(tokens)
+        , m_pos(0)
+        , m_code(code)
+        , m_depth(0)
+        , m_maxDepth(0)
+    {}
+
+    bool parse(string& error);
+
+private:
+    bool parseOr();
+    bool parseAnd();
+    bool parseComparison();
+    bool parseSum();
+    bool parseProduct();
+    bool parseUnary();
+    bool parseValue();
+
+    bool isOperator(const char* op) const;
+    bool isGroup() const;
+    bool fail(const string& message);
+    size_t emit(Op op, i32 arg = 0);
+
+private:
+    const vector<Token>&                m_tokens;
+    size_t                              m_pos;
+    vector<Condition::Instruction>&     m_code;
+    int                                 m_depth;
+    int                                 m_maxDepth;
+    string                              m_error;
+};
+
+bool Parser::parse(string& error)
+{
+    bool ok = parseOr();
+    if (ok && m_tokens[m_pos].kind != Token::Kind::End) ok = fail("Unexpected '" + m_tokens[m_pos].text + "'");
+    if (ok && m_maxDepth > Condition::kMaxStack) ok = fail("Too complicated");
+
+    if (!ok) error = m_error;
+    return ok;
+}
+
+bool Parser::isOperator(const char* op) const
+{
+    const Token& t = m_tokens[m_pos];
+    return t.kind == Token::Kind::Operator && t.text == op;
+}
+
+// Looks ahead from just inside an opening bracket for a comparison or logical operator before its closing bracket.
+// An address can't sensibly be a truth value, so one at any depth means the brackets are there to group.
+bool Parser::isGroup() const
+{
+    int depth = 0;
+    for (size_t i = m_pos; m_tokens[i].kind != Token::Kind::End; ++i)
+    {
+        const Token& t = m_tokens[i];
+        if (t.kind != Token::Kind::Operator) continue;
+
+        if (t.text == "(")
+        {
+            ++depth;
+        }
+        else if (t.text == ")")
+        {
+            if (depth-- == 0) break;
+        }
+        else
+        {
+            for (const char* op : { "==", "!=", "<", "<=", ">", ">=", "&&", "||" })
+            {
+                if (t.text == op) return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool Parser::fail(const string& message)
+{
+    m_error = message;
+    return false;
+}
+
+size_t Parser::emit(Op op, i32 arg)
+{
+    switch (op)
+    {
+    case Op::Number:
+    case Op::Register:
+    case Op::TState:
+        m_depth++;
+        break;
+
+    case Op::Peek:
+    case Op::Not:
+    case Op::Negate:
+    case Op::Complement:
+    case Op::Bool:
+        break;
+
+    default:
+        // Binary operators pop one more than they push, and a jump pops when it doesn't jump.
+        m_depth--;
+        break;
+    }
+    m_maxDepth = max(m_maxDepth, m_depth);
+
+    m_code.push_back({ op, arg });
+    return m_code.size() - 1;
+}
+
+bool Parser::parseOr()
+{
+    if (!parseAnd()) return false;
+    while (isOperator("||"))
+    {
+        ++m_pos;
+        size_t jump = emit(Op::JumpIfTrue);
+        if (!parseAnd()) return false;
+        emit(Op::Bool);
+        m_code[jump].arg = (i32)m_code.size();
+    }
+    return true;
+}
+
+bool Parser::parseAnd()
+{
+    if (!parseComparison()) return false;
+    while (isOperator("&&"))
+    {
+        ++m_pos;
+        size_t jump = emit(Op::JumpIfFalse);
+        if (!parseComparison()) return false;
+        emit(Op::Bool);
+        m_code[jump].arg = (i32)m_code.size();
+    }
+    return true;
+}
+
+bool Parser::parseComparison()
+{
+    static const struct { const char* text; Op op; } kComparisons[] =
+    {
+        { "==", Op::Equal },
+        { "!=", Op::NotEqual },
+        { "<",  Op::Less },
+        { "<=", Op::LessEqual },
+        { ">",  Op::Greater },
+        { ">=", Op::GreaterEqual },
+    };
+
+    if (!parseSum()) return false;
+    for (const auto& c : kComparisons)
+    {
+        if (isOperator(c.text))
+        {
+            ++m_pos;
+            if (!parseSum()) return false;
+            emit(c.op);
+            break;
+        }
+    }
+    return true;
+}
+
+bool Parser::parseSum()
+{
+    if (!parseProduct()) return false;
+    for (;;)
+    {
+        Op op;
+        if (isOperator("+"))        op = Op::Add;
+        else if (isOperator("-"))   op = Op::Subtract;
+        else if (isOperator("|"))   op = Op::Or;
+        else if (isOperator("^"))   op = Op::Xor;
+        else break;
+
+        ++m_pos;
+        if (!parseProduct()) return false;
+        emit(op);
+    }
+    return true;
+}
+
+bool Parser::parseProduct()
+{
+    if (!parseUnary()) return false;
+    while (isOperator("&"))
+    {
+        ++m_pos;
+        if (!parseUnary()) return false;
+        emit(Op::And);
+    }
+    return true;
+}
+
+bool Parser::parseUnary()
+{
+    Op op;
+    if (isOperator("!"))        op = Op::Not;
+    else if (isOperator("-"))   op = Op::Negate;
+    else if (isOperator("~"))   op = Op::Complement;
+    else return parseValue();
+
+    ++m_pos;
+    if (!parseUnary()) return false;
+    emit(op);
+    return true;
+}
+
+bool Parser::parseValue()
+{
+    const Token& t = m_tokens[m_pos];
+    switch (t.kind)
+    {
+    case Token::Kind::Number:
+        ++m_pos;
+        emit(Op::Number, t.value);
+        return true;
+
+    case Token::Kind::Name:
+        ++m_pos;
+        if (t.text == "TSTATE")
+        {
+            emit(Op::TState);
+            return true;
+        }
+        for (int i = 0; i < kNumRegisters; ++i)
+        {
+            if (t.text == kRegisterNames[i])
+            {
+                emit(Op::Register, i);
+                return true;
+            }
+        }
+        return fail("Unknown name '" + t.text + "'");
+
+    case Token::Kind::Operator:
+        if (t.text == "(")
+        {
+            // Brackets read memory, as in (HL), unless there is a comparison or logical operator inside, in which
+            // case they only group: (A==0 || B==0) && C==1.
+            ++m_pos;
+            const bool group = isGroup();
+            if (group ? !parseOr() : !parseSum()) return false;
+            if (!isOperator(")")) return fail("Expected ')'");
+            ++m_pos;
+            if (!group) emit(Op::Peek);
+            return true;
+        }
+        return fail("Expected a value before '" + t.text + "'");
+
+    case Token::Kind::End:
+        break;
+    }
+
+    return fail("Expected a value");
+}
+
+} // namespace
+
+//----------------------------------------------------------------------------------------------------------------------
+// Condition
+//----------------------------------------------------------------------------------------------------------------------
+
+Condition::Condition()
+{
+
+}
+
+bool Condition::compile(const string& text, string& error)
+{
+    vector<Token> tokens;
+    vector<Instruction> code;
+    if (!tokenise(text, tokens, error)) return false;
+    if (tokens.size() > 1)
+    {
+        Parser parser(tokens, code);
+        if (!parser.parse(error)) return false;
+    }
+
+    m_text = text;
+    m_code = move(code);
+    return true;
+}
+
+bool Condition::evaluate(Spectrum& speccy) const
+{
+    if (m_code.empty()) return true;
+
+    Spectrum::CPU& z80 = speccy.getZ80();
+    i32 stack[kMaxStack];
+    int n = 0;
+
+    const Instruction* code = m_code.data();
+    const i32 size = (i32)m_code.size();
+    for (i32 pc = 0; pc < size; ++pc)
+    {
+        const Instruction& in = code[pc];
+
+        switch (in.op)
+        {
+        case Op::Number:        stack[n++] = in.arg;                                         break;
+        case Op::Register:      stack[n++] = readRegister(z80, in.arg);                      break;
+        case Op::TState:        stack[n++] = (i32)speccy.getTState();                        break;
+        case Op::Peek:          stack[n - 1] = speccy.peek(u16(stack[n - 1]));               break;
+        case Op::Not:           stack[n - 1] = !stack[n - 1];                                break;
+        case Op::Negate:        stack[n - 1] = i32(0u - u32(stack[n - 1]));                  break;
+        case Op::Complement:    stack[n - 1] = ~stack[n - 1];                                break;
+        case Op::Bool:          stack[n - 1] = stack[n - 1] != 0;                            break;
+
+        case Op::And:           --n; stack[n - 1] &= stack[n];                               break;
+        case Op::Or:            --n; stack[n - 1] |= stack[n];                               break;
+        case Op::Xor:           --n; stack[n - 1] ^= stack[n];                               break;
+        case Op::Add:           --n; stack[n - 1] = i32(u32(stack[n - 1]) + u32(stack[n]));  break;
+        case Op::Subtract:      --n; stack[n - 1] = i32(u32(stack[n - 1]) - u32(stack[n]));  break;
+        case Op::Equal:         --n; stack[n - 1] = stack[n - 1] == stack[n];                break;
+        case Op::NotEqual:      --n; stack[n - 1] = stack[n - 1] != stack[n];                break;
+        case Op::Less:          --n; stack[n - 1] = stack[n - 1] < stack[n];                 break;
+        case Op::LessEqual:     --n; stack[n - 1] = stack[n - 1] <= stack[n];                break;
+        case Op::Greater:       --n; stack[n - 1] = stack[n - 1] > stack[n];                 break;
+        case Op::GreaterEqual:  --n; stack[n - 1] = stack[n - 1] >= stack[n];                break;
+
+        case Op::JumpIfFalse:
+            if (stack[n - 1] == 0) pc = in.arg - 1;
+            else --n;
+            break;
+
+        case Op::JumpIfTrue:
+            if (stack[n - 1] != 0)
+            {
+                stack[n - 1] = 1;
+                pc = in.arg - 1;
+            }
+            else --n;
+            break;
+        }
+    }
+
+    NX_ASSERT(n == 1);
+    return stack[0] != 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,96 @@
+//----------------------------------------------------------------------------------------------------------------------
+// Breakpoint conditions
+// An expression such as A==$3F && (HL)!=0 && tstate>30000, compiled once into bytecode for a small stack machine so
+// that a conditional breakpoint in a hot loop costs little more than an unconditional one.
+//----------------------------------------------------------------------------------------------------------------------
+
+#pragma once
+
+#include "config.h"
+#include "types.h"
+
+#include <string>
+#include <vector>
+
+class Spectrum;
+
+//----------------------------------------------------------------------------------------------------------------------
+// Syntax
+// Values are registers (A, F, B, C, D, E, H, L, I, R, IXH, IXL, IYH, IYL, AF, BC, DE, HL, IX, IY, SP, PC and AF', BC',
+// DE', HL'), tstate (the T-state within the frame) and numbers, written as 42, $2A, #2A, 0x2A or 2Ah.  Names are not
+// case sensitive.  Brackets read a byte of memory, as in Z80 assembly: (HL), (IX+5), ($5C3A).  Brackets with a
+// comparison or logical operator anywhere inside them group terms instead, as in (A==0 || B==0) && C==1.  Arithmetic
+// wraps around at 32 bits.
+//
+// From the tightest binding to the loosest, the operators are:
+//
+//      ! - ~                   Unary not, minus and complement
+//      &                       Bitwise and
+//      + - | ^                 Add, subtract, bitwise or and exclusive or
+//      == != < <= > >=         Comparisons, which give 1 or 0
+//      &&                      Logical and
+//      ||                      Logical or
+//
+// so A&$80==0 tests bit 7 of A.  && and || stop as soon as the answer is known.
+//----------------------------------------------------------------------------------------------------------------------
+
+class Condition
+{
+public:
+    Condition();
+
+    // Replace the condition with a new one.  Returns false, with the reason in error and the old condition kept, if
+    // the text doesn't compile.  An empty text is always true.
+    bool compile(const string& text, string& error);
+
+    const string& getText() const { return m_text; }
+    bool isEmpty() const { return m_code.empty(); }
+
+    // True if the condition holds for the machine as it is now.
+    bool evaluate(Spectrum& speccy) const;
+
+    //
+    // Bytecode
+    // Each instruction pushes, pops or replaces values on the stack.  Jumps go to the instruction at arg.
+    //
+
+    enum class Op : u8
+    {
+        Number,         // Push arg
+        Register,       // Push the register numbered arg
+        TState,         // Push the frame T-state
+        Peek,           // Replace the top with the byte at that address
+        Not,            // Unary operators replace the top
+        Negate,
+        Complement,
+        And,            // Binary operators pop two and push the result
+        Or,
+        Xor,
+        Add,
+        Subtract,
+        Equal,
+        NotEqual,
+        Less,
+        LessEqual,
+        Greater,
+        GreaterEqual,
+        JumpIfFalse,    // If the top is 0, jump and leave it; otherwise pop it (for &&)
+        JumpIfTrue,     // If the top isn't 0, make it 1 and jump; otherwise pop it (for ||)
+        Bool,           // Make the top 1 if it isn't 0
+    };
+
+    struct Instruction
+    {
+        Op      op;
+        i32     arg;
+    };
+
+    static const int kMaxStack = 16;
+
+private:
+    string                  m_text;
+    vector<Instruction>     m_code;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
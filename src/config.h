@@ -9,6 +9,21 @@
 // Show a console on Win32 platform
 #define NX_DEBUG_CONSOLE        0
 
+// Compute the Z80's F register only when it is read, instead of after every arithmetic instruction
+#define NX_LAZY_FLAGS           1
+
+// Decode common instruction pairs and delay loops into single handlers in the Z80's block cache
+#define NX_FUSION               1
+
+// Count the t-states spent on each opcode and at each address while the debugger's profiler is switched on
+#define NX_PROFILER             1
+
+// Allow every instruction the Z80 runs to be recorded to a file, with its timing and register changes
+#define NX_TRACE                1
+
+// Follow the Z80's calls and returns while the debugger's call stack is switched on, and time each routine
+#define NX_CALL_STACK           1
+
 //----------------------------------------------------------------------------------------------------------------------
 
 namespace std {}
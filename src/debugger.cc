@@ -14,10 +14,19 @@ Debugger::Debugger(Nx& nx)
     , m_memoryDumpWindow(nx)
     , m_disassemblyWindow(nx)
     , m_cpuStatusWindow(nx)
+#if NX_PROFILER
+    , m_profilerWindow(nx)
+#endif
+#if NX_CALL_STACK
+    , m_callStackWindow(nx)
+#endif
     , m_memoryDumpCommands({
         "G|oto",
         "C|hecksums",
         "E|dit",
+        "M|ark coverage",
+        "O|verlay coverage",
+        "R|eset coverage",
         "Up|Scroll up",
         "Down|Scroll down",
         "PgUp|Page up",
@@ -26,11 +35,13 @@ Debugger::Debugger(Nx& nx)
         "Tab|Switch window"})
     , m_disassemblyCommands({
         "G|oto",
+        "C|ondition",
         "F1|Render video",
         "F5|Pause/Run",
         "Ctrl-F5|Run to",
         "F6|Step Over",
         "F7|Step In",
+        "F8|Step Out",
         "F9|Breakpoint",
         "Up|Scroll up",
         "Down|Scroll down",
@@ -38,6 +49,31 @@ Debugger::Debugger(Nx& nx)
         "PgDn|Page down",
         "~|Exit",
         "Tab|Switch window"})
+#if NX_PROFILER
+    , m_profilerCommands({
+        "P|rofile on/off",
+        "V|iew opcodes/hotspots/routines",
+        "R|eset",
+        "S|ave CSV",
+        "Up|Scroll up",
+        "Down|Scroll down",
+        "PgUp|Page up",
+        "PgDn|Page down",
+        "~|Exit",
+        "Tab|Switch window"})
+#endif
+#if NX_CALL_STACK
+    , m_callStackCommands({
+        "T|rack calls on/off",
+        "C|lear",
+        "F8|Step Out",
+        "Up|Scroll up",
+        "Down|Scroll down",
+        "PgUp|Page up",
+        "PgDn|Page down",
+        "~|Exit",
+        "Tab|Switch window"})
+#endif
 {
     m_disassemblyWindow.Select();
 }
@@ -85,6 +121,22 @@ void Debugger::key(sf::Keyboard::Key key, bool down, bool shift, bool ctrl, bool
             {
                 getMemoryDumpWindow().Select();
             }
+#if NX_PROFILER
+            else if (getMemoryDumpWindow().isSelected())
+            {
+                getProfilerWindow().Select();
+            }
+#endif
+#if NX_CALL_STACK
+#   if NX_PROFILER
+            else if (getProfilerWindow().isSelected())
+#   else
+            else if (getMemoryDumpWindow().isSelected())
+#   endif
+            {
+                getCallStackWindow().Select();
+            }
+#endif
             else
             {
                 getDisassemblyWindow().Select();
@@ -115,6 +167,12 @@ void Debugger::render(Draw& draw)
     m_memoryDumpWindow.draw(draw);
     m_disassemblyWindow.draw(draw);
     m_cpuStatusWindow.draw(draw);
+#if NX_PROFILER
+    m_profilerWindow.draw(draw);
+#endif
+#if NX_CALL_STACK
+    m_callStackWindow.draw(draw);
+#endif
 }
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -123,6 +181,12 @@ void Debugger::render(Draw& draw)
 
 const vector<string>& Debugger::commands() const
 {
+#if NX_PROFILER
+    if (m_profilerWindow.isSelected()) return m_profilerCommands;
+#endif
+#if NX_CALL_STACK
+    if (m_callStackWindow.isSelected()) return m_callStackCommands;
+#endif
     return m_memoryDumpWindow.isSelected() ? m_memoryDumpCommands : m_disassemblyCommands;
 }
 
@@ -7,6 +7,7 @@
 #include <string>
 
 #include "editor.h"
+#include "z80.h"
 
 //----------------------------------------------------------------------------------------------------------------------
 // Memory dump
@@ -25,12 +26,14 @@ protected:
 
     void adjust();
     void poke(u8 value);
+    u8 coverageColour(u16 address) const;
 
 private:
     u16     m_address;
     Editor  m_gotoEditor;
     int     m_enableGoto;
     bool    m_showChecksums;
+    bool    m_showCoverage;
 
     // Edit mode
     bool    m_editMode;
@@ -60,7 +63,11 @@ private:
     void onText(char ch) override;
     void onUnselected() override;
 
+    void conditionText(char ch);
     u16 backInstruction(u16 address);
+#if NX_PROFILER
+    void drawHeat(Draw& draw, int row, u16 address);
+#endif
 
     void setView(u16 newTopAddress);
     int findViewAddress(u16 address);
@@ -76,13 +83,20 @@ private:
     
     Editor  m_gotoEditor;
     int     m_enableGoto;
+
+    // Editing the condition of the breakpoint at m_conditionAddress
+    Editor  m_conditionEditor;
+    int     m_enableCondition;
+    u16     m_conditionAddress;
+    string  m_conditionError;
 };
 
 //----------------------------------------------------------------------------------------------------------------------
 // CPU Status
 //----------------------------------------------------------------------------------------------------------------------
 
-class Z80;
+template <typename Bus> class Z80;
+class Spectrum48Bus;
 
 class CpuStatusWindow final : public Window
 {
@@ -95,9 +109,105 @@ private:
     void onText(char ch) override;
 
 protected:
-    Z80&        m_z80;
+    Z80<Spectrum48Bus>& m_z80;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+// Profiler
+//----------------------------------------------------------------------------------------------------------------------
+
+#if NX_PROFILER
+
+class ProfilerWindow final : public SelectableWindow
+{
+public:
+    ProfilerWindow(Nx& nx);
+
+    const HotspotProfile& getHotspotProfile() const { return m_hotspots; }
+
+    // Write every opcode that has run, busiest first, with its counts and mnemonic.
+    bool saveOpcodesCsv(const string& fileName);
+
+    // Write every address that has run an instruction, busiest first, with the instruction now there.
+    bool saveHotspotsCsv(const string& fileName);
+
+#if NX_CALL_STACK
+    // Write every routine that has been called, with the most inclusive t-states first.
+    bool saveRoutinesCsv(const string& fileName);
+#endif
+
+private:
+    void onDraw(Draw& draw) override;
+    void onKey(sf::Keyboard::Key key, bool shift, bool ctrl, bool alt) override;
+    void onText(char ch) override;
+
+    enum class View
+    {
+        Opcodes,
+        Hotspots,
+#if NX_CALL_STACK
+        Routines,
+#endif
+    };
+
+    struct OpcodeRow
+    {
+        OpcodeProfile::Table    table;
+        int                     opCode;     // -1 for interrupts
+        OpcodeProfile::Entry    entry;
+    };
+
+    vector<OpcodeRow> sortedOpcodes() const;
+    vector<u16> sortedHotspots() const;
+    static string label(const OpcodeRow& row);
+    static string mnemonic(const OpcodeRow& row);
+    string mnemonicAt(u16 address);
+
+    void drawOpcodes(Draw& draw, int numRows);
+    void drawHotspots(Draw& draw, int numRows);
+#if NX_CALL_STACK
+    void drawRoutines(Draw& draw, int numRows);
+    CallStack& getCallStack();
+#endif
+
+private:
+    Z80<Spectrum48Bus>& m_z80;
+    OpcodeProfile       m_opcodes;
+    HotspotProfile      m_hotspots;
+    bool                m_enabled;
+    View                m_view;
+    int                 m_topRow;
 };
 
+#endif
+
+//----------------------------------------------------------------------------------------------------------------------
+// Call stack
+//----------------------------------------------------------------------------------------------------------------------
+
+#if NX_CALL_STACK
+
+class CallStackWindow final : public SelectableWindow
+{
+public:
+    CallStackWindow(Nx& nx);
+
+    CallStack& getCallStack() { return m_callStack; }
+
+private:
+    void onDraw(Draw& draw) override;
+    void onKey(sf::Keyboard::Key key, bool shift, bool ctrl, bool alt) override;
+    void onText(char ch) override;
+
+private:
+    Z80<Spectrum48Bus>& m_z80;
+    CallStack           m_callStack;
+    bool                m_enabled;
+    int                 m_topRow;
+};
+
+#endif
+
 //----------------------------------------------------------------------------------------------------------------------
 // Debugger
 //----------------------------------------------------------------------------------------------------------------------
@@ -117,14 +227,32 @@ public:
     MemoryDumpWindow&   getMemoryDumpWindow() { return m_memoryDumpWindow; }
     DisassemblyWindow&  getDisassemblyWindow() { return m_disassemblyWindow; }
     CpuStatusWindow&    getCpuStatusWindow() { return m_cpuStatusWindow; }
+#if NX_PROFILER
+    ProfilerWindow&     getProfilerWindow() { return m_profilerWindow; }
+#endif
+#if NX_CALL_STACK
+    CallStackWindow&    getCallStackWindow() { return m_callStackWindow; }
+#endif
 
 private:
     MemoryDumpWindow    m_memoryDumpWindow;
     DisassemblyWindow   m_disassemblyWindow;
     CpuStatusWindow     m_cpuStatusWindow;
+#if NX_PROFILER
+    ProfilerWindow      m_profilerWindow;
+#endif
+#if NX_CALL_STACK
+    CallStackWindow     m_callStackWindow;
+#endif
 
     vector<string>      m_memoryDumpCommands;
     vector<string>      m_disassemblyCommands;
+#if NX_PROFILER
+    vector<string>      m_profilerCommands;
+#endif
+#if NX_CALL_STACK
+    vector<string>      m_callStackCommands;
+#endif
 };
 
 //----------------------------------------------------------------------------------------------------------------------
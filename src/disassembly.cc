@@ -19,6 +19,9 @@ DisassemblyWindow::DisassemblyWindow(Nx& nx)
     , m_topAddress(0x0000)
     , m_gotoEditor(6, 23, 43, 1, Draw::attr(Colour::White, Colour::Magenta, false), false, 4, 0)
     , m_enableGoto(0)
+    , m_conditionEditor(6, 23, 43, 1, Draw::attr(Colour::White, Colour::Magenta, false), false, 64, 64)
+    , m_enableCondition(0)
+    , m_conditionAddress(0)
 {
     adjustBar();
     m_gotoEditor.onlyAllowHex();
@@ -147,6 +150,7 @@ void DisassemblyWindow::onDraw(Draw& draw)
     u16 a = m_topAddress;
     u8 selectColour = draw.attr(Colour::Black, Colour::Yellow, true);
     u8 breakpointColour = draw.attr(Colour::Yellow, Colour::Red, true);
+    u8 conditionColour = draw.attr(Colour::Yellow, Colour::Magenta, true);
     u8 pcColour = draw.attr(Colour::White, Colour::Green, true);
     u16 pc = m_nx.getSpeccy().getZ80().PC();
 
@@ -159,7 +163,7 @@ void DisassemblyWindow::onDraw(Draw& draw)
             : (a == pc)
                 ? pcColour
                 : m_nx.getSpeccy().hasUserBreakpointAt(a)
-                    ? breakpointColour
+                    ? m_nx.getSpeccy().getBreakpointCondition(a).empty() ? breakpointColour : conditionColour
                     : row & 1
                         ? m_bkgColour
                         : bkg2;
@@ -177,6 +181,9 @@ void DisassemblyWindow::onDraw(Draw& draw)
         {
             draw.printChar(m_x + 1, m_y + row, '*', colour, gGfxFont);
         }
+#if NX_PROFILER
+        drawHeat(draw, row, a);
+#endif
 
         a = next;
     }
@@ -188,12 +195,49 @@ void DisassemblyWindow::onDraw(Draw& draw)
         draw.printSquashedString(m_x + 1, m_y + 1, "Goto:", draw.attr(Colour::Yellow, Colour::Magenta, true));
         m_gotoEditor.render(draw, 0);
     }
+
+    if (m_enableCondition)
+    {
+        draw.attrRect(m_x, m_y + 1, m_width, 1, draw.attr(Colour::Black, Colour::Magenta, true));
+        draw.printString(m_x + 1, m_y + 1, "    ", draw.attr(Colour::White, Colour::Magenta, true));
+        draw.printSquashedString(m_x + 1, m_y + 1, "If:", draw.attr(Colour::Yellow, Colour::Magenta, true));
+        m_conditionEditor.render(draw, 0);
+
+        if (!m_conditionError.empty())
+        {
+            u8 errorColour = draw.attr(Colour::Yellow, Colour::Red, true);
+            draw.attrRect(m_x, m_y + 2, m_width, 1, errorColour);
+            draw.printString(m_x + 1, m_y + 2, m_conditionError.c_str(), errorColour);
+        }
+    }
 }
 
+#if NX_PROFILER
+
+// The share of the profiled t-states spent on the instruction, coloured by how hot it is.
+void DisassemblyWindow::drawHeat(Draw& draw, int row, u16 address)
+{
+    const HotspotProfile& hotspots = m_nx.getDebugger().getProfilerWindow().getHotspotProfile();
+    const u64 t = hotspots.tStates[address];
+    if (!t) return;
+
+    const double percent = 100.0 * (double)t / (double)hotspots.total;
+    const Colour paper = percent >= 10.0 ? Colour::Red : percent >= 1.0 ? Colour::Yellow : Colour::Cyan;
+    u8 colour = draw.attr(Colour::Black, paper, true);
+
+    draw.attrRect(m_x + 38, m_y + row, 4, 1, colour);
+    draw.printString(m_x + 38, m_y + row, Draw::format(percent < 9.95 ? "%.1f%%" : "%3.0f%%", percent), colour);
+}
+
+#endif
+
 void DisassemblyWindow::onKey(sf::Keyboard::Key key, bool shift, bool ctrl, bool alt)
 {
     using K = sf::Keyboard::Key;
 
+    // Keys typed into the condition are for the editor.
+    if (m_enableCondition) return;
+
     if (!shift && !ctrl && !alt)
     {
         switch (key)
@@ -233,6 +277,13 @@ void DisassemblyWindow::onKey(sf::Keyboard::Key key, bool shift, bool ctrl, bool
             m_enableGoto = 1;
             break;
 
+        case K::C:
+            m_enableGoto = 0;
+            m_conditionAddress = m_address;
+            m_conditionError.clear();
+            m_enableCondition = 1;
+            break;
+
         default:
             break;
         }
@@ -256,6 +307,12 @@ void DisassemblyWindow::onKey(sf::Keyboard::Key key, bool shift, bool ctrl, bool
 
 void DisassemblyWindow::onText(char ch)
 {
+    if (m_enableCondition)
+    {
+        conditionText(ch);
+        return;
+    }
+
     if (m_enableGoto == 0) return;
     if (m_enableGoto == 1)
     {
@@ -301,6 +358,45 @@ void DisassemblyWindow::onText(char ch)
     }
 }
 
+// Enter sets the condition, adding a breakpoint if there isn't one, and Escape leaves it as it was.  A condition that
+// doesn't compile keeps the editor open with the reason underneath.
+void DisassemblyWindow::conditionText(char ch)
+{
+    if (m_enableCondition == 1)
+    {
+        // We swallow the first event, because it will be the key that enabled the editor.  Start from the breakpoint's
+        // current condition.
+        m_conditionEditor.clear();
+        for (char c : m_nx.getSpeccy().getBreakpointCondition(m_conditionAddress)) m_conditionEditor.text(c);
+        m_enableCondition = 2;
+        return;
+    }
+
+    m_conditionError.clear();
+    switch (ch)
+    {
+    case 27:
+        m_enableCondition = 0;
+        break;
+
+    case 10:
+    case 13:
+        {
+            auto view = m_conditionEditor.getText();
+            string condition;
+            for (size_t i = 0; i < view.size(); ++i) condition += view[i];
+            if (m_nx.getSpeccy().setBreakpointCondition(m_conditionAddress, condition, m_conditionError))
+            {
+                m_enableCondition = 0;
+            }
+        }
+        break;
+
+    default:
+        m_conditionEditor.text(ch);
+    }
+}
+
 u16 DisassemblyWindow::backInstruction(u16 address)
 {
     u16 count = 1;
@@ -341,4 +437,5 @@ u16 DisassemblyWindow::disassemble(u16 address)
 void DisassemblyWindow::onUnselected()
 {
     m_enableGoto = 0;
+    m_enableCondition = 0;
 }
@@ -0,0 +1,114 @@
+//----------------------------------------------------------------------------------------------------------------------
+// Timed event queue
+// Holds the t-state at which each peripheral next needs attention, so the CPU can run straight to the earliest one.
+//----------------------------------------------------------------------------------------------------------------------
+
+#pragma once
+
+#include "config.h"
+#include "types.h"
+
+#include <limits>
+
+//----------------------------------------------------------------------------------------------------------------------
+// Event types
+// Each type has at most one pending time.  Adding a device means adding an entry here and handling it in the
+// machine's event dispatch.
+//----------------------------------------------------------------------------------------------------------------------
+
+enum class Event
+{
+    Interrupt,      // End of frame, and the maskable interrupt
+    Scanline,       // Start of the next scanline
+    TapeEdge,       // Next change of the tape's EAR signal
+    AudioSample,    // Next audio sample boundary
+
+    COUNT
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+// Event queue
+//----------------------------------------------------------------------------------------------------------------------
+
+class EventQueue
+{
+public:
+    static const TState kNever = numeric_limits<TState>::max();
+
+    EventQueue()
+    {
+        clear();
+    }
+
+    // Remove all pending events.
+    void clear()
+    {
+        for (int i = 0; i < (int)Event::COUNT; ++i) m_times[i] = kNever;
+        m_next = kNever;
+    }
+
+    // Set the time of an event, replacing any time it already had.
+    void schedule(Event event, TState t)
+    {
+        m_times[(int)event] = t;
+        if (t < m_next) m_next = t; else findNext();
+    }
+
+    void cancel(Event event)
+    {
+        m_times[(int)event] = kNever;
+        findNext();
+    }
+
+    bool isPending(Event event) const { return m_times[(int)event] != kNever; }
+
+    // The t-state of a single event, or kNever.
+    TState timeOf(Event event) const { return m_times[(int)event]; }
+
+    // The t-state of the earliest pending event.
+    TState nextTime() const { return m_next; }
+
+    // Remove the earliest event due at or before t.  Returns false if nothing is due.
+    bool pop(TState t, Event& event)
+    {
+        if (m_next > t) return false;
+
+        int earliest = 0;
+        for (int i = 1; i < (int)Event::COUNT; ++i)
+        {
+            if (m_times[i] < m_times[earliest]) earliest = i;
+        }
+
+        event = (Event)earliest;
+        m_times[earliest] = kNever;
+        findNext();
+        return true;
+    }
+
+    // Move all pending events back by dt t-states.  Called when the frame counter is reset.
+    void rebase(TState dt)
+    {
+        for (int i = 0; i < (int)Event::COUNT; ++i)
+        {
+            if (m_times[i] != kNever) m_times[i] -= dt;
+        }
+        findNext();
+    }
+
+private:
+    void findNext()
+    {
+        m_next = kNever;
+        for (int i = 0; i < (int)Event::COUNT; ++i)
+        {
+            if (m_times[i] < m_next) m_next = m_times[i];
+        }
+    }
+
+private:
+    TState      m_times[(int)Event::COUNT];
+    TState      m_next;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
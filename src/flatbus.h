@@ -0,0 +1,126 @@
+//----------------------------------------------------------------------------------------------------------------------
+// Flat bus
+// 64K of RAM with no ROM and no devices, for running the Z80 on its own.  Memory accesses take their uncontended
+// times unless the memory asks for 48K contention, ports read as $ff and writes to them are ignored unless the memory
+// has an onOut handler.
+//----------------------------------------------------------------------------------------------------------------------
+
+#pragma once
+
+#include "config.h"
+#include "types.h"
+
+#include <algorithm>
+#include <functional>
+
+//----------------------------------------------------------------------------------------------------------------------
+// Memory
+// Owned separately from the bus, since the Z80 takes its bus by value.
+//----------------------------------------------------------------------------------------------------------------------
+
+struct FlatMemory
+{
+    FlatMemory()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        std::fill(ram, ram + 65536, u8(0));
+        for (u32& g : generations) ++g;
+    }
+
+    u8      ram[65536];
+    u32     generations[256] = {};
+
+    // Contend $4000-$7fff with the 48K ULA's pattern, repeating every 69888 t-states.  Direct access to memory is
+    // refused for that range, as on the real bus.
+    bool    contended = false;
+
+    // Called for every port write, if set.
+    std::function<void(u16 port, u8 x)>   onOut;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+// Bus
+//----------------------------------------------------------------------------------------------------------------------
+
+class FlatBus
+{
+public:
+    FlatBus(FlatMemory& memory) : m_memory(memory) {}
+
+    u8 peek(u16 address) { return m_memory.ram[address]; }
+    u8 peek(u16 address, TState& t) { contend(address, 3, 1, t); return m_memory.ram[address]; }
+    u16 peek16(u16 address, TState& t) { return peek(address, t) + 256 * peek(u16(address + 1), t); }
+    u8 fetch(u16 address, TState& t) { contend(address, 4, 1, t); return m_memory.ram[address]; }
+    u8 in(u16 port, TState& t) { t += 4; return 0xff; }
+    void out(u16 port, u8 x, TState& t)
+    {
+        t += 4;
+        if (m_memory.onOut) m_memory.onOut(port, x);
+    }
+
+    void contend(u16 address, TState delay, int num, TState& t)
+    {
+        if (isContended(address))
+        {
+            for (int i = 0; i < num; ++i) t += contention(t) + delay;
+        }
+        else
+        {
+            t += delay * num;
+        }
+    }
+
+    void poke(u16 address, u8 x, TState& t)
+    {
+        contend(address, 3, 1, t);
+        m_memory.ram[address] = x;
+        ++m_memory.generations[address >> 8];
+    }
+
+    void poke16(u16 address, u16 x, TState& t)
+    {
+        poke(address, u8(x), t);
+        poke(u16(address + 1), u8(x >> 8), t);
+    }
+
+    const u32* pageGenerations() { return m_memory.generations; }
+    bool isContended(u16 address) { return m_memory.contended && (address & 0xc000) == 0x4000; }
+
+    const u8* readDirect(u16 address, int length)
+    {
+        return isDirect(address, length) ? m_memory.ram + address : nullptr;
+    }
+
+    u8* writeDirect(u16 address, int length)
+    {
+        const int end = address + length;
+        if (!isDirect(address, length)) return nullptr;
+        for (int page = address >> 8; page <= (end - 1) >> 8; ++page) ++m_memory.generations[page];
+        return m_memory.ram + address;
+    }
+
+private:
+    bool isDirect(u16 address, int length) const
+    {
+        const int end = address + length;
+        return end <= 0x10000 && (!m_memory.contended || address >= 0x8000 || end <= 0x4000);
+    }
+
+    // Same timings as the table the Spectrum builds in initMemory().
+    static TState contention(TState t)
+    {
+        static const TState kPattern[8] = { 6, 5, 4, 3, 2, 1, 0, 0 };
+        t = t % 69888 - 14335;
+        if (t < 0 || t >= 192 * 224 || t % 224 >= 128) return 0;
+        return kPattern[t % 8];
+    }
+
+    FlatMemory&     m_memory;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
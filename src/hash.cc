@@ -0,0 +1,124 @@
+//----------------------------------------------------------------------------------------------------------------------
+// Block hashing implementation
+// The data is processed in 32-byte stripes of four 64-bit lanes.  Each lane is mixed with a key that changes every
+// stripe, and the low and high halves multiplied together (a 32x32->64 multiply, which SSE2 has), while the plain data
+// is added to the neighbouring lane.  The four lanes are only combined at the end.  The SSE2 and plain versions give
+// the same result.
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "hash.h"
+
+#include <cstring>
+
+#if NX_SSE2
+#   include <emmintrin.h>
+#endif
+
+static const u64 kPrime1 = 0x9e3779b185ebca87ull;
+static const u64 kPrime2 = 0xc2b2ae3d27d4eb4full;
+static const u64 kPrime3 = 0x165667b19e3779f9ull;
+static const u64 kPrime4 = 0x85ebca77c2b2ae63ull;
+
+static const int kStripeSize = 32;
+
+static const u64 kKeys[4] = { 0xbe4ba423396cfeb8ull, 0x1cad21f72c81017cull, 0xdb979083e96dd4deull, 0x1f67b3b7a4a44072ull };
+static const u64 kKeyStep = kPrime3;
+
+static u64 rotl(u64 x, int n)
+{
+    return (x << n) | (x >> (64 - n));
+}
+
+static u64 mixLane(u64 x)
+{
+    return rotl(x * kPrime2, 31) * kPrime1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Stripes
+//----------------------------------------------------------------------------------------------------------------------
+
+static void hashStripes(u64 acc[4], u64 keys[4], const u8* data, size_t numStripes)
+{
+#if NX_SSE2
+    __m128i acc01 = _mm_loadu_si128((const __m128i*)&acc[0]);
+    __m128i acc23 = _mm_loadu_si128((const __m128i*)&acc[2]);
+    __m128i key01 = _mm_loadu_si128((const __m128i*)&keys[0]);
+    __m128i key23 = _mm_loadu_si128((const __m128i*)&keys[2]);
+    const __m128i step = _mm_set1_epi64x((long long)kKeyStep);
+
+    for (size_t i = 0; i < numStripes; ++i, data += kStripeSize)
+    {
+        __m128i d01 = _mm_loadu_si128((const __m128i*)data);
+        __m128i d23 = _mm_loadu_si128((const __m128i*)(data + 16));
+        __m128i k01 = _mm_xor_si128(d01, key01);
+        __m128i k23 = _mm_xor_si128(d23, key23);
+
+        acc01 = _mm_add_epi64(acc01, _mm_mul_epu32(k01, _mm_srli_epi64(k01, 32)));
+        acc23 = _mm_add_epi64(acc23, _mm_mul_epu32(k23, _mm_srli_epi64(k23, 32)));
+        acc01 = _mm_add_epi64(acc01, _mm_shuffle_epi32(d01, _MM_SHUFFLE(1, 0, 3, 2)));
+        acc23 = _mm_add_epi64(acc23, _mm_shuffle_epi32(d23, _MM_SHUFFLE(1, 0, 3, 2)));
+
+        key01 = _mm_add_epi64(key01, step);
+        key23 = _mm_add_epi64(key23, step);
+    }
+
+    _mm_storeu_si128((__m128i*)&acc[0], acc01);
+    _mm_storeu_si128((__m128i*)&acc[2], acc23);
+    _mm_storeu_si128((__m128i*)&keys[0], key01);
+    _mm_storeu_si128((__m128i*)&keys[2], key23);
+#else
+    for (size_t i = 0; i < numStripes; ++i, data += kStripeSize)
+    {
+        u64 d[4];
+        memcpy(d, data, kStripeSize);
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            u64 k = d[lane] ^ keys[lane];
+            acc[lane] += (k & 0xffffffff) * (k >> 32);
+            acc[lane ^ 1] += d[lane];
+            keys[lane] += kKeyStep;
+        }
+    }
+#endif
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Hashing
+//----------------------------------------------------------------------------------------------------------------------
+
+u64 hash64(const void* data, size_t size)
+{
+    u64 acc[4] = { kPrime3, kPrime2, kPrime1, kPrime4 };
+    u64 keys[4] = { kKeys[0], kKeys[1], kKeys[2], kKeys[3] };
+
+    const u8* bytes = (const u8*)data;
+    size_t numStripes = size / kStripeSize;
+    hashStripes(acc, keys, bytes, numStripes);
+
+    // The last partial stripe is padded with zeroes.  The length is mixed in below, so padding can't cause collisions.
+    size_t tail = size % kStripeSize;
+    if (tail)
+    {
+        u8 last[kStripeSize] = {};
+        memcpy(last, bytes + numStripes * kStripeSize, tail);
+        hashStripes(acc, keys, last, 1);
+    }
+
+    u64 h = u64(size) * kPrime1;
+    for (u64 lane : acc)
+    {
+        h ^= mixLane(lane);
+        h = rotl(h, 27) * kPrime1 + kPrime4;
+    }
+
+    h ^= h >> 33;
+    h *= kPrime2;
+    h ^= h >> 29;
+    h *= kPrime3;
+    h ^= h >> 32;
+    return h;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,21 @@
+//----------------------------------------------------------------------------------------------------------------------
+// Block hashing
+// A fast, non-cryptographic 64-bit hash for comparing large blocks of emulator state, such as a frame or all of RAM.
+// The result only depends on the bytes, so it can be stored and compared between runs, builds and platforms.
+//----------------------------------------------------------------------------------------------------------------------
+
+#pragma once
+
+#include "config.h"
+#include "types.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__)
+#   define NX_SSE2      1
+#else
+#   define NX_SSE2      0
+#endif
+
+u64 hash64(const void* data, size_t size);
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,484 @@
+//----------------------------------------------------------------------------------------------------------------------
+// Dynamic recompiler support
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "jit.h"
+
+#if NX_JIT
+
+#ifdef _WIN32
+#   define WIN32_LEAN_AND_MEAN
+#   include <windows.h>
+#else
+#   include <sys/mman.h>
+#   include <unistd.h>
+#endif
+
+//----------------------------------------------------------------------------------------------------------------------
+// Code buffer
+//----------------------------------------------------------------------------------------------------------------------
+
+JitBuffer::JitBuffer(size_t size)
+    : m_code(nullptr)
+    , m_capacity(size)
+    , m_size(0)
+    , m_start(0)
+    , m_pageSize(4096)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    m_pageSize = info.dwPageSize;
+    m_code = (u8 *)VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+    m_pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    m_code = (p == MAP_FAILED) ? nullptr : (u8 *)p;
+#endif
+}
+
+JitBuffer::~JitBuffer()
+{
+    if (m_code)
+    {
+#ifdef _WIN32
+        VirtualFree(m_code, 0, MEM_RELEASE);
+#else
+        munmap(m_code, m_capacity);
+#endif
+    }
+}
+
+bool JitBuffer::begin(size_t maxSize)
+{
+    if (!m_code || m_size + maxSize > m_capacity) return false;
+    if (!protect(m_size, m_size + maxSize, true)) return false;
+    m_start = m_size;
+    return true;
+}
+
+void* JitBuffer::end()
+{
+    // x86 keeps instruction fetches coherent with data writes, so there's no cache to flush.
+    protect(m_start, m_size, false);
+    return m_code + m_start;
+}
+
+// The buffer is never writable and executable at the same time.  Only the pages covering the function being written
+// are made writable, so a block costs one or two pages' worth of protection changes rather than the whole buffer.
+bool JitBuffer::protect(size_t start, size_t end, bool writable)
+{
+    if (end > m_capacity) end = m_capacity;
+    if (start >= end) return true;
+    start &= ~(m_pageSize - 1);
+    end = (end + m_pageSize - 1) & ~(m_pageSize - 1);
+    if (end > m_capacity) end = m_capacity;
+
+#ifdef _WIN32
+    DWORD old;
+    return VirtualProtect(m_code + start, end - start, writable ? PAGE_READWRITE : PAGE_EXECUTE_READ, &old) != 0;
+#else
+    return mprotect(m_code + start, end - start, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) == 0;
+#endif
+}
+
+void JitBuffer::patchRel32(size_t at, size_t target)
+{
+    u32 rel = u32(i32(target - (at + 4)));
+    for (int i = 0; i < 4; ++i) m_code[at + i] = u8(rel >> (i * 8));
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// x86-64 emitter
+//----------------------------------------------------------------------------------------------------------------------
+
+void X64Emitter::prologue()
+{
+    const size_t start = m_buf.pos();
+    (void)start;
+    m_buf.emit({ 0x53 });                           // push rbx
+    m_buf.emit({ 0x41, 0x54 });                     // push r12
+    m_buf.emit({ 0x41, 0x55 });                     // push r13
+    m_buf.emit({ 0x41, 0x56 });                     // push r14
+    m_buf.emit({ 0x41, 0x57 });                     // push r15
+    m_buf.emit({ 0x48, 0x83, 0xec, 0x30 });         // sub rsp,48       (shadow space, counter and 16-byte alignment)
+#ifdef _WIN32
+    m_buf.emit({ 0x48, 0x89, 0xcb });               // mov rbx,rcx
+    m_buf.emit({ 0x49, 0x89, 0xd4 });               // mov r12,rdx
+    m_buf.emit({ 0x4d, 0x89, 0xc5 });               // mov r13,r8
+#else
+    m_buf.emit({ 0x48, 0x89, 0xfb });               // mov rbx,rdi
+    m_buf.emit({ 0x49, 0x89, 0xf4 });               // mov r12,rsi
+    m_buf.emit({ 0x49, 0x89, 0xd5 });               // mov r13,rdx
+#endif
+    m_buf.emit({ 0x4d, 0x8b, 0x3c, 0x24 });         // mov r15,[r12]
+    NX_ASSERT(m_buf.pos() - start == kPrologueSize);
+}
+
+void X64Emitter::epilogue()
+{
+    m_buf.emit({ 0x48, 0x83, 0xc4, 0x30 });         // add rsp,48
+    m_buf.emit({ 0x41, 0x5f });                     // pop r15
+    m_buf.emit({ 0x41, 0x5e });                     // pop r14
+    m_buf.emit({ 0x41, 0x5d });                     // pop r13
+    m_buf.emit({ 0x41, 0x5c });                     // pop r12
+    m_buf.emit({ 0x5b });                           // pop rbx
+    m_buf.emit({ 0xc3 });                           // ret
+}
+
+void X64Emitter::jumpToFunction(i32 offset, const FunctionTable& table)
+{
+    const size_t lookUp = pos();
+    loadWord(Eax, offset);
+    m_buf.emit({ 0x89, 0xc1 });                     // mov ecx,eax
+    m_buf.emit({ 0x81, 0xe1 });                     // and ecx,mask
+    m_buf.emit32(table.mask);
+    m_buf.emit({ 0x69, 0xc9 });                     // imul ecx,ecx,size
+    m_buf.emit32(table.size);
+    m_buf.emit({ 0x48, 0xba });                     // mov rdx,entries
+    m_buf.emit64(u64(table.entries));
+    m_buf.emit({ 0x48, 0x01, 0xca });               // add rdx,rcx
+
+    m_buf.emit({ 0x39, 0x82 });                     // cmp [rdx+addressOffset],eax
+    m_buf.emit32(u32(table.addressOffset));
+    size_t noAddress = jumpIf(Cond::NotEqual);
+
+    m_buf.emit({ 0xc1, 0xe8, 0x08 });               // shr eax,8
+    m_buf.emit({ 0x49, 0xb8 });                     // mov r8,generations
+    m_buf.emit64(u64(table.generations));
+    m_buf.emit({ 0x41, 0x8b, 0x04, 0x80 });         // mov eax,[r8+rax*4]
+    m_buf.emit({ 0x39, 0x82 });                     // cmp [rdx+generationOffset],eax
+    m_buf.emit32(u32(table.generationOffset));
+    size_t oldGeneration = jumpIf(Cond::NotEqual);
+
+    m_buf.emit({ 0x48, 0x8b, 0x82 });               // mov rax,[rdx+codeOffset]
+    m_buf.emit32(u32(table.codeOffset));
+    m_buf.emit({ 0x48, 0x85, 0xc0 });               // test rax,rax
+    size_t noCode = jumpIf(Cond::Equal);
+    m_buf.emit({ 0x48, 0x83, 0xc0, kPrologueSize });    // add rax,kPrologueSize
+    m_buf.emit({ 0xff, 0xe0 });                     // jmp rax
+
+    patch(oldGeneration, pos());
+    callHelper(table.revalidate, 0);
+    testLow(Eax);
+    size_t invalid = jumpIf(Cond::Equal);
+    patch(jump(), lookUp);
+
+    patch(noAddress, pos());
+    patch(noCode, pos());
+    patch(invalid, pos());
+}
+
+void X64Emitter::callHandler(const void* fn)
+{
+    storeTState();
+#ifdef _WIN32
+    m_buf.emit({ 0x48, 0x89, 0xd9 });               // mov rcx,rbx
+    m_buf.emit({ 0x4c, 0x89, 0xe2 });               // mov rdx,r12
+#else
+    m_buf.emit({ 0x48, 0x89, 0xdf });               // mov rdi,rbx
+    m_buf.emit({ 0x4c, 0x89, 0xe6 });               // mov rsi,r12
+#endif
+    m_buf.emit({ 0x48, 0xb8 });                     // mov rax,fn
+    m_buf.emit64(u64(fn));
+    m_buf.emit({ 0xff, 0xd0 });                     // call rax
+    m_buf.emit({ 0x4d, 0x8b, 0x3c, 0x24 });         // mov r15,[r12]
+}
+
+void X64Emitter::callHelper(const void* fn, i32 arg)
+{
+#ifdef _WIN32
+    m_buf.emit({ 0x48, 0x89, 0xd9 });               // mov rcx,rbx
+    m_buf.emit({ 0xba });                           // mov edx,arg
+#else
+    m_buf.emit({ 0x48, 0x89, 0xdf });               // mov rdi,rbx
+    m_buf.emit({ 0xbe });                           // mov esi,arg
+#endif
+    m_buf.emit32(u32(arg));
+    m_buf.emit({ 0x48, 0xb8 });                     // mov rax,fn
+    m_buf.emit64(u64(fn));
+    m_buf.emit({ 0xff, 0xd0 });                     // call rax
+}
+
+void X64Emitter::watchCounter(const u32* counter)
+{
+    m_buf.emit({ 0x49, 0xbe });                     // mov r14,counter
+    m_buf.emit64(u64(counter));
+    m_buf.emit({ 0x41, 0x8b, 0x06 });               // mov eax,[r14]
+    m_buf.emit({ 0x89, 0x44, 0x24, 0x20 });         // mov [rsp+32],eax
+}
+
+void X64Emitter::addTState(u8 x)
+{
+    NX_ASSERT(x < 0x80);
+    m_buf.emit({ 0x49, 0x83, 0xc7, x });            // add r15,x
+}
+
+void X64Emitter::storeTState()
+{
+    m_buf.emit({ 0x4d, 0x89, 0x3c, 0x24 });         // mov [r12],r15
+}
+
+void X64Emitter::modrmRbx(u8 reg, i32 offset)
+{
+    if (offset >= -128 && offset < 128)
+    {
+        m_buf.emit8(0x43 | (reg << 3));             // [rbx+disp8]
+        m_buf.emit8(u8(offset));
+    }
+    else
+    {
+        m_buf.emit8(0x83 | (reg << 3));             // [rbx+disp32]
+        m_buf.emit32(u32(offset));
+    }
+}
+
+void X64Emitter::loadByte(Reg32 reg, i32 offset)
+{
+    m_buf.emit({ 0x0f, 0xb6 });                     // movzx reg,byte [rbx+offset]
+    modrmRbx(reg, offset);
+}
+
+void X64Emitter::loadWord(Reg32 reg, i32 offset)
+{
+    m_buf.emit({ 0x0f, 0xb7 });                     // movzx reg,word [rbx+offset]
+    modrmRbx(reg, offset);
+}
+
+void X64Emitter::storeByte(i32 offset, Reg32 reg)
+{
+    m_buf.emit({ 0x88 });                           // mov [rbx+offset],reg8
+    modrmRbx(reg, offset);
+}
+
+void X64Emitter::storeWord(i32 offset, Reg32 reg)
+{
+    m_buf.emit({ 0x66, 0x89 });                     // mov [rbx+offset],reg16
+    modrmRbx(reg, offset);
+}
+
+void X64Emitter::storeByteImm(i32 offset, u8 x)
+{
+    m_buf.emit({ 0xc6 });                           // mov byte [rbx+offset],x
+    modrmRbx(0, offset);
+    m_buf.emit8(x);
+}
+
+void X64Emitter::storeWordImm(i32 offset, u16 x)
+{
+    m_buf.emit({ 0x66, 0xc7 });                     // mov word [rbx+offset],x
+    modrmRbx(0, offset);
+    m_buf.emit16(x);
+}
+
+void X64Emitter::incByte(i32 offset)
+{
+    m_buf.emit({ 0xfe });                           // inc byte [rbx+offset]
+    modrmRbx(0, offset);
+}
+
+void X64Emitter::decByte(i32 offset)
+{
+    m_buf.emit({ 0xfe });                           // dec byte [rbx+offset]
+    modrmRbx(1, offset);
+}
+
+void X64Emitter::incWord(i32 offset)
+{
+    m_buf.emit({ 0x66, 0xff });                     // inc word [rbx+offset]
+    modrmRbx(0, offset);
+}
+
+void X64Emitter::decWord(i32 offset)
+{
+    m_buf.emit({ 0x66, 0xff });                     // dec word [rbx+offset]
+    modrmRbx(1, offset);
+}
+
+void X64Emitter::testByte(i32 offset, u8 mask)
+{
+    m_buf.emit({ 0xf6 });                           // test byte [rbx+offset],mask
+    modrmRbx(0, offset);
+    m_buf.emit8(mask);
+}
+
+void X64Emitter::addR7(i32 offset, u8 x)
+{
+    NX_ASSERT(x < 0x80);
+    loadByte(Eax, offset);
+    m_buf.emit({ 0x8d, 0x48, x });                  // lea ecx,[rax+x]
+    m_buf.emit({ 0x83, 0xe1, 0x7f });               // and ecx,7fh
+    m_buf.emit({ 0x25, 0x80, 0x00, 0x00, 0x00 });   // and eax,80h
+    m_buf.emit({ 0x09, 0xc8 });                     // or eax,ecx
+    storeByte(offset, Eax);
+}
+
+void X64Emitter::moveByte(i32 fromOffset, i32 toOffset)
+{
+    m_buf.emit({ 0x8a });                           // mov al,[rbx+fromOffset]
+    modrmRbx(0, fromOffset);
+    storeByte(toOffset, Eax);
+}
+
+void X64Emitter::moveWord(i32 fromOffset, i32 toOffset)
+{
+    loadWord(Eax, fromOffset);
+    storeWord(toOffset, Eax);
+}
+
+void X64Emitter::swapWords(i32 offset1, i32 offset2)
+{
+    loadWord(Eax, offset1);
+    loadWord(Ecx, offset2);
+    storeWord(offset1, Ecx);
+    storeWord(offset2, Eax);
+}
+
+void X64Emitter::moveImm(Reg32 reg, u32 x)
+{
+    m_buf.emit8(0xb8 + reg);                        // mov reg,x
+    m_buf.emit32(x);
+}
+
+void X64Emitter::moveReg(Reg32 dest, Reg32 src)
+{
+    m_buf.emit({ 0x89, u8(0xc0 | (src << 3) | dest) });    // mov dest,src
+}
+
+void X64Emitter::alu(Alu op, Reg32 dest, Reg32 src)
+{
+    m_buf.emit8(u8(op));                            // op dest,src
+    m_buf.emit8(0xc0 | (src << 3) | dest);
+}
+
+void X64Emitter::addImm(Reg32 reg, i32 x)
+{
+    m_buf.emit({ 0x81, u8(0xc0 | reg) });           // add reg,x
+    m_buf.emit32(u32(x));
+}
+
+void X64Emitter::andImm(Reg32 reg, u8 x)
+{
+    NX_ASSERT(x < 0x80);
+    m_buf.emit({ 0x83, u8(0xe0 | reg), x });        // and reg,x
+}
+
+void X64Emitter::shiftRight(Reg32 reg, u8 n)
+{
+    m_buf.emit({ 0xc1, u8(0xe8 | reg), n });        // shr reg,n
+}
+
+void X64Emitter::testLow(Reg32 reg)
+{
+    m_buf.emit({ 0x84, u8(0xc0 | (reg << 3) | reg) });     // test reg8,reg8
+}
+
+void X64Emitter::moveBase(const void* base)
+{
+    m_buf.emit({ 0x49, 0xb8 });                     // mov r8,base
+    m_buf.emit64(u64(base));
+}
+
+void X64Emitter::modrmR8Index(u8 reg, Reg32 index)
+{
+    m_buf.emit8(0x04 | (reg << 3));                 // [r8+index]
+    m_buf.emit8(index << 3);
+}
+
+void X64Emitter::loadByteAt(Reg32 reg, const void* base, Reg32 index)
+{
+    moveBase(base);
+    m_buf.emit({ 0x41, 0x0f, 0xb6 });               // movzx reg,byte [r8+index]
+    modrmR8Index(reg, index);
+}
+
+void X64Emitter::loadWordAt(Reg32 reg, const void* base, Reg32 index)
+{
+    moveBase(base);
+    m_buf.emit({ 0x41, 0x0f, 0xb7 });               // movzx reg,word [r8+index]
+    modrmR8Index(reg, index);
+}
+
+void X64Emitter::storeByteAt(const void* base, Reg32 index, Reg32 reg)
+{
+    moveBase(base);
+    m_buf.emit({ 0x41, 0x88 });                     // mov [r8+index],reg8
+    modrmR8Index(reg, index);
+}
+
+void X64Emitter::storeWordAt(const void* base, Reg32 index, Reg32 reg)
+{
+    moveBase(base);
+    m_buf.emit({ 0x66, 0x41, 0x89 });               // mov [r8+index],reg16
+    modrmR8Index(reg, index);
+}
+
+void X64Emitter::incCounterAt(const u32* counters, Reg32 index)
+{
+    moveBase(counters);
+    m_buf.emit({ 0x41, 0xff, 0x04 });               // inc dword [r8+index*4]
+    m_buf.emit8(0x80 | (index << 3));
+}
+
+size_t X64Emitter::rel32()
+{
+    size_t at = m_buf.pos();
+    m_buf.emit32(0);
+    return at;
+}
+
+size_t X64Emitter::jumpIf(Cond cond)
+{
+    m_buf.emit({ 0x0f, u8(0x80 | u8(cond)) });      // jcc target
+    return rel32();
+}
+
+size_t X64Emitter::jump()
+{
+    m_buf.emit({ 0xe9 });                           // jmp target
+    return rel32();
+}
+
+size_t X64Emitter::jumpIfOutside(Reg32 reg, u32 low, u32 high)
+{
+    m_buf.emit({ 0x44, 0x8d, u8(0x80 | reg) });     // lea r8d,[reg-low]
+    m_buf.emit32(u32(0) - low);
+    m_buf.emit({ 0x41, 0x81, 0xf8 });               // cmp r8d,high-low
+    m_buf.emit32(high - low);
+    return jumpIf(Cond::Above);
+}
+
+size_t X64Emitter::exitIfPastLimit()
+{
+    m_buf.emit({ 0x4d, 0x39, 0xef });               // cmp r15,r13
+    m_buf.emit({ 0x0f, 0x8d });                     // jge exit
+    return rel32();
+}
+
+size_t X64Emitter::exitIfWordNotEqual(i32 offset, u16 x)
+{
+    m_buf.emit({ 0x66, 0x81 });                     // cmp word [rbx+offset],x
+    modrmRbx(7, offset);
+    m_buf.emit16(x);
+    return jumpIf(Cond::NotEqual);
+}
+
+size_t X64Emitter::exitIfByteNotEqual(i32 offset, u8 x)
+{
+    m_buf.emit({ 0x80 });                           // cmp byte [rbx+offset],x
+    modrmRbx(7, offset);
+    m_buf.emit8(x);
+    return jumpIf(Cond::NotEqual);
+}
+
+size_t X64Emitter::exitIfCounterChanged()
+{
+    m_buf.emit({ 0x41, 0x8b, 0x06 });               // mov eax,[r14]
+    m_buf.emit({ 0x3b, 0x44, 0x24, 0x20 });         // cmp eax,[rsp+32]
+    return jumpIf(Cond::NotEqual);
+}
+
+#endif // NX_JIT
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
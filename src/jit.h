@@ -0,0 +1,213 @@
+//----------------------------------------------------------------------------------------------------------------------
+// Dynamic recompiler support
+// Executable code buffer and the small subset of the x86-64 instruction set that the Z80 recompiler emits.
+//----------------------------------------------------------------------------------------------------------------------
+
+#pragma once
+
+#include "config.h"
+#include "types.h"
+
+#if defined(_M_X64) || defined(__x86_64__)
+#   define NX_JIT       1
+#else
+#   define NX_JIT       0
+#endif
+
+#if NX_JIT
+
+//----------------------------------------------------------------------------------------------------------------------
+// Code buffer
+// A fixed block of memory for generated code.  The pages of the function being written are writable between begin()
+// and end(); everything already written is executable.
+// Code is appended until the buffer is full, at which point the owner must throw everything away with reset().
+//----------------------------------------------------------------------------------------------------------------------
+
+class JitBuffer
+{
+public:
+    JitBuffer(size_t size);
+    ~JitBuffer();
+
+    JitBuffer(const JitBuffer&) = delete;
+    JitBuffer& operator= (const JitBuffer&) = delete;
+
+    bool isValid() const { return m_code != nullptr; }
+
+    // Start a new function and make the buffer writable.  Returns false if there isn't room for one of maxSize bytes.
+    bool begin(size_t maxSize);
+
+    // Finish the current function, make the buffer executable again and return the function's entry point.
+    void* end();
+
+    // Discard all generated code.
+    void reset() { m_size = 0; m_start = 0; }
+
+    // Current write position, used for patching jumps.
+    size_t pos() const { return m_size; }
+
+    void emit8(u8 x) { m_code[m_size++] = x; }
+    void emit16(u16 x) { emit8(u8(x)); emit8(u8(x >> 8)); }
+    void emit32(u32 x) { emit16(u16(x)); emit16(u16(x >> 16)); }
+    void emit64(u64 x) { emit32(u32(x)); emit32(u32(x >> 32)); }
+    void emit(std::initializer_list<u8> bytes) { for (u8 b : bytes) emit8(b); }
+
+    // Write a 32-bit relative offset at position at, so that it lands on position target.
+    void patchRel32(size_t at, size_t target);
+
+private:
+    bool protect(size_t start, size_t end, bool writable);
+
+private:
+    u8*         m_code;
+    size_t      m_capacity;
+    size_t      m_size;
+    size_t      m_start;
+    size_t      m_pageSize;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+// x86-64 emitter
+// Generated functions have the C signature:
+//
+//      void f(void* context, i64* tState, i64 limit);
+//
+// In the body, rbx holds the context, r12 the t-state pointer, r13 the limit, r14 points to a watched counter whose
+// value on entry is kept in the stack frame, and r15 holds the t-state.  All five are callee-saved on both the Windows
+// and System V ABIs, so they survive calls back into C++.  *tState is only brought up to date around calls and on exit.
+// eax, ecx and edx are scratch registers, and r8 holds the base for host memory operations.  Calls are free to change
+// all four.
+//----------------------------------------------------------------------------------------------------------------------
+
+class X64Emitter
+{
+public:
+    enum Reg32 : u8
+    {
+        Eax = 0,
+        Ecx = 1,
+        Edx = 2,
+    };
+
+    enum class Alu : u8
+    {
+        Add = 0x01,
+        Or = 0x09,
+        And = 0x21,
+        Sub = 0x29,
+        Xor = 0x31,
+    };
+
+    // Condition codes for jumpIf().
+    enum class Cond : u8
+    {
+        Equal = 0x4,
+        NotEqual = 0x5,
+        Above = 0x7,        // Unsigned
+    };
+
+    // Where to find generated functions: a direct-mapped table of mask + 1 entries of size bytes, indexed by the low
+    // bits of a 16-bit address.  Each entry holds the address, a generation and a pointer to the function at the
+    // given offsets.  An entry can only be used while its generation matches the counter for the address's page.  If
+    // it doesn't, revalidate(context, 0) is called, and returns non-zero in al if it has brought the generation up to
+    // date.
+    struct FunctionTable
+    {
+        const void* entries;
+        u32         size;
+        u32         mask;
+        i32         addressOffset;
+        i32         generationOffset;
+        i32         codeOffset;
+        const u32*  generations;
+        const void* revalidate;
+    };
+
+    static const u8 kPrologueSize = 26;
+
+    X64Emitter(JitBuffer& buffer) : m_buf(buffer) {}
+
+    void prologue();
+    void epilogue();
+
+    // Jump past the prologue of the function in the table for the word at context[offset], if there is one.  Falls
+    // through otherwise.
+    void jumpToFunction(i32 offset, const FunctionTable& table);
+
+    // Call fn(context, tState), with *tState up to date.
+    void callHandler(const void* fn);
+
+    // Call fn(context, arg), which returns its answer in al.  The t-state isn't stored.
+    void callHelper(const void* fn, i32 arg);
+
+    // Remember the value of a counter, for exitIfCounterChanged().
+    void watchCounter(const u32* counter);
+
+    // t-state += x, and *tState = t-state.
+    void addTState(u8 x);
+    void storeTState();
+
+    // Operations on bytes and words at an offset from the context.
+    void loadByte(Reg32 reg, i32 offset);           // Zero-extended
+    void loadWord(Reg32 reg, i32 offset);           // Zero-extended
+    void storeByte(i32 offset, Reg32 reg);
+    void storeWord(i32 offset, Reg32 reg);
+    void storeByteImm(i32 offset, u8 x);
+    void storeWordImm(i32 offset, u16 x);
+    void incByte(i32 offset);
+    void decByte(i32 offset);
+    void incWord(i32 offset);
+    void decWord(i32 offset);
+    void testByte(i32 offset, u8 mask);
+    void addR7(i32 offset, u8 x);                   // Add to the low 7 bits, preserving bit 7
+    void moveByte(i32 fromOffset, i32 toOffset);
+    void moveWord(i32 fromOffset, i32 toOffset);
+    void swapWords(i32 offset1, i32 offset2);
+
+    // Operations on scratch registers.
+    void moveImm(Reg32 reg, u32 x);
+    void moveReg(Reg32 dest, Reg32 src);
+    void alu(Alu op, Reg32 dest, Reg32 src);
+    void addImm(Reg32 reg, i32 x);
+    void andImm(Reg32 reg, u8 x);
+    void shiftRight(Reg32 reg, u8 n);
+    void testLow(Reg32 reg);                        // test on the low byte
+
+    // Operations on host memory at base + index, with the index in a scratch register.
+    void loadByteAt(Reg32 reg, const void* base, Reg32 index);      // Zero-extended
+    void loadWordAt(Reg32 reg, const void* base, Reg32 index);      // Zero-extended
+    void storeByteAt(const void* base, Reg32 index, Reg32 reg);
+    void storeWordAt(const void* base, Reg32 index, Reg32 reg);
+    void incCounterAt(const u32* counters, Reg32 index);            // ++counters[index]
+
+    // Jumps.  Each returns the position of a rel32 to patch with the target.
+    size_t jumpIf(Cond cond);
+    size_t jump();
+    size_t jumpIfOutside(Reg32 reg, u32 low, u32 high);     // reg < low or reg > high, unsigned
+
+    // Conditional exits.  Each returns the position of a rel32 to patch with the exit address.
+    size_t exitIfPastLimit();                       // t-state >= limit
+    size_t exitIfWordNotEqual(i32 offset, u16 x);   // context[offset] != x
+    size_t exitIfByteNotEqual(i32 offset, u8 x);    // context[offset] != x
+    size_t exitIfCounterChanged();                  // *counter != value on entry
+
+    void patch(size_t at, size_t target) { m_buf.patchRel32(at, target); }
+    size_t pos() const { return m_buf.pos(); }
+
+    // Raw bytes, for data kept alongside the code.
+    void data(u8 x) { m_buf.emit8(x); }
+
+private:
+    void modrmRbx(u8 reg, i32 offset);
+    void modrmR8Index(u8 reg, Reg32 index);
+    void moveBase(const void* base);
+    size_t rel32();
+
+private:
+    JitBuffer&  m_buf;
+};
+
+#endif // NX_JIT
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
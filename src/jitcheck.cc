@@ -0,0 +1,226 @@
+//----------------------------------------------------------------------------------------------------------------------
+// Recompiler differential check implementation
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "flatbus.h"
+#include "jitcheck.h"
+#include "nxfile.h"
+#include "z80.h"
+
+#include <cstdio>
+#include <cstring>
+
+extern const u8 gRom48[16384];
+
+//----------------------------------------------------------------------------------------------------------------------
+// Flat machine
+// 64K of RAM on a flat bus with the 48K contention pattern, so the Z80's uncontended shortcuts and its contended paths
+// both get exercised.  RST 10h is replaced with OUT ($ff),A; RET so that printed characters can be collected without
+// running the ROM's print routine.
+//----------------------------------------------------------------------------------------------------------------------
+
+struct FlatMachine
+{
+    FlatMachine()
+    {
+        copy(gRom48, gRom48 + 16384, memory.ram);
+        memory.ram[0x10] = 0xd3;
+        memory.ram[0x11] = 0xff;
+        memory.ram[0x12] = 0xc9;
+        memory.contended = true;
+        memory.onOut = [this](u16 port, u8 x) {
+            if ((port & 0xff) == 0xff) output += char(x == 13 ? '\n' : x);
+        };
+        copy(memory.generations, memory.generations + 256, checkedGenerations);
+    }
+
+    FlatMemory      memory;
+    string          output;
+
+    // Page generations when memory was last compared.
+    u32             checkedGenerations[256];
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+// State comparison
+//----------------------------------------------------------------------------------------------------------------------
+
+using CheckCPU = Z80<FlatBus>;
+
+static bool compareCpus(CheckCPU& jit, CheckCPU& ref, TState jitT, TState refT, bool print)
+{
+    struct Field
+    {
+        const char* name;
+        int         jit;
+        int         ref;
+    };
+
+    Field fields[] = {
+        { "AF",     jit.AF(),       ref.AF() },
+        { "BC",     jit.BC(),       ref.BC() },
+        { "DE",     jit.DE(),       ref.DE() },
+        { "HL",     jit.HL(),       ref.HL() },
+        { "IX",     jit.IX(),       ref.IX() },
+        { "IY",     jit.IY(),       ref.IY() },
+        { "SP",     jit.SP(),       ref.SP() },
+        { "PC",     jit.PC(),       ref.PC() },
+        { "AF'",    jit.AF_(),      ref.AF_() },
+        { "BC'",    jit.BC_(),      ref.BC_() },
+        { "DE'",    jit.DE_(),      ref.DE_() },
+        { "HL'",    jit.HL_(),      ref.HL_() },
+        { "IR",     jit.IR(),       ref.IR() },
+        { "MP",     jit.MP(),       ref.MP() },
+        { "IFF1",   jit.IFF1(),     ref.IFF1() },
+        { "IFF2",   jit.IFF2(),     ref.IFF2() },
+        { "IM",     jit.IM(),       ref.IM() },
+        { "HALT",   jit.isHalted(), ref.isHalted() },
+    };
+
+    bool same = (jitT == refT);
+    for (const Field& f : fields) same = same && (f.jit == f.ref);
+
+    if (print)
+    {
+        printf("        JIT   INTERP\n");
+        for (const Field& f : fields)
+        {
+            printf("%-4s    %04X  %04X%s\n", f.name, f.jit, f.ref, f.jit == f.ref ? "" : "  <--");
+        }
+        printf("T       %lld  %lld%s\n", (long long)jitT, (long long)refT, jitT == refT ? "" : "  <--");
+    }
+
+    return same;
+}
+
+// Compares the pages either machine has written since the last call.
+static bool compareMemory(FlatMachine& jit, FlatMachine& ref)
+{
+    bool same = true;
+    for (int page = 0; page < 256; ++page)
+    {
+        if (jit.memory.generations[page] != jit.checkedGenerations[page] ||
+            ref.memory.generations[page] != ref.checkedGenerations[page])
+        {
+            same = same && memcmp(jit.memory.ram + page * 256, ref.memory.ram + page * 256, 256) == 0;
+            jit.checkedGenerations[page] = jit.memory.generations[page];
+            ref.checkedGenerations[page] = ref.memory.generations[page];
+        }
+    }
+    return same;
+}
+
+static bool isFinished(CheckCPU& cpu, FlatMachine& machine)
+{
+    // Stop on JR $ or JP $, or a HALT, since no interrupt will ever come.
+    const u8* mem = machine.memory.ram;
+    u16 pc = cpu.PC();
+    if (mem[pc] == 0x18 && mem[u16(pc + 1)] == 0xfe) return true;
+    if (mem[pc] == 0xc3 && mem[u16(pc + 1)] + 256 * mem[u16(pc + 2)] == pc) return true;
+    return cpu.isHalted();
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Running
+//----------------------------------------------------------------------------------------------------------------------
+
+bool JitCheck::run(string fileName)
+{
+#if NX_JIT
+    // How far the recompiled CPU runs before the interpreter catches up and the two are compared.
+    static const TState kChunkTStates = 256;
+
+    vector<u8> file = NxFile::loadFile(fileName);
+    if (file.size() != 49179)
+    {
+        printf("%s: not a 48K .sna snapshot\n", fileName.c_str());
+        return false;
+    }
+
+    FlatMachine jitMachine;
+    FlatMachine refMachine;
+    CheckCPU jit{ FlatBus(jitMachine.memory) };
+    CheckCPU ref{ FlatBus(refMachine.memory) };
+    jit.setDispatch(CheckCPU::Dispatch::Jit);
+    ref.setDispatch(CheckCPU::Dispatch::Interpreter);
+
+    const u8* data = file.data();
+    for (CheckCPU* cpu : { &jit, &ref })
+    {
+        cpu->I() = BYTE_OF(data, 0);
+        cpu->HL_() = WORD_OF(data, 1);
+        cpu->DE_() = WORD_OF(data, 3);
+        cpu->BC_() = WORD_OF(data, 5);
+        cpu->AF_() = WORD_OF(data, 7);
+        cpu->HL() = WORD_OF(data, 9);
+        cpu->DE() = WORD_OF(data, 11);
+        cpu->BC() = WORD_OF(data, 13);
+        cpu->IY() = WORD_OF(data, 15);
+        cpu->IX() = WORD_OF(data, 17);
+        cpu->IFF2() = (BYTE_OF(data, 19) & 0x04) != 0;
+        cpu->IFF1() = cpu->IFF2();
+        cpu->R() = BYTE_OF(data, 20);
+        cpu->AF() = WORD_OF(data, 21);
+        cpu->SP() = WORD_OF(data, 23);
+        cpu->IM() = BYTE_OF(data, 25);
+    }
+    for (FlatMachine* machine : { &jitMachine, &refMachine })
+    {
+        copy(data + 27, data + 27 + 0xc000, machine->memory.ram + 0x4000);
+    }
+
+    TState jitT = 0;
+    TState refT = 0;
+    jit.PC() = jit.pop(jitT);
+    ref.PC() = ref.pop(refT);
+    jitT = refT = 0;
+
+    size_t printed = 0;
+    for (;;)
+    {
+        u16 pc = jit.PC();
+        TState startT = jitT;
+
+        jit.run(jitT, jitT + kChunkTStates);
+        while (refT < jitT) ref.step(refT);
+
+        bool finished = isFinished(jit, jitMachine);
+        bool same = compareCpus(jit, ref, jitT, refT, false);
+        same = compareMemory(jitMachine, refMachine) && same;
+        same = same && jitMachine.output == refMachine.output;
+
+        const string& output = jitMachine.output;
+        fwrite(output.data() + printed, 1, output.size() - printed, stdout);
+        fflush(stdout);
+        printed = output.size();
+
+        if (!same)
+        {
+            printf("\nDivergence in the run from PC=%04X, T=%lld:\n", pc, (long long)startT);
+            compareCpus(jit, ref, jitT, refT, true);
+            for (int a = 0; a < 65536; ++a)
+            {
+                if (jitMachine.memory.ram[a] != refMachine.memory.ram[a])
+                {
+                    printf("First memory difference at %04X: %02X (JIT) vs %02X (INTERP)\n",
+                        a, jitMachine.memory.ram[a], refMachine.memory.ram[a]);
+                    break;
+                }
+            }
+            return false;
+        }
+
+        if (finished)
+        {
+            printf("\nNo divergence after %lld T-states.\n", (long long)jitT);
+            return true;
+        }
+    }
+#else
+    printf("The recompiler is not available on this platform.\n");
+    return false;
+#endif
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
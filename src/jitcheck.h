@@ -0,0 +1,20 @@
+//----------------------------------------------------------------------------------------------------------------------
+// Recompiler differential check
+// Runs a 48K snapshot on two CPUs in lockstep, one recompiled and one interpreted, and reports the first point at which
+// their states differ.  Meant for ZEXALL (etc/zexall.sna), whose RST 10h output is echoed to stdout.
+//----------------------------------------------------------------------------------------------------------------------
+
+#pragma once
+
+#include "config.h"
+#include "types.h"
+
+class JitCheck
+{
+public:
+    // Returns true if the program ran to completion without the CPUs diverging.
+    bool run(string fileName);
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
@@ -2,8 +2,11 @@
 // NX - Next Emulator
 //----------------------------------------------------------------------------------------------------------------------
 
+#include "jitcheck.h"
 #include "nx.h"
 
+#include <cstring>
+
 //----------------------------------------------------------------------------------------------------------------------
 // Constants
 //----------------------------------------------------------------------------------------------------------------------
@@ -94,6 +97,16 @@ void Application::run()
 int main(int argc, char** argv)
 {
     Application::console();
+
+    // Command-line tools that don't need the emulator window
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strncmp(argv[i], "-jitcheck=", 10) == 0)
+        {
+            return JitCheck().run(argv[i] + 10) ? 0 : 1;
+        }
+    }
+
     Application app(argc, argv);
     app.run();
 }
@@ -18,6 +18,7 @@ MemoryDumpWindow::MemoryDumpWindow(Nx& nx)
     , m_gotoEditor(6, 2, 43, 1, Draw::attr(Colour::White, Colour::Magenta, false), false, 4, 0)
     , m_enableGoto(0)
     , m_showChecksums(0)
+    , m_showCoverage(false)
     , m_editMode(false)
     , m_editAddress(0)
     , m_editNibble(0)
@@ -61,6 +62,15 @@ void MemoryDumpWindow::onDraw(Draw& draw)
             }
         }
         draw.printString(m_x + 1, m_y + i, ss.str(), m_bkgColour);
+        if (m_showCoverage)
+        {
+            for (int b = 0; b < 8; ++b)
+            {
+                u8 colour = coverageColour(a + b);
+                draw.attrRect(m_x + 8 + (b * 3), m_y + i, 2, 1, colour);
+                if (!m_showChecksums) draw.pokeAttr(m_x + 34 + b, m_y + i, colour);
+            }
+        }
         if (cx != 0)
         {
             draw.pokeAttr(cx, cy, Draw::attr(Colour::White, Colour::Blue, true) | 0x80);
@@ -77,6 +87,21 @@ void MemoryDumpWindow::onDraw(Draw& draw)
     }
 }
 
+// Bytes that have been run are green, or magenta if they have also been written to.  Other bytes are red if they have
+// been written to and cyan if they have only been read.
+u8 MemoryDumpWindow::coverageColour(u16 address) const
+{
+    using Access = Coverage::Access;
+    const Coverage& coverage = m_nx.getSpeccy().getCoverage();
+    const bool executed = coverage.test(Access::Executed, address);
+    const bool written = coverage.test(Access::Written, address);
+
+    if (executed)   return Draw::attr(Colour::Black, written ? Colour::Magenta : Colour::Green, true);
+    if (written)    return Draw::attr(Colour::Black, Colour::Red, true);
+    if (coverage.test(Access::Read, address)) return Draw::attr(Colour::Black, Colour::Cyan, true);
+    return m_bkgColour;
+}
+
 void MemoryDumpWindow::onKey(sf::Keyboard::Key key, bool shift, bool ctrl, bool alt)
 {
     if (!m_enableGoto || !m_gotoEditor.key(key, true, shift, ctrl, alt))
@@ -189,6 +214,19 @@ void MemoryDumpWindow::onKey(sf::Keyboard::Key key, bool shift, bool ctrl, bool
                     adjust();
                     break;
 
+                case K::M:
+                    m_nx.getSpeccy().setCoverage(!m_nx.getSpeccy().isCoverageEnabled());
+                    if (m_nx.getSpeccy().isCoverageEnabled()) m_showCoverage = true;
+                    break;
+
+                case K::O:
+                    m_showCoverage = !m_showCoverage;
+                    break;
+
+                case K::R:
+                    m_nx.getSpeccy().getCoverage().clear();
+                    break;
+
                 default:
                     break;
                 }
@@ -5,6 +5,7 @@
 #include "nx.h"
 #include "ui.h"
 #include "nxfile.h"
+#include "snapshot.h"
 
 #include <algorithm>
 #include <cassert>
@@ -461,8 +462,8 @@ void Emulator::joystickKey(Joystick key, bool down)
 
 void Emulator::openFile()
 {
-    bool mute = getSpeccy().getAudio().isMute();
-    getSpeccy().getAudio().mute(true);
+    bool mute = getEmulator().getAudio().isMute();
+    getEmulator().getAudio().mute(true);
 
 #ifdef _WIN32
     // Open file
@@ -483,7 +484,7 @@ void Emulator::openFile()
     }
 #endif
 
-    getSpeccy().getAudio().mute(mute);
+    getEmulator().getAudio().mute(mute);
 
     getSpeccy().renderVideo();
     getEmulator().render();
@@ -491,8 +492,8 @@ void Emulator::openFile()
 
 void Emulator::saveFile()
 {
-    bool mute = getSpeccy().getAudio().isMute();
-    getSpeccy().getAudio().mute(true);
+    bool mute = getEmulator().getAudio().isMute();
+    getEmulator().getAudio().mute(true);
 
 #ifdef _WIN32
     // Save file
@@ -513,7 +514,7 @@ void Emulator::saveFile()
     }
 #endif
 
-    getSpeccy().getAudio().mute(mute);
+    getEmulator().getAudio().mute(mute);
 }
 
 bool Nx::openFile(string fileName)
@@ -577,7 +578,8 @@ bool Nx::saveFile(string fileName)
 extern const u8 gRom48[16384];
 
 Nx::Nx(int argc, char** argv)
-    : m_machine(new Spectrum(std::bind(&Nx::frame, this)))   // #todo: Allow the debugger to switch Spectrums, via proxy
+    : m_audio()
+    , m_machine(new Spectrum(&m_audio))   // #todo: Allow the debugger to switch Spectrums, via proxy
     , m_quit(false)
     , m_frameCounter(0)
     , m_zoom(false)
@@ -593,6 +595,8 @@ Nx::Nx(int argc, char** argv)
     //--- Rendering -----------------------------------------------------------------
     , m_window(sf::VideoMode(kWindowWidth * kDefaultScale * 2, kWindowHeight * kDefaultScale * 2), "NX " NX_VERSION,
                sf::Style::Titlebar | sf::Style::Close)
+    , m_videoTexture()
+    , m_videoSprite()
 
     //--- Peripherals ---------------------------------------------------------------
     , m_kempstonJoystick(false)
@@ -602,6 +606,11 @@ Nx::Nx(int argc, char** argv)
 
     //--- Files ---------------------------------------------------------------------
     , m_tempPath()
+
+#if NX_TRACE
+    //--- Tracing -------------------------------------------------------------------
+    , m_trace()
+#endif
 {
     sf::FileInputStream f;
 #ifdef __APPLE__
@@ -610,7 +619,9 @@ Nx::Nx(int argc, char** argv)
     m_tempPath = fs::path(argv[0]).parent_path();
 #endif
     setScale(kDefaultScale);
-    m_machine->getVideoSprite().setScale(float(kDefaultScale * 2), float(kDefaultScale * 2));
+    m_videoTexture.create(kWindowWidth, kWindowHeight);
+    m_videoSprite.setTexture(m_videoTexture);
+    m_videoSprite.setScale(float(kDefaultScale * 2), float(kDefaultScale * 2));
     m_ui.getSprite().setScale(float(kDefaultScale), float(kDefaultScale));
 
     //m_machine->load(0, loadFile(romFileName));
@@ -660,6 +671,10 @@ Nx::Nx(int argc, char** argv)
 
 Nx::~Nx()
 {
+#if NX_TRACE
+    m_machine->getZ80().setTrace(nullptr);
+    m_trace.stop();
+#endif
     delete m_machine;
 }
 
@@ -670,7 +685,8 @@ Nx::~Nx()
 void Nx::render()
 {
     m_window.clear();
-    m_window.draw(m_machine->getVideoSprite());
+    m_videoTexture.update((const sf::Uint8 *)m_machine->getFrameBuffer());
+    m_window.draw(m_videoSprite);
     m_ui.render((m_frameCounter++ & 16) != 0);
     m_window.draw(m_ui.getSprite());
     m_window.display();
@@ -754,7 +770,7 @@ void Nx::run()
         //
         // Generate a frame
         //
-        if (m_zoom || m_machine->getAudio().getSignal().isTriggered())
+        if (m_zoom || m_audio.getSignal().isTriggered())
         {
             frame();
             render();
@@ -787,211 +803,18 @@ void Nx::frame()
 
 bool Nx::loadSnaSnapshot(string fileName)
 {
-    vector<u8> buffer = NxFile::loadFile(fileName);
-    u8* data = buffer.data();
-    i64 size = (i64)buffer.size();
-    Z80& z80 = m_machine->getZ80();
-    
-    if (size != 49179) return false;
-    
-    z80.I() = BYTE_OF(data, 0);
-    z80.HL_() = WORD_OF(data, 1);
-    z80.DE_() = WORD_OF(data, 3);
-    z80.BC_() = WORD_OF(data, 5);
-    z80.AF_() = WORD_OF(data, 7);
-    z80.HL() = WORD_OF(data, 9);
-    z80.DE() = WORD_OF(data, 11);
-    z80.BC() = WORD_OF(data, 13);
-    z80.IY() = WORD_OF(data, 15);
-    z80.IX() = WORD_OF(data, 17);
-    z80.IFF1() = (BYTE_OF(data, 19) & 0x01) != 0;
-    z80.IFF2() = (BYTE_OF(data, 19) & 0x04) != 0;
-    z80.R() = BYTE_OF(data, 20);
-    z80.AF() = WORD_OF(data, 21);
-    z80.SP() = WORD_OF(data, 23);
-    z80.IM() = BYTE_OF(data, 25);
-    m_machine->setBorderColour(BYTE_OF(data, 26));
-    m_machine->load(0x4000, data + 27, 0xc000);
-    
-    TState t = 0;
-    z80.PC() = z80.pop(t);
-    z80.IFF1() = z80.IFF2();
-    m_machine->resetTState();
-    
-    return true;
+    return Snapshot::loadSna(*m_machine, NxFile::loadFile(fileName));
 }
 
 bool Nx::loadZ80Snapshot(string fileName)
 {
-    vector<u8> buffer = NxFile::loadFile(fileName);
-    u8* data = buffer.data();
-    Z80& z80 = m_machine->getZ80();
-
-    // Only support version 1.0 Z80 files now
-    if (buffer.size() < 30) return false;
-    int version = 1;
-    if (WORD_OF(data, 6) == 0)
-    {
-        if (WORD_OF(data, 30) == 23) version = 2;
-        else version = 3;
-    }
-
-    if (version > 1)
-    {
-        // Check to see if we're only 48K
-        u8 hardware = BYTE_OF(data, 34);
-        if (version == 2 && (hardware != 0 && hardware == 1)) return false;
-        if (version == 3 && (hardware != 0 || hardware == 1 || hardware == 3)) return false;
-    }
-
-    z80.A() = BYTE_OF(data, 0);
-    z80.F() = BYTE_OF(data, 1);
-    z80.BC() = WORD_OF(data, 2);
-    z80.HL() = WORD_OF(data, 4);
-    z80.PC() = WORD_OF(data, 6);
-    z80.SP() = WORD_OF(data, 8);
-    z80.I() = BYTE_OF(data, 10);
-    z80.R() = (BYTE_OF(data, 11) & 0x7f) | ((BYTE_OF(data, 12) & 0x01) << 7);
-    u8 b12 = BYTE_OF(data, 12);
-    if (b12 == 255) b12 = 1;
-    m_machine->setBorderColour((b12 & 0x0e) >> 1);
-    bool compressed = (b12 & 0x20) != 0;
-    z80.DE() = WORD_OF(data, 13);
-    z80.BC_() = WORD_OF(data, 15);
-    z80.DE_() = WORD_OF(data, 17);
-    z80.HL_() = WORD_OF(data, 19);
-    u8 a_ = BYTE_OF(data, 21);
-    u8 f_ = BYTE_OF(data, 22);
-    z80.AF_() = (u16(a_) << 8) + u16(f_);
-    z80.IY() = WORD_OF(data, 23);
-    z80.IX() = WORD_OF(data, 25);
-    z80.IFF1() = BYTE_OF(data, 27) ? 1 : 0;
-    z80.IFF2() = BYTE_OF(data, 28) ? 1 : 0;
-    z80.IM() = int(BYTE_OF(data, 29) & 0x03);
-
-#define CHECK_BUFFER() do { if (size_t(mem - data) >= buffer.size()) { NX_BREAK(); return false; } } while(0)
-
-    if (version == 1)
-    {
-        if (compressed)
-        {
-            u8* mem = data + 30;
-            u16 a = 0x4000;
-            while (1)
-            {
-                // Check we haven't run out of bytes.
-                CHECK_BUFFER();
-                u8 b = *mem++;
-                if (b == 0x00)
-                {
-                    // Not enough room for 4 terminating bytes
-                    if (size_t(mem + 3 - data) > buffer.size())
-                    {
-                        NX_BREAK();
-                        return false;
-                    }
-
-                    if (mem[0] == 0xed && mem[1] == 0xed && mem[2] == 0x00)
-                    {
-                        // Terminator.
-                        break;
-                    }
-
-                    m_machine->poke(a++, 0);
-                }
-                else if (b == 0xed)
-                {
-                    CHECK_BUFFER();
-                    b = *mem++;
-                    if (b != 0xed)
-                    {
-                        m_machine->poke(a++, 0xed);
-                        m_machine->poke(a++, b);
-                    }
-                    else
-                    {
-                        // Two EDs - compression.
-                        CHECK_BUFFER();
-                        u8 count = *mem++;
-                        CHECK_BUFFER();
-                        b = *mem++;
-
-                        for (u8 i = 0; i < count; ++i)
-                        {
-                            m_machine->poke(a++, b);
-                        }
-                    }
-                }
-                else
-                {
-                    m_machine->poke(a++, b);
-                }
-            }
-        }
-        else
-        {
-            if (buffer.size() != (0xc000 + 30)) return false;
-
-            m_machine->load(0x4000, data + 30, 0xc000);
-        }
-    }
-    else
-    {
-        // Version 2 & 3 files
-        u8* mem = data + 32 + WORD_OF(data, 30);
-        z80.PC() = WORD_OF(data, 32);
-        if (version == 3)
-        {
-            m_machine->setTState(TState(WORD_OF(data, 55)) + (TState(BYTE_OF(data, 57)) << 16));
-        }
-
-        u16 pages[] = { 0x0000, 0x0000, 0x0000, 0x0000, 0x8000, 0xc000, 0x0000, 0x0000, 0x4000, 0x0000, 0x0000, 0x0000 };
-        for (int i = 0; i < 3; ++i)
-        {
-            u16 a = pages[BYTE_OF(mem,2)];
-            u16 len = WORD_OF(mem, 0);
-            mem += 3;
-            bool compressed = (len != 0xffff);
-            if (!compressed) len = 0x4000;
-
-            int idx = 0;
-            while (idx < len)
-            {
-                u8 b = mem[idx++];
-                if (b == 0xed)
-                {
-                    b = mem[idx++];
-                    if (b == 0xed)
-                    {
-                        u8 count = mem[idx++];
-                        b = mem[idx++];
-                        for (int ii = 0; ii < count; ++ii)
-                        {
-                            m_machine->poke(a++, b);
-                        }
-                    }
-                    else
-                    {
-                        m_machine->poke(a++, 0xed);
-                        m_machine->poke(a++, b);
-                    }
-                }
-                else
-                {
-                    m_machine->poke(a++, b);
-                }
-            }
-            mem += len;
-        }
-    }
-
-    return true;
+    return Snapshot::loadZ80(*m_machine, NxFile::loadFile(fileName));
 }
 
 bool Nx::saveSnaSnapshot(string fileName)
 {
     vector<u8> data;
-    Z80& z80 = m_machine->getZ80();
+    Spectrum::CPU& z80 = m_machine->getZ80();
 
     TState t = 0;
     z80.push(z80.PC(), t);
@@ -1024,48 +847,13 @@ bool Nx::saveSnaSnapshot(string fileName)
 
 bool Nx::loadNxSnapshot(string fileName)
 {
-    NxFile f;
-
-    if (f.load(fileName) &&
-        f.checkSection('SN48', 36) &&
-        f.checkSection('RM48', 49152))
-    {
-        const BlockSection& sn48 = f['SN48'];
-        const BlockSection& rm48 = f['RM48'];
-        Z80& z80 = m_machine->getZ80();
-
-        z80.AF() = sn48.peek16(0);
-        z80.BC() = sn48.peek16(2);
-        z80.DE() = sn48.peek16(4);
-        z80.HL() = sn48.peek16(6);
-        z80.AF_() = sn48.peek16(8);
-        z80.BC_() = sn48.peek16(10);
-        z80.DE_() = sn48.peek16(12);
-        z80.HL_() = sn48.peek16(14);
-        z80.IX() = sn48.peek16(16);
-        z80.IY() = sn48.peek16(18);
-        z80.SP() = sn48.peek16(20);
-        z80.PC() = sn48.peek16(22);
-        z80.IR() = sn48.peek16(24);
-        z80.MP() = sn48.peek16(26);
-        z80.IM() = (int)sn48.peek8(28);
-        z80.IFF1() = sn48.peek8(29) != 0;
-        z80.IFF2() = sn48.peek8(30) != 0;
-        m_machine->setBorderColour(sn48.peek8(31));
-        m_machine->setTState((TState)sn48.peek32(32));
-
-        m_machine->load(0x4000, rm48.data());
-
-        return true;
-    }
-
-    return false;
+    return Snapshot::loadNx(*m_machine, fileName);
 }
 
 bool Nx::saveNxSnapshot(string fileName)
 {
     NxFile f;
-    Z80& z80 = m_machine->getZ80();
+    Spectrum::CPU& z80 = m_machine->getZ80();
 
     BlockSection sn48('SN48');
     sn48.poke16(z80.AF());
@@ -1136,6 +924,25 @@ string Nx::getSetting(string key, string defaultSetting)
 void Nx::updateSettings()
 {
     m_kempstonJoystick = getSetting("kempston") == "yes";
+    m_machine->setIdleSkip(getSetting("idleskip") == "yes");
+    using Dispatch = Spectrum::CPU::Dispatch;
+    m_machine->getZ80().setDispatch(
+        getSetting("interpreter") == "yes" ? Dispatch::Interpreter :
+        getSetting("jit") == "yes" ? Dispatch::Jit :
+        getSetting("blocks") == "yes" ? Dispatch::Blocks :
+        Dispatch::Table);
+
+#if NX_TRACE
+    // Tracing starts once, from the state after the command line's files were loaded, and runs until the emulator
+    // quits.
+    string traceFile = getSetting("trace");
+    if (!traceFile.empty() && traceFile != "yes" && !m_trace.isRecording())
+    {
+        u16 registers[kTraceNumRegs];
+        m_machine->getZ80().traceRegisters(registers);
+        if (m_trace.start(traceFile, m_machine->getTState(), registers)) m_machine->getZ80().setTrace(&m_trace);
+    }
+#endif
 }
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -1150,7 +957,7 @@ void Nx::toggleDebugger()
 void Nx::togglePause(bool breakpointHit)
 {
     m_runMode = (m_runMode != RunMode::Normal) ? RunMode::Normal : RunMode::Stopped;
-    m_machine->getAudio().mute(m_runMode == RunMode::Stopped);
+    m_audio.mute(m_runMode == RunMode::Stopped);
 
     if (!isDebugging())
     {
@@ -1201,6 +1008,19 @@ void Nx::stepOut()
     if (m_runMode == RunMode::Normal) togglePause(false);
     else
     {
+#if NX_CALL_STACK
+        // The call stack knows which call we're in, even if there is data on top of the return address or the same
+        // return address is further down the stack.
+        const CallStack* callStack = getSpeccy().getZ80().getCallStack();
+        if (callStack && !callStack->getFrames().empty())
+        {
+            m_machine->addReturnBreakpoint(callStack->getFrames().back().sp);
+            m_runMode = RunMode::Normal;
+            return;
+        }
+#endif
+
+        // Otherwise guess that the return address is on the top of the stack.
         u16 sp = getSpeccy().getZ80().SP();
         TState t = 0;
         u16 address = m_machine->peek16(sp, t);
@@ -1266,7 +1086,7 @@ void Nx::hideAll()
 void Nx::toggleZoom()
 {
     m_zoom = !m_zoom;
-    getSpeccy().getAudio().mute(m_zoom);
+    m_audio.mute(m_zoom);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
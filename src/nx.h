@@ -5,9 +5,11 @@
 
 #pragma once
 
+#include "audio.h"
 #include "spectrum.h"
 #include "debugger.h"
-#include "tape.h"
+#include "tapebrowser.h"
+#include "trace.h"
 
 #include <SFML/Graphics.hpp>
 #include <experimental/filesystem>
@@ -72,6 +74,9 @@ public:
     // Obtain a reference to the current machine.
     Spectrum& getSpeccy() { return *m_machine; }
 
+    // The sound device, which the machine's beeper plays through.
+    Audio& getAudio() { return m_audio; }
+
     // Render the currently generated display
     void render();
 
@@ -93,6 +98,7 @@ public:
     void updateSettings();
 
     // Debugging
+    Debugger& getDebugger() { return m_debugger; }
     bool isDebugging() const { return Overlay::currentOverlay() == &m_debugger; }
     void togglePause(bool breakpointHit);
     void stepOver();
@@ -132,6 +138,7 @@ private:
     void setScale(int scale);
 
 private:
+    Audio               m_audio;
     Spectrum*           m_machine;
     Ui                  m_ui;
     Signal              m_renderSignal;
@@ -151,6 +158,8 @@ private:
 
     // Rendering
     sf::RenderWindow    m_window;
+    sf::Texture         m_videoTexture;
+    sf::Sprite          m_videoSprite;
 
     // Peripherals
     bool                m_kempstonJoystick;
@@ -160,6 +169,11 @@ private:
 
     // Files
     fs::path            m_tempPath;
+
+#if NX_TRACE
+    // Execution trace, started by the -trace=file setting
+    TraceRecorder       m_trace;
+#endif
 };
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -3,7 +3,6 @@
 //----------------------------------------------------------------------------------------------------------------------
 
 #include "nxfile.h"
-#include <SFML/System.hpp>
 #include <fstream>
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -145,13 +144,15 @@ NxFile::NxFile()
 vector<u8> NxFile::loadFile(string fileName)
 {
     vector<u8> buffer;
-    sf::FileInputStream f;
+    ifstream f;
 
-    if (f.open(fileName))
+    f.open(fileName, ios::in | ios::binary | ios::ate);
+    if (f)
     {
-        i64 size = f.getSize();
+        i64 size = f.tellg();
         buffer.resize(size);
-        f.read(buffer.data(), size);
+        f.seekg(0, ios::beg);
+        f.read((char *)buffer.data(), size);
     }
 
     return buffer;
@@ -0,0 +1,383 @@
+//----------------------------------------------------------------------------------------------------------------------
+// Profiler Window
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "debugger.h"
+#include "disasm.h"
+#include "nx.h"
+
+#if NX_PROFILER
+
+#include <algorithm>
+#include <cstdio>
+
+//----------------------------------------------------------------------------------------------------------------------
+// Profiler window
+//----------------------------------------------------------------------------------------------------------------------
+
+static const char* kTableNames[] = { "", "CB", "ED", "DD", "FD", "DDCB", "FDCB" };
+
+ProfilerWindow::ProfilerWindow(Nx& nx)
+    : SelectableWindow(nx, 45, 22, 34, 16, "Profiler", Colour::Black, Colour::White)
+    , m_z80(nx.getSpeccy().getZ80())
+    , m_enabled(false)
+    , m_view(View::Opcodes)
+    , m_topRow(0)
+{
+
+}
+
+// Every opcode that has run, with the most t-states first.
+vector<ProfilerWindow::OpcodeRow> ProfilerWindow::sortedOpcodes() const
+{
+    vector<OpcodeRow> rows;
+    for (int table = 0; table < (int)OpcodeProfile::Table::COUNT; ++table)
+    {
+        for (int opCode = 0; opCode < 256; ++opCode)
+        {
+            const OpcodeProfile::Entry& entry = m_opcodes.ops[table][opCode];
+            if (entry.count) rows.push_back({ (OpcodeProfile::Table)table, opCode, entry });
+        }
+    }
+    if (m_opcodes.interrupts.count) rows.push_back({ OpcodeProfile::Table::Base, -1, m_opcodes.interrupts });
+
+    stable_sort(rows.begin(), rows.end(), [](const OpcodeRow& a, const OpcodeRow& b) {
+        return a.entry.tStates > b.entry.tStates;
+    });
+    return rows;
+}
+
+// Every address that has run an instruction, with the most t-states first.
+vector<u16> ProfilerWindow::sortedHotspots() const
+{
+    vector<u16> addresses;
+    for (int a = 0; a < 65536; ++a)
+    {
+        if (m_hotspots.tStates[a]) addresses.push_back(u16(a));
+    }
+
+    stable_sort(addresses.begin(), addresses.end(), [this](u16 a, u16 b) {
+        return m_hotspots.tStates[a] > m_hotspots.tStates[b];
+    });
+    return addresses;
+}
+
+// The prefixes and opcode that select the entry.  The displacement of an indexed bit instruction isn't shown.
+string ProfilerWindow::label(const OpcodeRow& row)
+{
+    if (row.opCode < 0) return "INT";
+    return Draw::format("%s%02X", kTableNames[(int)row.table], row.opCode);
+}
+
+string ProfilerWindow::mnemonic(const OpcodeRow& row)
+{
+    if (row.opCode < 0) return "Interrupt";
+
+    u8 b[4] = { 0, 0, 0, 0 };
+    u8 op = (u8)row.opCode;
+    switch (row.table)
+    {
+    case OpcodeProfile::Table::Base:    b[0] = op;                                  break;
+    case OpcodeProfile::Table::CB:      b[0] = 0xcb;    b[1] = op;                  break;
+    case OpcodeProfile::Table::ED:      b[0] = 0xed;    b[1] = op;                  break;
+    case OpcodeProfile::Table::DD:      b[0] = 0xdd;    b[1] = op;                  break;
+    case OpcodeProfile::Table::FD:      b[0] = 0xfd;    b[1] = op;                  break;
+    case OpcodeProfile::Table::DDCB:    b[0] = 0xdd;    b[1] = 0xcb;    b[3] = op;  break;
+    case OpcodeProfile::Table::FDCB:    b[0] = 0xfd;    b[1] = 0xcb;    b[3] = op;  break;
+    default:                                                                        break;
+    }
+
+    Disassembler d;
+    d.disassemble(0, b[0], b[1], b[2], b[3]);
+    string operands = d.operands();
+    return operands.empty() ? d.opCode() : d.opCode() + " " + operands;
+}
+
+// The instruction in memory now, which might not be the one that was profiled if the code has since changed.
+string ProfilerWindow::mnemonicAt(u16 address)
+{
+    Spectrum& speccy = m_nx.getSpeccy();
+
+    Disassembler d;
+    d.disassemble(address, speccy.peek(address), speccy.peek(address + 1), speccy.peek(address + 2),
+        speccy.peek(address + 3));
+    string operands = d.operands();
+    return operands.empty() ? d.opCode() : d.opCode() + " " + operands;
+}
+
+bool ProfilerWindow::saveOpcodesCsv(const string& fileName)
+{
+    FILE* f = fopen(fileName.c_str(), "w");
+    if (!f) return false;
+
+    fprintf(f, "opcode,mnemonic,count,tstates,average\n");
+    for (const OpcodeRow& row : sortedOpcodes())
+    {
+        fprintf(f, "%s,\"%s\",%llu,%llu,%.2f\n", label(row).c_str(), mnemonic(row).c_str(),
+            (unsigned long long)row.entry.count, (unsigned long long)row.entry.tStates,
+            (double)row.entry.tStates / (double)row.entry.count);
+    }
+
+    return fclose(f) == 0;
+}
+
+bool ProfilerWindow::saveHotspotsCsv(const string& fileName)
+{
+    FILE* f = fopen(fileName.c_str(), "w");
+    if (!f) return false;
+
+    fprintf(f, "address,instruction,tstates,percent\n");
+    for (u16 a : sortedHotspots())
+    {
+        fprintf(f, "%04X,\"%s\",%llu,%.3f\n", a, mnemonicAt(a).c_str(), (unsigned long long)m_hotspots.tStates[a],
+            100.0 * (double)m_hotspots.tStates[a] / (double)m_hotspots.total);
+    }
+
+    return fclose(f) == 0;
+}
+
+#if NX_CALL_STACK
+
+CallStack& ProfilerWindow::getCallStack()
+{
+    return m_nx.getDebugger().getCallStackWindow().getCallStack();
+}
+
+bool ProfilerWindow::saveRoutinesCsv(const string& fileName)
+{
+    FILE* f = fopen(fileName.c_str(), "w");
+    if (!f) return false;
+
+    const CallStack& callStack = getCallStack();
+    const u64 total = callStack.getTotalTStates();
+    fprintf(f, "address,instruction,calls,inclusive,exclusive,inclusive_percent,exclusive_percent\n");
+    for (const CallStack::Routine& r : callStack.getRoutines())
+    {
+        fprintf(f, "%04X,\"%s\",%llu,%llu,%llu,%.3f,%.3f\n", r.address, mnemonicAt(r.address).c_str(),
+            (unsigned long long)r.calls, (unsigned long long)r.inclusive, (unsigned long long)r.exclusive,
+            total ? 100.0 * (double)r.inclusive / (double)total : 0.0,
+            total ? 100.0 * (double)r.exclusive / (double)total : 0.0);
+    }
+
+    return fclose(f) == 0;
+}
+
+#endif
+
+// Numbers are kept to 5 characters so that the columns line up.
+static string shortNumber(u64 n)
+{
+    static const char kUnits[] = "kMGT";
+
+    if (n < 100000) return Draw::format("%llu", (unsigned long long)n);
+
+    double x = (double)n;
+    int unit = -1;
+    while (x >= 999.5 && unit < 3)
+    {
+        x /= 1000.0;
+        ++unit;
+    }
+    return Draw::format(x < 9.95 ? "%.1f%c" : "%.0f%c", x, kUnits[unit]);
+}
+
+static double percentOf(u64 n, u64 total)
+{
+    return total ? 100.0 * (double)n / (double)total : 0.0;
+}
+
+void ProfilerWindow::onDraw(Draw& draw)
+{
+    u8 onColour = draw.attr(Colour::Black, Colour::Green, true);
+    u8 offColour = draw.attr(Colour::Black, Colour::Red, true);
+
+    draw.printString(m_x + 1, m_y + 1, m_enabled ? " On " : " Off ", m_enabled ? onColour : offColour);
+    const int numRows = m_height - 4;
+    const u8 titleColour = draw.attr(Colour::Blue, Colour::White, false);
+    switch (m_view)
+    {
+    case View::Opcodes:
+        draw.printString(m_x + 7, m_y + 1, "Opcodes", titleColour);
+        drawOpcodes(draw, numRows);
+        break;
+
+    case View::Hotspots:
+        draw.printString(m_x + 7, m_y + 1, "Hotspots", titleColour);
+        drawHotspots(draw, numRows);
+        break;
+
+#if NX_CALL_STACK
+    case View::Routines:
+        draw.printString(m_x + 7, m_y + 1, "Routines", titleColour);
+        drawRoutines(draw, numRows);
+        break;
+#endif
+    }
+}
+
+void ProfilerWindow::drawOpcodes(Draw& draw, int numRows)
+{
+    u8 titleColour = draw.attr(Colour::Blue, Colour::White, false);
+    vector<OpcodeRow> rows = sortedOpcodes();
+    u64 total = 0;
+    for (const OpcodeRow& row : rows) total += row.entry.tStates;
+
+    draw.printString(m_x + 27, m_y + 1, shortNumber(total), m_bkgColour);
+    draw.printString(m_x + 1, m_y + 2, "Op     Mnemonic          % Count", titleColour);
+
+    m_topRow = max(0, min(m_topRow, (int)rows.size() - numRows));
+
+    u8 bkg2 = m_bkgColour & ~0x40;
+    for (int i = 0; i < numRows && m_topRow + i < (int)rows.size(); ++i)
+    {
+        const OpcodeRow& row = rows[m_topRow + i];
+        u8 colour = (i & 1) ? bkg2 : m_bkgColour;
+
+        draw.attrRect(m_x, m_y + 3 + i, m_width, 1, colour);
+        draw.printString(m_x + 1, m_y + 3 + i, label(row), colour);
+        draw.printString(m_x + 8, m_y + 3 + i, mnemonic(row).substr(0, 14), colour);
+        draw.printString(m_x + 23, m_y + 3 + i, Draw::format("%4.1f", percentOf(row.entry.tStates, total)), colour);
+        draw.printString(m_x + 28, m_y + 3 + i, shortNumber(row.entry.count), colour);
+    }
+}
+
+void ProfilerWindow::drawHotspots(Draw& draw, int numRows)
+{
+    u8 titleColour = draw.attr(Colour::Blue, Colour::White, false);
+    vector<u16> addresses = sortedHotspots();
+
+    draw.printString(m_x + 27, m_y + 1, shortNumber(m_hotspots.total), m_bkgColour);
+    draw.printString(m_x + 1, m_y + 2, "Addr Instruction         % T-sts", titleColour);
+
+    m_topRow = max(0, min(m_topRow, (int)addresses.size() - numRows));
+
+    u8 bkg2 = m_bkgColour & ~0x40;
+    for (int i = 0; i < numRows && m_topRow + i < (int)addresses.size(); ++i)
+    {
+        const u16 a = addresses[m_topRow + i];
+        const u64 t = m_hotspots.tStates[a];
+        u8 colour = (i & 1) ? bkg2 : m_bkgColour;
+
+        draw.attrRect(m_x, m_y + 3 + i, m_width, 1, colour);
+        draw.printString(m_x + 1, m_y + 3 + i, Draw::format("%04X", a), colour);
+        draw.printString(m_x + 6, m_y + 3 + i, mnemonicAt(a).substr(0, 16), colour);
+        draw.printString(m_x + 23, m_y + 3 + i, Draw::format("%4.1f", percentOf(t, m_hotspots.total)), colour);
+        draw.printString(m_x + 28, m_y + 3 + i, shortNumber(t), colour);
+    }
+}
+
+#if NX_CALL_STACK
+
+// Routines are timed by the call stack, so they are counted while it's switched on, whether or not the profiler is.
+void ProfilerWindow::drawRoutines(Draw& draw, int numRows)
+{
+    u8 titleColour = draw.attr(Colour::Blue, Colour::White, false);
+    const CallStack& callStack = getCallStack();
+    vector<CallStack::Routine> routines = callStack.getRoutines();
+    const u64 total = callStack.getTotalTStates();
+
+    draw.printString(m_x + 27, m_y + 1, shortNumber(total), m_bkgColour);
+    draw.printString(m_x + 1, m_y + 2, "Addr Calls  Incl% Excl%   T-sts", titleColour);
+
+    if (routines.empty() && !m_nx.getSpeccy().getZ80().getCallStack())
+    {
+        draw.printString(m_x + 1, m_y + 3, "Switch on the call stack first", m_bkgColour);
+        return;
+    }
+
+    m_topRow = max(0, min(m_topRow, (int)routines.size() - numRows));
+
+    u8 bkg2 = m_bkgColour & ~0x40;
+    for (int i = 0; i < numRows && m_topRow + i < (int)routines.size(); ++i)
+    {
+        const CallStack::Routine& r = routines[m_topRow + i];
+        u8 colour = (i & 1) ? bkg2 : m_bkgColour;
+        const int y = m_y + 3 + i;
+
+        draw.attrRect(m_x, y, m_width, 1, colour);
+        draw.printString(m_x + 1, y, Draw::format("%04X", r.address), colour);
+        draw.printString(m_x + 6, y, shortNumber(r.calls), colour);
+        draw.printString(m_x + 13, y, Draw::format("%5.1f", percentOf(r.inclusive, total)), colour);
+        draw.printString(m_x + 19, y, Draw::format("%5.1f", percentOf(r.exclusive, total)), colour);
+        draw.printString(m_x + 27, y, shortNumber(r.inclusive), colour);
+    }
+}
+
+#endif
+
+void ProfilerWindow::onKey(sf::Keyboard::Key key, bool shift, bool ctrl, bool alt)
+{
+    using K = sf::Keyboard::Key;
+    if (shift || ctrl || alt) return;
+
+    const int page = m_height - 4;
+    switch (key)
+    {
+    case K::P:
+        m_enabled = !m_enabled;
+        m_z80.setOpcodeProfile(m_enabled ? &m_opcodes : nullptr);
+        m_z80.setHotspotProfile(m_enabled ? &m_hotspots : nullptr);
+        break;
+
+    case K::V:
+        switch (m_view)
+        {
+        case View::Opcodes:     m_view = View::Hotspots;    break;
+#if NX_CALL_STACK
+        case View::Hotspots:    m_view = View::Routines;    break;
+#endif
+        default:                m_view = View::Opcodes;     break;
+        }
+        m_topRow = 0;
+        break;
+
+    case K::R:
+        m_opcodes.clear();
+        m_hotspots.clear();
+#if NX_CALL_STACK
+        getCallStack().clearProfile();
+#endif
+        m_topRow = 0;
+        break;
+
+    case K::S:
+        switch (m_view)
+        {
+        case View::Opcodes:
+            saveOpcodesCsv("opcodes.csv");
+            break;
+
+        case View::Hotspots:
+            saveHotspotsCsv("hotspots.csv");
+            break;
+
+#if NX_CALL_STACK
+        case View::Routines:
+            // The folded stacks can be drawn as a flame graph.
+            saveRoutinesCsv("routines.csv");
+            getCallStack().saveFoldedStacks("stacks.txt");
+            break;
+#endif
+        }
+        break;
+
+    case K::Up:         --m_topRow;         break;
+    case K::Down:       ++m_topRow;         break;
+    case K::PageUp:     m_topRow -= page;   break;
+    case K::PageDown:   m_topRow += page;   break;
+
+    default:
+        break;
+    }
+
+    m_topRow = max(0, m_topRow);
+}
+
+void ProfilerWindow::onText(char ch)
+{
+}
+
+#endif // NX_PROFILER
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,20 @@
+//----------------------------------------------------------------------------------------------------------------------
+// Snapshot loading
+// Restores a 48K machine from the snapshot formats that NX understands.  Each returns false, possibly leaving the
+// machine half-loaded, if the data is not a snapshot it can use.
+//----------------------------------------------------------------------------------------------------------------------
+
+#pragma once
+
+#include "spectrum.h"
+
+class Snapshot
+{
+public:
+    static bool loadSna(Spectrum& speccy, const vector<u8>& data);
+    static bool loadZ80(Spectrum& speccy, const vector<u8>& data);
+    static bool loadNx(Spectrum& speccy, string fileName);
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
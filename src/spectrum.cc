@@ -2,18 +2,47 @@
 // Spectrum base class implementation
 //----------------------------------------------------------------------------------------------------------------------
 
+#include "hash.h"
 #include "spectrum.h"
 #include "tape.h"
 
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <random>
 
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb_image_write.h>
+
+//----------------------------------------------------------------------------------------------------------------------
+// Profiling
+// Adds the lifetime of the timer to a total, if there is one.
+//----------------------------------------------------------------------------------------------------------------------
+
+class ProfileTimer
+{
+public:
+    ProfileTimer(double* total)
+        : m_total(total)
+    {
+        if (m_total) m_start = chrono::steady_clock::now();
+    }
+
+    ~ProfileTimer()
+    {
+        if (m_total) *m_total += chrono::duration<double>(chrono::steady_clock::now() - m_start).count();
+    }
+
+private:
+    double*                             m_total;
+    chrono::steady_clock::time_point    m_start;
+};
+
 //----------------------------------------------------------------------------------------------------------------------
 // Constructor
 //----------------------------------------------------------------------------------------------------------------------
 
-Spectrum::Spectrum(function<void()> frameFunc)
+Spectrum::Spectrum(IAudioSink* audioSink)
     //--- Clock state ----------------------------------------------------
     : m_tState(0)
 
@@ -25,14 +54,16 @@ Spectrum::Spectrum(function<void()> frameFunc)
     , m_drawTState(0)
 
     //--- Audio state ----------------------------------------------------
-    , m_audio(69888, frameFunc)
+    , m_beeper(69888, audioSink)
     , m_tape(nullptr)
+    , m_tapeTState(0)
 
     //--- Memory state ---------------------------------------------------
     , m_romWritable(true)
+    , m_pageGenerations()
 
     //--- CPU state ------------------------------------------------------
-    , m_z80(*this)
+    , m_z80(Spectrum48Bus(*this))
 
     //--- ULA state ------------------------------------------------------
     , m_borderColour(7)
@@ -40,9 +71,30 @@ Spectrum::Spectrum(function<void()> frameFunc)
     , m_speaker(0)
     , m_tapeEar(0)
 
+    //--- Debugger state -------------------------------------------------
+    , m_breakpoints()
+    , m_numBreakpoints(0)
+#if NX_CALL_STACK
+    , m_returnBreakpoint(-1)
+#endif
+
     //--- Kempston -------------------------------------------------------
     , m_kempstonJoystick(false)
     , m_kempstonState(0)
+
+    //--- Profiling ------------------------------------------------------
+    , m_profile(nullptr)
+
+    //--- Coverage -------------------------------------------------------
+    , m_coverageEnabled(false)
+
+    //--- Idle loops -----------------------------------------------------
+    , m_idleSkip(false)
+    , m_idleCheckDue(false)
+    , m_idleTracing(false)
+    , m_idleTrace()
+    , m_idleRejectAddress(0)
+    , m_idleRejectFrame(0)
 {
     reset();
 }
@@ -60,12 +112,6 @@ Spectrum::~Spectrum()
 // State
 //----------------------------------------------------------------------------------------------------------------------
 
-sf::Sprite& Spectrum::getVideoSprite()
-{
-    m_videoTexture.update((const sf::Uint8 *)m_image);
-    return m_videoSprite;
-}
-
 void Spectrum::setKeyboardState(vector<u8> &rows)
 {
     m_keys = rows;
@@ -94,52 +140,87 @@ void Spectrum::reset(bool hard /* = true */)
     }
     m_z80.restart();
     m_tState = 0;
+    m_tapeTState = 0;
+    initEvents();
 }
 
 //----------------------------------------------------------------------------------------------------------------------
 // Frame emulation
 //----------------------------------------------------------------------------------------------------------------------
 
-void Spectrum::updateTape(TState numTStates)
+void Spectrum::updateTape(TState tState)
 {
-    if (m_tape)
+    if (m_tape && tState > m_tapeTState)
     {
-        m_tapeEar = m_tape->play(numTStates);
+        ProfileTimer timer(m_profile ? &m_profile->tape : nullptr);
+        m_tapeEar = m_tape->play(tState - m_tapeTState);
     }
+    m_tapeTState = tState;
+}
+
+void Spectrum::updateBeeper(TState t)
+{
+    ProfileTimer timer(m_profile ? &m_profile->beeper : nullptr);
+    m_beeper.update(t, m_speaker);
+}
+
+void Spectrum::updatePeripherals()
+{
+    updateVideo(m_tState);
+    updateTape(m_tState);
+    updateBeeper(m_tState);
 }
 
 bool Spectrum::update(RunMode runMode, bool& breakpointHit)
 {
+    ProfileTimer timer(m_profile ? &m_profile->total : nullptr);
     bool result = false;
     breakpointHit = false;
-    TState frameTime = getFrameTime();
-    TState startTState;
 
     switch (runMode)
     {
     case RunMode::Normal:
-        while (m_tState < getFrameTime())
+        while (!result && !breakpointHit)
         {
-            startTState = m_tState;
-            m_z80.step(m_tState);
-            updateVideo();
-            updateTape(m_tState - startTState);
-            m_audio.updateBeeper(m_tState, m_speaker);
-            //m_audio.updateBeeper(m_tState, m_tapeEar ? 1 : 0);
-            if ((runMode == RunMode::Normal) && shouldBreak(m_z80.PC()))
+            // Run straight to the next event.  The bus brings the video and beeper up to date on screen writes and ULA
+            // OUTs, and the tape on ULA INs, so nothing else needs checking between instructions.  A halted CPU can't
+            // do either, so it runs to the interrupt (or tape edge) in one go and the scanline and sample events
+            // catch up in bulk.  So can an idle loop, or the passes of a block instruction.
+            const TState quietLimit = min(m_events.timeOf(Event::Interrupt), m_events.timeOf(Event::TapeEdge));
+            TState limit = m_z80.isWaitingForInterrupt() ? quietLimit : m_events.nextTime();
+            if (m_idleSkip && m_idleCheckDue && !hasBreakpoints() && !m_z80.isInterruptPending() &&
+                !m_z80.isInstrumented())
+            {
+                m_idleCheckDue = false;
+                skipIdleLoop(quietLimit);
+            }
+            if (!hasBreakpoints() || m_z80.isWaitingForInterrupt())
             {
-                breakpointHit = true;
-                break;
+                m_z80.run(m_tState, limit, quietLimit);
+            }
+            else
+            {
+                while (m_tState < limit)
+                {
+                    m_z80.step(m_tState);
+                    if (shouldBreak(m_z80.PC()))
+                    {
+                        breakpointHit = true;
+                        break;
+                    }
+                }
             }
+            result = processEvents();
         }
+        if (breakpointHit) updatePeripherals();
         break;
 
     case RunMode::StepIn:
     case RunMode::StepOver:
-        startTState = m_tState;
         m_z80.step(m_tState);
-        updateVideo();
-        updateTape(m_tState - startTState);
+        updateVideo(m_tState);
+        updateTape(m_tState);
+        result = processEvents();
         break;
 
     case RunMode::Stopped:
@@ -147,14 +228,225 @@ bool Spectrum::update(RunMode runMode, bool& breakpointHit)
         break;
     }
 
-    if (m_tState >= getFrameTime())
+    return result;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Events
+//----------------------------------------------------------------------------------------------------------------------
+
+void Spectrum::initEvents()
+{
+    m_events.clear();
+    m_events.schedule(Event::Interrupt, getFrameTime());
+    m_events.schedule(Event::Scanline, 0);
+    m_events.schedule(Event::AudioSample, m_beeper.getTStatesPerSample());
+}
+
+bool Spectrum::processEvents()
+{
+    bool frameComplete = false;
+    TState frameTime = getFrameTime();
+    Event event;
+
+    while (m_events.pop(m_tState, event))
     {
-        m_tState -= getFrameTime();
-        m_z80.interrupt();
-        result = true;
+        switch (event)
+        {
+        case Event::Interrupt:
+            // Finish off this frame and start the next one.
+            updatePeripherals();
+            m_tState -= frameTime;
+            m_tapeTState -= frameTime;
+            m_events.rebase(frameTime);
+            m_events.schedule(Event::Interrupt, frameTime);
+            if (m_tape && m_tape->isPlaying() && !m_events.isPending(Event::TapeEdge))
+            {
+                m_events.schedule(Event::TapeEdge, m_tState);
+            }
+            m_z80.interrupt();
+            frameComplete = true;
+            break;
+
+        case Event::Scanline:
+            // Events before the end of the frame can be seen after the last instruction has crossed it.  Leave the
+            // catching up to the interrupt in that case.
+            if (m_tState < frameTime) updateVideo(m_tState);
+            m_events.schedule(Event::Scanline, (m_tState / 224 + 1) * 224);
+            m_idleCheckDue = true;
+            break;
+
+        case Event::TapeEdge:
+            if (m_tape && m_tape->isPlaying())
+            {
+                updateTape(m_tState);
+                m_events.schedule(Event::TapeEdge, m_tapeTState + m_tape->nextEdge());
+            }
+            break;
+
+        case Event::AudioSample:
+            {
+                TState period = m_beeper.getTStatesPerSample();
+                if (m_tState < frameTime) updateBeeper(m_tState);
+                m_events.schedule(Event::AudioSample, (m_tState / period + 1) * period);
+            }
+            break;
+
+        default:
+            assert(0);
+            break;
+        }
     }
 
-    return result;
+    return frameComplete;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Idle loops
+//----------------------------------------------------------------------------------------------------------------------
+
+// Checks for the start of a loop that is known to be a common way of waiting for an interrupt, and returns its length in
+// bytes, or 0.  It only needs to be a good guess, because skipIdleLoop() checks that the loop really is idle before
+// skipping anything.
+int Spectrum::idleLoopSize(u16 address)
+{
+    const u8* m = m_ram.data();
+
+    // The ROM's WAIT-KEY1 loop, where the editor waits for the interrupt to read a key:
+    //
+    //      15DE    CALL INPUT-AD
+    //              RET C
+    //              JR Z,15DE
+    //
+    if (address == 0x15de)
+    {
+        static const u8 kWaitKey1[] = { 0xcd, 0xe6, 0x15, 0xd8, 0x28, 0xfa };
+        return equal(begin(kWaitKey1), end(kWaitKey1), m + address) ? (int)sizeof(kWaitKey1) : 0;
+    }
+
+    // Polling a variable until the interrupt changes it, usually FRAMES:
+    //
+    //      loop    LD A,(nn)
+    //              CP n / CP r / AND n
+    //              JR Z/NZ,loop
+    //
+    if (m[address] == 0x3a)
+    {
+        u16 a = address + 3;
+        u8 op = m[a];
+        if (op == 0xfe || op == 0xe6) a += 2;
+        else if ((op & 0xf8) == 0xb8) a += 1;
+        else return 0;
+
+        u8 jr = m[a];
+        bool loops = (jr == 0x20 || jr == 0x28) && u16(a + 2 + (signed char)m[u16(a + 1)]) == address;
+        return loops ? u16(a + 2 - address) : 0;
+    }
+
+    return 0;
+}
+
+void Spectrum::recordIdleAccess(TState t, TState delay)
+{
+    m_idleTrace.accesses.push_back({ t - m_idleTrace.last, delay });
+    m_idleTrace.last = t + contention(t) + delay;
+}
+
+// Single-step until PC reaches address.  Returns false if the limit or the step count runs out first.
+bool Spectrum::stepTo(u16 address, TState limit)
+{
+    static const int kMaxLoopSteps = 64;
+
+    for (int i = 0; i < kMaxLoopSteps && m_tState < limit; ++i)
+    {
+        m_z80.step(m_tState);
+        if (m_z80.PC() == address) return true;
+    }
+
+    return false;
+}
+
+// Run the loop starting at PC until the pass that would end past limit.  Returns false if it isn't an idle loop, in
+// which case it has still been run correctly for the passes that were tried.
+bool Spectrum::skipIdleLoop(TState limit)
+{
+    // Longest pass that will be replayed.  This also keeps the replay inside the contention table.
+    static const TState kMaxPassTStates = 1000;
+
+    // Passes to try before giving up.  The first pass after the interrupt usually does some work, and the one after
+    // that may still be writing things that are the same every time, like return addresses on the stack.
+    static const int kMaxPasses = 4;
+
+    // Longest loop that idleLoopSize() recognises.
+    static const int kMaxLoopSize = 8;
+
+    // An event can stop the CPU anywhere in the loop, so look back a few bytes for the head.
+    const u16 pc = m_z80.PC();
+    int head = -1;
+    for (int back = 0; back < kMaxLoopSize && head < 0; ++back)
+    {
+        if (idleLoopSize(u16(pc - back)) > back) head = u16(pc - back);
+    }
+    if (head < 0) return false;
+    if (head == m_idleRejectAddress && m_frameCounter == m_idleRejectFrame) return false;
+    if (pc != head && !stepTo(u16(head), limit)) return false;
+
+    auto cpuState = [this]() -> array<int, 17>
+    {
+        CPU& z = m_z80;
+        return { z.AF(), z.BC(), z.DE(), z.HL(), z.IX(), z.IY(), z.SP(), z.AF_(), z.BC_(), z.DE_(), z.HL_(), z.I(),
+            z.MP(), z.IFF1(), z.IFF2(), z.IM(), z.isHalted() };
+    };
+
+    // Look for a pass that leaves everything as it found it, apart from the clock and R.
+    bool idle = false;
+    u8 r = 0;
+    for (int pass = 0; pass < kMaxPasses && !idle; ++pass)
+    {
+        const auto state = cpuState();
+        const TState start = m_tState;
+        r = m_z80.R();
+
+        m_idleTrace.accesses.clear();
+        m_idleTrace.last = start;
+        m_idleTrace.sideEffects = false;
+        m_idleTracing = true;
+        bool looped = stepTo(u16(head), limit);
+        m_idleTracing = false;
+
+        // Running into the limit says nothing about the loop, so it can be tried again after the next event.
+        if (!looped && m_tState >= limit) return false;
+        if (!looped || m_tState - start > kMaxPassTStates) break;
+        idle = !m_idleTrace.sideEffects && cpuState() == state;
+    }
+
+    if (!idle)
+    {
+        m_idleRejectAddress = u16(head);
+        m_idleRejectFrame = m_frameCounter;
+        return false;
+    }
+
+    m_idleTrace.tail = m_tState - m_idleTrace.last;
+    const u8 rPerPass = (m_z80.R() - r) & 0x7f;
+
+    // Every pass from now on is the same, so only the contention, which depends on the time, has to be worked out.
+    for (;;)
+    {
+        TState t = m_tState;
+        for (const IdleTrace::Access& access : m_idleTrace.accesses)
+        {
+            t += access.gap;
+            t += contention(t) + access.delay;
+        }
+        t += m_idleTrace.tail;
+        if (t > limit) break;
+
+        m_tState = t;
+        m_z80.R() = (m_z80.R() & 0x80) | ((m_z80.R() + rPerPass) & 0x7f);
+    }
+
+    return true;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -198,76 +490,31 @@ void Spectrum::initMemory()
     {
         m_ram[a] = (u8)dist(rng);
     }
-}
-
-u8 Spectrum::peek(u16 address)
-{
-    return m_ram[address];
-}
-
-u8 Spectrum::peek(u16 address, TState& t)
-{
-    contend(address, 3, 1, t);
-    return peek(address);
-}
-
-u16 Spectrum::peek16(u16 address, TState& t)
-{
-    return peek(address, t) + 256 * peek(address + 1, t);
+    for (u32& generation : m_pageGenerations) ++generation;
 }
 
 void Spectrum::poke(u16 address, u8 x)
 {
-    if (m_romWritable || address >= 0x4000) m_ram[address] = x;
-}
-
-void Spectrum::poke(u16 address, u8 x, TState& t)
-{
-    contend(address, 3, 1, t);
-    poke(address, x);
-}
-
-void Spectrum::poke16(u16 address, u16 w, TState& t)
-{
-    Reg r(w);
-    poke(address, r.l, t);
-    poke(address + 1, r.h, t);
+    if (m_romWritable || address >= 0x4000)
+    {
+        m_ram[address] = x;
+        ++m_pageGenerations[address >> 8];
+    }
 }
 
 void Spectrum::load(u16 address, const void* buffer, i64 size)
 {
     i64 clampedSize = min((i64)address + size, (i64)65536) - address;
     copy((u8*)buffer, (u8*)buffer + size, m_ram.begin() + address);
-}
-
-void Spectrum::load(u16 address, const vector<u8>& buffer)
-{
-    load(address, buffer.data(), buffer.size());
-}
-
-bool Spectrum::isContended(u16 addr) const
-{
-    return ((addr & 0xc000) == 0x4000);
-}
-
-void Spectrum::contend(u16 address, TState delay, int num, TState& t)
-{
-    if (isContended(address))
-    {
-        for (int i = 0; i < num; ++i)
-        {
-            t += contention(t) + delay;
-        }
-    }
-    else
+    for (i64 page = address >> 8; page <= (address + clampedSize - 1) >> 8; ++page)
     {
-        t += delay * num;
+        ++m_pageGenerations[page];
     }
 }
 
-TState Spectrum::contention(TState tStates)
+void Spectrum::load(u16 address, const vector<u8>& buffer)
 {
-    return m_contention[tStates];
+    load(address, buffer.data(), buffer.size());
 }
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -289,7 +536,7 @@ void Spectrum::ioContend(u16 port, TState delay, int num, TState& t)
     }
 }
 
-u8 Spectrum::in(u16 port, TState& t)
+u8 Spectrum::readPort(u16 port, TState& t)
 {
     u8 x = 0;
     bool isUlaPort = ((port & 1) == 0);
@@ -299,7 +546,7 @@ u8 Spectrum::in(u16 port, TState& t)
     //
     if (isContended(port))
     {
-        contend(port, 1, 1, t);
+        ioContend(port, 1, 1, t);
     }
     else
     {
@@ -311,13 +558,13 @@ u8 Spectrum::in(u16 port, TState& t)
     //
     if (isUlaPort)
     {
-        contend(port, 3, 1, t);
+        ioContend(port, 3, 1, t);
     }
     else
     {
         if (isContended(port))
         {
-            contend(port, 1, 3, t);
+            ioContend(port, 1, 3, t);
         }
         else
         {
@@ -332,6 +579,8 @@ u8 Spectrum::in(u16 port, TState& t)
     Reg p(port);
     if (isUlaPort)
     {
+        if (t < getFrameTime()) updateTape(t);
+
         x = 0xff;
         u8 row = p.h;
         for (int i = 0; i < 8; ++i)
@@ -363,14 +612,14 @@ u8 Spectrum::in(u16 port, TState& t)
     return x;
 }
 
-void Spectrum::out(u16 port, u8 x, TState& t)
+void Spectrum::writePort(u16 port, u8 x, TState& t)
 {
     //
     // Early contention
     //
     if (isContended(port))
     {
-        contend(port, 1, 1, t);
+        ioContend(port, 1, 1, t);
     }
     else
     {
@@ -384,6 +633,13 @@ void Spectrum::out(u16 port, u8 x, TState& t)
     //
     if (isUlaPort)
     {
+        // Draw and play everything up to now before the border and speaker change.  Anything past the end of the frame
+        // is dealt with when the frame completes.
+        if (t < getFrameTime())
+        {
+            updateVideo(t);
+            updateBeeper(t);
+        }
         m_borderColour = x & 7;
         m_speaker = (x & 0x10) ? 1 : 0;
     }
@@ -393,13 +649,13 @@ void Spectrum::out(u16 port, u8 x, TState& t)
     //
     if (isUlaPort)
     {
-        contend(port, 3, 1, t);
+        ioContend(port, 3, 1, t);
     }
     else
     {
         if (isContended(port))
         {
-            contend(port, 1, 3, t);
+            ioContend(port, 1, 3, t);
         }
         else
         {
@@ -414,9 +670,6 @@ void Spectrum::out(u16 port, u8 x, TState& t)
 
 void Spectrum::initVideo()
 {
-    m_videoTexture.create(kWindowWidth, kWindowHeight);
-    m_videoSprite.setTexture(m_videoTexture);
-
     m_videoMap.resize(getFrameTime());
 
     // Start of display area is 14336.  We wait 4 t-states before we draw 8 pixels.  The left border is 24 pixels wide.
@@ -515,16 +768,14 @@ void Spectrum::initVideo()
 
 void Spectrum::renderVideo()
 {
-    TState t = m_tState;
-    m_tState = 69888;
-    updateVideo();
-    m_tState = t;
+    updateVideo(getFrameTime());
 }
 
-void Spectrum::updateVideo()
+void Spectrum::updateVideo(TState t)
 {
+    ProfileTimer timer(m_profile ? &m_profile->video : nullptr);
     bool flash = (m_frameCounter & 16) != 0;
-    TState tState = m_tState;
+    TState tState = t;
 
     static const u32 colours[16] =
     {
@@ -602,7 +853,7 @@ void Spectrum::updateVideo()
         m_drawTState += 4;
     } // for numbytes
 
-    if (m_tState >= getFrameTime())
+    if (t >= getFrameTime())
     {
         m_videoWrite = 0;
         m_drawTState = m_startTState;
@@ -611,58 +862,185 @@ void Spectrum::updateVideo()
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-// Breakpoints
+// Regression testing
 //----------------------------------------------------------------------------------------------------------------------
 
-vector<Spectrum::Breakpoint>::iterator Spectrum::findBreakpoint(u16 address)
+u64 Spectrum::hashFrame() const
 {
-    for (auto it = m_breakpoints.begin(); it != m_breakpoints.end(); ++it)
-    {
-        if (it->address == address) return it;
-    }
+    return hash64(m_image, kWindowWidth * kWindowHeight * sizeof(u32));
+}
 
-    return m_breakpoints.end();
+u64 Spectrum::hashRam() const
+{
+    return hash64(m_ram.data() + 0x4000, 0xc000);
+}
+
+bool Spectrum::saveFrame(const string& fileName) const
+{
+    return stbi_write_png(fileName.c_str(), kWindowWidth, kWindowHeight, 4, m_image, kWindowWidth * sizeof(u32)) != 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Coverage
+//----------------------------------------------------------------------------------------------------------------------
+
+void Spectrum::setCoverage(bool enabled)
+{
+    // The bus reports every address as contended while coverage is on, so that the Z80 sends every access through
+    // it.  Recompiled blocks have the old answer built in.
+    m_coverageEnabled = enabled;
+    m_z80.flushBlocks();
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Breakpoints
+//----------------------------------------------------------------------------------------------------------------------
+
+void Spectrum::setBreakpointFlags(u16 address, u8 flags)
+{
+    m_numBreakpoints += (flags ? 1 : 0) - (m_breakpoints[address] ? 1 : 0);
+    m_breakpoints[address] = flags;
 }
 
 void Spectrum::toggleBreakpoint(u16 address)
 {
-    auto it = findBreakpoint(address);
-    if (it == m_breakpoints.end())
+    if (m_breakpoints[address])
     {
-        m_breakpoints.emplace_back(Breakpoint{ BreakpointType::User, address });
+        setBreakpointFlags(address, 0);
+        m_breakConditions.erase(address);
     }
     else
     {
-        m_breakpoints.erase(it);
+        setBreakpointFlags(address, kUserBreakpoint);
     }
 }
 
+// A user breakpoint at the same place may have a condition that isn't true, so it gets the flag too.
 void Spectrum::addTemporaryBreakpoint(u16 address)
 {
-    auto it = findBreakpoint(address);
-    if (it == m_breakpoints.end())
-    {
-        m_breakpoints.emplace_back(Breakpoint{ BreakpointType::Temporary, address });
-    }
+    setBreakpointFlags(address, m_breakpoints[address] | kTemporaryBreakpoint);
+}
+
+bool Spectrum::hasBreakpoints() const
+{
+#if NX_CALL_STACK
+    if (m_returnBreakpoint >= 0) return true;
+#endif
+    return m_numBreakpoints != 0;
 }
 
+// Called after every instruction while there are breakpoints.
 bool Spectrum::shouldBreak(u16 address)
 {
-    if (m_breakpoints.size() == 0) return false;
-    auto it = findBreakpoint(address);
-    bool result = it != m_breakpoints.end();
-    if (result && (it->type == BreakpointType::Temporary))
+#if NX_CALL_STACK
+    if (m_returnBreakpoint >= 0)
     {
-        m_breakpoints.erase(it);
+        // Without a call stack to follow, there is nothing to wait for.
+        const CallStack* callStack = m_z80.getCallStack();
+        if (!callStack || callStack->hasReturned(u16(m_returnBreakpoint)))
+        {
+            m_returnBreakpoint = -1;
+            return true;
+        }
     }
+#endif
 
-    return result;
+    const u8 flags = m_breakpoints[address];
+    if (!flags) return false;
+
+    // Temporary breakpoints go once they've been hit, whatever the condition of a user breakpoint at the same place.
+    if (flags & kTemporaryBreakpoint)
+    {
+        setBreakpointFlags(address, flags & ~kTemporaryBreakpoint);
+        return true;
+    }
+
+    // The condition is only looked up here, so that an address without one costs nothing extra.
+    return !(flags & kConditionalBreakpoint) || m_breakConditions[address].evaluate(*this);
 }
 
 bool Spectrum::hasUserBreakpointAt(u16 address)
 {
-    auto it = findBreakpoint(address);
-    return (it != m_breakpoints.end() && it->type == BreakpointType::User);
+    return (m_breakpoints[address] & kUserBreakpoint) != 0;
+}
+
+bool Spectrum::setBreakpointCondition(u16 address, const string& condition, string& error)
+{
+    Condition& c = m_breakConditions[address];
+    if (!c.compile(condition, error))
+    {
+        if (c.isEmpty()) m_breakConditions.erase(address);
+        return false;
+    }
+
+    u8 flags = m_breakpoints[address] | kUserBreakpoint;
+    if (c.isEmpty())
+    {
+        m_breakConditions.erase(address);
+        flags &= ~kConditionalBreakpoint;
+    }
+    else
+    {
+        flags |= kConditionalBreakpoint;
+    }
+    setBreakpointFlags(address, flags);
+    return true;
+}
+
+string Spectrum::getBreakpointCondition(u16 address) const
+{
+    auto it = m_breakConditions.find(address);
+    return it == m_breakConditions.end() ? string() : it->second.getText();
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// IExternals interface
+// Forwards to the 48K bus, which the emulated Z80 uses directly.
+//----------------------------------------------------------------------------------------------------------------------
+
+u8 Spectrum::peek(u16 address)
+{
+    return Spectrum48Bus(*this).peek(address);
+}
+
+u8 Spectrum::peek(u16 address, TState& t)
+{
+    return Spectrum48Bus(*this).peek(address, t);
+}
+
+u16 Spectrum::peek16(u16 address, TState& t)
+{
+    return Spectrum48Bus(*this).peek16(address, t);
+}
+
+void Spectrum::poke(u16 address, u8 x, TState& t)
+{
+    Spectrum48Bus(*this).poke(address, x, t);
+}
+
+void Spectrum::poke16(u16 address, u16 x, TState& t)
+{
+    Spectrum48Bus(*this).poke16(address, x, t);
+}
+
+void Spectrum::contend(u16 address, TState delay, int num, TState& t)
+{
+    Spectrum48Bus(*this).contend(address, delay, num, t);
+}
+
+u8 Spectrum::fetch(u16 address, TState& t)
+{
+    return Spectrum48Bus(*this).fetch(address, t);
+}
+
+u8 Spectrum::in(u16 port, TState& t)
+{
+    return readPort(port, t);
+}
+
+void Spectrum::out(u16 port, u8 x, TState& t)
+{
+    writePort(port, x, t);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
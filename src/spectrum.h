@@ -6,12 +6,14 @@
 
 #include "types.h"
 #include "config.h"
+#include "condition.h"
 #include "z80.h"
-#include "audio.h"
-
-#include <SFML/Graphics.hpp>
+#include "beeper.h"
+#include "eventqueue.h"
 
+#include <algorithm>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -23,6 +25,46 @@ struct SpectrumConfig
     u32*        image;
 };
 
+//----------------------------------------------------------------------------------------------------------------------
+// Profile
+// Wall-clock seconds spent in each part of the machine while a profile is attached.  Whatever update() spends outside
+// video, tape and beeper is the CPU and event handling.
+//----------------------------------------------------------------------------------------------------------------------
+
+struct SpectrumProfile
+{
+    double      total;      // All of update()
+    double      video;      // updateVideo()
+    double      tape;       // Tape::play()
+    double      beeper;     // Beeper::update()
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+// Coverage
+// A bit per byte of the address space for each kind of access, set while coverage is switched on.  Only opcode
+// fetches (including prefixes) count as execution, so operands and displacements are marked as reads.
+//----------------------------------------------------------------------------------------------------------------------
+
+struct Coverage
+{
+    enum class Access
+    {
+        Executed,
+        Read,
+        Written,
+
+        COUNT
+    };
+
+    Coverage() { clear(); }
+
+    void clear() { for (auto& map : bits) fill(begin(map), end(map), 0); }
+    void mark(Access access, u16 address) { bits[(int)access][address >> 3] |= u8(1 << (address & 7)); }
+    bool test(Access access, u16 address) const { return (bits[(int)access][address >> 3] >> (address & 7)) & 1; }
+
+    u8          bits[(int)Access::COUNT][65536 / 8];
+};
+
 //----------------------------------------------------------------------------------------------------------------------
 // Keyboard keys
 //----------------------------------------------------------------------------------------------------------------------
@@ -53,24 +95,60 @@ enum class RunMode
     StepOver,   // Step over a single instruction, and run a subroutine CALL till it returns to following instruction.
 };
 
+class Tape;
+class Spectrum;
+
+//----------------------------------------------------------------------------------------------------------------------
+// 48K bus
+// Concrete bus policy for the Z80.  Memory and contention are handled inline so they compile into the instruction
+// handlers; port I/O is passed on to the Spectrum.
+//----------------------------------------------------------------------------------------------------------------------
+
+class Spectrum48Bus
+{
+public:
+    Spectrum48Bus(Spectrum& speccy) : m_speccy(speccy) {}
+
+    u8              peek                (u16 address);
+    u8              peek                (u16 address, TState& t);
+    u16             peek16              (u16 address, TState& t);
+    void            poke                (u16 address, u8 x, TState& t);
+    void            poke16              (u16 address, u16 x, TState& t);
+    void            contend             (u16 address, TState delay, int num, TState& t);
+    u8              fetch               (u16 address, TState& t);
+    u8              in                  (u16 port, TState& t);
+    void            out                 (u16 port, u8 x, TState& t);
+    const u32*      pageGenerations     ();
+    bool            isContended         (u16 address);
+    const u8*       readDirect          (u16 address, int length);
+    u8*             writeDirect         (u16 address, int length);
+
+private:
+    Spectrum&       m_speccy;
+};
+
 //----------------------------------------------------------------------------------------------------------------------
 // Spectrum base class
 // Each model must override this and implement the specifics
 //----------------------------------------------------------------------------------------------------------------------
 
-class Tape;
-
 class Spectrum: public IExternals
 {
+    friend class Spectrum48Bus;
+
 public:
     // TState counter
     using TState        = i64;
 
+    // CPU type, bound to this machine's bus
+    using CPU           = Z80<Spectrum48Bus>;
+
     //------------------------------------------------------------------------------------------------------------------
     // Construction/Destruction
     //------------------------------------------------------------------------------------------------------------------
 
-    Spectrum(function<void()> frameFunc);
+    // The audio sink is optional, and can be null for a machine that runs without sound.
+    Spectrum(IAudioSink* audioSink);
     virtual ~Spectrum();
 
     //------------------------------------------------------------------------------------------------------------------
@@ -83,12 +161,11 @@ public:
     // State
     //------------------------------------------------------------------------------------------------------------------
 
-    sf::Sprite&     getVideoSprite      ();
+    const u32*      getFrameBuffer      () const { return m_image; }    // kWindowWidth x kWindowHeight, RGBA bytes
     TState          getFrameTime        () const { return 69888; }
     u8              getBorderColour     () const { return m_borderColour; }
-    Z80&            getZ80              () { return m_z80; }
+    CPU&            getZ80              () { return m_z80; }
     TState          getTState           () { return m_tState;}
-    Audio&          getAudio            () { return m_audio; }
     Tape*           getTape             () { return m_tape; }
 
     //------------------------------------------------------------------------------------------------------------------
@@ -101,8 +178,10 @@ public:
     void            poke                (u16 address, u8 x, TState& t) override;
     void            poke16              (u16 address, u16 x, TState& t) override;
     void            contend             (u16 address, TState delay, int num, TState& t) override;
+    u8              fetch               (u16 address, TState& t) override;
     u8              in                  (u16 port, TState& t) override;
     void            out                 (u16 port, u8 x, TState& t) override;
+    const u32*      pageGenerations     () override { return m_pageGenerations; }
 
     //------------------------------------------------------------------------------------------------------------------
     // General functionality, not specific to a model
@@ -122,23 +201,35 @@ public:
     void            setBorderColour     (u8 borderColour);
 
     // Reset the tState counter
-    void            resetTState         () { m_tState = 0; }
+    void            resetTState         () { m_tState = m_tapeTState = 0; }
 
     // Set the tState counter
-    void            setTState           (TState t) { m_tState = t;}
+    void            setTState           (TState t) { m_tState = m_tapeTState = t; }
 
     // Set the tape, it will be played if not stopped.
     void            setTape             (Tape* tape) { m_tape = tape;}
 
+    // Enable skipping over busy-wait loops that can't change anything until the next interrupt.
+    void            setIdleSkip         (bool enabled) { m_idleSkip = enabled; }
+
     // Render all video, irregardless of t-state.
     void            renderVideo         ();
 
+    // Start accumulating timings into profile, or stop if it's null.  Costs nothing noticeable when off.
+    void            setProfile          (SpectrumProfile* profile) { m_profile = profile; }
+
+    // Start or stop marking the bytes that are executed, read and written.  Cheap enough to leave on, but stops the
+    // Z80 moving memory in bulk.  The marks are kept when it is switched off.
+    void            setCoverage         (bool enabled);
+    bool            isCoverageEnabled   () const { return m_coverageEnabled; }
+    Coverage&       getCoverage         () { return m_coverage; }
+
     //------------------------------------------------------------------------------------------------------------------
     // Memory interface
     //------------------------------------------------------------------------------------------------------------------
 
-    bool            isContended         (u16 addr) const;
-    TState          contention          (TState t);
+    bool            isContended         (u16 addr) const { return ((addr & 0xc000) == 0x4000); }
+    TState          contention          (TState t) { return m_contention[t]; }
     void            poke                (u16 address, u8 x);
     void            load                (u16 address, const vector<u8>& buffer);
     void            load                (u16 address, const void* buffer, i64 size);
@@ -157,6 +248,17 @@ public:
     void            setKempstonState(u8 state);
     u8              getKempstonState() const;
 
+    //------------------------------------------------------------------------------------------------------------------
+    // Regression testing
+    //------------------------------------------------------------------------------------------------------------------
+
+    // Stable 64-bit hashes of the current frame and of RAM ($4000-$ffff), for comparing against known good runs.
+    u64             hashFrame           () const;
+    u64             hashRam             () const;
+
+    // Write the current frame to a PNG file.
+    bool            saveFrame           (const string& fileName) const;
+
     //------------------------------------------------------------------------------------------------------------------
     // Debugger interface
     //------------------------------------------------------------------------------------------------------------------
@@ -165,51 +267,106 @@ public:
     void            addTemporaryBreakpoint  (u16 address);
     bool            hasUserBreakpointAt     (u16 address);
 
+    // Only stop at the breakpoint at address, which is added if it isn't there, when the condition holds.  An empty
+    // condition makes it unconditional again.  Returns false, with the reason in error, if the condition doesn't
+    // compile.  See condition.h for the syntax.
+    bool            setBreakpointCondition  (u16 address, const string& condition, string& error);
+    string          getBreakpointCondition  (u16 address) const;
+#if NX_CALL_STACK
+    // Stop once the call whose return address was pushed at sp has returned, as followed by the Z80's call stack.
+    void            addReturnBreakpoint     (u16 sp) { m_returnBreakpoint = sp; }
+#endif
+
 private:
     //
     // Memory
     //
     void            initMemory          ();
 
+    //
+    // I/O
+    //
+    u8              readPort            (u16 port, TState& t);
+    void            writePort           (u16 port, u8 x, TState& t);
+
     //
     // Video
     //
     void            initVideo           ();
-    void            updateVideo         ();
+    void            updateVideo         (TState t);
 
     //
     // Tape
     //
-    void            updateTape          (TState numTStates);
+    void            updateTape          (TState tState);
+
+    //
+    // Audio
+    //
+    void            updateBeeper        (TState t);
+
+    //
+    // Bring video, tape and beeper up to the current t-state
+    //
+    void            updatePeripherals   ();
+
+    //
+    // Events
+    //
+    void            initEvents          ();
+    bool            processEvents       ();     // Returns true if the frame completed
 
     //
     // Breakpoints
+    // Each address has its own breakpoint flags, so that looking for a breakpoint after an instruction is a single load
+    // and branch.  When paging arrives, each bank will need a table of its own, with this one following what is paged
+    // in.
     //
-    enum class BreakpointType
+    enum BreakpointFlags : u8
     {
-        User,       // User added breakpoint, only user can remove it
-        Temporary,  // System added breakpoint, and it should be removed when hit.
+        kUserBreakpoint         = 0x01,     // User added breakpoint, only user can remove it
+        kTemporaryBreakpoint    = 0x02,     // System added breakpoint, and it should be removed when hit.
+        kConditionalBreakpoint  = 0x04,     // User breakpoint with a condition in m_breakConditions
     };
 
-    struct Breakpoint
+    void            setBreakpointFlags      (u16 address, u8 flags);
+    bool            hasBreakpoints          () const;
+    bool            shouldBreak             (u16 address);
+
+    //
+    // Idle loops
+    // A loop that goes round without writing anything new to memory or touching a port, and comes back to the same
+    // registers, will do the same again on every pass until an interrupt.  Once such a pass has been run, the rest
+    // just have their timing replayed from the contended accesses recorded during it.
+    //
+    struct IdleTrace
     {
-        BreakpointType  type;
-        u16             address;
+        struct Access
+        {
+            TState  gap;        // Uncontended t-states since the previous contended access finished
+            TState  delay;      // Length of the access, not counting contention
+        };
+
+        vector<Access>  accesses;
+        TState          last;           // When the last contended access finished
+        TState          tail;           // Uncontended t-states after the last contended access
+        bool            sideEffects;    // Memory changed, or a port was accessed
     };
 
-    vector<Breakpoint>::iterator    findBreakpoint          (u16 address);
-    bool                            shouldBreak             (u16 address);
+    int             idleLoopSize        (u16 address);
+    bool            skipIdleLoop        (TState limit);
+    bool            stepTo              (u16 address, TState limit);
+    void            recordIdleAccess    (TState t, TState delay);     // Kept out of line, away from the bus
 
 
 private:
 
     // Clock state
     TState          m_tState;
+    EventQueue      m_events;
 
     // Video state
     u32*            m_image;
-    sf::Texture     m_videoTexture;
-    sf::Sprite      m_videoSprite;
     u8              m_frameCounter;
     vector<u16>     m_videoMap;         // Maps t-states to addresses
     int             m_videoWrite;       // Write point into 2D image array
@@ -217,16 +374,18 @@ private:
     TState          m_drawTState;       // Current t-state that has been draw to
 
     // Audio state
-    Audio           m_audio;
+    Beeper          m_beeper;
     Tape*           m_tape;
+    TState          m_tapeTState;       // T-state the tape has been played up to
 
     // Memory state
     vector<u8>      m_ram;
     vector<u8>      m_contention;
     bool            m_romWritable;
+    u32             m_pageGenerations[256];     // Bumped on every write to each 256-byte page
 
     // CPU state
-    Z80             m_z80;
+    CPU             m_z80;
 
     // ULA state
     u8              m_borderColour;
@@ -235,9 +394,141 @@ private:
     u8              m_tapeEar;
 
     // Debugger state
-    vector<Breakpoint>  m_breakpoints;
+    u8                              m_breakpoints[65536];   // BreakpointFlags for each address
+    int                             m_numBreakpoints;       // Number of addresses with any flags
+    unordered_map<u16, Condition>   m_breakConditions;      // For the addresses with kConditionalBreakpoint
+#if NX_CALL_STACK
+    int                             m_returnBreakpoint;     // SP of the frame to step out of, or -1
+#endif
 
     // Kempston
     bool            m_kempstonJoystick;
     u8              m_kempstonState;
+
+    // Profiling
+    SpectrumProfile*    m_profile;
+
+    // Coverage
+    bool            m_coverageEnabled;
+    Coverage        m_coverage;
+
+    // Idle loop state
+    bool            m_idleSkip;
+    bool            m_idleCheckDue;     // Set once per scanline, so that looking for loops costs little
+    bool            m_idleTracing;      // Set while a pass of a possible idle loop is being recorded
+    IdleTrace       m_idleTrace;
+    u16             m_idleRejectAddress;
+    u8              m_idleRejectFrame;  // Don't try the same loop again until the next frame
 };
+
+//----------------------------------------------------------------------------------------------------------------------
+// 48K bus implementation
+//----------------------------------------------------------------------------------------------------------------------
+
+inline u8 Spectrum48Bus::peek(u16 address)
+{
+    return m_speccy.m_ram[address];
+}
+
+inline u8 Spectrum48Bus::peek(u16 address, TState& t)
+{
+    contend(address, 3, 1, t);
+    if (m_speccy.m_coverageEnabled) m_speccy.m_coverage.mark(Coverage::Access::Read, address);
+    return peek(address);
+}
+
+inline u16 Spectrum48Bus::peek16(u16 address, TState& t)
+{
+    return peek(address, t) + 256 * peek(address + 1, t);
+}
+
+inline void Spectrum48Bus::poke(u16 address, u8 x, TState& t)
+{
+    contend(address, 3, 1, t);
+    if (address < 0x5b00)
+    {
+        if (address < 0x4000)
+        {
+            if (!m_speccy.m_romWritable) return;
+        }
+        else if (t < m_speccy.getFrameTime())
+        {
+            // Screen write, so draw everything up to now with the old contents.
+            m_speccy.updateVideo(t);
+        }
+    }
+    if (m_speccy.m_idleTracing && m_speccy.m_ram[address] != x) m_speccy.m_idleTrace.sideEffects = true;
+    if (m_speccy.m_coverageEnabled) m_speccy.m_coverage.mark(Coverage::Access::Written, address);
+    m_speccy.m_ram[address] = x;
+    ++m_speccy.m_pageGenerations[address >> 8];
+}
+
+inline void Spectrum48Bus::poke16(u16 address, u16 x, TState& t)
+{
+    Reg r(x);
+    poke(address, r.l, t);
+    poke(address + 1, r.h, t);
+}
+
+inline void Spectrum48Bus::contend(u16 address, TState delay, int num, TState& t)
+{
+    if (m_speccy.isContended(address))
+    {
+        for (int i = 0; i < num; ++i)
+        {
+            if (m_speccy.m_idleTracing) m_speccy.recordIdleAccess(t, delay);
+            t += m_speccy.contention(t) + delay;
+        }
+    }
+    else
+    {
+        t += delay * num;
+    }
+}
+
+inline u8 Spectrum48Bus::fetch(u16 address, TState& t)
+{
+    contend(address, 4, 1, t);
+    if (m_speccy.m_coverageEnabled) m_speccy.m_coverage.mark(Coverage::Access::Executed, address);
+    return peek(address);
+}
+
+inline u8 Spectrum48Bus::in(u16 port, TState& t)
+{
+    if (m_speccy.m_idleTracing) m_speccy.m_idleTrace.sideEffects = true;
+    return m_speccy.readPort(port, t);
+}
+
+inline void Spectrum48Bus::out(u16 port, u8 x, TState& t)
+{
+    if (m_speccy.m_idleTracing) m_speccy.m_idleTrace.sideEffects = true;
+    m_speccy.writePort(port, x, t);
+}
+
+inline const u32* Spectrum48Bus::pageGenerations()
+{
+    return m_speccy.m_pageGenerations;
+}
+
+inline bool Spectrum48Bus::isContended(u16 address)
+{
+    // Coverage has to see every access.
+    return m_speccy.isContended(address) || m_speccy.m_coverageEnabled;
+}
+
+inline const u8* Spectrum48Bus::readDirect(u16 address, int length)
+{
+    // The ROM and the top 32K are never contended.
+    const int end = address + length;
+    if (end > 0x10000 || (address < 0x8000 && end > 0x4000) || m_speccy.m_coverageEnabled) return nullptr;
+    return m_speccy.m_ram.data() + address;
+}
+
+inline u8* Spectrum48Bus::writeDirect(u16 address, int length)
+{
+    // Only the top 32K can be written without contention, video updates or ROM protection getting involved.
+    const int end = address + length;
+    if (address < 0x8000 || end > 0x10000 || m_speccy.m_coverageEnabled) return nullptr;
+    for (int page = address >> 8; page <= (end - 1) >> 8; ++page) ++m_speccy.m_pageGenerations[page];
+    return m_speccy.m_ram.data() + address;
+}
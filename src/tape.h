@@ -7,8 +7,6 @@
 #include "config.h"
 #include "types.h"
 
-#include "ui.h"
-
 #include <string>
 #include <vector>
 
@@ -34,28 +32,35 @@ public:
         Block,
     };
 
+    struct ProgramHeader
+    {
+        u16     autoStartLine;
+        u16     programLength;
+        u16     variableOffset;
+    };
+
+    struct ArrayHeader
+    {
+        char    variableName;
+        u16     arrayLength;
+    };
+
+    struct BytesHeader
+    {
+        u16     startAddress;
+        u16     dataLength;
+    };
+
     struct Header
     {
         string      fileName;
         BlockType   type;
 
+        // Standard C++ doesn't allow types to be declared inside an anonymous union, so they live above.
         union {
-            struct ProgramHeader
-            {
-                u16     autoStartLine;
-                u16     programLength;
-                u16     variableOffset;
-            } p;
-            struct ArrayHeader
-            {
-                char    variableName;
-                u16     arrayLength;
-            } a;
-            struct BytesHeader
-            {
-                u16     startAddress;
-                u16     dataLength;
-            } b;
+            ProgramHeader   p;
+            ArrayHeader     a;
+            BytesHeader     b;
         };
 
         u8      checkSum;
@@ -87,6 +92,9 @@ public:
 
     bool isPlaying() const { return m_state != State::Stopped; }
 
+    // Number of t-states until the EAR signal next changes, or the tape moves to its next state.
+    TState nextEdge() const;
+
 private:
     // Returns true if end of block
     bool nextBit();
@@ -113,56 +121,12 @@ private:
     int         m_index;
     int         m_bitIndex;
     int         m_counter;
-};
-
-//----------------------------------------------------------------------------------------------------------------------
-// TapeWindow
-//----------------------------------------------------------------------------------------------------------------------
 
-class TapeWindow final : public Window
-{
-public:
-    TapeWindow(Nx& nx);
-
-    void reset();
-    void setTape(Tape *tape)    { m_tape = tape; reset(); m_tape->selectBlock(0); }
-    void ejectTape()            { m_tape = nullptr; reset(); }
-
-protected:
-    void onDraw(Draw& draw) override;
-    void onKey(sf::Keyboard::Key key, bool shift, bool ctrl, bool alt) override;
-    void onText(char ch) override;
-
-private:
-    int m_topIndex;
-    int m_index;
-    Tape* m_tape;
-};
-
-//----------------------------------------------------------------------------------------------------------------------
-// A tape-browser overlay
-// Contains a single tape, and allows controls
-//----------------------------------------------------------------------------------------------------------------------
-
-class TapeBrowser final : public Overlay
-{
-public:
-    TapeBrowser(Nx& nx);
-
-    Tape* loadTape(const vector<u8>& data);
-
-protected:
-    void render(Draw& draw) override;
-    void key(sf::Keyboard::Key key, bool down, bool shift, bool ctrl, bool alt) override;
-    void text(char ch) override;
-    const vector<string>& commands() const override;
-
-private:
-    TapeWindow      m_window;
-    vector<string>  m_commands;
-    Tape*           m_currentTape;
+    // Edge logging, for the debug console
+    TState      m_logTStates;
+    u8          m_logLastBit;
+    int         m_logBits;
 };
 
 //----------------------------------------------------------------------------------------------------------------------
 //----------------------------------------------------------------------------------------------------------------------
-
@@ -0,0 +1,262 @@
+//----------------------------------------------------------------------------------------------------------------------
+// Execution trace
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "trace.h"
+
+#if NX_TRACE
+
+#include <chrono>
+#include <cstring>
+
+#ifndef _WIN32
+#   include <fcntl.h>
+#   include <sys/mman.h>
+#   include <unistd.h>
+#endif
+
+//----------------------------------------------------------------------------------------------------------------------
+// Memory-mapped output file
+//----------------------------------------------------------------------------------------------------------------------
+
+TraceFile::TraceFile()
+#ifdef _WIN32
+    : m_file(INVALID_HANDLE_VALUE)
+    , m_mapping(nullptr)
+#else
+    : m_file(-1)
+#endif
+    , m_view(nullptr)
+    , m_viewStart(0)
+    , m_size(0)
+{
+
+}
+
+TraceFile::~TraceFile()
+{
+    close();
+}
+
+bool TraceFile::open(const string& fileName)
+{
+    close();
+
+#ifdef _WIN32
+    m_file = CreateFileA(fileName.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE) return false;
+#else
+    m_file = ::open(fileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (m_file < 0) return false;
+#endif
+
+    m_viewStart = 0;
+    m_size = 0;
+    if (!mapChunk())
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool TraceFile::write(const u8* data, size_t size)
+{
+    while (size)
+    {
+        if (!m_view) return false;
+
+        const u64 offset = m_size - m_viewStart;
+        if (offset == kChunkSize)
+        {
+            unmapChunk();
+            m_viewStart += kChunkSize;
+            if (!mapChunk()) return false;
+            continue;
+        }
+
+        const size_t n = (size_t)min<u64>(size, kChunkSize - offset);
+        memcpy(m_view + offset, data, n);
+        data += n;
+        size -= n;
+        m_size += n;
+    }
+    return true;
+}
+
+void TraceFile::close()
+{
+    unmapChunk();
+
+#ifdef _WIN32
+    if (m_file != INVALID_HANDLE_VALUE)
+    {
+        LARGE_INTEGER size;
+        size.QuadPart = (LONGLONG)m_size;
+        SetFilePointerEx(m_file, size, nullptr, FILE_BEGIN);
+        SetEndOfFile(m_file);
+        CloseHandle(m_file);
+        m_file = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (m_file >= 0)
+    {
+        // Cut off the unused end of the last chunk.
+        int result = ftruncate(m_file, (off_t)m_size);
+        NX_ASSERT(result == 0);
+        (void)result;
+        ::close(m_file);
+        m_file = -1;
+    }
+#endif
+}
+
+// Make the file big enough for the chunk at m_viewStart and map it in.
+bool TraceFile::mapChunk()
+{
+    const u64 end = m_viewStart + kChunkSize;
+
+#ifdef _WIN32
+    m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READWRITE, DWORD(end >> 32), DWORD(end), nullptr);
+    if (!m_mapping) return false;
+    m_view = (u8 *)MapViewOfFile(m_mapping, FILE_MAP_WRITE, DWORD(m_viewStart >> 32), DWORD(m_viewStart),
+        (SIZE_T)kChunkSize);
+#else
+    if (ftruncate(m_file, (off_t)end) != 0) return false;
+    void* p = mmap(nullptr, kChunkSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_file, (off_t)m_viewStart);
+    m_view = (p == MAP_FAILED) ? nullptr : (u8 *)p;
+#endif
+
+    return m_view != nullptr;
+}
+
+void TraceFile::unmapChunk()
+{
+#ifdef _WIN32
+    if (m_view) UnmapViewOfFile(m_view);
+    if (m_mapping) CloseHandle(m_mapping);
+    m_mapping = nullptr;
+#else
+    if (m_view) munmap(m_view, kChunkSize);
+#endif
+    m_view = nullptr;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Recorder
+//----------------------------------------------------------------------------------------------------------------------
+
+TraceRecorder::TraceRecorder(size_t bufferSize)
+    : m_head(0)
+    , m_tail(0)
+    , m_tState(0)
+    , m_dropped(false)
+    , m_numRecords(0)
+    , m_numDropped(0)
+    , m_stopping(false)
+    , m_failed(false)
+    , m_recording(false)
+{
+    size_t size = 1024;
+    while (size < bufferSize) size *= 2;
+    m_buffer.resize(size);
+    m_mask = size - 1;
+    for (u16& r : m_registers) r = 0;
+}
+
+TraceRecorder::~TraceRecorder()
+{
+    stop();
+}
+
+bool TraceRecorder::start(const string& fileName, TState tState, const u16* registers)
+{
+    stop();
+    if (!m_file.open(fileName)) return false;
+
+    u8 header[16 + kTraceNumRegs * 2] = { 'N', 'X', 'T', 'R' };
+    int n = 4;
+    header[n++] = u8(kTraceVersion);
+    header[n++] = u8(kTraceVersion >> 8);
+    header[n++] = u8(kTraceNumRegs);
+    header[n++] = 0;
+    for (int i = 0; i < 8; ++i) header[n++] = u8(u64(tState) >> (i * 8));
+    for (int i = 0; i < kTraceNumRegs; ++i)
+    {
+        header[n++] = u8(registers[i]);
+        header[n++] = u8(registers[i] >> 8);
+        m_registers[i] = registers[i];
+    }
+    if (!m_file.write(header, n))
+    {
+        m_file.close();
+        return false;
+    }
+
+    m_head = 0;
+    m_tail = 0;
+    m_tState = tState;
+    m_dropped = false;
+    m_numRecords = 0;
+    m_numDropped = 0;
+    m_stopping = false;
+    m_failed = false;
+    m_writer = thread(&TraceRecorder::writerLoop, this);
+    m_recording = true;
+    return true;
+}
+
+void TraceRecorder::stop()
+{
+    if (!m_recording) return;
+
+    m_stopping = true;
+    m_writer.join();
+    m_file.close();
+    m_recording = false;
+}
+
+// Copies whatever has been recorded to the file, and only sleeps when there is nothing to copy.  Once asked to stop,
+// it empties the buffer first.  A failed write ends it early, since the file is no use after a gap.
+void TraceRecorder::writerLoop()
+{
+    for (;;)
+    {
+        const bool stopping = m_stopping.load(memory_order_acquire);
+        const u64 head = m_head.load(memory_order_acquire);
+        const u64 tail = m_tail.load(memory_order_relaxed);
+
+        if (head != tail)
+        {
+            if (!writeOut(tail, head))
+            {
+                m_failed.store(true, memory_order_relaxed);
+                break;
+            }
+            m_tail.store(head, memory_order_release);
+        }
+        else if (stopping)
+        {
+            break;
+        }
+        else
+        {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+    }
+}
+
+bool TraceRecorder::writeOut(u64 from, u64 to)
+{
+    const size_t start = size_t(from & m_mask);
+    const size_t size = size_t(to - from);
+    const size_t first = min(size, m_buffer.size() - start);
+
+    return m_file.write(&m_buffer[start], first) && m_file.write(&m_buffer[0], size - first);
+}
+
+#endif // NX_TRACE
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
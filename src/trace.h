@@ -0,0 +1,241 @@
+//----------------------------------------------------------------------------------------------------------------------
+// Execution trace
+// Records every instruction the Z80 runs to a file.  The emulation thread only appends compact records to a ring
+// buffer in memory; a writer thread copies them out to a memory-mapped file.  If the writer falls behind, records are
+// dropped rather than stalling the emulation.
+//----------------------------------------------------------------------------------------------------------------------
+
+#pragma once
+
+#include "config.h"
+#include "types.h"
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+//----------------------------------------------------------------------------------------------------------------------
+// File format
+// All values are little-endian.  The file starts with a header:
+//
+//      char    magic[4]            "NXTR"
+//      u16     version             kTraceVersion
+//      u16     numRegisters        TraceReg::COUNT
+//      i64     tState              T-state before the first record
+//      u16     registers[]         Register values before the first record, in TraceReg order
+//
+// followed by one record per instruction:
+//
+//      u8      flags               Bits 0-2: number of opcode bytes.  Bit 3: an interrupt was accepted instead.
+//                                  Bit 4: records were dropped before this one.
+//      u16     pc                  Address of the instruction, or of the interrupted instruction
+//      u8      bytes[]             The instruction's opcode and operand bytes
+//      varint  tState              Start T-state, as a zig-zag encoded difference from the previous record's
+//      u16     changed             One bit per register that isn't the value predicted from the previous record
+//      u16     values[]            The new values of those registers, in TraceReg order
+//
+// Registers are predicted to be unchanged, except IR, whose R half is predicted to count the instruction's M1 cycles.
+// Differences are always from the last record written, so dropped records don't stop the rest being decoded.
+//----------------------------------------------------------------------------------------------------------------------
+
+const u16 kTraceVersion = 1;
+
+enum class TraceReg
+{
+    AF, BC, DE, HL,
+    AF_, BC_, DE_, HL_,
+    IX, IY, SP, IR, WZ,
+
+    COUNT
+};
+
+const int kTraceNumRegs = (int)TraceReg::COUNT;
+
+const u8 kTraceLengthMask = 0x07;
+const u8 kTraceInterrupt = 0x08;
+const u8 kTraceDropped = 0x10;
+
+// The IR value expected after an instruction starting with these bytes.
+inline u16 tracePredictIR(u16 ir, const u8* bytes, int numBytes)
+{
+    if (numBytes == 0) return ir;
+
+    const u8 op = bytes[0];
+    const int m1 = (op == 0xcb || op == 0xdd || op == 0xed || op == 0xfd) ? 2 : 1;
+    return u16((ir & 0xff80) | ((ir + m1) & 0x7f));
+}
+
+#if NX_TRACE
+
+//----------------------------------------------------------------------------------------------------------------------
+// Memory-mapped output file
+// Grows a chunk at a time, and is cut back to the bytes written when it is closed.
+//----------------------------------------------------------------------------------------------------------------------
+
+class TraceFile
+{
+public:
+    TraceFile();
+    ~TraceFile();
+
+    TraceFile(const TraceFile&) = delete;
+    TraceFile& operator= (const TraceFile&) = delete;
+
+    bool open(const string& fileName);
+    bool write(const u8* data, size_t size);
+    void close();
+
+    u64 getSize() const { return m_size; }
+
+private:
+    bool mapChunk();
+    void unmapChunk();
+
+private:
+    static const u64 kChunkSize = 64 * 1024 * 1024;
+
+#ifdef _WIN32
+    HANDLE      m_file;
+    HANDLE      m_mapping;
+#else
+    int         m_file;
+#endif
+    u8*         m_view;         // The mapped chunk
+    u64         m_viewStart;    // File offset of the mapped chunk
+    u64         m_size;         // Bytes written
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+// Recorder
+//----------------------------------------------------------------------------------------------------------------------
+
+class TraceRecorder
+{
+public:
+    TraceRecorder(size_t bufferSize = 16 * 1024 * 1024);
+    ~TraceRecorder();
+
+    TraceRecorder(const TraceRecorder&) = delete;
+    TraceRecorder& operator= (const TraceRecorder&) = delete;
+
+    // Open the file, write the header and start the writer thread.
+    bool start(const string& fileName, TState tState, const u16* registers);
+
+    // Write out everything recorded so far and close the file.
+    void stop();
+
+    bool isRecording() const { return m_recording; }
+
+    // Add an instruction.  Called by the Z80 after running it, with the registers as they are now.  Never blocks.
+    void record(u16 pc, const u8* bytes, int numBytes, bool interrupt, TState tState, const u16* registers);
+
+    u64 getNumRecords() const { return m_numRecords; }
+    u64 getNumDropped() const { return m_numDropped; }
+
+    // True once the file couldn't be written.  The writer gives up at that point, and every later record is dropped.
+    bool hasFailed() const { return m_failed.load(memory_order_relaxed); }
+    u64 getFileSize() const { return m_file.getSize(); }
+
+private:
+    static const int kMaxRecordSize = 1 + 2 + 4 + 10 + 2 + kTraceNumRegs * 2;
+
+    void writerLoop();
+    bool writeOut(u64 from, u64 to);
+
+private:
+    // Ring buffer, a power of two in size.  m_head is only written by the emulation thread and m_tail by the writer.
+    vector<u8>          m_buffer;
+    u64                 m_mask;
+    atomic<u64>         m_head;
+    atomic<u64>         m_tail;
+
+    // Emulation thread state
+    u16                 m_registers[kTraceNumRegs];     // As of the last record written
+    TState              m_tState;
+    bool                m_dropped;
+    u64                 m_numRecords;
+    u64                 m_numDropped;
+
+    // Writer thread state
+    TraceFile           m_file;
+    thread              m_writer;
+    atomic<bool>        m_stopping;
+    atomic<bool>        m_failed;
+    bool                m_recording;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+// Recording
+//----------------------------------------------------------------------------------------------------------------------
+
+inline void TraceRecorder::record(u16 pc, const u8* bytes, int numBytes, bool interrupt, TState tState,
+    const u16* registers)
+{
+    if (m_failed.load(memory_order_relaxed))
+    {
+        // Nothing more will reach the file.
+        m_dropped = true;
+        ++m_numDropped;
+        return;
+    }
+
+    u8 rec[kMaxRecordSize];
+    int n = 0;
+
+    rec[n++] = u8(numBytes | (interrupt ? kTraceInterrupt : 0) | (m_dropped ? kTraceDropped : 0));
+    rec[n++] = u8(pc);
+    rec[n++] = u8(pc >> 8);
+    for (int i = 0; i < numBytes; ++i) rec[n++] = bytes[i];
+
+    const i64 dt = tState - m_tState;
+    u64 zz = (u64(dt) << 1) ^ u64(dt >> 63);
+    while (zz >= 0x80)
+    {
+        rec[n++] = u8(zz | 0x80);
+        zz >>= 7;
+    }
+    rec[n++] = u8(zz);
+
+    u16 predicted[kTraceNumRegs];
+    for (int i = 0; i < kTraceNumRegs; ++i) predicted[i] = m_registers[i];
+    predicted[(int)TraceReg::IR] = tracePredictIR(m_registers[(int)TraceReg::IR], bytes, numBytes);
+
+    const int changedAt = n;
+    u16 changed = 0;
+    n += 2;
+    for (int i = 0; i < kTraceNumRegs; ++i)
+    {
+        if (registers[i] != predicted[i])
+        {
+            changed |= u16(1 << i);
+            rec[n++] = u8(registers[i]);
+            rec[n++] = u8(registers[i] >> 8);
+        }
+    }
+    rec[changedAt] = u8(changed);
+    rec[changedAt + 1] = u8(changed >> 8);
+
+    const u64 head = m_head.load(memory_order_relaxed);
+    const u64 tail = m_tail.load(memory_order_acquire);
+    if (m_buffer.size() - (head - tail) < (u64)n)
+    {
+        // The writer is behind.  The next record says so, and is still relative to the last one written.
+        m_dropped = true;
+        ++m_numDropped;
+        return;
+    }
+
+    for (int i = 0; i < n; ++i) m_buffer[(head + i) & m_mask] = rec[i];
+    m_head.store(head + n, memory_order_release);
+
+    for (int i = 0; i < kTraceNumRegs; ++i) m_registers[i] = registers[i];
+    m_tState = tState;
+    m_dropped = false;
+    ++m_numRecords;
+}
+
+#endif // NX_TRACE
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
@@ -4,6 +4,7 @@
 
 #include "ui.h"
 #include "nx.h"
+#include "vram.h"
 
 #include <cassert>
 #include <cstdarg>
@@ -460,48 +461,7 @@ void Ui::render(bool flash)
     //
     // Convert the Ui VRAM into actual renderable pixels
     //
-
-    static const u32 colours[16] =
-    {
-        0xdf000000, 0xdfd70000, 0xdf0000d7, 0xdfd700d7, 0xdf00d700, 0xdfd7d700, 0xdf00d7d7, 0xdfd7d7d7,
-        0xdf000000, 0xdfff0000, 0xdf0000ff, 0xdfff00ff, 0xdf00ff00, 0xdfffff00, 0xdf00ffff, 0xdfffffff,
-    };
-
-    // Convert the pixels and attrs into an image
-    u32* img = m_image;
-    for (int row = 0; row < kUiHeight; ++row)
-    {
-        u8* attrRow = m_attrs.data() + ((row >> 3) * (kUiWidth >> 3));
-        u8* pixelRow = m_pixels.data() + (row * (kUiWidth >> 3));
-
-        for (int col = 0; col < kUiWidth / 8; ++col)
-        {
-            u8 p = *pixelRow++;
-            u8 a = *attrRow++;
-
-            if (0 == a)
-            {
-                for (int bit = 0; bit < 8; ++bit) *img++ = 0x00000000;
-            }
-            else
-            {
-                u8 ink = a & 0x07;
-                u8 paper = (a & 0x38) >> 3;
-                u8 bright = (a & 0x40) >> 3;
-
-                if (flash && ((a & 0x80) != 0))
-                {
-                    swap(ink, paper);
-                }
-
-                for (int bit = 0; bit < 8; ++bit)
-                {
-                    *img++ = (p & 0x80) != 0 ? colours[ink + bright] : colours[paper + bright];
-                    p <<= 1;
-                }
-            }
-        }
-    }
+    convertVram(m_image, m_pixels.data(), m_attrs.data(), flash);
 }
 
 sf::Sprite& Ui::getSprite()
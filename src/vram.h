@@ -0,0 +1,15 @@
+//----------------------------------------------------------------------------------------------------------------------
+// UI VRAM conversion
+// The UI is drawn into a Spectrum-like VRAM: one bit per pixel, and an attribute byte for each 8x8 cell.  An attribute
+// of 0 is fully transparent.  This turns it into a kUiWidth x kUiHeight image to lay over the emulated screen.
+//----------------------------------------------------------------------------------------------------------------------
+
+#pragma once
+
+#include "config.h"
+#include "types.h"
+
+void convertVram(u32* image, const u8* pixels, const u8* attrs, bool flash);
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
@@ -26,22 +26,34 @@
 
 
 #include "z80.h"
+#include "flatbus.h"
+#include "spectrum.h"
 
 #include <algorithm>
 #include <cassert>
+#include <cstddef>
+#include <cstring>
 
-const u8 Z80::kIoIncParityTable[16] = { 0, 0, 1, 0, 0, 1, 0, 1, 1, 0, 1, 1, 0, 1, 1, 0 };
-const u8 Z80::kIoDecParityTable[16] = { 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 1, 0, 1 };
-const u8 Z80::kHalfCarryAdd[8] = { 0, F_HALF, F_HALF, F_HALF, 0, 0, 0, F_HALF };
-const u8 Z80::kHalfCarrySub[8] = { 0, 0, F_HALF, 0, F_HALF, 0, F_HALF, F_HALF };
-const u8 Z80::kOverflowAdd[8] = { 0, 0, 0, F_PARITY, F_PARITY, 0, 0, 0 };
-const u8 Z80::kOverflowSub[8] = { 0, F_PARITY, 0, 0, 0, 0, F_PARITY, 0 };
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__)
+#   include <emmintrin.h>
+#   define NX_Z80_SSE2  1
+#else
+#   define NX_Z80_SSE2  0
+#endif
+
+template <typename Bus> const u8 Z80<Bus>::kIoIncParityTable[16] = { 0, 0, 1, 0, 0, 1, 0, 1, 1, 0, 1, 1, 0, 1, 1, 0 };
+template <typename Bus> const u8 Z80<Bus>::kIoDecParityTable[16] = { 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 1, 0, 1 };
+template <typename Bus> const u8 Z80<Bus>::kHalfCarryAdd[8] = { 0, F_HALF, F_HALF, F_HALF, 0, 0, 0, F_HALF };
+template <typename Bus> const u8 Z80<Bus>::kHalfCarrySub[8] = { 0, 0, F_HALF, 0, F_HALF, 0, F_HALF, F_HALF };
+template <typename Bus> const u8 Z80<Bus>::kOverflowAdd[8] = { 0, 0, 0, F_PARITY, F_PARITY, 0, 0, 0 };
+template <typename Bus> const u8 Z80<Bus>::kOverflowSub[8] = { 0, F_PARITY, 0, 0, 0, 0, F_PARITY, 0 };
 
 //----------------------------------------------------------------------------------------------------------------------
 // Flag manipulation
 //----------------------------------------------------------------------------------------------------------------------
 
-void Z80::setFlags(u8 flags, bool value)
+template <typename Bus>
+void Z80<Bus>::setFlags(u8 flags, bool value)
 {
     if (value)
     {
@@ -53,12 +65,124 @@ void Z80::setFlags(u8 flags, bool value)
     }
 }
 
+#if NX_LAZY_FLAGS
+
+template <typename Bus>
+void Z80<Bus>::deferFlags(FlagOp op, u8 x, u8 y, u16 result)
+{
+    m_flagOp = op;
+    m_flagX = x;
+    m_flagY = y;
+    m_flagResult = result;
+}
+
+// Produces exactly the flags that the eager versions of the instructions below compute.
+template <typename Bus>
+void Z80<Bus>::computeFlags()
+{
+    const u16 t = m_flagResult;
+    const u8 r = (u8)t;
+    const u8 x = (u8)(((m_flagX & 0x88) >> 3) | ((m_flagY & 0x88) >> 2) | ((t & 0x88) >> 1));
+    u8& f = m_af.l;
+
+    switch (m_flagOp)
+    {
+    case FlagOp::None:
+        break;
+
+    case FlagOp::Add:
+        f = ((t & 0x100) ? F_CARRY : 0) | kHalfCarryAdd[x & 0x07] | kOverflowAdd[x >> 4] | m_SZ53[r];
+        break;
+
+    case FlagOp::Sub:
+        f = ((t & 0x100) ? F_CARRY : 0) | F_NEG | kHalfCarrySub[x & 0x07] | kOverflowSub[x >> 4] | m_SZ53[r];
+        break;
+
+    case FlagOp::Cp:
+        f = ((t & 0x100) ? F_CARRY : (t ? 0 : F_ZERO)) | F_NEG | kHalfCarrySub[x & 7] | kOverflowSub[x >> 4] |
+            (m_flagY & (F_3 | F_5)) | (r & F_SIGN);
+        break;
+
+    case FlagOp::And:
+        f = F_HALF | m_SZ53P[r];
+        break;
+
+    case FlagOp::Or:
+        f = m_SZ53P[r];
+        break;
+
+    case FlagOp::Inc:
+        f = m_flagX | ((r == 0x80) ? F_PARITY : 0) | ((r & 0x0f) ? 0 : F_HALF) | m_SZ53[r];
+        break;
+
+    case FlagOp::Dec:
+        f = m_flagX | (((r & 0x0f) == 0x0f) ? F_HALF : 0) | F_NEG | (r == 0x7f ? F_PARITY : 0) | m_SZ53[r];
+        break;
+    }
+
+    m_flagOp = FlagOp::None;
+}
+
+template <typename Bus>
+u8 Z80<Bus>::carryFlag()
+{
+    switch (m_flagOp)
+    {
+    case FlagOp::Add:
+    case FlagOp::Sub:
+    case FlagOp::Cp:    return (m_flagResult >> 8) & F_CARRY;
+    case FlagOp::And:
+    case FlagOp::Or:    return 0;
+    case FlagOp::Inc:
+    case FlagOp::Dec:   return m_flagX;
+    default:            return m_af.l & F_CARRY;
+    }
+}
+
+template <typename Bus>
+bool Z80<Bus>::condition(u8 y)
+{
+    if (m_flagOp != FlagOp::None)
+    {
+        // Zero, carry and sign come straight from the result.  Every pending operation sets Z and S from its 8-bit
+        // result (CP can't borrow and leave zero).  Parity and overflow need the full calculation.
+        switch (y)
+        {
+        case 0: return (u8)m_flagResult != 0;
+        case 1: return (u8)m_flagResult == 0;
+        case 2: return carryFlag() == 0;
+        case 3: return carryFlag() != 0;
+        case 6: return (m_flagResult & 0x80) == 0;
+        case 7: return (m_flagResult & 0x80) != 0;
+        }
+    }
+
+    return getFlag(y, F());
+}
+
+#else
+
+template <typename Bus>
+u8 Z80<Bus>::carryFlag()
+{
+    return F() & F_CARRY;
+}
+
+template <typename Bus>
+bool Z80<Bus>::condition(u8 y)
+{
+    return getFlag(y, F());
+}
+
+#endif // NX_LAZY_FLAGS
+
 //----------------------------------------------------------------------------------------------------------------------
 // Initialisation
 //----------------------------------------------------------------------------------------------------------------------
 
-Z80::Z80(IExternals& ext)
-    : m_ext(ext)
+template <typename Bus>
+Z80<Bus>::Z80(Bus bus)
+    : m_bus(bus)
     , m_halt(false)
     , m_iff1(true)
     , m_iff2(true)
@@ -66,6 +190,22 @@ Z80::Z80(IExternals& ext)
     , m_interrupt(false)
     , m_nmi(false)
     , m_eiHappened(false)
+    , m_repeatLimit(0)
+    , m_dispatch(Dispatch::Table)
+#if NX_PROFILER
+    , m_opcodeProfile(nullptr)
+    , m_hotspotProfile(nullptr)
+#endif
+#if NX_TRACE
+    , m_trace(nullptr)
+#endif
+#if NX_CALL_STACK
+    , m_callStack(nullptr)
+#endif
+#if NX_JIT
+    , m_jitDispatcher(0)
+    , m_jitLeave(0)
+#endif
 {
     restart();
     for (int i = 0; i < 256; ++i)
@@ -83,8 +223,12 @@ Z80::Z80(IExternals& ext)
     m_SZ53P[0] |= F_ZERO;
 }
 
-void Z80::restart()
+template <typename Bus>
+void Z80<Bus>::restart()
 {
+#if NX_LAZY_FLAGS
+    m_flagOp = FlagOp::None;
+#endif
     AF() = 0xffff;
     BC() = 0xffff;
     DE() = 0xffff;
@@ -103,25 +247,30 @@ void Z80::restart()
     m_iff1 = m_iff2 = true;
     m_im = 0;
     m_interrupt = m_nmi = m_eiHappened = false;
+
+    for (Block& block : m_blocks) block.address = kNoBlock;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
 // Instruction utilities
 //----------------------------------------------------------------------------------------------------------------------
 
-void Z80::exx()
+template <typename Bus>
+void Z80<Bus>::exx()
 {
     std::swap(BC(), BC_());
     std::swap(DE(), DE_());
     std::swap(HL(), HL_());
 }
 
-void Z80::exAfAf()
+template <typename Bus>
+void Z80<Bus>::exAfAf()
 {
     std::swap(AF(), AF_());
 }
 
-void Z80::incReg8(u8& reg)
+template <typename Bus>
+void Z80<Bus>::incReg8(u8& reg)
 {
     ++reg;
 
@@ -131,10 +280,15 @@ void Z80::incReg8(u8& reg)
     // P: Result is 0x80
     // N: Reset
     // C: Unaffected
+#if NX_LAZY_FLAGS
+    deferFlags(FlagOp::Inc, carryFlag(), 0, reg);
+#else
     F() = (F() & F_CARRY) | ((reg == 0x80) ? F_PARITY : 0) | ((reg & 0x0f) ? 0 : F_HALF) | m_SZ53[reg];
+#endif
 }
 
-void Z80::decReg8(u8& reg)
+template <typename Bus>
+void Z80<Bus>::decReg8(u8& reg)
 {
     // S: Result is negative
     // Z: Result is zero
@@ -142,12 +296,19 @@ void Z80::decReg8(u8& reg)
     // P: Result is 0x7f
     // N: Set
     // C: Unaffected
+#if NX_LAZY_FLAGS
+    u8 c = carryFlag();
+    --reg;
+    deferFlags(FlagOp::Dec, c, 0, reg);
+#else
     F() = (F() & F_CARRY) | ((reg & 0x0f) ? 0 : F_HALF) | F_NEG;
     --reg;
     F() |= (reg == 0x7f ? F_PARITY : 0) | m_SZ53[reg];
+#endif
 }
 
-void Z80::addReg16(u16& r1, u16& r2)
+template <typename Bus>
+void Z80<Bus>::addReg16(u16& r1, u16& r2)
 {
     u32 add = (u32)r1 + (u32)r2;
 
@@ -163,7 +324,8 @@ void Z80::addReg16(u16& r1, u16& r2)
 }
 
 // Result always goes into A.
-void Z80::addReg8(u8& reg)
+template <typename Bus>
+void Z80<Bus>::addReg8(u8& reg)
 {
     // S: Result is negative
     // Z: Result is zero
@@ -172,13 +334,19 @@ void Z80::addReg8(u8& reg)
     // N: Reset
     // C: Carry from bit 7
     u16 t = A() + reg;
+#if NX_LAZY_FLAGS
+    deferFlags(FlagOp::Add, A(), reg, t);
+    A() = (u8)t;
+#else
     u8 x = (u8)(((A() & 0x88) >> 3) | ((reg & 0x88) >> 2) | ((t & 0x88) >> 1));
     A() = (u8)t;
     F() = ((t & 0x100) ? F_CARRY : 0) | kHalfCarryAdd[x & 0x07] | kOverflowAdd[x >> 4] | m_SZ53[A()];
+#endif
 }
 
 // Result always goes into HL
-void Z80::adcReg16(u16& reg)
+template <typename Bus>
+void Z80<Bus>::adcReg16(u16& reg)
 {
     // S: Not affected
     // Z: Not affected
@@ -195,7 +363,8 @@ void Z80::adcReg16(u16& reg)
 }
 
 // Result always goes into A
-void Z80::adcReg8(u8& reg)
+template <typename Bus>
+void Z80<Bus>::adcReg8(u8& reg)
 {
     // S: Result is negative
     // Z: Result is zero
@@ -203,13 +372,19 @@ void Z80::adcReg8(u8& reg)
     // P: Set if overflow
     // N: Reset
     // C: Carry from bit 7
-    u16 t = (u16)A() + reg + (F() & F_CARRY);
+    u16 t = (u16)A() + reg + carryFlag();
+#if NX_LAZY_FLAGS
+    deferFlags(FlagOp::Add, A(), reg, t);
+    A() = (u8)t;
+#else
     u8 x = (u8)(((A() & 0x88) >> 3) | ((reg & 0x88) >> 2) | ((t & 0x88) >> 1));
     A() = (u8)t;
     F() = ((t & 0x100) ? F_CARRY : 0) | kHalfCarryAdd[x & 0x07] | kOverflowAdd[x >> 4] | m_SZ53[A()];
+#endif
 }
 
-void Z80::subReg8(u8& reg)
+template <typename Bus>
+void Z80<Bus>::subReg8(u8& reg)
 {
     // S: Result is negative
     // Z: Result is zero
@@ -218,12 +393,18 @@ void Z80::subReg8(u8& reg)
     // N: Set
     // C: Set if borrowed
     u16 t = (u16)A() - reg;
+#if NX_LAZY_FLAGS
+    deferFlags(FlagOp::Sub, A(), reg, t);
+    A() = (u8)t;
+#else
     u8 x = (u8)(((A() & 0x88) >> 3) | ((reg & 0x88) >> 2) | ((t & 0x88) >> 1));
     A() = (u8)t;
     F() = ((t & 0x100) ? F_CARRY : 0) | F_NEG | kHalfCarrySub[x & 0x07] | kOverflowSub[x >> 4] | m_SZ53[A()];
+#endif
 }
 
-void Z80::sbcReg8(u8& reg)
+template <typename Bus>
+void Z80<Bus>::sbcReg8(u8& reg)
 {
     // S: Result is negative
     // Z: Result is zero
@@ -231,13 +412,19 @@ void Z80::sbcReg8(u8& reg)
     // P: Set if overflow
     // N: Set
     // C: Set if borrowed
-    u16 t = (u16)A() - reg - (F() & F_CARRY);
+    u16 t = (u16)A() - reg - carryFlag();
+#if NX_LAZY_FLAGS
+    deferFlags(FlagOp::Sub, A(), reg, t);
+    A() = (u8)t;
+#else
     u8 x = (u8)(((A() & 0x88) >> 3) | ((reg & 0x88) >> 2) | ((t & 0x88) >> 1));
     A() = (u8)t;
     F() = ((t & 0x100) ? F_CARRY : 0) | F_NEG | kHalfCarrySub[x & 0x07] | kOverflowSub[x >> 4] | m_SZ53[A()];
+#endif
 }
 
-void Z80::sbcReg16(u16& reg)
+template <typename Bus>
+void Z80<Bus>::sbcReg16(u16& reg)
 {
     // S: Result is negative
     // Z: Result is zero
@@ -253,7 +440,8 @@ void Z80::sbcReg16(u16& reg)
         | kHalfCarrySub[x & 0x07] | (HL() ? 0 : F_ZERO);
 }
 
-void Z80::cpReg8(u8& reg)
+template <typename Bus>
+void Z80<Bus>::cpReg8(u8& reg)
 {
     // S, Z: Based on result
     // H: Borrow from 4 during 'subtraction'
@@ -261,12 +449,17 @@ void Z80::cpReg8(u8& reg)
     // N: Set
     // C: Set if borrowed (r > A)
     u16 t = (int)A() - reg;
+#if NX_LAZY_FLAGS
+    deferFlags(FlagOp::Cp, A(), reg, t);
+#else
     u8 x = (u8)(((A() & 0x88) >> 3) | ((reg & 0x88) >> 2) | ((t & 0x88) >> 1));
     F() = ((t & 0x100) ? F_CARRY : (t ? 0 : F_ZERO)) | F_NEG | kHalfCarrySub[x & 7] | kOverflowSub[x >> 4] |
         (reg & (F_3 | F_5)) | ((u8)t & F_SIGN);
+#endif
 }
 
-void Z80::andReg8(u8& reg)
+template <typename Bus>
+void Z80<Bus>::andReg8(u8& reg)
 {
     A() &= reg;
 
@@ -275,10 +468,15 @@ void Z80::andReg8(u8& reg)
     // P: Overflow
     // N: Reset
     // C: Reset
+#if NX_LAZY_FLAGS
+    deferFlags(FlagOp::And, 0, 0, A());
+#else
     F() = F_HALF | m_SZ53P[A()];
+#endif
 }
 
-void Z80::orReg8(u8& reg)
+template <typename Bus>
+void Z80<Bus>::orReg8(u8& reg)
 {
     A() |= reg;
 
@@ -287,10 +485,15 @@ void Z80::orReg8(u8& reg)
     // P: Overflow
     // N: Reset
     // C: Reset
+#if NX_LAZY_FLAGS
+    deferFlags(FlagOp::Or, 0, 0, A());
+#else
     F() = m_SZ53P[A()];
+#endif
 }
 
-void Z80::xorReg8(u8& reg)
+template <typename Bus>
+void Z80<Bus>::xorReg8(u8& reg)
 {
     A() ^= reg;
 
@@ -299,7 +502,11 @@ void Z80::xorReg8(u8& reg)
     // P: Overflow
     // N: Reset
     // C: Reset
+#if NX_LAZY_FLAGS
+    deferFlags(FlagOp::Or, 0, 0, A());
+#else
     F() = m_SZ53P[A()];
+#endif
 }
 
 //         +-------------------------------------+
@@ -307,7 +514,8 @@ void Z80::xorReg8(u8& reg)
 //  | C |<-+--| 7                           0 |<-+
 //  +---+     +---+---+---+---+---+---+---+---+
 //
-void Z80::rlcReg8(u8& reg)
+template <typename Bus>
+void Z80<Bus>::rlcReg8(u8& reg)
 {
     // S, Z: Based on result
     // H: Reset
@@ -323,7 +531,8 @@ void Z80::rlcReg8(u8& reg)
 //  +->| 7                           0 |--+->| C |
 //     +---+---+---+---+---+---+---+---+     +---+
 //
-void Z80::rrcReg8(u8& reg)
+template <typename Bus>
+void Z80<Bus>::rrcReg8(u8& reg)
 {
     // S, Z: Based on result
     // H: Reset
@@ -340,7 +549,8 @@ void Z80::rrcReg8(u8& reg)
 //  +--| C |<----| 7                           0 |<-+
 //     +---+     +---+---+---+---+---+---+---+---+
 //
-void Z80::rlReg8(u8& reg)
+template <typename Bus>
+void Z80<Bus>::rlReg8(u8& reg)
 {
     // S, Z: Based on result
     // H: Reset
@@ -357,7 +567,8 @@ void Z80::rlReg8(u8& reg)
 //  +->| 7                           0 |---->| C |--+
 //     +---+---+---+---+---+---+---+---+     +---+
 //
-void Z80::rrReg8(u8& reg)
+template <typename Bus>
+void Z80<Bus>::rrReg8(u8& reg)
 {
     // S, Z: Based on result
     // H: Reset
@@ -373,7 +584,8 @@ void Z80::rrReg8(u8& reg)
 //  | C |<----| 7                           0 |<---- 0
 //  +---+     +---+---+---+---+---+---+---+---+
 //
-void Z80::slaReg8(u8& reg)
+template <typename Bus>
+void Z80<Bus>::slaReg8(u8& reg)
 {
     // S, Z: Based on result
     // H: Reset
@@ -392,7 +604,8 @@ void Z80::slaReg8(u8& reg)
 //  |    |
 //  +----+
 //
-void Z80::sraReg8(u8& reg)
+template <typename Bus>
+void Z80<Bus>::sraReg8(u8& reg)
 {
     // S, Z: Based on result
     // H: Reset
@@ -408,7 +621,8 @@ void Z80::sraReg8(u8& reg)
 //  | C |<----| 7                           0 |<---- 1
 //  +---+     +---+---+---+---+---+---+---+---+
 //
-void Z80::sl1Reg8(u8& reg)
+template <typename Bus>
+void Z80<Bus>::sl1Reg8(u8& reg)
 {
     // S, Z: Based on result
     // H: Reset
@@ -424,7 +638,8 @@ void Z80::sl1Reg8(u8& reg)
 //  0 ---->| 7                           0 |---->| C |
 //         +---+---+---+---+---+---+---+---+     +---+
 //
-void Z80::srlReg8(u8& reg)
+template <typename Bus>
+void Z80<Bus>::srlReg8(u8& reg)
 {
     // S, Z: Based on result
     // H: Reset
@@ -436,7 +651,8 @@ void Z80::srlReg8(u8& reg)
     F() |= m_SZ53P[reg];
 }
 
-void Z80::bitReg8(u8& reg, int b)
+template <typename Bus>
+void Z80<Bus>::bitReg8(u8& reg, int b)
 {
     // S: Undefined (set to bit 7 if bit 7 is checked, otherwise 0)
     // Z: Opposite of bit b
@@ -449,7 +665,8 @@ void Z80::bitReg8(u8& reg, int b)
     if ((b == 7) && (reg & 0x80)) F() |= F_SIGN;
 }
 
-void Z80::bitReg8MP(u8& reg, int b)
+template <typename Bus>
+void Z80<Bus>::bitReg8MP(u8& reg, int b)
 {
     // S: Undefined (set to bit 7 if bit 7 is checked, otherwise 0)
     // Z: Opposite of bit b
@@ -462,19 +679,22 @@ void Z80::bitReg8MP(u8& reg, int b)
     if ((b == 7) && (reg & 0x80)) F() |= F_SIGN;
 }
 
-void Z80::resReg8(u8& reg, int b)
+template <typename Bus>
+void Z80<Bus>::resReg8(u8& reg, int b)
 {
     // All flags preserved.
     reg = reg & ~((u8)1 << b);
 }
 
-void Z80::setReg8(u8& reg, int b)
+template <typename Bus>
+void Z80<Bus>::setReg8(u8& reg, int b)
 {
     // All flags preserved.
     reg = reg | ((u8)1 << b);
 }
 
-void Z80::daa()
+template <typename Bus>
+void Z80<Bus>::daa()
 {
     u8 result = A();
     u8 incr = 0;
@@ -507,23 +727,26 @@ void Z80::daa()
     setFlags(F_PARITY, m_parity[result] != 0);
 }
 
-int Z80::displacement(u8 x)
+template <typename Bus>
+int Z80<Bus>::displacement(u8 x)
 {
     return (128 ^ (int)x) - 128;
 }
 
-u16 Z80::pop(TState& inOutTState)
+template <typename Bus>
+u16 Z80<Bus>::pop(TState& inOutTState)
 {
-    u16 x = m_ext.peek16(SP(), inOutTState);
+    u16 x = m_bus.peek16(SP(), inOutTState);
     SP() += 2;
     return x;
 }
 
-void Z80::push(u16 x, TState& inOutTState)
+template <typename Bus>
+void Z80<Bus>::push(u16 x, TState& inOutTState)
 {
     Reg r(x);
-    m_ext.poke(--SP(), r.h, inOutTState);
-    m_ext.poke(--SP(), r.l, inOutTState);
+    m_bus.poke(--SP(), r.h, inOutTState);
+    m_bus.poke(--SP(), r.l, inOutTState);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -531,7 +754,8 @@ void Z80::push(u16 x, TState& inOutTState)
 // Run a single instruction
 //----------------------------------------------------------------------------------------------------------------------
 
-u8& Z80::getReg8(u8 y)
+template <typename Bus>
+u8& Z80<Bus>::getReg8(u8 y)
 {
     static u8 dummy = 0;
 
@@ -550,7 +774,8 @@ u8& Z80::getReg8(u8 y)
     }
 }
 
-u16& Z80::getReg16_1(u8 p)
+template <typename Bus>
+u16& Z80<Bus>::getReg16_1(u8 p)
 {
     switch (p)
     {
@@ -565,7 +790,8 @@ u16& Z80::getReg16_1(u8 p)
 }
 
 
-u16& Z80::getReg16_2(u8 p)
+template <typename Bus>
+u16& Z80<Bus>::getReg16_2(u8 p)
 {
     switch (p)
     {
@@ -579,7 +805,8 @@ u16& Z80::getReg16_2(u8 p)
     return _;
 }
 
-bool Z80::getFlag(u8 y, u8 flags)
+template <typename Bus>
+bool Z80<Bus>::getFlag(u8 y, u8 flags)
 {
     switch (y)
     {
@@ -597,57 +824,108 @@ bool Z80::getFlag(u8 y, u8 flags)
 }
 
 
-Z80::ALUFunc Z80::getAlu(u8 y)
+template <typename Bus>
+typename Z80<Bus>::ALUFunc Z80<Bus>::getAlu(u8 y)
 {
-    static ALUFunc funcs[8] =
+    static const ALUFunc funcs[8] =
     {
-        std::bind(&Z80::addReg8, this, std::placeholders::_1),
-        std::bind(&Z80::adcReg8, this, std::placeholders::_1),
-        std::bind(&Z80::subReg8, this, std::placeholders::_1),
-        std::bind(&Z80::sbcReg8, this, std::placeholders::_1),
-        std::bind(&Z80::andReg8, this, std::placeholders::_1),
-        std::bind(&Z80::xorReg8, this, std::placeholders::_1),
-        std::bind(&Z80::orReg8, this, std::placeholders::_1),
-        std::bind(&Z80::cpReg8, this, std::placeholders::_1),
+        &Z80::addReg8,
+        &Z80::adcReg8,
+        &Z80::subReg8,
+        &Z80::sbcReg8,
+        &Z80::andReg8,
+        &Z80::xorReg8,
+        &Z80::orReg8,
+        &Z80::cpReg8,
     };
 
     return funcs[y];
-};
+}
 
-Z80::RotShiftFunc Z80::getRotateShift(u8 y)
+template <typename Bus>
+typename Z80<Bus>::RotShiftFunc Z80<Bus>::getRotateShift(u8 y)
 {
-    static RotShiftFunc funcs[8] =
+    static const RotShiftFunc funcs[8] =
     {
-        std::bind(&Z80::rlcReg8, this, std::placeholders::_1),
-        std::bind(&Z80::rrcReg8, this, std::placeholders::_1),
-        std::bind(&Z80::rlReg8, this, std::placeholders::_1),
-        std::bind(&Z80::rrReg8, this, std::placeholders::_1),
-        std::bind(&Z80::slaReg8, this, std::placeholders::_1),
-        std::bind(&Z80::sraReg8, this, std::placeholders::_1),
-        std::bind(&Z80::sl1Reg8, this, std::placeholders::_1),
-        std::bind(&Z80::srlReg8, this, std::placeholders::_1),
+        &Z80::rlcReg8,
+        &Z80::rrcReg8,
+        &Z80::rlReg8,
+        &Z80::rrReg8,
+        &Z80::slaReg8,
+        &Z80::sraReg8,
+        &Z80::sl1Reg8,
+        &Z80::srlReg8,
     };
 
     return funcs[y];
 }
 
+template <typename Bus>
+void Z80<Bus>::alu(const DynamicOp& op, u8& reg)
+{
+    (this->*getAlu(op.y))(reg);
+}
+
+template <typename Bus>
+void Z80<Bus>::rotateShift(const DynamicOp& op, u8& reg)
+{
+    (this->*getRotateShift(op.y))(reg);
+}
+
+template <typename Bus>
+template <int N>
+void Z80<Bus>::alu(StaticOp<N> op, u8& reg)
+{
+    switch (op.y)
+    {
+    case 0: addReg8(reg);   break;
+    case 1: adcReg8(reg);   break;
+    case 2: subReg8(reg);   break;
+    case 3: sbcReg8(reg);   break;
+    case 4: andReg8(reg);   break;
+    case 5: xorReg8(reg);   break;
+    case 6: orReg8(reg);    break;
+    case 7: cpReg8(reg);    break;
+    }
+}
+
+template <typename Bus>
+template <int N>
+void Z80<Bus>::rotateShift(StaticOp<N> op, u8& reg)
+{
+    switch (op.y)
+    {
+    case 0: rlcReg8(reg);   break;
+    case 1: rrcReg8(reg);   break;
+    case 2: rlReg8(reg);    break;
+    case 3: rrReg8(reg);    break;
+    case 4: slaReg8(reg);   break;
+    case 5: sraReg8(reg);   break;
+    case 6: sl1Reg8(reg);   break;
+    case 7: srlReg8(reg);   break;
+    }
+}
 
-#define PEEK(a) m_ext.peek((a), tState)
-#define POKE(a, b) m_ext.poke((a), (b), tState)
-#define PEEK16(a) m_ext.peek16((a), tState)
-#define POKE16(a, w) m_ext.poke16((a), (w), tState)
-#define CONTEND(a, t, n) m_ext.contend((a), (t), (n), tState)
 
-void Z80::decodeInstruction(u8 opCode, u8& x, u8& y, u8& z, u8& p, u8& q)
+#define PEEK(a) m_bus.peek((a), tState)
+#define POKE(a, b) m_bus.poke((a), (b), tState)
+#define PEEK16(a) m_bus.peek16((a), tState)
+#define POKE16(a, w) m_bus.poke16((a), (w), tState)
+#define CONTEND(a, t, n) m_bus.contend((a), (t), (n), tState)
+
+template <typename Bus>
+Z80<Bus>::DynamicOp::DynamicOp(u8 opCode)
+    : opCode(opCode)
+    , x((opCode & 0xc0) >> 6)
+    , y((opCode & 0x38) >> 3)
+    , z(opCode & 0x07)
+    , p((y & 6) >> 1)
+    , q(y & 1)
 {
-    x = (opCode & 0xc0) >> 6;
-    y = (opCode & 0x38) >> 3;
-    z = (opCode & 0x07);
-    p = (y & 6) >> 1;
-    q = (y & 1);
 }
 
-u8 Z80::fetchInstruction(i64& tState)
+template <typename Bus>
+u8 Z80<Bus>::fetchInstruction(i64& tState)
 {
     // Fetch opcode and decode it.  The opcode can be viewed as XYZ fields with Y being sub-decoded to PQ fields:
     //
@@ -663,8 +941,7 @@ u8 Z80::fetchInstruction(i64& tState)
     //
     u8 r = R();
     R() = (r & 0x80) | ((r + 1) & 0x7f);
-    CONTEND(PC(), 4, 1);
-    return m_ext.peek(PC()++);
+    return m_bus.fetch(PC()++, tState);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -675,22 +952,33 @@ u8 Z80::fetchInstruction(i64& tState)
 #define IH idx.h
 #define IL idx.l
 
-void Z80::executeDDFDCB(Reg& idx, i64& tState)
+template <typename Bus>
+template <typename Op>
+void Z80<Bus>::prefixDDFDCB(Reg& idx, i64& tState)
 {
-    u8 x, y, z;
-    u8 opCode;
-
     CONTEND(PC(), 3, 1);
-    MP() = II + (i8)m_ext.peek(PC());
+    MP() = II + (i8)m_bus.peek(PC());
     ++PC();
     CONTEND(PC(), 3, 1);
-    opCode = m_ext.peek(PC());
+    u8 opCode = m_bus.peek(PC());
     CONTEND(PC(), 1, 2);
     ++PC();
 
-    x = (opCode & 0xc0) >> 6;
-    y = (opCode & 0x38) >> 3;
-    z = (opCode & 0x07);
+    if (Op::kUseTables)
+    {
+        ((&idx == &m_iy) ? ms_fdcbOps : ms_ddcbOps)[opCode](*this, tState);
+    }
+    else
+    {
+        executeDDFDCB(DynamicOp(opCode), idx, tState);
+    }
+}
+
+template <typename Bus>
+template <typename Op>
+void Z80<Bus>::executeDDFDCB(Op op, Reg& idx, i64& tState)
+{
+    const u8 x = op.x, y = op.y, z = op.z;
 
     u8* r = 0;
     u8 v = 0;
@@ -701,7 +989,7 @@ void Z80::executeDDFDCB(Reg& idx, i64& tState)
         r = (z == 6) ? &v : &getReg8(z);
         *r = PEEK(MP());
         CONTEND(MP(), 1, 1);
-        getRotateShift(y)(*r);
+        rotateShift(op, *r);
         POKE(MP(), *r);
         break;
 
@@ -729,11 +1017,27 @@ void Z80::executeDDFDCB(Reg& idx, i64& tState)
     }
 }
 
-void Z80::executeDDFD(Reg& idx, i64& tState)
+template <typename Bus>
+template <typename Op>
+void Z80<Bus>::prefixDDFD(Reg& idx, i64& tState)
 {
-    u8 x, y, z, p, q;
     u8 opCode = fetchInstruction(tState);
-    decodeInstruction(opCode, x, y, z, p, q);
+
+    if (Op::kUseTables)
+    {
+        ((&idx == &m_iy) ? ms_fdOps : ms_ddOps)[opCode](*this, tState);
+    }
+    else
+    {
+        executeDDFD(DynamicOp(opCode), idx, tState);
+    }
+}
+
+template <typename Bus>
+template <typename Op>
+void Z80<Bus>::executeDDFD(Op op, Reg& idx, i64& tState)
+{
+    const u8 opCode = op.opCode, x = op.x, y = op.y, z = op.z, p = op.p, q = op.q;
 
     i8 d = 0;
     u8 v = 0;
@@ -920,8 +1224,8 @@ void Z80::executeDDFD(Reg& idx, i64& tState)
                     CONTEND(PC(), 1, 5);
                     ++PC();
                     MP() = II + d;
-                    x = PEEK(MP());
-                    r2 = &x;
+                    v = PEEK(MP());
+                    r2 = &v;
                     break;
 
                 default:
@@ -953,8 +1257,8 @@ void Z80::executeDDFD(Reg& idx, i64& tState)
                     CONTEND(PC(), 1, 5);
                     ++PC();
                     MP() = II + d;
-                    x = PEEK(MP());
-                    r2 = &x;
+                    v = PEEK(MP());
+                    r2 = &v;
                     break;
 
                 default:
@@ -984,14 +1288,14 @@ void Z80::executeDDFD(Reg& idx, i64& tState)
             goto invalid_instruction;
         }
 
-        getAlu(y)(*r);
+        alu(op, *r);
         break;
 
     case 3: // x = 3
         switch (opCode)
         {
         case 0xcb:  // DDCB prefixes
-            executeDDFDCB(idx, tState);
+            prefixDDFDCB<Op>(idx, tState);
             break;
 
         case 0xe1:  // POP IX
@@ -1034,15 +1338,31 @@ void Z80::executeDDFD(Reg& idx, i64& tState)
     return;
 
 invalid_instruction:
-    execute(opCode, tState);
+    executeBase(op, tState);
     return;
 }
 
-void Z80::executeED(i64& tState)
+template <typename Bus>
+template <typename Op>
+void Z80<Bus>::prefixED(i64& tState)
 {
-    u8 x, y, z, p, q;
     u8 opCode = fetchInstruction(tState);
-    decodeInstruction(opCode, x, y, z, p, q);
+
+    if (Op::kUseTables)
+    {
+        ms_edOps[opCode](*this, tState);
+    }
+    else
+    {
+        executeED(DynamicOp(opCode), tState);
+    }
+}
+
+template <typename Bus>
+template <typename Op>
+void Z80<Bus>::executeED(Op op, i64& tState)
+{
+    const u8 opCode = op.opCode, x = op.x, y = op.y, z = op.z, p = op.p, q = op.q;
 
     u8* r = 0;
     u8 v = 0;
@@ -1058,7 +1378,7 @@ void Z80::executeED(i64& tState)
         case 0:
             r = (y == 6) ? &v : &getReg8(y);
             MP() = BC() + 1;
-            *r = m_ext.in(BC(), tState);
+            *r = m_bus.in(BC(), tState);
             NX_LOG_IN(BC(), *r);
             F() = (F() & F_CARRY) | m_SZ53P[*r];
             break;
@@ -1067,7 +1387,7 @@ void Z80::executeED(i64& tState)
             v = 0;
             r = (y == 6) ? &v : &getReg8(y);
             NX_LOG_OUT(BC(), *r);
-            m_ext.out(BC(), *r, tState);
+            m_bus.out(BC(), *r, tState);
             MP() = BC() + 1;
             break;
 
@@ -1120,8 +1440,7 @@ void Z80::executeED(i64& tState)
             break;
 
         case 6: // IM ?
-            y &= 3;
-            IM() = (y == 0) ? 0 : y - 1;
+            IM() = ((y & 3) == 0) ? 0 : (y & 3) - 1;
             break;
 
         case 7:
@@ -1186,32 +1505,23 @@ void Z80::executeED(i64& tState)
             CONTEND(DE(), 1, 2);
             ++DE();
             ++HL();
-            v += A();
-            F() = (F() & (F_CARRY | F_ZERO | F_SIGN)) | (BC() ? F_PARITY : 0) |
-                (v & F_3) | ((v & 0x02) ? F_5 : 0);
+            ldFlags(v);
             break;
 
         case 0xa1:  // CPI
-            {
-                v = PEEK(HL());
-                u8 t = A() - v;
-                u8 lookup = ((A() & 0x08) >> 3) | ((v & 0x08) >> 2) | ((t & 0x08) >> 1);
-                CONTEND(HL(), 1, 5);
-                ++HL();
-                --BC();
-                F() = (F() & F_CARRY) | (BC() ? (F_PARITY | F_NEG) : F_NEG) |
-                    kHalfCarrySub[lookup] | (t ? 0 : F_ZERO) | (t & F_SIGN);
-                if (F() & F_HALF) --t;
-                F() |= (t & F_3) | ((t & 0x02) ? F_5 : 0);
-                ++MP();
-            }
+            v = PEEK(HL());
+            CONTEND(HL(), 1, 5);
+            ++HL();
+            --BC();
+            cpFlags(v);
+            ++MP();
             break;
 
         case 0xa2:  // INI
             {
                 u8 t1, t2;
                 CONTEND(IR(), 1, 1);
-                t1 = m_ext.in(BC(), tState);
+                t1 = m_bus.in(BC(), tState);
                 NX_LOG_IN(BC(), t1);
                 POKE(HL(), t1);
                 MP() = BC() + 1;
@@ -1232,7 +1542,7 @@ void Z80::executeED(i64& tState)
                 t1 = PEEK(HL());
                 --B();
                 MP() = BC() + 1;
-                m_ext.out(BC(), t1, tState);
+                m_bus.out(BC(), t1, tState);
                 ++HL();
                 t2 = t1 + L();
                 F() = (t1 & 0x80 ? F_NEG : 0) |
@@ -1249,32 +1559,23 @@ void Z80::executeED(i64& tState)
             CONTEND(DE(), 1, 2);
             --DE();
             --HL();
-            v += A();
-            F() = (F() & (F_CARRY | F_ZERO | F_SIGN)) | (BC() ? F_PARITY : 0) |
-                (v & F_3) | ((v & 0x02) ? F_5 : 0);
+            ldFlags(v);
             break;
 
         case 0xa9:  // CPD
-            {
-                v = PEEK(HL());
-                u8 t = A() - v;
-                u8 lookup = ((A() & 0x08) >> 3) | ((v & 0x08) >> 2) | ((t & 0x08) >> 1);
-                CONTEND(HL(), 1, 5);
-                --HL();
-                --BC();
-                F() = (F() & F_CARRY) | (BC() ? (F_PARITY | F_NEG) : F_NEG) |
-                    kHalfCarrySub[lookup] | (t ? 0 : F_ZERO) | (t & F_SIGN);
-                if (F() & F_HALF) --t;
-                F() |= (t & F_3) | ((t & 0x02) ? F_5 : 0);
-                --MP();
-            }
+            v = PEEK(HL());
+            CONTEND(HL(), 1, 5);
+            --HL();
+            --BC();
+            cpFlags(v);
+            --MP();
             break;
 
         case 0xaa:  // IND
             {
                 u8 t1, t2;
                 CONTEND(IR(), 1, 1);
-                t1 = m_ext.in(BC(), tState);
+                t1 = m_bus.in(BC(), tState);
                 NX_LOG_IN(BC(), t1);
                 POKE(HL(), t1);
                 MP() = BC() - 1;
@@ -1296,7 +1597,7 @@ void Z80::executeED(i64& tState)
                 --B();
                 MP() = BC() - 1;
                 NX_LOG_OUT(BC(), t1);
-                m_ext.out(BC(), t1, tState);
+                m_bus.out(BC(), t1, tState);
                 --HL();
                 t2 = t1 + L();
                 F() = (t1 & 0x80 ? F_NEG : 0) |
@@ -1307,53 +1608,66 @@ void Z80::executeED(i64& tState)
             break;
 
         case 0xb0:  // LDIR
-            v = PEEK(HL());
-            POKE(DE(), v);
-            CONTEND(DE(), 1, 2);
-            --BC();
-            v += A();
-            F() = (F() & (F_CARRY | F_ZERO | F_SIGN)) | (BC() ? F_PARITY : 0) |
-                (v & F_3) | ((v & 0x02) ? F_5 : 0);
-            if (BC())
+            for (;;)
             {
-                CONTEND(DE(), 1, 5);
-                PC() -= 2;
-                MP() = PC() + 1;
+                v = PEEK(HL());
+                POKE(DE(), v);
+                CONTEND(DE(), 1, 2);
+                --BC();
+                ldFlags(v);
+                if (BC())
+                {
+                    CONTEND(DE(), 1, 5);
+                    MP() = PC() - 1;
+                }
+                ++DE();
+                ++HL();
+
+                if (!BC()) break;
+                if (!repeatBlockOp(opCode, tState))
+                {
+                    PC() -= 2;
+                    break;
+                }
+                bulkCopy(1, tState);
             }
-            ++DE();
-            ++HL();
             break;
 
         case 0xb1:  // CPIR
+            for (;;)
             {
                 v = PEEK(HL());
-                u8 t = A() - v;
-                u8 lookup = ((A() & 0x08) >> 3) | ((v & 0x08) >> 2) | ((t & 0x08) >> 1);
                 CONTEND(HL(), 1, 5);
                 --BC();
-                F() = (F() & F_CARRY) | (BC() ? (F_PARITY | F_NEG) : F_NEG) |
-                    kHalfCarrySub[lookup] | (t ? 0 : F_ZERO) | (t & F_SIGN);
-                if (F() & F_HALF) --t;
-                F() |= (t & F_3) | ((t & 0x02) ? F_5 : 0);
-                if ((F() & (F_PARITY | F_ZERO)) == F_PARITY)
+                cpFlags(v);
+                const bool repeat = (F() & (F_PARITY | F_ZERO)) == F_PARITY;
+                if (repeat)
                 {
                     CONTEND(HL(), 1, 5);
-                    PC() -= 2;
-                    MP() = PC() + 1;
+                    MP() = PC() - 1;
                 }
                 else
                 {
                     ++MP();
                 }
                 ++HL();
+
+                if (!repeat) break;
+                if (!repeatBlockOp(opCode, tState))
+                {
+                    PC() -= 2;
+                    break;
+                }
+                bulkSearch(1, tState);
             }
             break;
 
         case 0xb2:  // INIR
+            for (;;)
             {
                 u8 t1, t2;
                 CONTEND(IR(), 1, 1);
-                t1 = m_ext.in(BC(), tState);
+                t1 = m_bus.in(BC(), tState);
                 NX_LOG_IN(BC(), t1);
                 POKE(HL(), t1);
                 MP() = BC() + 1;
@@ -1363,16 +1677,20 @@ void Z80::executeED(i64& tState)
                     ((t2 < t1) ? F_HALF | F_CARRY : 0) |
                     (m_parity[(t2 & 0x07) ^ B()] ? F_PARITY : 0) |
                     m_SZ53[B()];
-                if (B())
+                if (B()) CONTEND(HL(), 1, 5);
+                ++HL();
+
+                if (!B()) break;
+                if (!repeatBlockOp(opCode, tState))
                 {
-                    CONTEND(HL(), 1, 5);
                     PC() -= 2;
+                    break;
                 }
-                ++HL();
             }
             break;
 
         case 0xb3:  // OTIR
+            for (;;)
             {
                 u8 t1, t2;
                 CONTEND(IR(), 1, 1);
@@ -1380,69 +1698,85 @@ void Z80::executeED(i64& tState)
                 --B();
                 MP() = BC() + 1;
                 NX_LOG_OUT(BC(), t1);
-                m_ext.out(BC(), t1, tState);
+                m_bus.out(BC(), t1, tState);
                 ++HL();
                 t2 = t1 + L();
                 F() = (t1 & 0x80 ? F_NEG : 0) |
                     ((t2 < t1) ? F_HALF | F_CARRY : 0) |
                     (m_parity[(t2 & 0x07) ^ B()] ? F_PARITY : 0) |
                     m_SZ53[B()];
-                if (B())
+
+                if (!B()) break;
+                CONTEND(BC(), 1, 5);
+                if (!repeatBlockOp(opCode, tState))
                 {
-                    CONTEND(BC(), 1, 5);
                     PC() -= 2;
+                    break;
                 }
             }
             break;
 
         case 0xb8:  // LDDR
-            v = PEEK(HL());
-            POKE(DE(), v);
-            CONTEND(DE(), 1, 2);
-            --BC();
-            v += A();
-            F() = (F() & (F_CARRY | F_ZERO | F_SIGN)) | (BC() ? F_PARITY : 0) |
-                (v & F_3) | ((v & 0x02) ? F_5 : 0);
-            if (BC())
+            for (;;)
             {
-                CONTEND(DE(), 1, 5);
-                PC() -= 2;
-                MP() = PC() + 1;
+                v = PEEK(HL());
+                POKE(DE(), v);
+                CONTEND(DE(), 1, 2);
+                --BC();
+                ldFlags(v);
+                if (BC())
+                {
+                    CONTEND(DE(), 1, 5);
+                    MP() = PC() - 1;
+                }
+                --DE();
+                --HL();
+
+                if (!BC()) break;
+                if (!repeatBlockOp(opCode, tState))
+                {
+                    PC() -= 2;
+                    break;
+                }
+                bulkCopy(-1, tState);
             }
-            --DE();
-            --HL();
             break;
 
         case 0xb9:  // CPDR
+            for (;;)
             {
                 v = PEEK(HL());
-                u8 t = A() - v;
-                u8 lookup = ((A() & 0x08) >> 3) | ((v & 0x08) >> 2) | ((t & 0x08) >> 1);
                 CONTEND(HL(), 1, 5);
                 --BC();
-                F() = (F() & F_CARRY) | (BC() ? (F_PARITY | F_NEG) : F_NEG) |
-                    kHalfCarrySub[lookup] | (t ? 0 : F_ZERO) | (t & F_SIGN);
-                if (F() & F_HALF) --t;
-                F() |= (t & F_3) | ((t & 0x02) ? F_5 : 0);
-                if ((F() & (F_PARITY | F_ZERO)) == F_PARITY)
+                cpFlags(v);
+                const bool repeat = (F() & (F_PARITY | F_ZERO)) == F_PARITY;
+                if (repeat)
                 {
                     CONTEND(HL(), 1, 5);
-                    PC() -= 2;
-                    MP() = PC() + 1;
+                    MP() = PC() - 1;
                 }
                 else
                 {
                     --MP();
                 }
                 --HL();
+
+                if (!repeat) break;
+                if (!repeatBlockOp(opCode, tState))
+                {
+                    PC() -= 2;
+                    break;
+                }
+                bulkSearch(-1, tState);
             }
             break;
 
         case 0xba:  // INDR
+            for (;;)
             {
                 u8 t1, t2;
                 CONTEND(IR(), 1, 1);
-                t1 = m_ext.in(BC(), tState);
+                t1 = m_bus.in(BC(), tState);
                 NX_LOG_IN(BC(), t1);
                 POKE(HL(), t1);
                 MP() = BC() - 1;
@@ -1452,16 +1786,20 @@ void Z80::executeED(i64& tState)
                     ((t2 < t1) ? F_HALF | F_CARRY : 0) |
                     (m_parity[(t2 & 0x07) ^ B()] ? F_PARITY : 0) |
                     m_SZ53[B()];
-                if (B())
+                if (B()) CONTEND(HL(), 1, 5);
+                --HL();
+
+                if (!B()) break;
+                if (!repeatBlockOp(opCode, tState))
                 {
-                    CONTEND(HL(), 1, 5);
                     PC() -= 2;
+                    break;
                 }
-                --HL();
             }
             break;
 
         case 0xbb:  // OTDR
+            for (;;)
             {
                 u8 t1, t2;
                 CONTEND(IR(), 1, 1);
@@ -1469,17 +1807,20 @@ void Z80::executeED(i64& tState)
                 --B();
                 MP() = BC() - 1;
                 NX_LOG_OUT(BC(), t1);
-                m_ext.out(BC(), t1, tState);
+                m_bus.out(BC(), t1, tState);
                 --HL();
                 t2 = t1 + L();
                 F() = (t1 & 0x80 ? F_NEG : 0) |
                     ((t2 < t1) ? F_HALF | F_CARRY : 0) |
                     (m_parity[(t2 & 0x07) ^ B()] ? F_PARITY : 0) |
                     m_SZ53[B()];
-                if (B())
+
+                if (!B()) break;
+                CONTEND(BC(), 1, 5);
+                if (!repeatBlockOp(opCode, tState))
                 {
-                    CONTEND(BC(), 1, 5);
                     PC() -= 2;
+                    break;
                 }
             }
             break;
@@ -1496,14 +1837,99 @@ void Z80::executeED(i64& tState)
     return;
 
 invalid_instruction:
-    execute(opCode, tState);
+    executeBase(op, tState);
     return;
 }
 
-void Z80::execute(u8 opCode, i64& tState)
+template <typename Bus>
+template <typename Op>
+void Z80<Bus>::prefixCB(i64& tState)
+{
+    u8 opCode = fetchInstruction(tState);
+
+    if (Op::kUseTables)
+    {
+        ms_cbOps[opCode](*this, tState);
+    }
+    else
+    {
+        executeCB(DynamicOp(opCode), tState);
+    }
+}
+
+template <typename Bus>
+template <typename Op>
+void Z80<Bus>::executeCB(Op op, i64& tState)
+{
+    const u8 x = op.x, y = op.y, z = op.z;
+    u8 d = 0;
+
+    switch (x)
+    {
+    case 0:     // 00-3F: Rotate/Shift instructions
+        if (z == 6)
+        {
+            d = PEEK(HL());
+            CONTEND(HL(), 1, 1);
+            rotateShift(op, d);
+            POKE(HL(), d);
+        }
+        else
+        {
+            rotateShift(op, getReg8(z));
+        }
+        break;
+
+    case 1:     // 40-7F: BIT instructions
+        if (z == 6)
+        {
+            // BIT n,(HL())
+            d = PEEK(HL());
+            CONTEND(HL(), 1, 1);
+            bitReg8MP(d, y);
+        }
+        else
+        {
+            bitReg8(getReg8(z), y);
+        }
+        break;
+
+    case 2:     // 80-BF: RES instructions
+        if (z == 6)
+        {
+            // RES n,(HL())
+            d = PEEK(HL());
+            CONTEND(HL(), 1, 1);
+            resReg8(d, y);
+            POKE(HL(), d);
+        }
+        else
+        {
+            resReg8(getReg8(z), y);
+        }
+        break;
+
+    case 3:     // C0-FF: SET instructions
+        if (z == 6)
+        {
+            // BIT n,(HL())
+            d = PEEK(HL());
+            CONTEND(HL(), 1, 1);
+            setReg8(d, y);
+            POKE(HL(), d);
+        }
+        else
+        {
+            setReg8(getReg8(z), y);
+        }
+    }
+}
+
+template <typename Bus>
+template <typename Op>
+void Z80<Bus>::executeBase(Op op, i64& tState)
 {
-    u8 x, y, z, p, q;
-    decodeInstruction(opCode, x, y, z, p, q);
+    const u8 x = op.x, y = op.y, z = op.z, p = op.p, q = op.q;
 
     // Commonly used local variables
     u8 d = 0;       // Used for displacement
@@ -1558,7 +1984,7 @@ void Z80::execute(u8 opCode, i64& tState)
                 break;
 
             default:    // 20, 28, 30, 38 - JR cc(y-4),d
-                if (getFlag(y - 4, F()))
+                if (condition(y - 4))
                 {
                     d = displacement(PEEK(PC()));
                     CONTEND(PC(), 1, 5);
@@ -1787,11 +2213,11 @@ void Z80::execute(u8 opCode, i64& tState)
             {
                 // ALU(y) (HL())
                 d = PEEK(HL());
-                getAlu(y)(d);
+                alu(op, d);
             }
             else
             {
-                getAlu(y)(getReg8(z));
+                alu(op, getReg8(z));
             }
         }
         break; // x == 2
@@ -1802,7 +2228,7 @@ void Z80::execute(u8 opCode, i64& tState)
         case 0:
             // C0, C8, D0, D8, E0, E8, F0, F8 - RET flag
             CONTEND(IR(), 1, 1);
-            if (getFlag(y, F()))
+            if (condition(y))
             {
                 PC() = pop(tState);
                 MP() = PC();
@@ -1843,7 +2269,7 @@ void Z80::execute(u8 opCode, i64& tState)
         case 2:
             // C2, CA, D2, DA, E2, EA, F2, FA - JP flag,nn
             tt = PEEK16(PC());
-            if (getFlag(y, F()))
+            if (condition(y))
             {
                 PC() = tt;
             }
@@ -1863,74 +2289,13 @@ void Z80::execute(u8 opCode, i64& tState)
                 break;
 
             case 1:     // CB (prefix)
-                opCode = fetchInstruction(tState);
-                decodeInstruction(opCode, x, y, z, p, q);
-
-                switch (x)
-                {
-                case 0:     // 00-3F: Rotate/Shift instructions
-                    if (z == 6)
-                    {
-                        d = PEEK(HL());
-                        CONTEND(HL(), 1, 1);
-                        getRotateShift(y)(d);
-                        POKE(HL(), d);
-                    }
-                    else
-                    {
-                        getRotateShift(y)(getReg8(z));
-                    }
-                    break;
-
-                case 1:     // 40-7F: BIT instructions
-                    if (z == 6)
-                    {
-                        // BIT n,(HL())
-                        d = PEEK(HL());
-                        CONTEND(HL(), 1, 1);
-                        bitReg8MP(d, y);
-                    }
-                    else
-                    {
-                        bitReg8(getReg8(z), y);
-                    }
-                    break;
-
-                case 2:     // 80-BF: RES instructions
-                    if (z == 6)
-                    {
-                        // RES n,(HL())
-                        d = PEEK(HL());
-                        CONTEND(HL(), 1, 1);
-                        resReg8(d, y);
-                        POKE(HL(), d);
-                    }
-                    else
-                    {
-                        resReg8(getReg8(z), y);
-                    }
-                    break;
-
-                case 3:     // C0-FF: SET instructions
-                    if (z == 6)
-                    {
-                        // BIT n,(HL())
-                        d = PEEK(HL());
-                        CONTEND(HL(), 1, 1);
-                        setReg8(d, y);
-                        POKE(HL(), d);
-                    }
-                    else
-                    {
-                        setReg8(getReg8(z), y);
-                    }
-                }
+                prefixCB<Op>(tState);
                 break;
 
             case 2:     // D3 - OUT (n),A()       A() -> $AAnn
                 d = PEEK(PC());
                 NX_LOG_OUT((u16)d | ((u16)A() << 8), A());
-                m_ext.out((u16)d | ((u16)A() << 8), A(), tState);
+                m_bus.out((u16)d | ((u16)A() << 8), A(), tState);
                 m_mp.h = A();
                 m_mp.l = (u8)(d + 1);
                 ++PC();
@@ -1941,7 +2306,7 @@ void Z80::execute(u8 opCode, i64& tState)
                 tt = ((u16)A() << 8) | d;
                 m_mp.h = A();
                 m_mp.l = (u8)(d + 1);
-                A() = m_ext.in(tt, tState);
+                A() = m_bus.in(tt, tState);
                 NX_LOG_IN(tt, A());
                 ++PC();
                 break;
@@ -1979,7 +2344,7 @@ void Z80::execute(u8 opCode, i64& tState)
             // C4 CC D4 DC E4 EC F4 FC - CALL F(),nn
             tt = PEEK16(PC());
             MP() = tt;
-            if (getFlag(y, F()))
+            if (condition(y))
             {
                 CONTEND(PC() + 1, 1, 1);
                 push(PC() + 2, tState);
@@ -2011,15 +2376,15 @@ void Z80::execute(u8 opCode, i64& tState)
                     break;
 
                 case 1:     // DD - IX prefix
-                    executeDDFD(m_ix, tState);
+                    prefixDDFD<Op>(m_ix, tState);
                     break;
 
                 case 2:     // ED - extensions prefix
-                    executeED(tState);
+                    prefixED<Op>(tState);
                     break;
 
                 case 3:     // FD - IY prefix
-                    executeDDFD(m_iy, tState);
+                    prefixDDFD<Op>(m_iy, tState);
                     break;
                 }
             }
@@ -2028,7 +2393,7 @@ void Z80::execute(u8 opCode, i64& tState)
         case 6:
             // C6, CE, D6, DE(), E6, EE, F6, FE - ALU A(),n
             d = PEEK(PC()++);
-            getAlu(y)(d);
+            alu(op, d);
             break;  // x, z = (3, 6)
 
         case 7:
@@ -2044,11 +2409,232 @@ void Z80::execute(u8 opCode, i64& tState)
     } // switch(x)
 }
 
-void Z80::step(i64& tState)
+template <typename Bus>
+void Z80<Bus>::execute(u8 opCode, i64& tState)
 {
-    assert(tState >= 0);
-    if (IFF1() && /*(*tState < 32)*/ m_interrupt && !m_eiHappened)
-    {
+    executeBase(DynamicOp(opCode), tState);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Block instructions
+//----------------------------------------------------------------------------------------------------------------------
+
+// Flags after LDI, LDD, LDIR and LDDR have moved v, with BC already decremented.
+template <typename Bus>
+void Z80<Bus>::ldFlags(u8 v)
+{
+    v += A();
+    F() = (F() & (F_CARRY | F_ZERO | F_SIGN)) | (BC() ? F_PARITY : 0) | (v & F_3) | ((v & 0x02) ? F_5 : 0);
+}
+
+// Flags after CPI, CPD, CPIR and CPDR have compared A with v, with BC already decremented.
+template <typename Bus>
+void Z80<Bus>::cpFlags(u8 v)
+{
+    u8 t = A() - v;
+    u8 lookup = ((A() & 0x08) >> 3) | ((v & 0x08) >> 2) | ((t & 0x08) >> 1);
+    u8 f = (F() & F_CARRY) | (BC() ? (F_PARITY | F_NEG) : F_NEG) | kHalfCarrySub[lookup] | (t ? 0 : F_ZERO) |
+        (t & F_SIGN);
+    if (f & F_HALF) --t;
+    F() = f | (t & F_3) | ((t & 0x02) ? F_5 : 0);
+}
+
+// Called when a repeating instruction has finished a pass and would be fetched again.  If run() would carry on
+// straight into it, does the two M1 cycles of that fetch and returns true.  Otherwise the caller must rewind PC, and
+// the next step() will fetch it.
+template <typename Bus>
+bool Z80<Bus>::repeatBlockOp(u8 opCode, TState& tState)
+{
+    const u16 pc = PC() - 2;
+    if (tState >= m_repeatLimit || isInterruptPending() ||
+        m_bus.peek(pc) != 0xed || m_bus.peek(u16(pc + 1)) != opCode)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < 2; ++i)
+    {
+        u8 r = R();
+        R() = (r & 0x80) | ((r + 1) & 0x7f);
+        CONTEND(u16(pc + i), 4, 1);
+    }
+    return true;
+}
+
+// The number of passes of LDxR or CPxR, starting just after the fetch, that run() would go through before reaching its
+// limit, up to maxPasses.  Uncontended, a pass is 13 t-states of work and then the 8 of the next fetch, with the limit
+// checked in between.
+template <typename Bus>
+int Z80<Bus>::bulkPasses(TState tState, int maxPasses)
+{
+    const TState passes = (m_repeatLimit - tState + 7) / 21;
+    return passes <= 0 ? 0 : int(min<TState>(passes, maxPasses));
+}
+
+// Does as many passes of LDIR (dir = 1) or LDDR (dir = -1) as possible in one go, stopping before the last so that the
+// normal path deals with the end of the instruction.  Does nothing if any of the memory involved is contended.
+template <typename Bus>
+void Z80<Bus>::bulkCopy(int dir, TState& tState)
+{
+    const u16 pc = PC() - 2;
+    const int n = bulkPasses(tState, BC() - 1);
+    if (n < 2 || m_bus.isContended(pc) || m_bus.isContended(u16(pc + 1))) return;
+
+    // Lowest addresses read and written.  The instruction mustn't overwrite itself, because the next fetch would see it.
+    const int from = dir > 0 ? HL() : HL() - (n - 1);
+    const int to = dir > 0 ? DE() : DE() - (n - 1);
+    if (from < 0 || to < 0 || (pc + 1 >= to && pc < to + n)) return;
+
+    const u8* src = m_bus.readDirect(u16(from), n);
+    u8* dst = src ? m_bus.writeDirect(u16(to), n) : nullptr;
+    if (!dst) return;
+
+    // A destination just ahead of the source in the direction of the copy repeats the bytes in between, which is how
+    // LDIR is used to fill memory.  memmove() would copy the original bytes instead.
+    const int ahead = (to - from) * dir;
+    if (ahead > 0 && ahead < n)
+    {
+        if (dir > 0)
+        {
+            for (int i = 0; i < n; ++i) dst[i] = src[i];
+        }
+        else
+        {
+            for (int i = n - 1; i >= 0; --i) dst[i] = src[i];
+        }
+    }
+    else
+    {
+        memmove(dst, src, n);
+    }
+
+    HL() = u16(HL() + dir * n);
+    DE() = u16(DE() + dir * n);
+    BC() -= u16(n);
+    ldFlags(dir > 0 ? dst[n - 1] : dst[0]);
+    R() = (R() & 0x80) | ((R() + 2 * n) & 0x7f);
+    tState += 21 * n;
+}
+
+// The index of the last byte in mem[0..n) equal to x, or -1.  memchr() has no standard reverse, so CPDR searches 16
+// bytes at a time from the end.
+static int findLastByte(const u8* mem, u8 x, int n)
+{
+    int i = n;
+#if NX_Z80_SSE2
+    const __m128i match = _mm_set1_epi8((char)x);
+    while (i >= 16)
+    {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(mem + i - 16)), match));
+        if (mask)
+        {
+            int bit = 15;
+            while (!(mask & (1 << bit))) --bit;
+            return i - 16 + bit;
+        }
+        i -= 16;
+    }
+#endif
+    while (--i >= 0)
+    {
+        if (mem[i] == x) return i;
+    }
+    return -1;
+}
+
+// As bulkCopy(), for CPIR and CPDR.  The passes stop short of a match, so that the normal path finds it.
+template <typename Bus>
+void Z80<Bus>::bulkSearch(int dir, TState& tState)
+{
+    const u16 pc = PC() - 2;
+    const int n = bulkPasses(tState, BC() - 1);
+    if (n < 2 || m_bus.isContended(pc) || m_bus.isContended(u16(pc + 1))) return;
+
+    const int from = dir > 0 ? HL() : HL() - (n - 1);
+    const u8* mem = from < 0 ? nullptr : m_bus.readDirect(u16(from), n);
+    if (!mem) return;
+
+    int passes = n;
+    u8 last;
+    if (dir > 0)
+    {
+        const u8* match = (const u8 *)memchr(mem, A(), n);
+        if (match) passes = int(match - mem);
+        last = passes ? mem[passes - 1] : 0;
+    }
+    else
+    {
+        const int match = findLastByte(mem, A(), n);
+        if (match >= 0) passes = n - 1 - match;
+        last = passes ? mem[n - passes] : 0;
+    }
+    if (!passes) return;
+
+    HL() = u16(HL() + dir * passes);
+    BC() -= u16(passes);
+    cpFlags(last);
+    R() = (R() & 0x80) | ((R() + 2 * passes) & 0x7f);
+    tState += 21 * passes;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Dispatch tables
+// Each handler is the shared instruction body instantiated with a StaticOp, so the decode of x/y/z/p/q and the
+// register and ALU selection are folded away at compile-time.
+//----------------------------------------------------------------------------------------------------------------------
+
+template <typename Bus> template <int N> void Z80<Bus>::opBase(Z80& cpu, i64& tState)  { cpu.executeBase(StaticOp<N>(), tState); }
+template <typename Bus> template <int N> void Z80<Bus>::opCB(Z80& cpu, i64& tState)    { cpu.executeCB(StaticOp<N>(), tState); }
+template <typename Bus> template <int N> void Z80<Bus>::opED(Z80& cpu, i64& tState)    { cpu.executeED(StaticOp<N>(), tState); }
+template <typename Bus> template <int N> void Z80<Bus>::opDD(Z80& cpu, i64& tState)    { cpu.executeDDFD(StaticOp<N>(), cpu.m_ix, tState); }
+template <typename Bus> template <int N> void Z80<Bus>::opFD(Z80& cpu, i64& tState)    { cpu.executeDDFD(StaticOp<N>(), cpu.m_iy, tState); }
+template <typename Bus> template <int N> void Z80<Bus>::opDDCB(Z80& cpu, i64& tState)  { cpu.executeDDFDCB(StaticOp<N>(), cpu.m_ix, tState); }
+template <typename Bus> template <int N> void Z80<Bus>::opFDCB(Z80& cpu, i64& tState)  { cpu.executeDDFDCB(StaticOp<N>(), cpu.m_iy, tState); }
+
+template <typename Bus> template <size_t... N> constexpr typename Z80<Bus>::OpTable Z80<Bus>::buildBaseOps(index_sequence<N...>)   { return {{ &Z80::opBase<N>... }}; }
+template <typename Bus> template <size_t... N> constexpr typename Z80<Bus>::OpTable Z80<Bus>::buildCBOps(index_sequence<N...>)     { return {{ &Z80::opCB<N>... }}; }
+template <typename Bus> template <size_t... N> constexpr typename Z80<Bus>::OpTable Z80<Bus>::buildEDOps(index_sequence<N...>)     { return {{ &Z80::opED<N>... }}; }
+template <typename Bus> template <size_t... N> constexpr typename Z80<Bus>::OpTable Z80<Bus>::buildDDOps(index_sequence<N...>)     { return {{ &Z80::opDD<N>... }}; }
+template <typename Bus> template <size_t... N> constexpr typename Z80<Bus>::OpTable Z80<Bus>::buildFDOps(index_sequence<N...>)     { return {{ &Z80::opFD<N>... }}; }
+template <typename Bus> template <size_t... N> constexpr typename Z80<Bus>::OpTable Z80<Bus>::buildDDCBOps(index_sequence<N...>)   { return {{ &Z80::opDDCB<N>... }}; }
+template <typename Bus> template <size_t... N> constexpr typename Z80<Bus>::OpTable Z80<Bus>::buildFDCBOps(index_sequence<N...>)   { return {{ &Z80::opFDCB<N>... }}; }
+
+template <typename Bus> const typename Z80<Bus>::OpTable Z80<Bus>::ms_baseOps = buildBaseOps(make_index_sequence<256>());
+template <typename Bus> const typename Z80<Bus>::OpTable Z80<Bus>::ms_cbOps   = buildCBOps(make_index_sequence<256>());
+template <typename Bus> const typename Z80<Bus>::OpTable Z80<Bus>::ms_edOps   = buildEDOps(make_index_sequence<256>());
+template <typename Bus> const typename Z80<Bus>::OpTable Z80<Bus>::ms_ddOps   = buildDDOps(make_index_sequence<256>());
+template <typename Bus> const typename Z80<Bus>::OpTable Z80<Bus>::ms_fdOps   = buildFDOps(make_index_sequence<256>());
+template <typename Bus> const typename Z80<Bus>::OpTable Z80<Bus>::ms_ddcbOps = buildDDCBOps(make_index_sequence<256>());
+template <typename Bus> const typename Z80<Bus>::OpTable Z80<Bus>::ms_fdcbOps = buildFDCBOps(make_index_sequence<256>());
+
+//----------------------------------------------------------------------------------------------------------------------
+// Stepping
+//----------------------------------------------------------------------------------------------------------------------
+
+template <typename Bus>
+void Z80<Bus>::step(i64& tState)
+{
+    assert(tState >= 0);
+    const bool interrupted = IFF1() && /*(*tState < 32)*/ m_interrupt && !m_eiHappened;
+#if NX_PROFILER || NX_TRACE || NX_CALL_STACK
+    const TState start = tState;
+    const u16 pc = PC();
+#endif
+#if NX_PROFILER
+    OpcodeProfile::Entry* entry = m_opcodeProfile ? &profileEntry() : nullptr;
+#endif
+#if NX_TRACE
+    // The bytes are read before running the instruction, in case it overwrites itself.
+    u8 bytes[4];
+    const int numBytes = (m_trace && !interrupted) ? traceBytes(pc, bytes) : 0;
+#endif
+#if NX_CALL_STACK
+    const u16 sp = SP();
+    const Transfer transfer = (m_callStack && !interrupted) ? callStackTransfer(pc) : Transfer::None;
+#endif
+
+    if (interrupted)
+    {
         IFF1() = false;
         IFF2() = false;
 
@@ -2068,7 +2654,7 @@ void Z80::step(i64& tState)
         {
             u16 p = (I() << 8) | 0xff;
             push(PC(), tState);
-            PC() = m_ext.peek16(p, tState);
+            PC() = m_bus.peek16(p, tState);
             tState += 7;
         }
         MP() = PC();
@@ -2080,19 +2666,1641 @@ void Z80::step(i64& tState)
         m_nmi = false;
 
         u8 opCode = fetchInstruction(tState);
-        execute(opCode, tState);
+        if (m_dispatch != Dispatch::Interpreter)
+        {
+            ms_baseOps[opCode](*this, tState);
+        }
+        else
+        {
+            execute(opCode, tState);
+        }
+
+#if NX_PROFILER
+        if (m_hotspotProfile) m_hotspotProfile->add(pc, tState - start);
+#endif
+    }
+
+#if NX_PROFILER
+    if (entry)
+    {
+        ++entry->count;
+        entry->tStates += tState - start;
+    }
+#endif
+
+#if NX_TRACE
+    if (m_trace)
+    {
+        u16 registers[kTraceNumRegs];
+        traceRegisters(registers);
+        m_trace->record(pc, bytes, numBytes, interrupted, start, registers);
+    }
+#endif
+
+#if NX_CALL_STACK
+    if (m_callStack) updateCallStack(transfer, interrupted, sp, tState - start);
+#endif
+}
+
+#if NX_PROFILER
+
+// The profile entry for what the next step will do.  The opcode bytes are read ahead without any timing, so that the
+// whole instruction, with the fetches of its prefixes, is charged to the table that finally runs it.
+template <typename Bus>
+OpcodeProfile::Entry& Z80<Bus>::profileEntry()
+{
+    using Table = OpcodeProfile::Table;
+    OpcodeProfile& profile = *m_opcodeProfile;
+
+    if (IFF1() && m_interrupt && !m_eiHappened) return profile.interrupts;
+
+    const u16 pc = PC();
+    const u8 opCode = m_bus.peek(pc);
+    const u8 opCode2 = m_bus.peek(u16(pc + 1));
+    switch (opCode)
+    {
+    case 0xcb:  return profile.ops[(int)Table::CB][opCode2];
+    case 0xed:  return profile.ops[(int)Table::ED][opCode2];
+
+    case 0xdd:
+    case 0xfd:
+        if (opCode2 == 0xcb)
+        {
+            return profile.ops[(int)(opCode == 0xdd ? Table::DDCB : Table::FDCB)][m_bus.peek(u16(pc + 3))];
+        }
+        return profile.ops[(int)(opCode == 0xdd ? Table::DD : Table::FD)][opCode2];
+
+    default:    return profile.ops[(int)Table::Base][opCode];
+    }
+}
+
+#endif
+
+#if NX_TRACE
+
+template <typename Bus>
+void Z80<Bus>::traceRegisters(u16* registers)
+{
+    registers[(int)TraceReg::AF] = AF();
+    registers[(int)TraceReg::BC] = BC();
+    registers[(int)TraceReg::DE] = DE();
+    registers[(int)TraceReg::HL] = HL();
+    registers[(int)TraceReg::AF_] = AF_();
+    registers[(int)TraceReg::BC_] = BC_();
+    registers[(int)TraceReg::DE_] = DE_();
+    registers[(int)TraceReg::HL_] = HL_();
+    registers[(int)TraceReg::IX] = IX();
+    registers[(int)TraceReg::IY] = IY();
+    registers[(int)TraceReg::SP] = SP();
+    registers[(int)TraceReg::IR] = IR();
+    registers[(int)TraceReg::WZ] = MP();
+}
+
+// Read the bytes of the instruction at pc without any timing, and return how many there are.  A prefix that is
+// followed by another prefix runs on its own.
+template <typename Bus>
+int Z80<Bus>::traceBytes(u16 pc, u8* bytes)
+{
+    bool endsBlock = false;
+    int numBytes = instructionLength(pc, endsBlock);
+    if (numBytes == 0) numBytes = 1;
+
+    for (int i = 0; i < numBytes; ++i) bytes[i] = m_bus.peek(u16(pc + i));
+    return numBytes;
+}
+
+#endif
+
+#if NX_CALL_STACK
+
+// What the instruction at pc might do to the call stack, read before it runs.  A DD or FD prefix in front of a call or
+// return is ignored by the CPU, and so is looked through here.
+template <typename Bus>
+typename Z80<Bus>::Transfer Z80<Bus>::callStackTransfer(u16 pc)
+{
+    u8 opCode = m_bus.peek(pc);
+    if (opCode == 0xdd || opCode == 0xfd) opCode = m_bus.peek(++pc);
+
+    if (opCode == 0xcd || (opCode & 0xc7) == 0xc4) return Transfer::Call;
+    if ((opCode & 0xc7) == 0xc7) return Transfer::Rst;
+    if (opCode == 0xc9 || (opCode & 0xc7) == 0xc0) return Transfer::Return;
+    if (opCode == 0xed && (m_bus.peek(u16(pc + 1)) & 0xc7) == 0x45) return Transfer::Return;    // RETN, RETI
+    return Transfer::None;
+}
+
+// Charge the instruction's t-states to the current routine, then follow the call or return if it happened.  A
+// conditional call pushed, and a conditional return popped, only if SP moved.
+template <typename Bus>
+void Z80<Bus>::updateCallStack(Transfer transfer, bool interrupted, u16 sp, TState t)
+{
+    m_callStack->charge(t);
+
+    const u16 newSp = SP();
+    CallStack::Kind kind;
+    if (interrupted)
+    {
+        kind = CallStack::Kind::Interrupt;
+    }
+    else if (transfer == Transfer::Call && newSp == u16(sp - 2))
+    {
+        kind = CallStack::Kind::Call;
+    }
+    else if (transfer == Transfer::Rst)
+    {
+        kind = CallStack::Kind::Rst;
     }
+    else
+    {
+        if (transfer == Transfer::Return && newSp == u16(sp + 2)) m_callStack->leave(sp);
+        return;
+    }
+
+    const u16 returnAddress = u16(m_bus.peek(newSp) | (m_bus.peek(u16(newSp + 1)) << 8));
+    m_callStack->enter(PC(), returnAddress, newSp, kind);
+}
+
+#endif
+
+// A halted CPU keeps executing the HALT opcode, which costs an M1 cycle and increments R each time.  Do all the cycles
+// up to the limit at once.  Returns false if it has to be done a step at a time because the fetches are contended or
+// every instruction is being traced.
+template <typename Bus>
+bool Z80<Bus>::skipHalt(TState& tState, TState limit)
+{
+    if (!isWaitingForInterrupt() || m_bus.isContended(PC())) return false;
+#if NX_TRACE
+    if (m_trace) return false;
+#endif
+
+    if (tState < limit)
+    {
+        const TState n = (limit - tState + 3) / 4;
+        tState += n * 4;
+        R() = (R() & 0x80) | ((R() + u8(n)) & 0x7f);
+#if NX_PROFILER
+        if (m_opcodeProfile)
+        {
+            OpcodeProfile::Entry& entry = m_opcodeProfile->ops[(int)OpcodeProfile::Table::Base][0x76];
+            entry.count += n;
+            entry.tStates += n * 4;
+        }
+        if (m_hotspotProfile) m_hotspotProfile->add(PC(), n * 4);
+#endif
+#if NX_CALL_STACK
+        if (m_callStack) m_callStack->charge(n * 4);
+#endif
+    }
+    return true;
 }
 
-void Z80::interrupt()
+template <typename Bus>
+void Z80<Bus>::interrupt()
 {
     m_interrupt = true;
 }
 
-void Z80::nmi()
+template <typename Bus>
+void Z80<Bus>::nmi()
 {
     m_nmi = true;
 }
 
+//----------------------------------------------------------------------------------------------------------------------
+// Block cache
+//----------------------------------------------------------------------------------------------------------------------
+
+template <typename Bus>
+const u8 Z80<Bus>::kBaseLength[256] =
+{
+    1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,
+    2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,
+    2, 3, 3, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1,
+    2, 3, 3, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1,
+    1, 1, 3, 2, 3, 1, 2, 1, 1, 1, 3, 2, 3, 1, 2, 1,
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 1, 2, 1,
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 1, 2, 1,
+};
+
+template <typename Bus>
+void Z80<Bus>::setDispatch(Dispatch dispatch)
+{
+    if (dispatch != m_dispatch)
+    {
+        // Blocks decoded for the JIT stop at I/O instructions, so they can't be shared with the block interpreter.
+        flushBlocks();
+    }
+
+    m_dispatch = dispatch;
+    if ((dispatch == Dispatch::Blocks || dispatch == Dispatch::Jit) && m_blocks.empty())
+    {
+        m_blocks.resize(kNumBlocks);
+    }
+}
+
+template <typename Bus>
+void Z80<Bus>::flushBlocks()
+{
+    for (Block& block : m_blocks) block.address = kNoBlock;
+}
+
+// Returns the length of the instruction at address, or 0 if it can't be worked out without executing it.  endsBlock
+// is set for instructions that always leave the block (unconditional jumps, returns and HALT) or change whether
+// interrupts can be taken.
+template <typename Bus>
+int Z80<Bus>::instructionLength(u16 address, bool& endsBlock)
+{
+    u8 opCode = m_bus.peek(address);
+    u8 opCode2 = m_bus.peek(address + 1);
+
+    switch (opCode)
+    {
+    case 0x18:  // JR d
+    case 0x76:  // HALT
+    case 0xc3:  // JP nn
+    case 0xc9:  // RET
+    case 0xe9:  // JP (HL)
+    case 0xfb:  // EI
+    case 0xc7: case 0xcf: case 0xd7: case 0xdf: case 0xe7: case 0xef: case 0xf7: case 0xff:    // RST n
+        endsBlock = true;
+        return kBaseLength[opCode];
+
+    case 0xcb:
+        return 2;
+
+    case 0xed:
+        // RETN/RETI restore IFF1
+        endsBlock = (opCode2 & 0xc7) == 0x45;
+        return (opCode2 & 0xc7) == 0x43 ? 4 : 2;
+
+    case 0xdd:
+    case 0xfd:
+        switch (opCode2)
+        {
+        case 0xcb:
+            return 4;
+
+        case 0xdd:
+        case 0xed:
+        case 0xfd:
+            endsBlock = true;
+            return 0;
+
+        case 0xe9:  // JP (IX)
+            endsBlock = true;
+            return 2;
+
+        default:
+            {
+                const u8 x = opCode2 >> 6, y = (opCode2 >> 3) & 7, z = opCode2 & 7;
+                bool indexed =
+                    (opCode2 >= 0x34 && opCode2 <= 0x36) ||
+                    (x == 1 && (y == 6 || z == 6) && opCode2 != 0x76) ||
+                    (x == 2 && z == 6);
+                return 1 + kBaseLength[opCode2] + (indexed ? 1 : 0);
+            }
+        }
+
+    default:
+        return kBaseLength[opCode];
+    }
+}
+
+template <typename Bus>
+bool Z80<Bus>::isIoInstruction(u8 opCode, u8 opCode2)
+{
+    switch (opCode)
+    {
+    case 0xd3:  // OUT (n),A
+    case 0xdb:  // IN A,(n)
+        return true;
+
+    case 0xdd:
+    case 0xfd:
+        return opCode2 == 0xd3 || opCode2 == 0xdb;
+
+    case 0xed:
+        // IN r,(C), OUT (C),r and the block I/O instructions
+        return
+            ((opCode2 & 0xc6) == 0x40) ||
+            ((opCode2 & 0xe6) == 0xa2);
+
+    default:
+        return false;
+    }
+}
+
+template <typename Bus>
+void Z80<Bus>::decodeBlock(Block& block, u16 address, u32 generation)
+{
+    block.address = address;
+    block.generation = generation;
+    block.numOps = 0;
+    block.hits = 0;
+    block.code = nullptr;
+
+    int a = address;
+    const int pageEnd = (address & 0xff00) + 0x100;
+    bool endsBlock = false;
+
+    while (!endsBlock && block.numOps < kMaxBlockOps)
+    {
+        u8 opCode = m_bus.peek(u16(a));
+        u8 opCode2 = m_bus.peek(u16(a + 1));
+        // The recompiler leaves I/O to step().
+        if (m_dispatch == Dispatch::Jit && isIoInstruction(opCode, opCode2)) break;
+
+        BlockOp op;
+        op.address = u16(a);
+        switch (opCode)
+        {
+        case 0xcb:  op.handler = ms_cbOps[opCode2];     op.fetches = 2;     break;
+        case 0xdd:  op.handler = ms_ddOps[opCode2];     op.fetches = 2;     break;
+        case 0xed:  op.handler = ms_edOps[opCode2];     op.fetches = 2;     break;
+        case 0xfd:  op.handler = ms_fdOps[opCode2];     op.fetches = 2;     break;
+        default:    op.handler = ms_baseOps[opCode];    op.fetches = 1;     break;
+        }
+        op.prefix = (op.fetches == 2) ? opCode : 0;
+        op.opCode = (op.fetches == 2) ? opCode2 : opCode;
+        op.fused = 0;
+
+        // The opcode bytes must lie in the page being tracked.  Operands are read by the handlers when they run, so
+        // they can't go stale.
+        if (a + op.fetches > pageEnd) break;
+
+#if NX_FUSION
+        int len = fuseOps(op, a, pageEnd);
+        if (len == 0) len = instructionLength(u16(a), endsBlock);
+#else
+        int len = instructionLength(u16(a), endsBlock);
+#endif
+        block.ops[block.numOps++] = op;
+        if (len == 0) break;
+        a += len;
+    }
+}
+
+// Checks whether the opcodes a block was decoded from are still in memory.  The operands don't matter because the
+// handlers read those as they run.
+template <typename Bus>
+bool Z80<Bus>::isBlockUnchanged(const Block& block)
+{
+    for (int i = 0; i < block.numOps; ++i)
+    {
+        const BlockOp& op = block.ops[i];
+        if (op.fetches == 2)
+        {
+            if (m_bus.peek(op.address) != op.prefix || m_bus.peek(op.address + 1) != op.opCode) return false;
+        }
+        else
+        {
+            if (m_bus.peek(op.address) != op.opCode) return false;
+        }
+
+        // The opcodes of fused instructions follow on from the first, with no operands in between.
+        for (int j = 0; j < op.fused; ++j)
+        {
+            if (m_bus.peek(u16(op.address + 1 + j)) != op.fusedOpCodes[j]) return false;
+        }
+    }
+
+    return true;
+}
+
+template <typename Bus>
+void Z80<Bus>::runBlocks(TState& tState, TState limit)
+{
+    const u32* generations = m_bus.pageGenerations();
+
+    while (tState < limit)
+    {
+        if (m_halt && skipHalt(tState, limit)) break;
+
+        // Accepting an interrupt, and the instruction after an EI, go through the normal path.
+        if (m_eiHappened || (m_interrupt && IFF1()))
+        {
+            step(tState);
+            continue;
+        }
+
+        const u16 pc = PC();
+        const u32 generation = generations[pc >> 8];
+        Block& block = m_blocks[pc & (kNumBlocks - 1)];
+        if (block.address != pc)
+        {
+            decodeBlock(block, pc, generation);
+        }
+        else if (block.generation != generation)
+        {
+#if NX_JIT
+            // Recompiled code is checked against the bytes it was compiled from, which include its operands.
+            if (block.code && !isCodeUnchanged(block))
+            {
+                block.code = nullptr;
+                block.hits = 0;
+            }
+            if (block.code)
+            {
+                block.generation = generation;
+            }
+            else
+#endif
+            if (isBlockUnchanged(block))
+            {
+                block.generation = generation;
+            }
+            else
+            {
+                decodeBlock(block, pc, generation);
+            }
+        }
+
+        if (block.numOps == 0)
+        {
+            // The first opcode straddles a page boundary, or is I/O.
+            step(tState);
+            continue;
+        }
+
+        m_nmi = false;
+
+#if NX_JIT
+        if (m_dispatch == Dispatch::Jit)
+        {
+            if (!block.code && ++block.hits == kJitThreshold)
+            {
+                compileBlock(block);
+            }
+            if (block.code)
+            {
+                ((JitFunc)block.code)(this, &tState, limit);
+                continue;
+            }
+        }
+#endif
+
+        const BlockOp* op = block.ops;
+        const BlockOp* end = block.ops + block.numOps;
+        for (;;)
+        {
+            // Perform the M1 cycles that fetchInstruction would have done.  The opcodes are already known.
+            for (int i = 0; i < op->fetches; ++i)
+            {
+                u8 r = R();
+                R() = (r & 0x80) | ((r + 1) & 0x7f);
+                m_bus.fetch(PC()++, tState);
+            }
+            op->handler(*this, tState);
+
+            if (++op == end ||
+                tState >= limit ||
+                PC() != op->address ||
+                generations[pc >> 8] != generation)
+            {
+                break;
+            }
+        }
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Fused instructions
+//----------------------------------------------------------------------------------------------------------------------
+
+#if NX_FUSION
+
+// If the instructions at address form a sequence with a fused handler, sets up op to run them and returns their total
+// length.  Otherwise returns 0 and leaves op alone.
+template <typename Bus>
+int Z80<Bus>::fuseOps(BlockOp& op, int address, int pageEnd)
+{
+    struct Sequence
+    {
+        OpHandler   handler;
+        int         length;         // Bytes matched, including the last instruction's operand if it has one
+        u8          bytes[5];
+    };
+
+    static const Sequence kSequences[] =
+    {
+        { &opDecBCLoop,         5,  { 0x0b, 0x78, 0xb1, 0x20, 0xfb } },     // DEC BC; LD A,B; OR C; JR NZ,$-3
+        { &opDecBLoop,          3,  { 0x05, 0x20, 0xfd } },                 // DEC B; JR NZ,$-1
+        { &opFused<0x05, 0x20>, 2,  { 0x05, 0x20 } },                       // DEC B; JR NZ,d
+        { &opDjnzLoop,          2,  { 0x10, 0xfe } },                       // DJNZ $
+        { &opFused<0x7e, 0x23>, 2,  { 0x7e, 0x23 } },                       // LD A,(HL); INC HL
+    };
+
+    if (op.fetches != 1) return 0;
+
+    for (const Sequence& seq : kSequences)
+    {
+        if (address + seq.length > pageEnd) continue;
+
+        bool match = true;
+        for (int i = 0; i < seq.length && match; ++i) match = m_bus.peek(u16(address + i)) == seq.bytes[i];
+        if (!match) continue;
+
+        // Each fused instruction is one opcode byte, and only the last can have an operand.  That operand byte is
+        // read again when the handler runs, so it doesn't need to be checked when the block is revalidated.
+        op.handler = seq.handler;
+        op.fused = 0;
+        for (int i = 1; i < seq.length && kBaseLength[seq.bytes[i - 1]] == 1; ++i)
+        {
+            op.fusedOpCodes[op.fused++] = seq.bytes[i];
+        }
+        int length = 0;
+        for (int i = 0; i <= op.fused; ++i) length += kBaseLength[seq.bytes[i]];
+        return length;
+    }
+
+    return 0;
+}
+
+// The M1 cycle of an instruction after the first in a fused op, as runBlocks() would have done it.
+template <typename Bus>
+void Z80<Bus>::fetchFused(i64& tState)
+{
+    u8 r = R();
+    R() = (r & 0x80) | ((r + 1) & 0x7f);
+    m_bus.fetch(PC()++, tState);
+}
+
+// True if nothing a counting loop does can be contended: its bytes, and the IR value used by DJNZ and DEC rr.  R
+// changes on every pass, but buses contend whole pages or more, so the ends of I's page stand for all of them.
+template <typename Bus>
+bool Z80<Bus>::isLoopUncontended(u16 head, int length, bool contendsIR)
+{
+    for (int i = 0; i < length; ++i)
+    {
+        if (m_bus.isContended(u16(head + i))) return false;
+    }
+    return !contendsIR || (!m_bus.isContended(u16(I() << 8)) && !m_bus.isContended(u16((I() << 8) | 0xff)));
+}
+
+// The number of passes of a loop, each taking period t-states, that run() would go through before reaching its limit,
+// up to maxPasses.  The limit is checked before every instruction, so all of a pass but its last instruction must
+// start before the limit.
+template <typename Bus>
+int Z80<Bus>::loopPasses(TState tState, int period, int lastLength, int maxPasses)
+{
+    const TState passes = (m_repeatLimit - tState + lastLength - 1) / period;
+    return passes <= 0 ? 0 : int(min<TState>(passes, maxPasses));
+}
+
+template <typename Bus>
+template <int N>
+void Z80<Bus>::executeFused(i64& tState)
+{
+    executeBase(StaticOp<N>(), tState);
+}
+
+template <typename Bus>
+template <int N, int N2, int... Rest>
+void Z80<Bus>::executeFused(i64& tState)
+{
+    executeBase(StaticOp<N>(), tState);
+    if (tState >= m_repeatLimit) return;
+    fetchFused(tState);
+    executeFused<N2, Rest...>(tState);
+}
+
+// A straight sequence of instructions.  The block loop has already done the first M1 cycle.
+template <typename Bus>
+template <int... N>
+void Z80<Bus>::opFused(Z80& cpu, i64& tState)
+{
+    cpu.executeFused<N...>(tState);
+}
+
+// DJNZ $: 13 t-states a pass.
+template <typename Bus>
+void Z80<Bus>::opDjnzLoop(Z80& cpu, i64& tState)
+{
+    const u16 head = cpu.PC() - 1;
+    cpu.executeFused<0x10>(tState);
+    if (cpu.PC() != head || !cpu.isLoopUncontended(head, 2, true)) return;
+
+    // Every pass but the last jumps back, and B = 0 counts 256.
+    const int n = cpu.loopPasses(tState, 13, 13, u8(cpu.B() - 1));
+    cpu.B() -= u8(n);
+    cpu.R() = (cpu.R() & 0x80) | ((cpu.R() + n) & 0x7f);
+    tState += 13 * n;
+}
+
+// DEC B; JR NZ,$-1: 16 t-states a pass.
+template <typename Bus>
+void Z80<Bus>::opDecBLoop(Z80& cpu, i64& tState)
+{
+    const u16 head = cpu.PC() - 1;
+    cpu.executeFused<0x05, 0x20>(tState);
+    if (cpu.PC() != head || !cpu.isLoopUncontended(head, 3, false)) return;
+
+    const int n = cpu.loopPasses(tState, 16, 12, u8(cpu.B() - 1));
+    if (n == 0) return;
+
+    // The flags only depend on the last decrement.
+    cpu.B() -= u8(n - 1);
+    cpu.decReg8(cpu.B());
+    cpu.R() = (cpu.R() & 0x80) | ((cpu.R() + 2 * n) & 0x7f);
+    tState += 16 * n;
+}
+
+// DEC BC; LD A,B; OR C; JR NZ,$-3: 26 t-states a pass.
+template <typename Bus>
+void Z80<Bus>::opDecBCLoop(Z80& cpu, i64& tState)
+{
+    const u16 head = cpu.PC() - 1;
+    cpu.executeFused<0x0b, 0x78, 0xb1, 0x20>(tState);
+    if (cpu.PC() != head || !cpu.isLoopUncontended(head, 5, true)) return;
+
+    const int n = cpu.loopPasses(tState, 26, 12, u16(cpu.BC() - 1));
+    if (n == 0) return;
+
+    cpu.BC() -= u16(n);
+    cpu.A() = cpu.B();
+    cpu.orReg8(cpu.C());
+    cpu.R() = (cpu.R() & 0x80) | ((cpu.R() + 4 * n) & 0x7f);
+    tState += 26 * n;
+}
+
+#endif // NX_FUSION
+
+//----------------------------------------------------------------------------------------------------------------------
+// Recompiler
+//----------------------------------------------------------------------------------------------------------------------
+
+#if NX_JIT
+
+template <typename Bus>
+void Z80<Bus>::jitFetch(Z80& cpu, i64& tState)
+{
+    cpu.m_bus.fetch(cpu.PC()++, tState);
+}
+
+template <typename Bus>
+u8 Z80<Bus>::jitCarry(Z80& cpu, int)
+{
+    return cpu.carryFlag();
+}
+
+template <typename Bus>
+u8 Z80<Bus>::jitCondition(Z80& cpu, int y)
+{
+    return cpu.condition(u8(y)) ? 1 : 0;
+}
+
+// Called by the dispatcher for the block at PC when its page has been written to.  Does what runBlocks() would, short
+// of decoding the block again.
+template <typename Bus>
+u8 Z80<Bus>::jitRevalidate(Z80& cpu, int)
+{
+    const u16 pc = cpu.PC();
+    Block& block = cpu.m_blocks[pc & (kNumBlocks - 1)];
+    if (!cpu.isCodeUnchanged(block)) return 0;
+
+    block.generation = cpu.m_bus.pageGenerations()[pc >> 8];
+    return 1;
+}
+
+// Checks memory against the bytes a block's recompiled code was compiled from, which take in every opcode as well as
+// the operands built into the code.
+template <typename Bus>
+bool Z80<Bus>::isCodeUnchanged(const Block& block)
+{
+    if (const u8* memory = m_bus.readDirect(u16(block.address), block.codeLength))
+    {
+        return memcmp(memory, block.codeBytes, block.codeLength) == 0;
+    }
+    for (int i = 0; i < block.codeLength; ++i)
+    {
+        if (m_bus.peek(u16(block.address + i)) != block.codeBytes[i]) return false;
+    }
+    return true;
+}
+
+// True if op's handler doesn't use PC or R, write to memory or jump, so the code needn't bring PC and R up to date
+// before calling it, or check on them afterwards.
+template <typename Bus>
+bool Z80<Bus>::isJitPure(const BlockOp& op)
+{
+    if (op.fused) return false;
+
+    const u8 x = op.opCode >> 6, y = (op.opCode >> 3) & 7, z = op.opCode & 7, p = y >> 1, q = y & 1;
+    switch (op.prefix)
+    {
+    case 0:
+        switch (x)
+        {
+        case 0:     return z == 7 || z == 3 || (z == 1 && q == 1) || ((z == 4 || z == 5) && y != 6);
+        case 1:     return y != 6;                                      // LD r,r' and LD r,(HL)
+        case 2:     return true;                                        // ALU A,r and ALU A,(HL)
+        default:    return (z == 1 && (q == 0 || p == 1 || p == 3)) ||  // POP, EXX, LD SP,HL
+                        (z == 3 && y == 5);                             // EX DE,HL
+        }
+
+    case 0xcb:
+        return z != 6 || x == 1;                                        // Registers, and BIT n,(HL)
+
+    default:
+        return false;
+    }
+}
+
+// Memory in the top 32K, as a pointer to address 0, if the bus lets it be read directly.  It is never contended and
+// holds no ROM or screen, so it can be written directly as well, as long as the page generations are bumped.
+template <typename Bus>
+const u8* Z80<Bus>::jitMemory()
+{
+    const u8* top = m_bus.readDirect(0x8000, 0x8000);
+    return top ? top - 0x8000 : nullptr;
+}
+
+// Writes PC and R back to memory.
+template <typename Bus>
+void Z80<Bus>::compileSync(X64Emitter& x64, JitState& state)
+{
+    if (!state.pcStored) x64.storeWordImm(jitOffset(&PC()), state.pc);
+    if (state.pendingR) x64.addR7(jitOffset(&R()), state.pendingR);
+    state.pcStored = true;
+    state.pendingR = 0;
+}
+
+// Pushes ecx, with the new SP in eax.
+template <typename Bus>
+void Z80<Bus>::compilePush(X64Emitter& x64, const u8* memory)
+{
+    using X = X64Emitter;
+    x64.storeWord(jitOffset(&SP()), X::Eax);
+    x64.storeWordAt(memory, X::Eax, X::Ecx);
+    compileWritten(x64, true);
+}
+
+// Pops into ecx, with SP in eax.
+template <typename Bus>
+void Z80<Bus>::compilePop(X64Emitter& x64, const u8* memory)
+{
+    using X = X64Emitter;
+    x64.loadWordAt(X::Ecx, memory, X::Eax);
+    x64.addImm(X::Eax, 2);
+    x64.storeWord(jitOffset(&SP()), X::Eax);
+}
+
+// Bumps the generations of the pages written by storing a byte or word at the address in eax.  Changes eax and edx.
+template <typename Bus>
+void Z80<Bus>::compileWritten(X64Emitter& x64, bool word)
+{
+    using X = X64Emitter;
+    const u32* generations = m_bus.pageGenerations();
+    if (word)
+    {
+        x64.moveReg(X::Edx, X::Eax);
+        x64.addImm(X::Edx, 1);
+        x64.shiftRight(X::Edx, 8);
+        x64.incCounterAt(generations, X::Edx);
+    }
+    x64.shiftRight(X::Eax, 8);
+    x64.incCounterAt(generations, X::Eax);
+}
+
+// Puts the carry flag in eax, as 0 or 1.
+template <typename Bus>
+void Z80<Bus>::compileCarry(X64Emitter& x64, const JitState& state)
+{
+#if NX_LAZY_FLAGS
+    switch (state.flags)
+    {
+    case kJitFlagsUnknown:
+        x64.callHelper((const void *)&jitCarry, 0);
+        x64.andImm(X64Emitter::Eax, 1);
+        return;
+
+    case int(FlagOp::Add):
+    case int(FlagOp::Sub):
+    case int(FlagOp::Cp):
+        x64.loadByte(X64Emitter::Eax, jitOffset(&m_flagResult) + 1);
+        x64.andImm(X64Emitter::Eax, 1);
+        return;
+
+    case int(FlagOp::And):
+    case int(FlagOp::Or):
+        x64.moveImm(X64Emitter::Eax, 0);
+        return;
+
+    case int(FlagOp::Inc):
+    case int(FlagOp::Dec):
+        x64.loadByte(X64Emitter::Eax, jitOffset(&m_flagX));
+        return;
+    }
+#endif
+
+    x64.loadByte(X64Emitter::Eax, jitOffset(&m_af.l));
+    x64.andImm(X64Emitter::Eax, F_CARRY);
+}
+
+// Tests condition y (as in JP cc) and returns the position of a jump to patch with where to go if it is false.  If the
+// answer is already known, nothing is generated and always or never is set instead.
+template <typename Bus>
+size_t Z80<Bus>::compileJumpUnless(X64Emitter& x64, JitState& state, u8 y, bool& always, bool& never)
+{
+    static const u8 kMasks[4] = { F_ZERO, F_CARRY, F_PARITY, F_SIGN };
+    const bool ifSet = (y & 1) != 0;
+    always = never = false;
+
+    // Each test leaves ZF set when the flag is clear.
+#if NX_LAZY_FLAGS
+    if (state.flags != int(FlagOp::None))
+    {
+        const i32 result = jitOffset(&m_flagResult);
+        switch (state.flags == kJitFlagsUnknown ? -1 : y >> 1)
+        {
+        case 0:
+            // Z is set when the result is zero, so the sense is reversed.
+            x64.testByte(result, 0xff);
+            return x64.jumpIf(ifSet ? X64Emitter::Cond::NotEqual : X64Emitter::Cond::Equal);
+
+        case 1:
+            if (state.flags == int(FlagOp::And) || state.flags == int(FlagOp::Or))
+            {
+                always = !ifSet;
+                never = ifSet;
+                return 0;
+            }
+            if (state.flags == int(FlagOp::Inc) || state.flags == int(FlagOp::Dec))
+            {
+                x64.testByte(jitOffset(&m_flagX), 0xff);
+            }
+            else
+            {
+                x64.testByte(result + 1, 0x01);
+            }
+            break;
+
+        case 3:
+            x64.testByte(result, 0x80);
+            break;
+
+        default:
+            // Not known, or P/V, which needs all of F.
+            x64.callHelper((const void *)&jitCondition, y);
+            x64.testLow(X64Emitter::Eax);
+            state.flags = kJitFlagsUnknown;
+            return x64.jumpIf(X64Emitter::Cond::Equal);
+        }
+        return x64.jumpIf(ifSet ? X64Emitter::Cond::Equal : X64Emitter::Cond::NotEqual);
+    }
+#endif
+
+    x64.testByte(jitOffset(&m_af.l), kMasks[y >> 1]);
+    return x64.jumpIf(ifSet ? X64Emitter::Cond::Equal : X64Emitter::Cond::NotEqual);
+}
+
+// A jump that has been taken, with PC going to target.  A jump back to the start of the block carries on round the
+// loop while there is time left, since nothing runBlocks() checks between blocks can change inside one.
+template <typename Bus>
+void Z80<Bus>::compileJump(X64Emitter& x64, const JitState& state, const Block& block, u16 target, size_t top,
+    vector<JitExit>& exits)
+{
+    JitState taken = state;
+    taken.pc = target;
+    taken.pcStored = false;
+
+    if (target == block.address)
+    {
+        exits.push_back({ x64.exitIfPastLimit(), taken, nullptr, true });
+        compileSync(x64, taken);
+        x64.patch(x64.jump(), top);
+    }
+    else
+    {
+        exits.push_back({ x64.jump(), taken, nullptr });
+    }
+}
+
+#if NX_LAZY_FLAGS
+
+// ALU(y) A,operand, where the operand is the byte at src, or n if src is null.
+template <typename Bus>
+void Z80<Bus>::compileAlu(X64Emitter& x64, JitState& state, u8 y, const u8* src, u8 n)
+{
+    using X = X64Emitter;
+    const i32 a = jitOffset(&A());
+    const i32 result = jitOffset(&m_flagResult);
+    const bool withCarry = (y == 1 || y == 3);
+
+    if (withCarry) compileCarry(x64, state);
+    x64.loadByte(X::Ecx, a);
+    if (src)
+    {
+        x64.loadByte(X::Edx, jitOffset(src));
+    }
+    else
+    {
+        x64.moveImm(X::Edx, n);
+    }
+
+    FlagOp op;
+    switch (y)
+    {
+    case 0:     // ADD
+    case 1:     // ADC
+        x64.storeByte(jitOffset(&m_flagX), X::Ecx);
+        x64.storeByte(jitOffset(&m_flagY), X::Edx);
+        x64.alu(X::Alu::Add, X::Ecx, X::Edx);
+        if (withCarry) x64.alu(X::Alu::Add, X::Ecx, X::Eax);
+        x64.storeWord(result, X::Ecx);
+        x64.storeByte(a, X::Ecx);
+        op = FlagOp::Add;
+        break;
+
+    case 2:     // SUB
+    case 3:     // SBC
+    case 7:     // CP
+        x64.storeByte(jitOffset(&m_flagX), X::Ecx);
+        x64.storeByte(jitOffset(&m_flagY), X::Edx);
+        x64.alu(X::Alu::Sub, X::Ecx, X::Edx);
+        if (withCarry) x64.alu(X::Alu::Sub, X::Ecx, X::Eax);
+        x64.storeWord(result, X::Ecx);
+        if (y != 7) x64.storeByte(a, X::Ecx);
+        op = (y == 7) ? FlagOp::Cp : FlagOp::Sub;
+        break;
+
+    default:    // AND, XOR, OR
+        x64.alu(y == 4 ? X::Alu::And : (y == 5 ? X::Alu::Xor : X::Alu::Or), X::Ecx, X::Edx);
+        x64.storeByte(a, X::Ecx);
+        x64.storeWord(result, X::Ecx);
+        x64.storeByteImm(jitOffset(&m_flagX), 0);
+        x64.storeByteImm(jitOffset(&m_flagY), 0);
+        op = (y == 4) ? FlagOp::And : FlagOp::Or;
+        break;
+    }
+
+    x64.storeByteImm(jitOffset(&m_flagOp), u8(op));
+    state.flags = int(op);
+}
+
+// INC r or DEC r.  An earlier INC or DEC has already left the carry in m_flagX.
+template <typename Bus>
+void Z80<Bus>::compileIncDec(X64Emitter& x64, JitState& state, u8& reg, bool dec)
+{
+    using X = X64Emitter;
+    const FlagOp op = dec ? FlagOp::Dec : FlagOp::Inc;
+
+    if (state.flags != int(FlagOp::Inc) && state.flags != int(FlagOp::Dec))
+    {
+        compileCarry(x64, state);
+        x64.storeByte(jitOffset(&m_flagX), X::Eax);
+    }
+    if (dec)
+    {
+        x64.decByte(jitOffset(&reg));
+    }
+    else
+    {
+        x64.incByte(jitOffset(&reg));
+    }
+    x64.loadByte(X::Ecx, jitOffset(&reg));
+    x64.storeWord(jitOffset(&m_flagResult), X::Ecx);
+    x64.storeByteImm(jitOffset(&m_flagY), 0);
+    x64.storeByteImm(jitOffset(&m_flagOp), u8(op));
+    state.flags = int(op);
+}
+
+#endif // NX_LAZY_FLAGS
+
+// Generates an unprefixed instruction inline, if it is one of the common ones and its bytes are uncontended.  Returns
+// false, having generated nothing, otherwise.  Memory is only accessed inline in the top 32K; at other addresses, an
+// instruction that carries on through the block calls its handler and comes back, and one that jumps leaves through
+// it.
+template <typename Bus>
+bool Z80<Bus>::compileNative(X64Emitter& x64, JitState& state, const Block& block, const BlockOp& op, size_t top,
+    vector<JitExit>& exits)
+{
+    if (op.fetches != 1 || op.fused != 0) return false;
+
+    const u8 opCode = op.opCode;
+    const int length = kBaseLength[opCode];
+    if ((op.address & 0xff) + length > 0x100) return false;
+    for (int i = 0; i < length; ++i)
+    {
+        if (m_bus.isContended(u16(op.address + i))) return false;
+    }
+
+    const u8 x = opCode >> 6, y = (opCode >> 3) & 7, z = opCode & 7, p = y >> 1, q = y & 1;
+    const u8 n = m_bus.peek(u16(op.address + 1));
+    const u16 nn = u16(n | (m_bus.peek(u16(op.address + 2)) << 8));
+    const u16 next = u16(op.address + length);
+    const u16 target = u16(next + (i8)n);
+    const i32 mp = jitOffset(&MP());
+    const u8* memory = jitMemory();
+    const bool direct = memory && nn >= 0x8000 && (p != 2 || nn != 0xffff);   // For (nn), where p == 2 is a word
+
+    // DJNZ, INC rr, DEC rr, RET cc and PUSH rr spend time with IR on the address bus.  That time is built in, so if I
+    // has changed, the instruction goes through its handler instead, and the code is left.
+    const bool contendsIR = (opCode == 0x10) || (x == 0 && z == 3) || (x == 3 && (z == 0 || (z == 5 && q == 0)));
+    if (contendsIR && (m_bus.isContended(u16(I() << 8)) || m_bus.isContended(u16((I() << 8) | 0xff)))) return false;
+
+    bool supported;
+    switch (x)
+    {
+    case 0:
+        switch (z)
+        {
+        case 0:     supported = (y != 1);                   break;      // Not EX AF,AF'
+        case 1:     supported = (q == 0);                   break;      // LD rr,nn
+        case 2:     supported = memory && (p < 2 || direct);    break;  // LD (rr),A, LD A,(rr) and (nn) loads
+        case 3:     supported = true;                       break;      // INC rr, DEC rr
+        case 4:
+        case 5:     supported = NX_LAZY_FLAGS && y != 6;    break;      // INC r, DEC r
+        case 6:     supported = (y != 6);                   break;      // LD r,n
+        default:    supported = false;                      break;
+        }
+        break;
+
+    case 1:         supported = (y != 6 || z != 6) && (memory || (y != 6 && z != 6));  break;  // LD, not HALT
+    case 2:         supported = NX_LAZY_FLAGS && z != 6;    break;      // ALU A,r
+
+    default:
+        supported =
+            (z == 1 && q == 1 && p != 0 && p != 3) ||                   // EXX, JP (HL)
+            z == 2 ||                                                   // JP cc,nn
+            (z == 3 && (y == 0 || y == 5)) ||                           // JP nn, EX DE,HL
+            (z == 6 && NX_LAZY_FLAGS) ||                                // ALU A,n
+            (memory && (z == 0 || z == 4 || opCode == 0xc9 || opCode == 0xcd)) ||       // RET, CALL
+            (memory && (z == 1 || z == 5) && q == 0 && p != 3);         // POP rr, PUSH rr, but not AF
+        break;
+    }
+    if (!supported) return false;
+
+    using X = X64Emitter;
+    if (contendsIR) exits.push_back({ x64.exitIfByteNotEqual(jitOffset(&I()), I()), state, &op });
+    const JitState before = state;
+    ++state.pendingR;
+
+    // The state once the instruction has run, for leaving after a write, in case it was to this block's page.
+    JitState after = state;
+    after.pc = next;
+    after.pcStored = false;
+
+    bool always, never;
+    size_t notTaken = 0;
+    size_t slow = 0;
+
+    switch (x)
+    {
+    case 0:
+        switch (z)
+        {
+        case 0:
+            if (y == 0)
+            {
+                // NOP
+                x64.addTState(4);
+            }
+            else if (y == 2)
+            {
+                // DJNZ d
+                x64.addTState(8);
+                x64.decByte(jitOffset(&B()));
+                notTaken = x64.jumpIf(X64Emitter::Cond::Equal);
+                x64.addTState(5);
+                x64.storeWordImm(mp, target);
+                compileJump(x64, state, block, target, top, exits);
+                x64.patch(notTaken, x64.pos());
+            }
+            else if (y == 3)
+            {
+                // JR d
+                x64.addTState(12);
+                x64.storeWordImm(mp, target);
+                compileJump(x64, state, block, target, top, exits);
+            }
+            else
+            {
+                // JR cc,d
+                x64.addTState(7);
+                notTaken = compileJumpUnless(x64, state, y - 4, always, never);
+                if (!never)
+                {
+                    x64.addTState(5);
+                    x64.storeWordImm(mp, target);
+                    compileJump(x64, state, block, target, top, exits);
+                }
+                if (!always && !never) x64.patch(notTaken, x64.pos());
+            }
+            break;
+
+        case 1:
+            // LD rr,nn
+            x64.addTState(10);
+            x64.storeWordImm(jitOffset(&getReg16_1(p)), nn);
+            break;
+
+        case 2:
+        {
+            // LD (BC),A, LD A,(BC), LD (DE),A, LD A,(DE), LD (nn),HL, LD HL,(nn), LD (nn),A, LD A,(nn)
+            const bool word = (p == 2);
+            const i32 reg = word ? jitOffset(&HL()) : jitOffset(&A());
+            if (p < 2)
+            {
+                x64.loadWord(X::Eax, jitOffset(&getReg16_1(p)));
+                slow = x64.jumpIfOutside(X::Eax, 0x8000, 0xffff);
+                x64.addTState(7);
+            }
+            else
+            {
+                x64.moveImm(X::Eax, nn);
+                x64.addTState(word ? 16 : 13);
+            }
+
+            if (q == 0)
+            {
+                if (word)
+                {
+                    x64.loadWord(X::Ecx, reg);
+                }
+                else
+                {
+                    x64.loadByte(X::Ecx, reg);
+                }
+            }
+
+            // MP is the address + 1, with A in the high byte for LD (rr),A and LD (nn),A.
+            x64.moveReg(X::Edx, X::Eax);
+            x64.addImm(X::Edx, 1);
+            if (q == 0 && !word)
+            {
+                x64.storeByte(jitOffset(&m_mp.l), X::Edx);
+                x64.storeByte(jitOffset(&m_mp.h), X::Ecx);
+            }
+            else
+            {
+                x64.storeWord(mp, X::Edx);
+            }
+
+            if (q == 0)
+            {
+                if (word)
+                {
+                    x64.storeWordAt(memory, X::Eax, X::Ecx);
+                }
+                else
+                {
+                    x64.storeByteAt(memory, X::Eax, X::Ecx);
+                }
+                compileWritten(x64, word);
+            }
+            else if (word)
+            {
+                x64.loadWordAt(X::Ecx, memory, X::Eax);
+                x64.storeWord(reg, X::Ecx);
+            }
+            else
+            {
+                x64.loadByteAt(X::Ecx, memory, X::Eax);
+                x64.storeByte(reg, X::Ecx);
+            }
+
+            if (slow) exits.push_back({ slow, before, &op, false, x64.pos() });
+            if (q == 0) exits.push_back({ x64.exitIfCounterChanged(), after, nullptr });
+            break;
+        }
+
+        case 3:
+            // INC rr, DEC rr
+            x64.addTState(6);
+            if (q == 0)
+            {
+                x64.incWord(jitOffset(&getReg16_1(p)));
+            }
+            else
+            {
+                x64.decWord(jitOffset(&getReg16_1(p)));
+            }
+            break;
+
+#if NX_LAZY_FLAGS
+        case 4:
+        case 5:
+            // INC r, DEC r
+            x64.addTState(4);
+            compileIncDec(x64, state, getReg8(y), z == 5);
+            break;
+#endif
+
+        case 6:
+            // LD r,n
+            x64.addTState(7);
+            x64.storeByteImm(jitOffset(&getReg8(y)), n);
+            break;
+        }
+        break;
+
+    case 1:
+        if (y != 6 && z != 6)
+        {
+            // LD r,r'
+            x64.addTState(4);
+            if (y != z) x64.moveByte(jitOffset(&getReg8(z)), jitOffset(&getReg8(y)));
+            break;
+        }
+
+        // LD r,(HL), LD (HL),r
+        x64.loadWord(X::Eax, jitOffset(&HL()));
+        slow = x64.jumpIfOutside(X::Eax, 0x8000, 0xffff);
+        x64.addTState(7);
+        if (z == 6)
+        {
+            x64.loadByteAt(X::Ecx, memory, X::Eax);
+            x64.storeByte(jitOffset(&getReg8(y)), X::Ecx);
+        }
+        else
+        {
+            x64.loadByte(X::Ecx, jitOffset(&getReg8(z)));
+            x64.storeByteAt(memory, X::Eax, X::Ecx);
+            compileWritten(x64, false);
+        }
+        exits.push_back({ slow, before, &op, false, x64.pos() });
+        if (y == 6) exits.push_back({ x64.exitIfCounterChanged(), after, nullptr });
+        break;
+
+#if NX_LAZY_FLAGS
+    case 2:
+        // ALU A,r
+        x64.addTState(4);
+        compileAlu(x64, state, y, &getReg8(z), 0);
+        break;
+#endif
+
+    default:
+        switch (z)
+        {
+        case 0:
+            // RET cc
+            x64.loadWord(X::Eax, jitOffset(&SP()));
+            exits.push_back({ x64.jumpIfOutside(X::Eax, 0x8000, 0xfffe), before, &op });
+            x64.addTState(5);
+            notTaken = compileJumpUnless(x64, state, y, always, never);
+            if (!never)
+            {
+                x64.addTState(6);
+                x64.loadWord(X::Eax, jitOffset(&SP()));
+                compilePop(x64, memory);
+                x64.storeWord(jitOffset(&PC()), X::Ecx);
+                x64.storeWord(mp, X::Ecx);
+
+                JitState taken = state;
+                taken.pcStored = true;
+                exits.push_back({ x64.jump(), taken, nullptr });
+            }
+            if (!always && !never) x64.patch(notTaken, x64.pos());
+            break;
+
+        case 1:
+            if (q == 0)
+            {
+                // POP rr
+                x64.loadWord(X::Eax, jitOffset(&SP()));
+                slow = x64.jumpIfOutside(X::Eax, 0x8000, 0xfffe);
+                x64.addTState(10);
+                compilePop(x64, memory);
+                x64.storeWord(jitOffset(&getReg16_2(p)), X::Ecx);
+                exits.push_back({ slow, before, &op, false, x64.pos() });
+            }
+            else if (p == 0)
+            {
+                // RET, which always ends the block
+                x64.loadWord(X::Eax, jitOffset(&SP()));
+                exits.push_back({ x64.jumpIfOutside(X::Eax, 0x8000, 0xfffe), before, &op });
+                x64.addTState(10);
+                compilePop(x64, memory);
+                x64.storeWord(jitOffset(&PC()), X::Ecx);
+                x64.storeWord(mp, X::Ecx);
+                state.pcStored = true;
+                return true;
+            }
+            else if (p == 1)
+            {
+                // EXX
+                x64.addTState(4);
+                x64.swapWords(jitOffset(&BC()), jitOffset(&BC_()));
+                x64.swapWords(jitOffset(&DE()), jitOffset(&DE_()));
+                x64.swapWords(jitOffset(&HL()), jitOffset(&HL_()));
+            }
+            else
+            {
+                // JP (HL), which always ends the block
+                x64.addTState(4);
+                x64.moveWord(jitOffset(&HL()), jitOffset(&PC()));
+                state.pcStored = true;
+                return true;
+            }
+            break;
+
+        case 2:
+            // JP cc,nn
+            x64.addTState(10);
+            x64.storeWordImm(mp, nn);
+            notTaken = compileJumpUnless(x64, state, y, always, never);
+            if (!never) compileJump(x64, state, block, nn, top, exits);
+            if (!always && !never) x64.patch(notTaken, x64.pos());
+            break;
+
+        case 3:
+            if (y == 0)
+            {
+                // JP nn
+                x64.addTState(10);
+                x64.storeWordImm(mp, nn);
+                compileJump(x64, state, block, nn, top, exits);
+            }
+            else
+            {
+                // EX DE,HL
+                x64.addTState(4);
+                x64.swapWords(jitOffset(&DE()), jitOffset(&HL()));
+            }
+            break;
+
+        case 4:
+        case 5:
+            if (z == 5 && q == 0)
+            {
+                // PUSH rr
+                x64.loadWord(X::Eax, jitOffset(&SP()));
+                x64.addImm(X::Eax, -2);
+                slow = x64.jumpIfOutside(X::Eax, 0x8000, 0xfffe);
+                x64.addTState(11);
+                x64.loadWord(X::Ecx, jitOffset(&getReg16_2(p)));
+                compilePush(x64, memory);
+                exits.push_back({ slow, before, &op, false, x64.pos() });
+                exits.push_back({ x64.exitIfCounterChanged(), after, nullptr });
+                break;
+            }
+
+            // CALL cc,nn and CALL nn
+            x64.loadWord(X::Eax, jitOffset(&SP()));
+            x64.addImm(X::Eax, -2);
+            exits.push_back({ x64.jumpIfOutside(X::Eax, 0x8000, 0xfffe), before, &op });
+            x64.addTState(10);
+            x64.storeWordImm(mp, nn);
+            always = (z == 5);
+            never = false;
+            if (!always) notTaken = compileJumpUnless(x64, state, y, always, never);
+            if (!never)
+            {
+                JitState called = state;
+                called.pc = nn;
+                called.pcStored = false;
+
+                x64.addTState(7);
+                x64.loadWord(X::Eax, jitOffset(&SP()));
+                x64.addImm(X::Eax, -2);
+                x64.moveImm(X::Ecx, next);
+                compilePush(x64, memory);
+                exits.push_back({ x64.exitIfCounterChanged(), called, nullptr });
+                compileJump(x64, state, block, nn, top, exits);
+            }
+            if (!always && !never) x64.patch(notTaken, x64.pos());
+            break;
+
+#if NX_LAZY_FLAGS
+        case 6:
+            // ALU A,n
+            x64.addTState(7);
+            compileAlu(x64, state, y, nullptr, n);
+            break;
+#endif
+        }
+        break;
+    }
+
+    state.pc = next;
+    state.pcStored = false;
+    return true;
+}
+
+// The code that every block finishes with.  It goes straight on to the block at PC if that has been compiled and
+// nothing runBlocks() checks between blocks stands in the way.  Otherwise it returns to runBlocks(), through
+// m_jitLeave.
+template <typename Bus>
+bool Z80<Bus>::compileDispatcher()
+{
+    if (!m_jit->begin(kJitMaxOpSize)) return false;
+
+    X64Emitter x64(*m_jit);
+    vector<size_t> leaves;
+    m_jitDispatcher = x64.pos();
+
+    leaves.push_back(x64.exitIfPastLimit());
+    leaves.push_back(x64.exitIfByteNotEqual(jitOffset(&m_halt), 0));
+    leaves.push_back(x64.exitIfByteNotEqual(jitOffset(&m_eiHappened), 0));
+    x64.loadByte(X64Emitter::Eax, jitOffset(&m_interrupt));
+    x64.loadByte(X64Emitter::Ecx, jitOffset(&m_iff1));
+    x64.alu(X64Emitter::Alu::And, X64Emitter::Eax, X64Emitter::Ecx);
+    leaves.push_back(x64.jumpIf(X64Emitter::Cond::NotEqual));
+    x64.storeByteImm(jitOffset(&m_nmi), 0);
+
+    const X64Emitter::FunctionTable table =
+    {
+        m_blocks.data(),
+        u32(sizeof(Block)),
+        u32(kNumBlocks - 1),
+        i32(offsetof(Block, address)),
+        i32(offsetof(Block, generation)),
+        i32(offsetof(Block, code)),
+        m_bus.pageGenerations(),
+        (const void *)&jitRevalidate,
+    };
+    x64.jumpToFunction(jitOffset(&PC()), table);
+
+    m_jitLeave = x64.pos();
+    for (size_t at : leaves) x64.patch(at, m_jitLeave);
+    x64.storeTState();
+    x64.epilogue();
+
+    m_jit->end();
+    return true;
+}
+
+template <typename Bus>
+void Z80<Bus>::compileBlock(Block& block)
+{
+    if (!m_jit)
+    {
+        m_jit.reset(new JitBuffer(kJitBufferSize));
+        if (!compileDispatcher()) return;
+    }
+
+    const size_t maxSize = kJitMaxOpSize * (block.numOps + 2);
+    if (!m_jit->begin(maxSize))
+    {
+        // Out of room, so throw all the code away and start again.
+        m_jit->reset();
+        for (Block& b : m_blocks)
+        {
+            b.code = nullptr;
+            b.hits = 0;
+        }
+        if (!compileDispatcher() || !m_jit->begin(maxSize)) return;
+    }
+
+    X64Emitter x64(*m_jit);
+    const size_t start = x64.pos();
+    const i32 pcOffset = jitOffset(&PC());
+    vector<JitExit> exits;
+    int codeLength = 0;
+
+    x64.prologue();
+    x64.watchCounter(&m_bus.pageGenerations()[block.address >> 8]);
+    const size_t top = x64.pos();
+
+    JitState state = { u16(block.address), true, 0, kJitFlagsUnknown };
+    for (int i = 0; i < block.numOps; ++i)
+    {
+        const BlockOp& op = block.ops[i];
+        if (i > 0) exits.push_back({ x64.exitIfPastLimit(), state, nullptr, true });
+
+        codeLength = max(codeLength, op.address + op.fetches + op.fused - int(block.address));
+        if (compileNative(x64, state, block, op, top, exits))
+        {
+            codeLength = max(codeLength, op.address + kBaseLength[op.opCode] - int(block.address));
+            continue;
+        }
+
+        // The M1 cycles, as runBlocks() would do them, and the handler.
+        bool contended = false;
+        for (int f = 0; f < op.fetches; ++f) contended |= m_bus.isContended(u16(op.address + f));
+        if (contended)
+        {
+            compileSync(x64, state);
+            for (int f = 0; f < op.fetches; ++f) x64.callHandler((const void *)&jitFetch);
+        }
+        else
+        {
+            x64.addTState(u8(4 * op.fetches));
+        }
+        state.pc = u16(op.address + op.fetches);
+        state.pcStored = contended;
+        state.pendingR += op.fetches;
+        state.flags = kJitFlagsUnknown;
+        if (isJitPure(op))
+        {
+            x64.callHandler((const void *)op.handler);
+            continue;
+        }
+
+        // R only has to be right for LD A,R and LD R,A.  The other handlers just add to it, which can wait.
+        if (op.prefix == 0xed)
+        {
+            compileSync(x64, state);
+        }
+        else if (!state.pcStored)
+        {
+            x64.storeWordImm(pcOffset, state.pc);
+            state.pcStored = true;
+        }
+        x64.callHandler((const void *)op.handler);
+
+        if (i + 1 < block.numOps)
+        {
+            state.pc = block.ops[i + 1].address;
+            exits.push_back({ x64.exitIfWordNotEqual(pcOffset, state.pc), state, nullptr });
+            exits.push_back({ x64.exitIfCounterChanged(), state, nullptr });
+        }
+    }
+
+    compileSync(x64, state);
+    x64.patch(x64.jump(), m_jitDispatcher);
+
+    const size_t exit = m_jitDispatcher;
+    for (JitExit& e : exits)
+    {
+        if (e.back)
+        {
+            // The handler of an instruction without operands needs neither PC nor R.
+            x64.patch(e.at, x64.pos());
+            x64.addTState(4);
+            x64.callHandler((const void *)e.op->handler);
+            x64.patch(x64.jump(), e.back);
+            continue;
+        }
+
+        const size_t to = e.pastLimit ? m_jitLeave : exit;
+        if (e.state.pcStored && e.state.pendingR == 0 && !e.op)
+        {
+            x64.patch(e.at, to);
+            continue;
+        }
+
+        x64.patch(e.at, x64.pos());
+        if (e.op)
+        {
+            // The instruction's bytes are uncontended, or it wouldn't have been generated inline.
+            x64.addTState(4);
+            ++e.state.pendingR;
+            e.state.pc = u16(e.op->address + 1);
+            e.state.pcStored = false;
+            compileSync(x64, e.state);
+            x64.callHandler((const void *)e.op->handler);
+        }
+        else
+        {
+            compileSync(x64, e.state);
+        }
+        x64.patch(x64.jump(), to);
+    }
+
+    // Keep the opcodes, and the operands built into the code, for isCodeUnchanged().
+    const size_t bytes = x64.pos();
+    for (int i = 0; i < codeLength; ++i) x64.data(m_bus.peek(u16(block.address + i)));
+    NX_ASSERT(x64.pos() - start <= maxSize);
+
+    block.code = m_jit->end();
+    block.codeBytes = (const u8 *)block.code + (bytes - start);
+    block.codeLength = codeLength;
+}
+
+#endif // NX_JIT
+
+//----------------------------------------------------------------------------------------------------------------------
+// Running
+//----------------------------------------------------------------------------------------------------------------------
+
+template <typename Bus>
+void Z80<Bus>::run(TState& tState, TState limit, TState repeatLimit)
+{
+    m_repeatLimit = max(limit, repeatLimit);
+    if (!isInstrumented() && (m_dispatch == Dispatch::Blocks || m_dispatch == Dispatch::Jit) && m_bus.pageGenerations())
+    {
+        runBlocks(tState, limit);
+    }
+    else
+    {
+        while (tState < limit)
+        {
+            if (m_halt && skipHalt(tState, limit)) break;
+            step(tState);
+        }
+    }
+    m_repeatLimit = 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Instantiations
+// Every bus the core is used with must be listed here.
+//----------------------------------------------------------------------------------------------------------------------
+
+template class Z80<ExternalsBus>;
+template class Z80<FlatBus>;
+template class Z80<Spectrum48Bus>;
+
 //----------------------------------------------------------------------------------------------------------------------
 //----------------------------------------------------------------------------------------------------------------------
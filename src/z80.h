@@ -2,10 +2,18 @@
 // Z80 emulation
 //----------------------------------------------------------------------------------------------------------------------
 
+#pragma once
+
+#include "callstack.h"
 #include "config.h"
+#include "jit.h"
+#include "trace.h"
 #include "types.h"
 
+#include <array>
 #include <functional>
+#include <memory>
+#include <utility>
 
 //----------------------------------------------------------------------------------------------------------------------
 // CPU interface to external systems
@@ -23,30 +31,215 @@ struct IExternals
     // Contention
     virtual void contend(u16 address, TState delay, int num, TState& t) = 0;
 
+    // Opcode fetch (M1 cycle), including the refresh.  Read the opcode and take 4 t-states plus contention.
+    virtual u8 fetch(u16 address, TState& t) { contend(address, 4, 1, t); return peek(address); }
+
     // I/O
     virtual u8 in(u16 port, TState& t) = 0;
     virtual void out(u16 port, u8 x, TState& t) = 0;
+
+    // Write tracking for the block cache: one counter per 256-byte page that changes on every write to that page.
+    // Returns null if writes aren't tracked.
+    virtual const u32* pageGenerations() { return nullptr; }
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+// Bus policies
+// The Z80 is parameterised on a bus type providing the same methods as IExternals.  A concrete bus lets memory and
+// contention accesses inline into the instruction handlers.  ExternalsBus forwards to an IExternals for code that
+// needs to choose the bus at run-time.
+//
+// A bus also provides pageGenerations(): a table of 256 counters, one per 256-byte page, each of which must change
+// whenever that page is written to.  It may return null if writes aren't tracked.  isContended() tells the Z80
+// whether an address can ever be contended, or otherwise needs every access to it to go through the bus; returning
+// true is always safe.  If the answer changes, the Z80's blocks must be flushed.
+//
+// readDirect() and writeDirect() let the block instructions move and search memory in bulk.  Each returns a pointer to
+// length bytes starting at address if none of them are contended and they can be accessed without side effects, or
+// null (always safe).  writeDirect() counts as a write to every page in the range.
+//----------------------------------------------------------------------------------------------------------------------
+
+class ExternalsBus
+{
+public:
+    ExternalsBus(IExternals& ext) : m_ext(ext) {}
+
+    u8 peek(u16 address) { return m_ext.peek(address); }
+    u8 peek(u16 address, TState& t) { return m_ext.peek(address, t); }
+    u16 peek16(u16 address, TState& t) { return m_ext.peek16(address, t); }
+    void poke(u16 address, u8 x, TState& t) { m_ext.poke(address, x, t); }
+    void poke16(u16 address, u16 x, TState& t) { m_ext.poke16(address, x, t); }
+    void contend(u16 address, TState delay, int num, TState& t) { m_ext.contend(address, delay, num, t); }
+    u8 fetch(u16 address, TState& t) { return m_ext.fetch(address, t); }
+    u8 in(u16 port, TState& t) { return m_ext.in(port, t); }
+    void out(u16 port, u8 x, TState& t) { m_ext.out(port, x, t); }
+
+    const u32* pageGenerations() { return m_ext.pageGenerations(); }
+    bool isContended(u16 address) { return true; }
+    const u8* readDirect(u16 address, int length) { return nullptr; }
+    u8* writeDirect(u16 address, int length) { return nullptr; }
+
+private:
+    IExternals& m_ext;
 };
 
+#if NX_PROFILER
+
+//----------------------------------------------------------------------------------------------------------------------
+// Opcode profile
+// The number of times each opcode in each dispatch table was run, and the t-states it took including contention.
+//----------------------------------------------------------------------------------------------------------------------
+
+struct OpcodeProfile
+{
+    enum class Table
+    {
+        Base,
+        CB,
+        ED,
+        DD,
+        FD,
+        DDCB,
+        FDCB,
+
+        COUNT
+    };
+
+    struct Entry
+    {
+        u64     count = 0;
+        u64     tStates = 0;
+    };
+
+    void clear() { *this = OpcodeProfile(); }
+
+    Entry   ops[(int)Table::COUNT][256];
+    Entry   interrupts;     // Accepting a maskable interrupt
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+// Hotspot profile
+// The t-states spent on the instruction at each address, charged to the address of its first byte.
+//----------------------------------------------------------------------------------------------------------------------
+
+struct HotspotProfile
+{
+    HotspotProfile() { clear(); }
+
+    void clear()
+    {
+        tStates.assign(65536, 0);
+        total = 0;
+    }
+
+    void add(u16 address, TState t)
+    {
+        tStates[address] += t;
+        total += t;
+    }
+
+    vector<u64> tStates;
+    u64         total;
+};
+
+#endif
+
 //----------------------------------------------------------------------------------------------------------------------
 // Z80 emulation
 //----------------------------------------------------------------------------------------------------------------------
 
+template <typename Bus>
 class Z80
 {
 public:
-
-    Z80(IExternals& ext);
+    // Instruction dispatch strategy.  The interpreter decodes every opcode at run-time with a large switch; the
+    // table dispatcher jumps straight into a handler that has its decode folded in at compile-time.  The block cache
+    // goes one further and predecodes runs of instructions into lists of table handlers, which are reused until the
+    // memory they were decoded from is written to.  The JIT recompiles hot blocks to x86-64 and runs the rest as
+    // blocks.  Both need a bus that provides page generations, and only affect run(); single steps use the tables.
+    enum class Dispatch
+    {
+        Interpreter,
+        Table,
+        Blocks,
+        Jit,
+    };
+
+    Z80(Bus bus);
 
     void step(TState& tState);
+
+    // Run instructions until tState reaches limit.  The last instruction may finish past the limit.  A repeating block
+    // instruction can carry on to repeatLimit, if that is later, for callers that only need to stop at limit to
+    // catch up with the CPU's time and not to change anything it can see.
+    void run(TState& tState, TState limit, TState repeatLimit = 0);
     void interrupt();
     void nmi();
     void restart();
 
     bool isHalted() const { return m_halt; }
 
+    // True if the CPU is halted and won't be woken by the next step.  Nothing it does until the next interrupt can
+    // be observed, other than the passing of time.
+    bool isWaitingForInterrupt() const { return m_halt && !m_eiHappened && !isInterruptPending(); }
+
+    // True if the next step will accept a maskable interrupt.
+    bool isInterruptPending() const { return m_interrupt && m_iff1; }
+
+    void setDispatch(Dispatch dispatch);
+    Dispatch getDispatch() const { return m_dispatch; }
+
+    // Throw away all decoded and recompiled blocks.  Needed when the bus changes its answer to isContended().
+    void flushBlocks();
+
+#if NX_PROFILER
+    // Count every instruction into a profile, or stop counting if it is null.  While a profile is attached, run()
+    // goes a step at a time whatever the dispatch, so that each instruction is seen on its own.
+    void setOpcodeProfile(OpcodeProfile* profile) { m_opcodeProfile = profile; }
+    OpcodeProfile* getOpcodeProfile() const { return m_opcodeProfile; }
+    void setHotspotProfile(HotspotProfile* profile) { m_hotspotProfile = profile; }
+    HotspotProfile* getHotspotProfile() const { return m_hotspotProfile; }
+    bool isProfiling() const { return m_opcodeProfile || m_hotspotProfile; }
+#endif
+
+#if NX_TRACE
+    // Record every instruction into a trace, or stop recording if it is null.  As with profiling, run() goes a step at
+    // a time while there is a trace.
+    void setTrace(TraceRecorder* trace) { m_trace = trace; }
+    TraceRecorder* getTrace() const { return m_trace; }
+
+    // Fill in the registers in TraceReg order, as the trace header needs them.
+    void traceRegisters(u16* registers);
+#endif
+
+#if NX_CALL_STACK
+    // Follow calls and returns on a call stack, or stop if it is null.  Like profiling, this makes run() go a step at a
+    // time.
+    void setCallStack(CallStack* callStack) { m_callStack = callStack; }
+    CallStack* getCallStack() const { return m_callStack; }
+#endif
+
+    // True while a profile, trace or call stack has to see every instruction run on its own.
+    bool isInstrumented() const
+    {
+#if NX_PROFILER
+        if (isProfiling()) return true;
+#endif
+#if NX_TRACE
+        if (m_trace) return true;
+#endif
+#if NX_CALL_STACK
+        if (m_callStack) return true;
+#endif
+        return false;
+    }
+
     u8& A() { return m_af.h; }
+#if NX_LAZY_FLAGS
+    u8& F() { resolveFlags(); return m_af.l; }
+#else
     u8& F() { return m_af.l; }
+#endif
     u8& B() { return m_bc.h; }
     u8& C() { return m_bc.l; }
     u8& D() { return m_de.h; }
@@ -60,7 +253,11 @@ public:
     u8& I() { return m_ir.h; }
     u8& R() { return m_ir.l; }
 
+#if NX_LAZY_FLAGS
+    u16& AF() { resolveFlags(); return m_af.r; }
+#else
     u16& AF() { return m_af.r; }
+#endif
     u16& BC() { return m_bc.r; }
     u16& DE() { return m_de.r; }
     u16& HL() { return m_hl.r; }
@@ -98,6 +295,34 @@ public:
 private:
     void setFlags(u8 flags, bool value);
 
+#if NX_LAZY_FLAGS
+    //
+    // Lazy flags
+    // The 8-bit arithmetic instructions record their operands and result instead of computing F.  F is only worked out
+    // when something reads it through F() or AF(), and conditional instructions test single flags straight from the
+    // recorded result.
+    //
+    enum class FlagOp : u8
+    {
+        None,       // F is up to date
+        Add,        // ADD, ADC: m_flagX + m_flagY (+ carry) = m_flagResult
+        Sub,        // SUB, SBC: m_flagX - m_flagY (- carry) = m_flagResult
+        Cp,         // CP: as Sub, but A is not changed
+        And,        // AND: result in m_flagResult
+        Or,         // OR, XOR: result in m_flagResult
+        Inc,        // INC r: result in m_flagResult, previous carry in m_flagX
+        Dec,        // DEC r: result in m_flagResult, previous carry in m_flagX
+    };
+
+    void resolveFlags() { if (m_flagOp != FlagOp::None) computeFlags(); }
+    void computeFlags();
+    void deferFlags(FlagOp op, u8 x, u8 y, u16 result);
+#endif
+
+    // Flag tests that don't need the whole of F.
+    u8 carryFlag();
+    bool condition(u8 y);
+
     void exx();
     void exAfAf();
 
@@ -134,23 +359,255 @@ private:
     u16& getReg16_2(u8 p);
     bool getFlag(u8 y, u8 flags);
 
-    using ALUFunc = function<void(u8&)>;
-    using RotShiftFunc = function<void(u8&)>;
+    // Pointers to members rather than functions bound to this, so that the tables can be shared by every CPU.
+    using ALUFunc = void (Z80::*)(u8&);
+    using RotShiftFunc = void (Z80::*)(u8&);
 
     ALUFunc getAlu(u8 y);
     RotShiftFunc getRotateShift(u8 y);
 
-    void decodeInstruction(u8 opCode, u8& x, u8& y, u8& z, u8& p, u8& q);
     u8 fetchInstruction(i64& tState);
+#if NX_PROFILER
+    OpcodeProfile::Entry& profileEntry();
+#endif
+#if NX_TRACE
+    int traceBytes(u16 pc, u8* bytes);
+#endif
+#if NX_CALL_STACK
+    enum class Transfer
+    {
+        None,
+        Call,
+        Rst,
+        Return,
+    };
+
+    Transfer callStackTransfer(u16 pc);
+    void updateCallStack(Transfer transfer, bool interrupted, u16 sp, TState t);
+#endif
+    bool skipHalt(TState& tState, TState limit);
+
+    //
+    // Block instructions
+    // LDIR and the other repeating instructions go round again without leaving the handler while run()'s limit hasn't
+    // been reached and no interrupt is waiting.  Copies and searches through uncontended memory are done many passes at
+    // a time.
+    //
+    void ldFlags(u8 v);
+    void cpFlags(u8 v);
+    bool repeatBlockOp(u8 opCode, TState& tState);
+    int bulkPasses(TState tState, int maxPasses);
+    void bulkCopy(int dir, TState& tState);
+    void bulkSearch(int dir, TState& tState);
+
+    // Opcode fields decoded at run-time, used by the interpreter.
+    struct DynamicOp
+    {
+        static const bool kUseTables = false;
+
+        DynamicOp(u8 opCode);
+
+        u8 opCode, x, y, z, p, q;
+    };
+
+    // Opcode fields known at compile-time, used to generate the dispatch table handlers.
+    template <int N>
+    struct StaticOp
+    {
+        static const bool kUseTables = true;
+
+        // Plain constants rather than enumerators, so that switching on a field with cases for every value isn't
+        // reported as cases missing from an enum.
+        static constexpr u8 opCode  = (u8)N;
+        static constexpr u8 x       = (u8)((N & 0xc0) >> 6);
+        static constexpr u8 y       = (u8)((N & 0x38) >> 3);
+        static constexpr u8 z       = (u8)(N & 0x07);
+        static constexpr u8 p       = (u8)(((N & 0x38) >> 4) & 3);
+        static constexpr u8 q       = (u8)((N >> 3) & 1);
+    };
+
+    void alu(const DynamicOp& op, u8& reg);
+    void rotateShift(const DynamicOp& op, u8& reg);
+    template <int N> void alu(StaticOp<N> op, u8& reg);
+    template <int N> void rotateShift(StaticOp<N> op, u8& reg);
 
     void execute(u8 opCode, i64& tState);
-    void executeDDFDCB(Reg& idx, i64& tState);
-    void executeDDFD(Reg& idx, i64& tState);
-    void executeED(i64& tState);
+
+    // Instruction bodies shared by the interpreter and the dispatch tables.
+    template <typename Op> void executeBase(Op op, i64& tState);
+    template <typename Op> void executeCB(Op op, i64& tState);
+    template <typename Op> void executeED(Op op, i64& tState);
+    template <typename Op> void executeDDFD(Op op, Reg& idx, i64& tState);
+    template <typename Op> void executeDDFDCB(Op op, Reg& idx, i64& tState);
+
+    // Prefix handling.  These fetch the next opcode and pass it on to the interpreter or the relevant table.
+    template <typename Op> void prefixCB(i64& tState);
+    template <typename Op> void prefixED(i64& tState);
+    template <typename Op> void prefixDDFD(Reg& idx, i64& tState);
+    template <typename Op> void prefixDDFDCB(Reg& idx, i64& tState);
+
+    //
+    // Dispatch tables
+    //
+    using OpHandler = void(*)(Z80& cpu, i64& tState);
+    using OpTable = array<OpHandler, 256>;
+
+    template <int N> static void opBase(Z80& cpu, i64& tState);
+    template <int N> static void opCB(Z80& cpu, i64& tState);
+    template <int N> static void opED(Z80& cpu, i64& tState);
+    template <int N> static void opDD(Z80& cpu, i64& tState);
+    template <int N> static void opFD(Z80& cpu, i64& tState);
+    template <int N> static void opDDCB(Z80& cpu, i64& tState);
+    template <int N> static void opFDCB(Z80& cpu, i64& tState);
+
+    template <size_t... N> static constexpr OpTable buildBaseOps(index_sequence<N...>);
+    template <size_t... N> static constexpr OpTable buildCBOps(index_sequence<N...>);
+    template <size_t... N> static constexpr OpTable buildEDOps(index_sequence<N...>);
+    template <size_t... N> static constexpr OpTable buildDDOps(index_sequence<N...>);
+    template <size_t... N> static constexpr OpTable buildFDOps(index_sequence<N...>);
+    template <size_t... N> static constexpr OpTable buildDDCBOps(index_sequence<N...>);
+    template <size_t... N> static constexpr OpTable buildFDCBOps(index_sequence<N...>);
+
+    static const OpTable ms_baseOps;
+    static const OpTable ms_cbOps;
+    static const OpTable ms_edOps;
+    static const OpTable ms_ddOps;
+    static const OpTable ms_fdOps;
+    static const OpTable ms_ddcbOps;
+    static const OpTable ms_fdcbOps;
+
+    //
+    // Block cache
+    //
+    static const int kNumBlocks = 4096;     // Direct-mapped on the low bits of the start address
+    static const int kMaxBlockOps = 16;
+    static const u32 kNoBlock = 0x10000;
+
+    struct BlockOp
+    {
+        OpHandler   handler;
+        u16         address;    // Address of the instruction's first byte
+        u8          fetches;    // M1 cycles to perform before calling the handler (2 for prefixed instructions)
+        u8          prefix;     // CB, DD, ED or FD for prefixed instructions
+        u8          opCode;     // Opcode that selected the handler
+        u8          fused;      // Number of following instructions run by the same handler
+        u8          fusedOpCodes[3];
+    };
+
+    // A run of instructions from a single page.  Execution leaves the block as soon as PC doesn't match the next
+    // instruction's address, or the page is written to.  A block whose page has been written to is checked against
+    // memory before being used again, and only decoded again if its opcodes have changed.
+    struct Block
+    {
+        u32         address = kNoBlock;
+        u32         generation = 0;
+        int         numOps = 0;
+        int         hits = 0;           // Number of times entered, to find blocks worth recompiling
+        void*       code = nullptr;     // Recompiled code, or null
+        const u8*   codeBytes = nullptr;    // Copy of the bytes the code was compiled from
+        int         codeLength = 0;
+        BlockOp     ops[kMaxBlockOps];
+    };
+
+    void runBlocks(TState& tState, TState limit);
+    void decodeBlock(Block& block, u16 address, u32 generation);
+    bool isBlockUnchanged(const Block& block);
+    int instructionLength(u16 address, bool& endsBlock);
+    static bool isIoInstruction(u8 opCode, u8 opCode2);
+
+    static const u8 kBaseLength[256];
+
+#if NX_FUSION
+    //
+    // Fused instructions
+    // Some common sequences of unprefixed instructions are decoded into a single block op, whose handler runs them all
+    // without going back through the block loop.  It stops between instructions if run()'s limit is reached, leaving PC
+    // at the next one.  Loops that only count a register down are run many passes at a time.
+    //
+    int fuseOps(BlockOp& op, int address, int pageEnd);
+    void fetchFused(i64& tState);
+    bool isLoopUncontended(u16 head, int length, bool contendsIR);
+    int loopPasses(TState tState, int period, int lastLength, int maxPasses);
+
+    template <int N> void executeFused(i64& tState);
+    template <int N, int N2, int... Rest> void executeFused(i64& tState);
+
+    template <int... N> static void opFused(Z80& cpu, i64& tState);
+    static void opDjnzLoop(Z80& cpu, i64& tState);
+    static void opDecBLoop(Z80& cpu, i64& tState);
+    static void opDecBCLoop(Z80& cpu, i64& tState);
+#endif
+
+#if NX_JIT
+    //
+    // Recompiler
+    // Hot blocks are translated to x86-64.  The common loads, 8-bit arithmetic, INC/DEC, stack operations and jumps
+    // are generated inline when their bytes are uncontended, keeping PC, R and the pending flag operation in step at
+    // compile-time and only writing them back when code outside needs them.  Memory in the top 32K, which is never
+    // contended, is read and written directly; other addresses go through the handler.  Everything else calls its
+    // table handler.  A jump back to the start of the block loops inside the code, and other blocks are reached
+    // through a shared dispatcher without returning to runBlocks().  The inline instructions have their operands built
+    // in, so a compiled block keeps a copy of its bytes, and after a write to its page it is checked against that
+    // instead of being decoded again.  I/O instructions are never put in a block, so they always go through step().
+    //
+    static const int kJitThreshold = 16;
+    static const size_t kJitBufferSize = 4 * 1024 * 1024;
+    static const size_t kJitMaxOpSize = 256;
+    static const int kJitFlagsUnknown = NX_LAZY_FLAGS ? -1 : 0;     // Without lazy flags, F is always known
+
+    using JitFunc = void(*)(Z80* cpu, i64* tState, i64 limit);
+
+    // What the generated code has done at a point, as far as compileBlock() knows.
+    struct JitState
+    {
+        u16         pc;             // Value of PC at this point
+        bool        pcStored;       // True if PC in memory is pc
+        u8          pendingR;       // M1 cycles not yet added to R
+        int         flags;          // Pending FlagOp, or kJitFlagsUnknown
+    };
+
+    // A jump out of the code, which must first bring PC and R up to date, and run op through its handler if set.  It
+    // goes to the dispatcher, or straight back to runBlocks() if the time is up.  If back is set, op is an instruction
+    // without operands whose memory access couldn't be made directly, and the handler returns to the code there.
+    struct JitExit
+    {
+        size_t          at;
+        JitState        state;
+        const BlockOp*  op;
+        bool            pastLimit = false;
+        size_t          back = 0;
+    };
+
+    bool compileDispatcher();
+    void compileBlock(Block& block);
+    bool compileNative(X64Emitter& x64, JitState& state, const Block& block, const BlockOp& op, size_t top,
+        vector<JitExit>& exits);
+    void compileJump(X64Emitter& x64, const JitState& state, const Block& block, u16 target, size_t top,
+        vector<JitExit>& exits);
+    size_t compileJumpUnless(X64Emitter& x64, JitState& state, u8 y, bool& always, bool& never);
+    void compileCarry(X64Emitter& x64, const JitState& state);
+    void compileSync(X64Emitter& x64, JitState& state);
+    void compilePush(X64Emitter& x64, const u8* memory);
+    void compilePop(X64Emitter& x64, const u8* memory);
+    void compileWritten(X64Emitter& x64, bool word);
+#if NX_LAZY_FLAGS
+    void compileAlu(X64Emitter& x64, JitState& state, u8 y, const u8* src, u8 n);
+    void compileIncDec(X64Emitter& x64, JitState& state, u8& reg, bool dec);
+#endif
+    bool isCodeUnchanged(const Block& block);
+    static bool isJitPure(const BlockOp& op);
+    const u8* jitMemory();
+    i32 jitOffset(const void* p) const { return i32((const u8 *)p - (const u8 *)this); }
+
+    static void jitFetch(Z80& cpu, i64& tState);
+    static u8 jitCarry(Z80& cpu, int);
+    static u8 jitCondition(Z80& cpu, int y);
+    static u8 jitRevalidate(Z80& cpu, int);
+#endif
 
 
 private:
-    IExternals& m_ext;
+    Bus         m_bus;
 
     // Base registers
     Reg         m_af, m_bc, m_de, m_hl;
@@ -163,6 +620,14 @@ private:
     // Internal registers
     Reg         m_mp;
 
+#if NX_LAZY_FLAGS
+    // Pending flag calculation
+    FlagOp      m_flagOp;
+    u8          m_flagX;
+    u8          m_flagY;
+    u16         m_flagResult;
+#endif
+
     bool        m_halt;
     bool        m_iff1;
     bool        m_iff2;
@@ -171,6 +636,24 @@ private:
     bool        m_nmi;          // Set to false when nmi occurs.
     bool        m_eiHappened;   // Set to false when EI is called.  This stops the interrupt occurring for at least one
                                 // instruction afterwards.
+    TState      m_repeatLimit;  // How far repeating and fused instructions may go on in this run(), or 0 outside it
+    Dispatch    m_dispatch;
+    vector<Block> m_blocks;
+#if NX_PROFILER
+    OpcodeProfile* m_opcodeProfile;
+    HotspotProfile* m_hotspotProfile;
+#endif
+#if NX_TRACE
+    TraceRecorder* m_trace;
+#endif
+#if NX_CALL_STACK
+    CallStack*  m_callStack;
+#endif
+#if NX_JIT
+    unique_ptr<JitBuffer> m_jit;
+    size_t      m_jitDispatcher;    // Position of the code that all blocks leave through
+    size_t      m_jitLeave;         // Position of its return to runBlocks()
+#endif
 
     u8          m_parity[256];
     u8          m_SZ53[256];
@@ -184,3 +667,11 @@ private:
     static const u8 kOverflowSub[8];
 };
 
+// StaticOp's constants need definitions too in C++14, in case one is bound to a reference.
+template <typename Bus> template <int N> constexpr u8 Z80<Bus>::StaticOp<N>::opCode;
+template <typename Bus> template <int N> constexpr u8 Z80<Bus>::StaticOp<N>::x;
+template <typename Bus> template <int N> constexpr u8 Z80<Bus>::StaticOp<N>::y;
+template <typename Bus> template <int N> constexpr u8 Z80<Bus>::StaticOp<N>::z;
+template <typename Bus> template <int N> constexpr u8 Z80<Bus>::StaticOp<N>::p;
+template <typename Bus> template <int N> constexpr u8 Z80<Bus>::StaticOp<N>::q;
+
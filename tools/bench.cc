@@ -0,0 +1,148 @@
+//----------------------------------------------------------------------------------------------------------------------
+// NX benchmark
+// Runs files on a headless machine as fast as possible and reports how fast the emulation went.
+//
+//      nx-bench [-frames=N] [-interp|-table|-blocks|-jit] [-idle] [-trace=file] file...
+//
+// Files can be .sna, .z80, .nx or .tap.  A tape is loaded by typing LOAD "" into a freshly reset machine.  Each file is
+// run twice: once for the headline numbers, and once more with profiling on for the breakdown, so that the timers
+// don't eat into the headline.  -trace records every instruction of the headline run, to show what tracing costs.
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "headless.h"
+#include "trace.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+//----------------------------------------------------------------------------------------------------------------------
+// Options
+//----------------------------------------------------------------------------------------------------------------------
+
+struct BenchOptions
+{
+    int                     frames;
+    Spectrum::CPU::Dispatch dispatch;
+    bool                    idleSkip;
+    string                  traceFile;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+// Running
+//----------------------------------------------------------------------------------------------------------------------
+
+// Loads the file into a new machine and runs it for the given number of frames.  Returns the wall-clock time taken,
+// or a negative number if the file couldn't be loaded.
+static double bench(const string& fileName, const BenchOptions& options, SpectrumProfile* profile,
+    TraceRecorder* trace)
+{
+    HeadlessMachine machine;
+    Spectrum& speccy = machine.getSpeccy();
+
+    speccy.getZ80().setDispatch(options.dispatch);
+    speccy.setIdleSkip(options.idleSkip);
+    if (!machine.load(fileName)) return -1.0;
+
+    if (trace)
+    {
+        u16 registers[kTraceNumRegs];
+        speccy.getZ80().traceRegisters(registers);
+        if (!trace->start(options.traceFile, speccy.getTState(), registers))
+        {
+            printf("%s: unable to create %s\n", fileName.c_str(), options.traceFile.c_str());
+            trace = nullptr;
+        }
+        speccy.getZ80().setTrace(trace);
+    }
+
+    speccy.setProfile(profile);
+    auto start = chrono::steady_clock::now();
+    machine.runFrames(options.frames);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    // The time to write out the rest of the trace isn't counted.
+    speccy.getZ80().setTrace(nullptr);
+    if (trace) trace->stop();
+    return seconds;
+}
+
+static bool benchFile(const string& fileName, const BenchOptions& options)
+{
+    TraceRecorder trace;
+    double seconds = bench(fileName, options, nullptr, options.traceFile.empty() ? nullptr : &trace);
+    if (seconds < 0)
+    {
+        printf("%s: unable to load\n", fileName.c_str());
+        return false;
+    }
+
+    SpectrumProfile profile = {};
+    bench(fileName, options, &profile, nullptr);
+
+    // A 48K runs at 3.5MHz, 69888 t-states per frame.
+    double fps = options.frames / seconds;
+    double mhz = double(options.frames) * 69888.0 / seconds / 1000000.0;
+    double cpu = profile.total - profile.video - profile.tape - profile.beeper;
+    auto percent = [&profile](double t) { return profile.total > 0 ? t * 100.0 / profile.total : 0.0; };
+
+    printf("%s\n", fileName.c_str());
+    printf("    %d frames in %.3fs: %.1f frames/sec, %.2f MHz (%.1fx real time)\n",
+        options.frames, seconds, fps, mhz, mhz / 3.5);
+    printf("    CPU      %5.1f%%\n", percent(cpu));
+    printf("    Video    %5.1f%%\n", percent(profile.video));
+    printf("    Tape     %5.1f%%\n", percent(profile.tape));
+    printf("    Beeper   %5.1f%%\n", percent(profile.beeper));
+    if (trace.getNumRecords() || trace.getNumDropped())
+    {
+        printf("    Trace    %llu instructions, %llu dropped, %.1f MB\n", (unsigned long long)trace.getNumRecords(),
+            (unsigned long long)trace.getNumDropped(), (double)trace.getFileSize() / (1024.0 * 1024.0));
+        if (trace.hasFailed())
+        {
+            printf("    Trace    writing %s failed, so the file is incomplete\n", options.traceFile.c_str());
+        }
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Main entry point
+//----------------------------------------------------------------------------------------------------------------------
+
+int main(int argc, char** argv)
+{
+    BenchOptions options = { 1000, Spectrum::CPU::Dispatch::Table, false, "" };
+    vector<string> files;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        if (strncmp(arg, "-frames=", 8) == 0)   options.frames = max(1, atoi(arg + 8));
+        else if (strcmp(arg, "-interp") == 0)   options.dispatch = Spectrum::CPU::Dispatch::Interpreter;
+        else if (strcmp(arg, "-table") == 0)    options.dispatch = Spectrum::CPU::Dispatch::Table;
+        else if (strcmp(arg, "-blocks") == 0)   options.dispatch = Spectrum::CPU::Dispatch::Blocks;
+        else if (strcmp(arg, "-jit") == 0)      options.dispatch = Spectrum::CPU::Dispatch::Jit;
+        else if (strcmp(arg, "-idle") == 0)     options.idleSkip = true;
+        else if (strncmp(arg, "-trace=", 7) == 0) options.traceFile = arg + 7;
+        else if (arg[0] == '-')
+        {
+            printf("Unknown option: %s\n", arg);
+            return 1;
+        }
+        else files.push_back(arg);
+    }
+
+    if (files.empty())
+    {
+        printf("Usage: nx-bench [-frames=N] [-interp|-table|-blocks|-jit] [-idle] [-trace=file] file...\n");
+        return 1;
+    }
+
+    bool ok = true;
+    for (const string& fileName : files) ok = benchFile(fileName, options) && ok;
+    return ok ? 0 : 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,136 @@
+//----------------------------------------------------------------------------------------------------------------------
+// Headless machine implementation
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "headless.h"
+#include "nxfile.h"
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cctype>
+
+extern const u8 gRom48[16384];
+
+//----------------------------------------------------------------------------------------------------------------------
+// Construction
+//----------------------------------------------------------------------------------------------------------------------
+
+HeadlessMachine::HeadlessMachine()
+    : m_speccy(new Spectrum(nullptr))
+    , m_tape()
+{
+    m_speccy->load(0, gRom48, 16384);
+    m_speccy->setRomWriteState(false);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Loading
+//----------------------------------------------------------------------------------------------------------------------
+
+bool HeadlessMachine::load(const string& fileName)
+{
+    string ext = fileName.substr(min(fileName.size(), fileName.rfind('.')));
+    for (char& c : ext) c = (char)tolower(c);
+
+    if (ext == ".nx") return Snapshot::loadNx(*m_speccy, fileName);
+
+    vector<u8> data = NxFile::loadFile(fileName);
+    if (data.empty()) return false;
+
+    if (ext == ".sna") return Snapshot::loadSna(*m_speccy, data);
+    if (ext == ".z80") return Snapshot::loadZ80(*m_speccy, data);
+    if (ext == ".tap")
+    {
+        m_tape.reset(new Tape(data));
+        typeLoad();
+        m_speccy->setTape(m_tape.get());
+        m_tape->selectBlock(0);
+        m_tape->play();
+        return true;
+    }
+
+    return false;
+}
+
+void HeadlessMachine::typeLoad()
+{
+    static const int kBootFrames = 100;     // Time for the ROM to get to the copyright message
+    static const int kKeyFrames = 5;        // Frames to hold and then release each key
+
+    // LOAD "" ENTER
+    const vector<Key> keys[] = {
+        { Key::J },
+        { Key::SymShift, Key::P },
+        { Key::SymShift, Key::P },
+        { Key::Enter },
+    };
+
+    runFrames(kBootFrames);
+    for (const vector<Key>& k : keys)
+    {
+        setKeys(k);
+        runFrames(kKeyFrames);
+        setKeys({});
+        runFrames(kKeyFrames);
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Running
+//----------------------------------------------------------------------------------------------------------------------
+
+void HeadlessMachine::runFrames(int frames)
+{
+    bool breakpointHit;
+    for (int i = 0; i < frames; )
+    {
+        if (m_speccy->update(RunMode::Normal, breakpointHit)) ++i;
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Keyboard
+//----------------------------------------------------------------------------------------------------------------------
+
+void HeadlessMachine::setKeys(const vector<Key>& keys)
+{
+    vector<u8> rows(8, 0);
+    for (Key key : keys)
+    {
+        int k = (int)key;
+        rows[k / 5] |= u8(1 << (k % 5));
+    }
+    m_speccy->setKeyboardState(rows);
+}
+
+bool HeadlessMachine::parseKey(const string& name, Key& key)
+{
+    // In the same order as the Key enum.
+    static const char* kNames[(int)Key::COUNT] = {
+        "shift", "z", "x", "c", "v",
+        "a", "s", "d", "f", "g",
+        "q", "w", "e", "r", "t",
+        "1", "2", "3", "4", "5",
+        "0", "9", "8", "7", "6",
+        "p", "o", "i", "u", "y",
+        "enter", "l", "k", "j", "h",
+        "space", "symshift", "m", "n", "b",
+    };
+
+    string lower = name;
+    for (char& c : lower) c = (char)tolower(c);
+
+    for (int i = 0; i < (int)Key::COUNT; ++i)
+    {
+        if (lower == kNames[i])
+        {
+            key = (Key)i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,43 @@
+//----------------------------------------------------------------------------------------------------------------------
+// Headless machine
+// A 48K Spectrum with no window or sound, for the command-line tools.  Loads any file NX understands, and can press
+// keys on the emulated keyboard.
+//----------------------------------------------------------------------------------------------------------------------
+
+#pragma once
+
+#include "spectrum.h"
+#include "tape.h"
+
+#include <memory>
+
+class HeadlessMachine
+{
+public:
+    HeadlessMachine();
+
+    Spectrum& getSpeccy() { return *m_speccy; }
+
+    // Load a .sna, .z80, .nx or .tap file.  A tape is loaded by booting the ROM and typing LOAD "", so set anything
+    // that affects how the machine runs before calling this.
+    bool load(const string& fileName);
+
+    // Run whole frames.
+    void runFrames(int frames);
+
+    // Set which keys are held down.  An empty list releases them all.
+    void setKeys(const vector<Key>& keys);
+
+    // Parse a key name: a letter or digit, or Shift, SymShift, Enter or Space.  Case is ignored.
+    static bool parseKey(const string& name, Key& key);
+
+private:
+    void typeLoad();
+
+private:
+    unique_ptr<Spectrum>    m_speccy;
+    unique_ptr<Tape>        m_tape;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,404 @@
+//----------------------------------------------------------------------------------------------------------------------
+// NX microbenchmarks
+// Times the emulator's hot paths in isolation and writes the results as JSON, so runs from two versions can be
+// diffed.
+//
+//      nx-microbench [-filter=text] [-out=file.json]
+//
+// Each benchmark is calibrated to run for a few milliseconds per batch, and then timed over several batches.  The
+// fastest batch is the most repeatable figure; the median is given as well to show how noisy the run was.
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "disasm.h"
+#include "snapshot.h"
+#include "spectrum.h"
+#include "tape.h"
+#include "vram.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+
+extern const u8 gRom48[16384];
+
+//----------------------------------------------------------------------------------------------------------------------
+// Timing
+//----------------------------------------------------------------------------------------------------------------------
+
+struct BenchResult
+{
+    string      name;
+    string      unit;           // What one operation is
+    i64         opsPerBatch;
+    int         batches;
+    double      bestNs;         // Nanoseconds per operation, fastest batch
+    double      medianNs;       // Nanoseconds per operation, median batch
+};
+
+class MicroBench
+{
+public:
+    MicroBench(string filter) : m_filter(filter) {}
+
+    // Time body, which performs opsPerCall operations of the given unit each time it is called.
+    void run(string name, string unit, i64 opsPerCall, function<void()> body);
+
+    const vector<BenchResult>& results() const { return m_results; }
+
+private:
+    static double seconds(function<void()>& body, int calls);
+
+private:
+    string                  m_filter;
+    vector<BenchResult>     m_results;
+};
+
+double MicroBench::seconds(function<void()>& body, int calls)
+{
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < calls; ++i) body();
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+void MicroBench::run(string name, string unit, i64 opsPerCall, function<void()> body)
+{
+    static const double kBatchSeconds = 0.02;
+    static const int kBatches = 9;
+
+    if (!m_filter.empty() && name.find(m_filter) == string::npos) return;
+
+    // Warm up, and find how many calls fill a batch.
+    int calls = 1;
+    for (;;)
+    {
+        double t = seconds(body, calls);
+        if (t >= kBatchSeconds || calls >= (1 << 24)) break;
+        calls = t > 0 ? max(calls + 1, int(calls * kBatchSeconds * 1.2 / t)) : calls * 16;
+    }
+
+    vector<double> times;
+    for (int i = 0; i < kBatches; ++i) times.push_back(seconds(body, calls));
+    sort(times.begin(), times.end());
+
+    double ops = double(opsPerCall) * calls;
+    BenchResult result = { name, unit, i64(ops), kBatches, times.front() * 1e9 / ops, times[kBatches / 2] * 1e9 / ops };
+    m_results.push_back(result);
+    fprintf(stderr, "%-28s %10.2f ns/%s\n", name.c_str(), result.bestNs, unit.c_str());
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Machine set-up
+//----------------------------------------------------------------------------------------------------------------------
+
+static Spectrum* newSpectrum()
+{
+    Spectrum* speccy = new Spectrum(nullptr);
+    speccy->load(0, gRom48, 16384);
+    speccy->setRomWriteState(false);
+    return speccy;
+}
+
+// Fills the screen with a changing pattern so that video conversion has something other than blank memory to draw.
+static void fillScreen(Spectrum& speccy)
+{
+    for (int a = 0x4000; a < 0x5800; ++a) speccy.poke(u16(a), u8(a * 37));
+    for (int a = 0x5800; a < 0x5b00; ++a) speccy.poke(u16(a), u8(a * 13) | 0x80);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Z80 opcode groups
+// Each group is a short pattern of instructions that leaves the machine able to run it again.  The pattern is repeated
+// through 8K of uncontended RAM, and the registers are put back before every pass.
+//----------------------------------------------------------------------------------------------------------------------
+
+struct OpcodeGroup
+{
+    const char*         name;
+    vector<u8>          pattern;
+    int                 numInstructions;
+};
+
+static void benchOpcodeGroups(MicroBench& bench)
+{
+    static const u16 kCode = 0x8000;
+    static const int kCodeSize = 0x2000;
+
+    // CALL to the next instruction, then POP to balance the stack.  The address is patched in as the code is laid out.
+    static const u8 kCallPop[] = { 0xcd, 0x00, 0x00, 0xe1 };
+
+    const OpcodeGroup groups[] = {
+        { "nop",                { 0x00 },                               1 },
+        { "ld r,r'",            { 0x41, 0x50 },                         2 },
+        { "ld r,n",             { 0x06, 0x12 },                         1 },
+        { "alu a,r",            { 0x80, 0xa9 },                         2 },
+        { "alu a,n",            { 0xc6, 0x03 },                         1 },
+        { "inc/dec r",          { 0x04, 0x0d },                         2 },
+        { "16-bit arithmetic",  { 0x09, 0x23 },                         2 },
+        { "(hl) load/store",    { 0x77, 0x7e },                         2 },
+        { "push/pop",           { 0xc5, 0xd1 },                         2 },
+        { "jr",                 { 0x18, 0x00 },                         1 },
+        { "call/pop",           { begin(kCallPop), end(kCallPop) },     2 },
+        { "cb rotate",          { 0xcb, 0x00 },                         1 },
+        { "cb bit",             { 0xcb, 0x47 },                         1 },
+        { "cb (hl)",            { 0xcb, 0xc6 },                         1 },
+        { "ed neg",             { 0xed, 0x44 },                         1 },
+        { "ed ldi",             { 0xed, 0xa0 },                         1 },
+        { "ix/iy indexed",      { 0xdd, 0x7e, 0x05, 0xfd, 0x77, 0x05 }, 2 },
+        { "ddcb indexed",       { 0xdd, 0xcb, 0x05, 0xc6 },             1 },
+    };
+
+    unique_ptr<Spectrum> speccy(newSpectrum());
+    Spectrum::CPU& z80 = speccy->getZ80();
+
+    for (const OpcodeGroup& group : groups)
+    {
+        int size = (int)group.pattern.size();
+        int repeats = kCodeSize / size;
+        vector<u8> code;
+        for (int i = 0; i < repeats; ++i)
+        {
+            u16 a = u16(kCode + code.size());
+            code.insert(code.end(), group.pattern.begin(), group.pattern.end());
+            if (group.pattern[0] == 0xcd)
+            {
+                code[code.size() - 3] = u8(a + 3);
+                code[code.size() - 2] = u8((a + 3) >> 8);
+            }
+        }
+        speccy->load(kCode, code);
+
+        int numSteps = repeats * group.numInstructions;
+        bench.run(string("z80.step/") + group.name, "instruction", numSteps, [&]
+        {
+            z80.PC() = kCode;
+            z80.SP() = 0xfff0;
+            z80.BC() = 0x0100;
+            z80.DE() = 0xd000;
+            z80.HL() = 0xc000;
+            z80.IX() = 0xc000;
+            z80.IY() = 0xc100;
+            TState t = 0;
+            for (int i = 0; i < numSteps; ++i) z80.step(t);
+        });
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Machine components
+//----------------------------------------------------------------------------------------------------------------------
+
+static void benchContention(MicroBench& bench)
+{
+    unique_ptr<Spectrum> speccy(newSpectrum());
+    static const int kCalls = 69888 / 4;
+
+    // Contended accesses, spread over the whole frame so that all the delays in the pattern get used.
+    bench.run("spectrum.contend", "call", kCalls, [&]
+    {
+        TState t = 0;
+        for (int i = 0; i < kCalls; ++i)
+        {
+            speccy->contend(u16(0x4000 + i), 3, 1, t);
+            t = (t + 1) % 69888;
+        }
+    });
+}
+
+static void benchVideo(MicroBench& bench)
+{
+    unique_ptr<Spectrum> speccy(newSpectrum());
+    fillScreen(*speccy);
+
+    bench.run("spectrum.updateVideo", "frame", 1, [&]
+    {
+        speccy->renderVideo();
+    });
+
+    bench.run("spectrum.hashFrame", "frame", 1, [&]
+    {
+        speccy->hashFrame();
+    });
+
+    bench.run("spectrum.hashRam", "call", 1, [&]
+    {
+        speccy->hashRam();
+    });
+}
+
+static void benchUiConversion(MicroBench& bench)
+{
+    vector<u8> pixels(kUiWidth / 8 * kUiHeight);
+    vector<u8> attrs(kUiWidth / 8 * kUiHeight / 8);
+    vector<u32> image(kUiWidth * kUiHeight);
+
+    // Half the cells transparent, like a window over the emulated screen.
+    for (size_t i = 0; i < pixels.size(); ++i) pixels[i] = u8(i * 71);
+    for (size_t i = 0; i < attrs.size(); ++i) attrs[i] = (i & 1) ? u8(0x47 + i) : 0;
+
+    bench.run("ui.convertVram", "frame", 1, [&]
+    {
+        convertVram(image.data(), pixels.data(), attrs.data(), true);
+    });
+}
+
+static void benchTape(MicroBench& bench)
+{
+    // A header and a screen's worth of data, as a TAP file.
+    vector<u8> tap;
+    auto addBlock = [&tap](const vector<u8>& block)
+    {
+        tap.push_back(u8(block.size()));
+        tap.push_back(u8(block.size() >> 8));
+        tap.insert(tap.end(), block.begin(), block.end());
+    };
+    vector<u8> header = { 0x00, 0x03, 'S', 'C', 'R', 'E', 'E', 'N', ' ', ' ', ' ', ' ', 0x00, 0x1b, 0x00, 0x40, 0, 0, 0 };
+    vector<u8> data(6914);
+    data[0] = 0xff;
+    for (size_t i = 1; i < data.size(); ++i) data[i] = u8(i * 29);
+    addBlock(header);
+    addBlock(data);
+
+    // One call per scanline, as the machine does during loading.
+    Tape tape(tap);
+    i64 numCalls = 0;
+    tape.selectBlock(0);
+    tape.play();
+    while (tape.isPlaying())
+    {
+        tape.play(224);
+        ++numCalls;
+    }
+
+    bench.run("tape.play", "call", numCalls, [&]
+    {
+        tape.selectBlock(0);
+        tape.play();
+        while (tape.isPlaying()) tape.play(224);
+    });
+}
+
+static void benchDisassembler(MicroBench& bench)
+{
+    // Count the instructions in the ROM first, so the figure is per instruction.
+    Disassembler d;
+    i64 numInstructions = 0;
+    for (u16 a = 0; a < 0x3ffc; ++numInstructions)
+    {
+        a = d.disassemble(a, gRom48[a], gRom48[a + 1], gRom48[a + 2], gRom48[a + 3]);
+    }
+
+    bench.run("disassembler.disassemble", "instruction", numInstructions, [&]
+    {
+        for (u16 a = 0; a < 0x3ffc; )
+        {
+            a = d.disassemble(a, gRom48[a], gRom48[a + 1], gRom48[a + 2], gRom48[a + 3]);
+        }
+    });
+}
+
+static void benchZ80Loader(MicroBench& bench)
+{
+    // A version 1 .z80 file, compressed, of a 48K machine with a busy screen and a copy of the ROM in upper memory.
+    vector<u8> memory(0xc000, 0);
+    for (int i = 0; i < 0x1b00; ++i) memory[i] = u8((i / 3) * 37);
+    copy(gRom48, gRom48 + 16384, memory.begin() + 0x4000);
+
+    vector<u8> file(30, 0);
+    file[6] = 0x00;     // PC, non-zero for version 1
+    file[7] = 0x80;
+    file[12] = 0x20;    // Compressed
+    for (size_t i = 0; i < memory.size(); )
+    {
+        size_t run = 1;
+        while (i + run < memory.size() && memory[i + run] == memory[i] && run < 255) ++run;
+        if (run >= 5 || (memory[i] == 0xed && run >= 2))
+        {
+            file.insert(file.end(), { 0xed, 0xed, u8(run), memory[i] });
+            i += run;
+        }
+        else
+        {
+            file.push_back(memory[i]);
+            // An ED followed by anything is written out as a run, so the byte after it can't be mistaken for ED.
+            if (memory[i++] == 0xed && i < memory.size())
+            {
+                file.push_back(memory[i++]);
+            }
+        }
+    }
+    file.insert(file.end(), { 0x00, 0xed, 0xed, 0x00 });
+
+    unique_ptr<Spectrum> speccy(newSpectrum());
+    bench.run("snapshot.loadZ80", "file", 1, [&]
+    {
+        Snapshot::loadZ80(*speccy, file);
+    });
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Output
+//----------------------------------------------------------------------------------------------------------------------
+
+static void writeJson(FILE* f, const vector<BenchResult>& results)
+{
+    fprintf(f, "{\n");
+    fprintf(f, "  \"version\": \"%s\",\n", NX_VERSION);
+    fprintf(f, "  \"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const BenchResult& r = results[i];
+        fprintf(f, "    { \"name\": \"%s\", \"unit\": \"%s\", \"ops\": %lld, \"batches\": %d, "
+            "\"best_ns\": %.3f, \"median_ns\": %.3f }%s\n",
+            r.name.c_str(), r.unit.c_str(), (long long)r.opsPerBatch, r.batches, r.bestNs, r.medianNs,
+            i + 1 < results.size() ? "," : "");
+    }
+    fprintf(f, "  ]\n");
+    fprintf(f, "}\n");
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Main entry point
+//----------------------------------------------------------------------------------------------------------------------
+
+int main(int argc, char** argv)
+{
+    string filter;
+    string outFileName;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        if (strncmp(arg, "-filter=", 8) == 0)   filter = arg + 8;
+        else if (strncmp(arg, "-out=", 5) == 0) outFileName = arg + 5;
+        else
+        {
+            printf("Usage: nx-microbench [-filter=text] [-out=file.json]\n");
+            return 1;
+        }
+    }
+
+    MicroBench bench(filter);
+    benchOpcodeGroups(bench);
+    benchContention(bench);
+    benchVideo(bench);
+    benchUiConversion(bench);
+    benchTape(bench);
+    benchDisassembler(bench);
+    benchZ80Loader(bench);
+
+    FILE* f = outFileName.empty() ? stdout : fopen(outFileName.c_str(), "w");
+    if (!f)
+    {
+        fprintf(stderr, "Unable to write %s\n", outFileName.c_str());
+        return 1;
+    }
+    writeJson(f, bench.results());
+    if (f != stdout) fclose(f);
+    return 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,444 @@
+//----------------------------------------------------------------------------------------------------------------------
+// NX batch runner
+// Runs many independent machines at once, one per job, spread over every core.
+//
+//      nx-runner [-threads=N] [-out=dir] [-golden=dir [-update]] [-interp|-table|-blocks|-jit] [-idle] jobfile
+//
+// The job file has one job per line (blank lines and lines starting with # are ignored):
+//
+//      file frames [shots=F,F,...] [input=F:Key+Key,F:,...]
+//
+// Each job loads the file (.sna, .z80, .nx or .tap) into its own machine and runs it for the given number of frames.
+// `input` holds keys down from the given frame onwards; an empty key list releases them.  Frame numbers count from 0,
+// after the file has loaded.  For each job, the runner writes `<out>/<job>_<name>.txt` with the hash of every frame, and
+// `<out>/<job>_<name>_<frame>.png` for each frame listed in `shots`.  The output directory must already exist.
+//
+// With -golden, the hashes of each job's last frame and RAM are checked against `<golden>/<job>_<name>.golden`, and
+// the runner fails if any differ.  The per-frame hashes are then only written if -out is also given, but screenshots are
+// always saved, to the current directory without -out.  -update writes
+// the golden files instead, along with a PNG of the last frame to show what passing looks like.
+//
+// Jobs are dealt out round-robin to one queue per thread.  A thread works from the front of its own queue and, when
+// that runs dry, steals from the back of the others', so a few long jobs don't leave the rest of the cores idle.
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "headless.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+//----------------------------------------------------------------------------------------------------------------------
+// Jobs
+//----------------------------------------------------------------------------------------------------------------------
+
+struct KeyEvent
+{
+    int                 frame;
+    vector<Key>         keys;
+};
+
+struct Job
+{
+    string              fileName;
+    string              name;           // Output file prefix
+    int                 frames;
+    vector<int>         shots;          // Sorted
+    vector<KeyEvent>    input;          // Sorted by frame
+
+    // Results
+    bool                ok;
+    string              error;
+    u64                 frameHash;      // Of the last frame
+    u64                 ramHash;        // At the end of the last frame
+    double              seconds;
+};
+
+struct RunnerOptions
+{
+    int                     threads;
+    string                  outDir;
+    string                  goldenDir;
+    bool                    updateGolden;
+    Spectrum::CPU::Dispatch dispatch;
+    bool                    idleSkip;
+};
+
+static bool parseInput(const string& text, vector<KeyEvent>& input, string& error)
+{
+    for (const string& event : split(text, ','))
+    {
+        size_t colon = event.find(':');
+        if (colon == string::npos)
+        {
+            error = "expected frame:keys in '" + event + "'";
+            return false;
+        }
+
+        KeyEvent e;
+        e.frame = atoi(event.substr(0, colon).c_str());
+        string keys = event.substr(colon + 1);
+        if (!keys.empty())
+        {
+            for (const string& keyName : split(keys, '+'))
+            {
+                Key key;
+                if (!HeadlessMachine::parseKey(keyName, key))
+                {
+                    error = "unknown key '" + keyName + "'";
+                    return false;
+                }
+                e.keys.push_back(key);
+            }
+        }
+        input.push_back(e);
+    }
+
+    stable_sort(input.begin(), input.end(), [](const KeyEvent& a, const KeyEvent& b) { return a.frame < b.frame; });
+    return true;
+}
+
+static bool parseJob(const string& line, Job& job, string& error)
+{
+    stringstream ss(line);
+    job.frames = 0;
+    if (!(ss >> job.fileName >> job.frames) || job.frames <= 0)
+    {
+        error = "expected: file frames [shots=...] [input=...]";
+        return false;
+    }
+
+    string field;
+    while (ss >> field)
+    {
+        if (field.compare(0, 6, "shots=") == 0)
+        {
+            for (const string& shot : split(field.substr(6), ',')) job.shots.push_back(atoi(shot.c_str()));
+            sort(job.shots.begin(), job.shots.end());
+        }
+        else if (field.compare(0, 6, "input=") == 0)
+        {
+            if (!parseInput(field.substr(6), job.input, error)) return false;
+        }
+        else
+        {
+            error = "unknown field '" + field + "'";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool loadJobs(const string& jobFileName, vector<Job>& jobs)
+{
+    ifstream f(jobFileName);
+    if (!f)
+    {
+        printf("%s: unable to open\n", jobFileName.c_str());
+        return false;
+    }
+
+    string line;
+    for (int lineNumber = 1; getline(f, line); ++lineNumber)
+    {
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == string::npos || line[start] == '#') continue;
+
+        Job job = {};
+        string error;
+        if (!parseJob(line, job, error))
+        {
+            printf("%s(%d): %s\n", jobFileName.c_str(), lineNumber, error.c_str());
+            return false;
+        }
+
+        // Name the output after the job number and the file's name without its path or extension.
+        string stem = job.fileName.substr(job.fileName.find_last_of("/\\") + 1);
+        stem = stem.substr(0, stem.rfind('.'));
+        char prefix[16];
+        snprintf(prefix, sizeof(prefix), "%03d_", (int)jobs.size());
+        job.name = prefix + stem;
+
+        jobs.push_back(job);
+    }
+
+    return true;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Golden files
+// <name>.golden holds the hashes of the last frame and of RAM from a known good run, and <name>.png is that frame.
+//----------------------------------------------------------------------------------------------------------------------
+
+static bool writeGolden(Job& job, const Spectrum& speccy, const string& base)
+{
+    FILE* f = fopen((base + ".golden").c_str(), "w");
+    if (!f)
+    {
+        job.error = "unable to write " + base + ".golden";
+        return false;
+    }
+
+    fprintf(f, "frame %016llx\nram %016llx\n", (unsigned long long)job.frameHash, (unsigned long long)job.ramHash);
+    fclose(f);
+
+    if (!speccy.saveFrame(base + ".png"))
+    {
+        job.error = "unable to write " + base + ".png";
+        return false;
+    }
+    return true;
+}
+
+static bool checkGolden(Job& job, const string& base)
+{
+    unsigned long long frameHash = 0;
+    unsigned long long ramHash = 0;
+
+    FILE* f = fopen((base + ".golden").c_str(), "r");
+    if (!f)
+    {
+        job.error = "no golden file " + base + ".golden";
+        return false;
+    }
+    bool parsed = fscanf(f, " frame %llx ram %llx", &frameHash, &ramHash) == 2;
+    fclose(f);
+
+    if (!parsed)
+    {
+        job.error = "unable to read " + base + ".golden";
+        return false;
+    }
+
+    if (frameHash != job.frameHash || ramHash != job.ramHash)
+    {
+        job.error = string("differs from golden") +
+            (frameHash != job.frameHash ? " frame" : "") +
+            (ramHash != job.ramHash ? " ram" : "") +
+            ", compare with " + base + ".png";
+        return false;
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Running a job
+//----------------------------------------------------------------------------------------------------------------------
+
+static void runJob(Job& job, const RunnerOptions& options)
+{
+    auto start = chrono::steady_clock::now();
+
+    HeadlessMachine machine;
+    Spectrum& speccy = machine.getSpeccy();
+    speccy.getZ80().setDispatch(options.dispatch);
+    speccy.setIdleSkip(options.idleSkip);
+    if (!machine.load(job.fileName))
+    {
+        job.error = "unable to load";
+        return;
+    }
+
+    // When checking against golden files, the per-frame output is only written if asked for.
+    string base = (options.outDir.empty() ? string(".") : options.outDir) + "/" + job.name;
+    FILE* hashFile = nullptr;
+    if (options.goldenDir.empty() || !options.outDir.empty())
+    {
+        hashFile = fopen((base + ".txt").c_str(), "w");
+        if (!hashFile)
+        {
+            job.error = "unable to write " + base + ".txt";
+            return;
+        }
+    }
+
+    size_t nextInput = 0;
+    size_t nextShot = 0;
+    for (int frame = 0; frame < job.frames; ++frame)
+    {
+        while (nextInput < job.input.size() && job.input[nextInput].frame <= frame)
+        {
+            machine.setKeys(job.input[nextInput++].keys);
+        }
+
+        machine.runFrames(1);
+
+        while (nextShot < job.shots.size() && job.shots[nextShot] <= frame)
+        {
+            if (job.shots[nextShot++] < frame) continue;
+            string pngName = base + "_" + to_string(frame) + ".png";
+            if (!speccy.saveFrame(pngName))
+            {
+                job.error = "unable to write " + pngName;
+                if (hashFile) fclose(hashFile);
+                return;
+            }
+        }
+
+        if (!hashFile) continue;
+
+        job.frameHash = speccy.hashFrame();
+        fprintf(hashFile, "%d %016llx\n", frame, (unsigned long long)job.frameHash);
+    }
+
+    if (hashFile) fclose(hashFile);
+    job.frameHash = speccy.hashFrame();
+    job.ramHash = speccy.hashRam();
+    job.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    if (options.goldenDir.empty())
+    {
+        job.ok = true;
+    }
+    else if (options.updateGolden)
+    {
+        job.ok = writeGolden(job, speccy, options.goldenDir + "/" + job.name);
+    }
+    else
+    {
+        job.ok = checkGolden(job, options.goldenDir + "/" + job.name);
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Work-stealing pool
+//----------------------------------------------------------------------------------------------------------------------
+
+class WorkQueue
+{
+public:
+    bool popFront(int& job)
+    {
+        lock_guard<mutex> lock(m_lock);
+        if (m_jobs.empty()) return false;
+        job = m_jobs.front();
+        m_jobs.pop_front();
+        return true;
+    }
+
+    bool popBack(int& job)
+    {
+        lock_guard<mutex> lock(m_lock);
+        if (m_jobs.empty()) return false;
+        job = m_jobs.back();
+        m_jobs.pop_back();
+        return true;
+    }
+
+    void push(int job)
+    {
+        lock_guard<mutex> lock(m_lock);
+        m_jobs.push_back(job);
+    }
+
+private:
+    mutex           m_lock;
+    deque<int>      m_jobs;
+};
+
+static void runJobs(vector<Job>& jobs, const RunnerOptions& options)
+{
+    // No new jobs are added once the threads start, so a thread can stop as soon as every queue is empty.
+    int numThreads = max(1, min(options.threads, (int)jobs.size()));
+    vector<WorkQueue> queues(numThreads);
+    for (int i = 0; i < (int)jobs.size(); ++i) queues[i % numThreads].push(i);
+
+    auto worker = [&](int self)
+    {
+        for (;;)
+        {
+            int job;
+            bool found = queues[self].popFront(job);
+            for (int i = 1; !found && i < numThreads; ++i)
+            {
+                found = queues[(self + i) % numThreads].popBack(job);
+            }
+            if (!found) return;
+
+            runJob(jobs[job], options);
+        }
+    };
+
+    vector<thread> threads;
+    for (int i = 0; i < numThreads; ++i) threads.emplace_back(worker, i);
+    for (thread& t : threads) t.join();
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Main entry point
+//----------------------------------------------------------------------------------------------------------------------
+
+int main(int argc, char** argv)
+{
+    RunnerOptions options = {};
+    options.threads = (int)thread::hardware_concurrency();
+    options.dispatch = Spectrum::CPU::Dispatch::Table;
+    string jobFileName;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        if (strncmp(arg, "-threads=", 9) == 0)      options.threads = max(1, atoi(arg + 9));
+        else if (strncmp(arg, "-out=", 5) == 0)     options.outDir = arg + 5;
+        else if (strncmp(arg, "-golden=", 8) == 0)  options.goldenDir = arg + 8;
+        else if (strcmp(arg, "-update") == 0)       options.updateGolden = true;
+        else if (strcmp(arg, "-interp") == 0)       options.dispatch = Spectrum::CPU::Dispatch::Interpreter;
+        else if (strcmp(arg, "-table") == 0)        options.dispatch = Spectrum::CPU::Dispatch::Table;
+        else if (strcmp(arg, "-blocks") == 0)       options.dispatch = Spectrum::CPU::Dispatch::Blocks;
+        else if (strcmp(arg, "-jit") == 0)          options.dispatch = Spectrum::CPU::Dispatch::Jit;
+        else if (strcmp(arg, "-idle") == 0)         options.idleSkip = true;
+        else if (arg[0] == '-')
+        {
+            printf("Unknown option: %s\n", arg);
+            return 1;
+        }
+        else jobFileName = arg;
+    }
+
+    if (jobFileName.empty())
+    {
+        printf("Usage: nx-runner [-threads=N] [-out=dir] [-golden=dir [-update]] [-interp|-table|-blocks|-jit] "
+            "[-idle] jobfile\n");
+        return 1;
+    }
+
+    // hardware_concurrency() is allowed to return 0 if it doesn't know.
+    options.threads = max(1, options.threads);
+
+    vector<Job> jobs;
+    if (!loadJobs(jobFileName, jobs)) return 1;
+
+    auto start = chrono::steady_clock::now();
+    runJobs(jobs, options);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    bool ok = true;
+    for (const Job& job : jobs)
+    {
+        if (job.ok)
+        {
+            printf("%s: %d frames in %.3fs, frame %016llx, ram %016llx\n",
+                job.name.c_str(), job.frames, job.seconds,
+                (unsigned long long)job.frameHash, (unsigned long long)job.ramHash);
+        }
+        else
+        {
+            printf("%s: %s: %s\n", job.name.c_str(), job.fileName.c_str(), job.error.c_str());
+            ok = false;
+        }
+    }
+    printf("%d jobs on %d threads in %.3fs\n", (int)jobs.size(), min(options.threads, (int)jobs.size()), seconds);
+
+    return ok ? 0 : 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,205 @@
+//----------------------------------------------------------------------------------------------------------------------
+// NX trace decoder
+// Prints an execution trace written by the emulator's -trace setting or nx-bench -trace, one instruction per line.
+//
+//      nx-tracedump [-from=N] [-count=N] file
+//
+// Each line shows the instruction's number in the trace, the T-state it started on, its address, bytes and mnemonic,
+// and the registers it changed.  Registers are rebuilt from the start of the file, so -from only skips the printing.
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "disasm.h"
+#include "trace.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+//----------------------------------------------------------------------------------------------------------------------
+// Reading
+//----------------------------------------------------------------------------------------------------------------------
+
+static const char* kRegNames[kTraceNumRegs] =
+{
+    "AF", "BC", "DE", "HL", "AF'", "BC'", "DE'", "HL'", "IX", "IY", "SP", "IR", "WZ"
+};
+
+class TraceReader
+{
+public:
+    TraceReader(const vector<u8>& data) : m_data(data), m_pos(0) {}
+
+    bool atEnd() const { return m_pos >= m_data.size(); }
+    bool isValid() const { return m_pos <= m_data.size(); }
+
+    // Reading past the end returns zeroes and makes the reader invalid.
+    u8 byte()
+    {
+        if (m_pos < m_data.size()) return m_data[m_pos++];
+        m_pos = m_data.size() + 1;
+        return 0;
+    }
+
+    u16 word()
+    {
+        u8 l = byte();
+        return u16(l | (byte() << 8));
+    }
+
+    u64 varint()
+    {
+        u64 x = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            u8 b = byte();
+            x |= u64(b & 0x7f) << shift;
+            if (!(b & 0x80)) break;
+        }
+        return x;
+    }
+
+private:
+    const vector<u8>&   m_data;
+    size_t              m_pos;
+};
+
+static bool loadFile(const char* fileName, vector<u8>& data)
+{
+    FILE* f = fopen(fileName, "rb");
+    if (!f) return false;
+
+    u8 buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) data.insert(data.end(), buffer, buffer + n);
+    fclose(f);
+    return true;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Printing
+//----------------------------------------------------------------------------------------------------------------------
+
+static void printRecord(u64 index, TState tState, u16 pc, const u8* bytes, int numBytes, u8 flags, u16 changed,
+    const u16* registers)
+{
+    if (flags & kTraceDropped) printf("--- records dropped ---\n");
+
+    string hex;
+    string text;
+    if (flags & kTraceInterrupt)
+    {
+        text = "<interrupt>";
+    }
+    else
+    {
+        u8 b[4] = { 0, 0, 0, 0 };
+        for (int i = 0; i < numBytes && i < 4; ++i)
+        {
+            b[i] = bytes[i];
+            char h[4];
+            snprintf(h, sizeof(h), "%02X", bytes[i]);
+            hex += h;
+        }
+
+        Disassembler d;
+        d.disassemble(pc, b[0], b[1], b[2], b[3]);
+        string operands = d.operands();
+        text = operands.empty() ? d.opCode() : d.opCode() + " " + operands;
+    }
+
+    printf("%10llu %6lld  %04X  %-8s  %-18s", (unsigned long long)index, (long long)tState, pc, hex.c_str(),
+        text.c_str());
+    for (int i = 0; i < kTraceNumRegs; ++i)
+    {
+        if (changed & (1 << i)) printf(" %s=%04X", kRegNames[i], registers[i]);
+    }
+    printf("\n");
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Main entry point
+//----------------------------------------------------------------------------------------------------------------------
+
+int main(int argc, char** argv)
+{
+    u64 from = 0;
+    u64 count = ~u64(0);
+    const char* fileName = nullptr;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        if (strncmp(arg, "-from=", 6) == 0)         from = strtoull(arg + 6, nullptr, 10);
+        else if (strncmp(arg, "-count=", 7) == 0)   count = strtoull(arg + 7, nullptr, 10);
+        else if (arg[0] == '-')
+        {
+            printf("Unknown option: %s\n", arg);
+            return 1;
+        }
+        else fileName = arg;
+    }
+
+    if (!fileName)
+    {
+        printf("Usage: nx-tracedump [-from=N] [-count=N] file\n");
+        return 1;
+    }
+
+    vector<u8> data;
+    if (!loadFile(fileName, data))
+    {
+        printf("%s: unable to open\n", fileName);
+        return 1;
+    }
+
+    TraceReader in(data);
+    if (in.byte() != 'N' || in.byte() != 'X' || in.byte() != 'T' || in.byte() != 'R' || in.word() != kTraceVersion ||
+        in.word() != kTraceNumRegs)
+    {
+        printf("%s: not an NX trace, or from a different version\n", fileName);
+        return 1;
+    }
+
+    u64 start = 0;
+    for (int i = 0; i < 8; ++i) start |= u64(in.byte()) << (i * 8);
+    TState tState = TState(start);
+
+    u16 registers[kTraceNumRegs];
+    for (u16& r : registers) r = in.word();
+
+    printf("     Index T-state  PC    Bytes     Instruction\n");
+
+    u64 index = 0;
+    while (!in.atEnd() && (index < from || index - from < count))
+    {
+        const u8 flags = in.byte();
+        const u16 pc = in.word();
+        const int numBytes = flags & kTraceLengthMask;
+        u8 bytes[kTraceLengthMask];
+        for (int i = 0; i < numBytes; ++i) bytes[i] = in.byte();
+
+        const u64 zz = in.varint();
+        tState += TState((zz >> 1) ^ (~(zz & 1) + 1));
+
+        const u16 changed = in.word();
+        registers[(int)TraceReg::IR] = tracePredictIR(registers[(int)TraceReg::IR], bytes, numBytes);
+        for (int i = 0; i < kTraceNumRegs; ++i)
+        {
+            if (changed & (1 << i)) registers[i] = in.word();
+        }
+
+        if (!in.isValid())
+        {
+            printf("Trace ends part way through a record\n");
+            return 1;
+        }
+
+        if (index >= from) printRecord(index, tState, pc, bytes, numBytes, flags, changed, registers);
+        ++index;
+    }
+
+    return 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------
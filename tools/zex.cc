@@ -0,0 +1,608 @@
+//----------------------------------------------------------------------------------------------------------------------
+// NX instruction exerciser harness
+// Runs ZEXALL or ZEXDOC on a bare Z80 with a flat 64K of RAM, as fast as the CPU core can go, and reports which test
+// groups passed and how many instructions a second were run.
+//
+//      nx-zex [-parallel | -threads=N] [-group=N] [-interp|-table|-blocks|-jit] [-expect=file] file
+//
+// The file can be a CP/M build (zexall.com or zexdoc.com), which is loaded at $0100 and prints through BDOS, or the
+// 48K Spectrum build (etc/zexall.sna), which is run with the 48K ROM and prints through RST $10.  Either way, the
+// print call is trapped and handled here instead of running any code for it.
+//
+// The test groups don't depend on each other, so each one can be run on its own by cutting the program's table of
+// tests down to that one entry.  -group=N runs only group N (counting from 1), and -parallel runs every group on its
+// own CPU, spread over all the cores, and prints the results in the usual order once they have all finished.
+//
+// Normally the program is single-stepped.  -interp, -table, -blocks or -jit run it through Z80::run() with that
+// dispatch instead, so that the block cache, recompiler, fused instructions and block instruction fast paths are
+// exercised too.  run() can't stop at the print call, so the call is patched to OUT ($ff),A; RET and the port write
+// is trapped.  Instructions aren't counted in this mode, so only the emulated MHz is reported.
+//
+// The exit status is 0 only if every group passed.  -expect names a file listing groups that are known to fail, one
+// per line, and those failures are then allowed.  Spaces don't matter, and lines that aren't a group are ignored, so
+// `etc/zexall problems.txt` can be used as it is.
+//----------------------------------------------------------------------------------------------------------------------
+
+#include "flatbus.h"
+#include "nxfile.h"
+#include "z80.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+
+extern const u8 gRom48[16384];
+
+using ZexCPU = Z80<FlatBus>;
+
+//----------------------------------------------------------------------------------------------------------------------
+// Console
+// Collects the program's output and picks out the result of each test group, which is a line that either ends in OK
+// or reports a CRC mismatch.  Output can be echoed as it arrives, or kept for printing later.
+//----------------------------------------------------------------------------------------------------------------------
+
+struct GroupResult
+{
+    string      line;       // As printed by the program
+    string      name;
+    bool        passed;
+    double      seconds;
+};
+
+class Console
+{
+public:
+    Console(bool echo)
+        : m_echo(echo)
+        , m_groupStart(chrono::steady_clock::now())
+    {}
+
+    void print(char c)
+    {
+        if (c == '\r' || c == '\n')
+        {
+            endLine();
+            return;
+        }
+
+        m_line += c;
+        if (m_echo) putchar(c);
+    }
+
+    const vector<GroupResult>& getResults() const { return m_results; }
+
+private:
+    void endLine()
+    {
+        if (m_line.empty()) return;
+
+        bool passed = m_line.size() >= 2 && m_line.compare(m_line.size() - 2, 2, "OK") == 0;
+        bool failed = m_line.find("ERROR") != string::npos || m_line.find("CRC:") != string::npos;
+        if (passed || failed)
+        {
+            auto now = chrono::steady_clock::now();
+            GroupResult result;
+            result.line = m_line;
+            result.name = m_line.substr(0, passed ? m_line.size() - 2 : min(m_line.find("ERROR"), m_line.find("CRC:")));
+            result.name.erase(result.name.find_last_not_of(". ") + 1);
+            result.passed = passed;
+            result.seconds = chrono::duration<double>(now - m_groupStart).count();
+            m_results.push_back(result);
+            m_groupStart = now;
+
+            if (m_echo) printf("  (%.2fs)", result.seconds);
+        }
+
+        if (m_echo)
+        {
+            putchar('\n');
+            fflush(stdout);
+        }
+        m_line.clear();
+    }
+
+private:
+    bool                                m_echo;
+    string                              m_line;
+    chrono::steady_clock::time_point    m_groupStart;
+    vector<GroupResult>                 m_results;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+// Exerciser
+// One copy of the program on its own CPU and memory.
+//----------------------------------------------------------------------------------------------------------------------
+
+class Exerciser
+{
+public:
+    Exerciser()
+        : m_cpu(FlatBus(m_memory))
+        , m_printTrap(0)
+        , m_cpm(false)
+        , m_tests(0)
+        , m_useRun(false)
+        , m_tState(0)
+        , m_instructions(0)
+    {}
+
+    bool load(const string& fileName, const vector<u8>& file);
+
+    // The number of test groups, or 0 if the table of tests couldn't be found.
+    int getNumGroups() const;
+
+    // Cut the table of tests down to a single group, counting from 0.
+    void selectGroup(int group);
+
+    // Run the program through Z80::run() with the given dispatch, rather than single-stepping it.
+    void setDispatch(ZexCPU::Dispatch dispatch);
+
+    void run(Console& console);
+
+    TState getTState() const { return m_tState; }
+    u64 getInstructions() const { return m_instructions; }
+
+private:
+    bool loadCom(const vector<u8>& file);
+    bool loadSna(const vector<u8>& file);
+    void findTests();
+    void print(Console& console);
+    bool isFinished();
+    void runSteps(Console& console);
+    void runDispatch(Console& console);
+
+private:
+    FlatMemory  m_memory;
+    ZexCPU      m_cpu;
+    u16         m_printTrap;        // Address whose call prints
+    bool        m_cpm;              // BDOS calling convention, and jumping to 0 ends the program
+    u16         m_tests;            // Address of the table of tests, or 0
+    bool        m_useRun;           // Run through Z80::run() instead of single steps
+    TState      m_tState;
+    u64         m_instructions;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+// Loading
+//----------------------------------------------------------------------------------------------------------------------
+
+bool Exerciser::load(const string& fileName, const vector<u8>& file)
+{
+    string ext = fileName.substr(min(fileName.size(), fileName.rfind('.')));
+    for (char& c : ext) c = (char)tolower(c);
+
+    bool loaded = (ext == ".sna") ? loadSna(file) : loadCom(file);
+    if (loaded) findTests();
+    return loaded;
+}
+
+bool Exerciser::loadCom(const vector<u8>& file)
+{
+    if (file.empty() || file.size() > 0xfe00 - 0x100) return false;
+
+    // Warm boot at 0, and BDOS at 5.  The program takes its stack from the BDOS jump address.
+    m_memory.clear();
+    m_memory.ram[0x0005] = 0xc3;
+    m_memory.ram[0x0006] = 0x00;
+    m_memory.ram[0x0007] = 0xfe;
+    copy(file.begin(), file.end(), m_memory.ram + 0x100);
+
+    m_cpu.PC() = 0x100;
+    m_cpu.SP() = 0xfe00;
+    m_printTrap = 0x0005;
+    m_cpm = true;
+    return true;
+}
+
+bool Exerciser::loadSna(const vector<u8>& data)
+{
+    if (data.size() != 49179) return false;
+
+    m_memory.clear();
+    copy(gRom48, gRom48 + 16384, m_memory.ram);
+    copy(data.begin() + 27, data.end(), m_memory.ram + 0x4000);
+
+    const u8* d = data.data();
+    m_cpu.I() = BYTE_OF(d, 0);
+    m_cpu.HL_() = WORD_OF(d, 1);
+    m_cpu.DE_() = WORD_OF(d, 3);
+    m_cpu.BC_() = WORD_OF(d, 5);
+    m_cpu.AF_() = WORD_OF(d, 7);
+    m_cpu.HL() = WORD_OF(d, 9);
+    m_cpu.DE() = WORD_OF(d, 11);
+    m_cpu.BC() = WORD_OF(d, 13);
+    m_cpu.IY() = WORD_OF(d, 15);
+    m_cpu.IX() = WORD_OF(d, 17);
+    m_cpu.IFF2() = (BYTE_OF(d, 19) & 0x04) != 0;
+    m_cpu.IFF1() = m_cpu.IFF2();
+    m_cpu.R() = BYTE_OF(d, 20);
+    m_cpu.AF() = WORD_OF(d, 21);
+    m_cpu.SP() = WORD_OF(d, 23);
+    m_cpu.IM() = BYTE_OF(d, 25);
+
+    TState t = 0;
+    m_cpu.PC() = m_cpu.pop(t);
+
+    m_printTrap = 0x0010;
+    m_cpm = false;
+    return true;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Test table
+// Every build walks a zero-terminated list of pointers to the tests with the same loop:
+//
+//          ld      hl,tests
+//  loop:   ld      a,(hl)
+//          inc     hl
+//          or      (hl)
+//          jp      z,done
+//----------------------------------------------------------------------------------------------------------------------
+
+void Exerciser::findTests()
+{
+    static const u8 kLoop[] = { 0x7e, 0x23, 0xb6, 0xca };
+
+    const u8* ram = m_memory.ram;
+    const u8* end = ram + 0x10000 - sizeof(kLoop);
+    for (const u8* p = ram + 3; p < end; ++p)
+    {
+        if (p[-3] == 0x21 && memcmp(p, kLoop, sizeof(kLoop)) == 0)
+        {
+            m_tests = u16(p[-2] + 256 * p[-1]);
+            return;
+        }
+    }
+}
+
+int Exerciser::getNumGroups() const
+{
+    if (!m_tests) return 0;
+
+    int n = 0;
+    for (u16 a = m_tests; m_memory.ram[a] | m_memory.ram[u16(a + 1)]; a += 2) ++n;
+    return n;
+}
+
+void Exerciser::selectGroup(int group)
+{
+    u8* table = m_memory.ram + m_tests;
+    table[0] = table[group * 2];
+    table[1] = table[group * 2 + 1];
+    table[2] = 0;
+    table[3] = 0;
+    ++m_memory.generations[m_tests >> 8];
+    ++m_memory.generations[u16(m_tests + 3) >> 8];
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Running
+//----------------------------------------------------------------------------------------------------------------------
+
+void Exerciser::print(Console& console)
+{
+    if (!m_cpm)
+    {
+        console.print(char(m_cpu.A()));
+        return;
+    }
+
+    // BDOS function 2 prints E, and 9 prints the string at DE up to a '$'.
+    switch (m_cpu.C())
+    {
+    case 2:
+        console.print(char(m_cpu.E()));
+        break;
+
+    case 9:
+        for (u16 a = m_cpu.DE(); m_memory.ram[a] != '$'; ++a) console.print(char(m_memory.ram[a]));
+        break;
+    }
+}
+
+bool Exerciser::isFinished()
+{
+    // A CP/M program ends by jumping to the warm boot.  Otherwise stop at JR $ or JP $, or a HALT, since no interrupt
+    // will ever come.
+    u16 pc = m_cpu.PC();
+    const u8* ram = m_memory.ram;
+    if (m_cpm && pc == 0) return true;
+    if (ram[pc] == 0x18 && ram[u16(pc + 1)] == 0xfe) return true;
+    if (ram[pc] == 0xc3 && ram[u16(pc + 1)] + 256 * ram[u16(pc + 2)] == pc) return true;
+    return m_cpu.isHalted();
+}
+
+void Exerciser::setDispatch(ZexCPU::Dispatch dispatch)
+{
+    m_cpu.setDispatch(dispatch);
+    m_useRun = true;
+}
+
+void Exerciser::run(Console& console)
+{
+    if (m_useRun)
+    {
+        runDispatch(console);
+    }
+    else
+    {
+        runSteps(console);
+    }
+
+    console.print('\n');
+}
+
+void Exerciser::runSteps(Console& console)
+{
+    while (!isFinished())
+    {
+        if (m_cpu.PC() == m_printTrap)
+        {
+            print(console);
+            m_cpu.PC() = m_cpu.pop(m_tState);
+            continue;
+        }
+
+        m_cpu.step(m_tState);
+        ++m_instructions;
+    }
+}
+
+void Exerciser::runDispatch(Console& console)
+{
+    // How far run() goes before checking whether the program has finished.
+    static const TState kChunkTStates = 1 << 16;
+
+    // CP/M's BDOS jumps to $fe00, and the Spectrum's print restart is at $0010.  A CP/M program's jump to the warm
+    // boot at 0 is caught by a HALT.
+    const u16 printCall = m_cpm ? 0xfe00 : m_printTrap;
+    u8* ram = m_memory.ram;
+    ram[printCall] = 0xd3;
+    ram[u16(printCall + 1)] = 0xff;
+    ram[u16(printCall + 2)] = 0xc9;
+    ++m_memory.generations[printCall >> 8];
+    if (m_cpm)
+    {
+        ram[0] = 0x76;
+        ++m_memory.generations[0];
+    }
+
+    m_memory.onOut = [&](u16 port, u8 x)
+    {
+        if ((port & 0xff) == 0xff) print(console);
+    };
+
+    while (!isFinished()) m_cpu.run(m_tState, m_tState + kChunkTStates);
+    m_memory.onOut = nullptr;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Parallel run
+// Each thread takes the next group that nobody has started.  The groups take anything from milliseconds to most of a
+// minute, so handing them out one at a time keeps all the threads busy until the end.
+//----------------------------------------------------------------------------------------------------------------------
+
+static bool runParallel(const string& fileName, const vector<u8>& file, int numGroups, int numThreads, bool useRun,
+    ZexCPU::Dispatch dispatch, vector<GroupResult>& results, TState& tStates, u64& instructions)
+{
+    vector<vector<GroupResult>> groupResults(numGroups);
+    vector<TState> groupTStates(numGroups, 0);
+    vector<u64> groupInstructions(numGroups, 0);
+    atomic<int> nextGroup(0);
+
+    auto worker = [&]
+    {
+        for (int group = nextGroup++; group < numGroups; group = nextGroup++)
+        {
+            unique_ptr<Exerciser> exerciser(new Exerciser);
+            exerciser->load(fileName, file);
+            exerciser->selectGroup(group);
+            if (useRun) exerciser->setDispatch(dispatch);
+
+            Console console(false);
+            exerciser->run(console);
+
+            groupResults[group] = console.getResults();
+            groupTStates[group] = exerciser->getTState();
+            groupInstructions[group] = exerciser->getInstructions();
+        }
+    };
+
+    vector<thread> threads;
+    for (int i = 0; i < numThreads; ++i) threads.emplace_back(worker);
+    for (thread& t : threads) t.join();
+
+    bool ok = true;
+    for (int group = 0; group < numGroups; ++group)
+    {
+        if (groupResults[group].size() != 1)
+        {
+            printf("Group %d: no result\n", group + 1);
+            ok = false;
+        }
+        results.insert(results.end(), groupResults[group].begin(), groupResults[group].end());
+        tStates += groupTStates[group];
+        instructions += groupInstructions[group];
+    }
+    return ok;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Expected failures
+//----------------------------------------------------------------------------------------------------------------------
+
+// Group names are compared without their spaces, since hand-written lists don't always space them as the program does.
+static string withoutSpaces(const string& text)
+{
+    string result;
+    for (char c : text) if (!isspace((unsigned char)c)) result += c;
+    return result;
+}
+
+static bool loadExpected(const string& fileName, vector<string>& names)
+{
+    vector<u8> file = NxFile::loadFile(fileName);
+    if (file.empty()) return false;
+
+    string line;
+    for (size_t i = 0; i <= file.size(); ++i)
+    {
+        if (i == file.size() || file[i] == '\n')
+        {
+            line = withoutSpaces(line);
+            if (!line.empty()) names.push_back(line);
+            line.clear();
+        }
+        else
+        {
+            line += char(file[i]);
+        }
+    }
+    return true;
+}
+
+static bool isExpected(const vector<string>& expected, const string& name)
+{
+    return find(expected.begin(), expected.end(), withoutSpaces(name)) != expected.end();
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Main entry point
+//----------------------------------------------------------------------------------------------------------------------
+
+static bool parseDispatch(const char* arg, ZexCPU::Dispatch& dispatch)
+{
+    if (strcmp(arg, "-interp") == 0)        dispatch = ZexCPU::Dispatch::Interpreter;
+    else if (strcmp(arg, "-table") == 0)    dispatch = ZexCPU::Dispatch::Table;
+    else if (strcmp(arg, "-blocks") == 0)   dispatch = ZexCPU::Dispatch::Blocks;
+    else if (strcmp(arg, "-jit") == 0)      dispatch = ZexCPU::Dispatch::Jit;
+    else return false;
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    int numThreads = 0;
+    int group = 0;
+    bool useRun = false;
+    ZexCPU::Dispatch dispatch = ZexCPU::Dispatch::Table;
+    string fileName;
+    string expectFileName;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        if (strcmp(arg, "-parallel") == 0)              numThreads = max(1, (int)thread::hardware_concurrency());
+        else if (strncmp(arg, "-threads=", 9) == 0)     numThreads = max(1, atoi(arg + 9));
+        else if (strncmp(arg, "-group=", 7) == 0)       group = atoi(arg + 7);
+        else if (strncmp(arg, "-expect=", 8) == 0)      expectFileName = arg + 8;
+        else if (parseDispatch(arg, dispatch))          useRun = true;
+        else if (arg[0] == '-')
+        {
+            printf("Unknown option: %s\n", arg);
+            return 1;
+        }
+        else fileName = arg;
+    }
+
+    if (fileName.empty())
+    {
+        printf("Usage: nx-zex [-parallel | -threads=N] [-group=N] [-interp|-table|-blocks|-jit] [-expect=file] file\n");
+        return 1;
+    }
+
+    vector<string> expected;
+    if (!expectFileName.empty() && !loadExpected(expectFileName, expected))
+    {
+        printf("%s: unable to load\n", expectFileName.c_str());
+        return 1;
+    }
+
+    vector<u8> file = NxFile::loadFile(fileName);
+    unique_ptr<Exerciser> exerciser(new Exerciser);
+    if (!exerciser->load(fileName, file))
+    {
+        printf("%s: unable to load\n", fileName.c_str());
+        return 1;
+    }
+
+    int numGroups = exerciser->getNumGroups();
+    if ((group || numThreads) && !numGroups)
+    {
+        printf("%s: unable to find the table of tests\n", fileName.c_str());
+        return 1;
+    }
+    if (group < 0 || group > numGroups)
+    {
+        printf("There are %d groups\n", numGroups);
+        return 1;
+    }
+
+    vector<GroupResult> results;
+    TState tStates = 0;
+    u64 instructions = 0;
+    bool ok = true;
+    auto start = chrono::steady_clock::now();
+
+    if (numThreads && !group)
+    {
+        numThreads = min(numThreads, numGroups);
+        printf("Running %d groups on %d threads...\n", numGroups, numThreads);
+        fflush(stdout);
+
+        ok = runParallel(fileName, file, numGroups, numThreads, useRun, dispatch, results, tStates, instructions);
+        for (const GroupResult& result : results) printf("%s  (%.2fs)\n", result.line.c_str(), result.seconds);
+    }
+    else
+    {
+        if (group) exerciser->selectGroup(group - 1);
+        if (useRun) exerciser->setDispatch(dispatch);
+
+        Console console(true);
+        exerciser->run(console);
+        results = console.getResults();
+        tStates = exerciser->getTState();
+        instructions = exerciser->getInstructions();
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    int numPassed = 0;
+    int numUnexpected = 0;
+    for (const GroupResult& result : results)
+    {
+        numPassed += result.passed ? 1 : 0;
+        numUnexpected += (result.passed || isExpected(expected, result.name)) ? 0 : 1;
+    }
+
+    printf("\n%d groups passed, %d failed", numPassed, (int)results.size() - numPassed);
+    if (!expected.empty()) printf(" (%d unexpectedly)", numUnexpected);
+    printf("\n");
+    for (const GroupResult& result : results)
+    {
+        const bool listed = isExpected(expected, result.name);
+        if (!result.passed) printf("    FAILED: %s%s\n", result.name.c_str(), listed ? " (expected)" : "");
+        else if (listed) printf("    PASSED: %s (expected to fail)\n", result.name.c_str());
+    }
+    if (useRun)
+    {
+        printf("%lld T-states in %.2fs: %.1f MHz\n", (long long)tStates, seconds, tStates / seconds / 1000000.0);
+    }
+    else
+    {
+        printf("%llu instructions in %.2fs: %.1f million instructions/sec, %.1f MHz\n",
+            (unsigned long long)instructions, seconds, instructions / seconds / 1000000.0,
+            tStates / seconds / 1000000.0);
+    }
+
+    return (ok && !results.empty() && numUnexpected == 0) ? 0 : 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------------------------------------------